@@ -87,8 +87,9 @@
 */
 
 /* Partition ()                                     Q255215                 {...}
-  - kind                {apple, amiga, atari, mbr, gpt, sparc, vtoc, bsd} 
-                                (source files dos: mbr, gpt; unix: sparc, vtoc, bsd)
+  - kind                {apple, amiga, atari, mbr, gpt, sparc, vtoc, bsd, lvm} 
+                                (source files dos: mbr, gpt; unix: sparc, vtoc, bsd;
+                                 lvm: lvm, a logical volume)
   - name                {#char[256]}
   - number              {#int}  (partitions are enumerated)
   - size                {#u8}   (size in bytes)
@@ -112,7 +113,7 @@
   - drive_name          {#char[256]}
   - letter              {char}      (instead of an enumeration, partitions may have letters)
 
-  [apple.c, amiga.c, atari.c, unix.c, dos.c]
+  [apple.c, amiga.c, atari.c, unix.c, dos.c, lvm.c]
 */
 
 /* Linux swap ()                                    Q779098                 {implemented}
@@ -164,8 +165,11 @@
   - useable_size            {#u8}           (total size in bytes)
   - labelone_sector         {#int}          (location of labelone)
   - meta_data_version       {#int}
+  - extent_size             {#u8}           (size of an extent in bytes, LVM2)
+  - physical_volumes        {#int}          (in the volume group, LVM2)
+  - logical_volumes         {#int}          (in the volume group, LVM2)
 
-  [linux.c]
+  [linux.c, lvm.c]
 */
 
 /* RAID Disk ()                                     Q55673155               {implemented}
@@ -552,8 +556,10 @@
 
 /* Apple UDIF disk image (disk image file format)   Q14757791               {implemented}
   / start_sector (file format)
+  - disk_size      {#u8}
+  - compression    {none, ADC, zlib, bzip2, LZFSE, LZMA, unknown, mixed}
 
-  [apple.c]
+  [udif.c]
 */
 
 /* Apple partition map (partition table)            Q375944                 {implemented}
@@ -863,14 +869,85 @@
   [compressed.c]
 */
 
+/* xz archive (file format)                                                 {implemented}
+  + start_sector (file format)
+
+  [compressed.c]
+*/
+
+/* zstd archive (file format)                                               {implemented}
+  + start_sector (file format)
+
+  [compressed.c]
+*/
+
+/* lz4 archive (file format)                                                {implemented}
+  + start_sector (file format)
+
+  [compressed.c]
+*/
+
 /* Windows virtual PC disk image (disk image file format) Q55357928         {implemented}
    / start_sector (file format)
    - kind           {fixed size, dynamic size, differential, unknown kind}
    - disk_size      {#u8}
+   - parent_name    {#char[2048]}   (differencing images only)
 
   [vpc.c]
 */
 
+/* QEMU qcow2 disk image (disk image file format)   Q592312                 {implemented}
+   / start_sector (file format)
+   - version        {2, 3}
+   - disk_size      {#u8}
+   - cluster_size   {#u4}
+   - backing_file   {#char[1024]}   (not followed, its clusters read as zeros)
+   - encrypted      {true}          (contents not analyzed)
+
+  [qcow.c]
+*/
+
+/* QEMU qcow disk image (disk image file format)    Q592312                 {implemented}
+   / start_sector (file format)
+   - version        {1}             (recognized only)
+
+  [qcow.c]
+*/
+
+/* VMware VMDK sparse extent (disk image file format) Q592312               {implemented}
+   / start_sector (file format)
+   - version        {1, 2, 3}
+   - disk_size      {#u8}
+   - kind           {#char[256]}    (createType of the embedded descriptor)
+   - parent_name    {#char[256]}    (delta disks only, not followed)
+
+  [vmdk.c]
+*/
+
+/* Microsoft VHDX disk image (disk image file format) Q592312               {implemented}
+   / start_sector (file format)
+   - kind           {dynamic size, differencing}
+   - disk_size      {#u8}
+
+  [vhdx.c]
+*/
+
+/* RAID array ()                                    Q79757                  {implemented}
+    (Linux RAID array put together from its members, see --raid)
+  - raid_level          {RAID0, RAID1, RAID5, RAID10, ...}
+  - UUID                {#char[256]}    (UUID of the whole RAID set)
+  - name                {#char[256]}    (superblock version 1.x only)
+  - superblock_version  {0.90, 1.x}
+  - regular_disks       {#int}          (number of regular disks)
+  - members_found       {#int}          (regular disks among the files given)
+  - stale_members       {#int}          (left out, they missed updates)
+  - spare_disks         {#int}
+  - chunk_size          {#u8}           (not for RAID1)
+  - degraded            {true, false}
+
+  [md.c]
+*/
+
 /* LILO boot loader (boot loader)                   Q861940                 {implemented}
 
   [linux.c]
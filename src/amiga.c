@@ -128,14 +128,38 @@ void add_amiga_dostype(char *typecode, int isfs, char *name, char *wikidata,
     dostype_counter++;
 }
 
+#ifdef USE_THREADS
+/* Detect functions may run in several threads at once, only one of them
+ * may fill the list. */
+static pthread_mutex_t init_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static void fill_amiga_dostypes();
+
 /* Before the use of any amiga detect function, the amiga_dostypes list
  * has to be initialized, i.e. filled with all the dostypes.
  * 
  */
 void init_amiga()
 {
+    #ifdef USE_THREADS
+    pthread_mutex_lock(&init_lock);
+    #endif
+
     /* If the initialization has been done before, there's nothing to do. */
-    if (initialized == 1) {return; }
+    if (initialized != 1)
+    {
+        fill_amiga_dostypes();
+    }
+
+    #ifdef USE_THREADS
+    pthread_mutex_unlock(&init_lock);
+    #endif
+}
+
+/* Fills the amiga_dostypes list, see init_amiga(). */
+static void fill_amiga_dostypes()
+{
 
     /* Properties */
     struct amiga_property intl_t = {"intl", "true"};
@@ -0,0 +1,164 @@
+/*
+ * arena.c
+ * Region allocator for everything found in a single file.
+ *
+ * Copyright (c) 2018 Felix Baumann
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "global.h"
+
+/*
+ * constants
+ */
+
+/* blocks start small and grow, most files yield just a few objects */
+#define MIN_BLOCK_SIZE (4096)
+#define MAX_BLOCK_SIZE (64*1024)
+
+/* alignment of all allocations, enough for the types we store */
+#define ARENA_ALIGN (8)
+
+/*
+ * types
+ */
+
+typedef struct arena_block {
+  struct arena_block *next;
+  size_t size, used;
+  /* data follows, see BLOCK_DATA */
+} ARENA_BLOCK;
+
+#define BLOCK_HEADER \
+  ((sizeof(ARENA_BLOCK) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+#define BLOCK_DATA(b) ((char *)(b) + BLOCK_HEADER)
+
+/*
+ * get memory from the arena, it lives until the arena is released
+ */
+
+void *arena_alloc(ARENA *arena, size_t size)
+{
+  ARENA_BLOCK *b;
+  size_t block_size;
+  void *p;
+
+  size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+  /* the newest block is the only one still being filled */
+  b = (ARENA_BLOCK *)arena->blocks;
+  if (b == NULL || b->size - b->used < size) {
+    block_size = b ? b->size * 2 : MIN_BLOCK_SIZE;
+    if (block_size > MAX_BLOCK_SIZE)
+      block_size = MAX_BLOCK_SIZE;
+    if (block_size < size)
+      block_size = size;
+
+    b = (ARENA_BLOCK *)malloc(BLOCK_HEADER + block_size);
+    if (b == NULL)
+      bailout("Out of memory");
+    b->size = block_size;
+    b->used = 0;
+    b->next = (ARENA_BLOCK *)arena->blocks;
+    arena->blocks = b;
+  }
+
+  p = BLOCK_DATA(b) + b->used;
+  b->used += size;
+  return p;
+}
+
+/*
+ * take over all memory of another arena, FROM is left empty
+ */
+
+void arena_adopt(ARENA *arena, ARENA *from)
+{
+  ARENA_BLOCK *head, *tail;
+
+  head = (ARENA_BLOCK *)arena->blocks;
+  if (from->blocks == NULL)
+    return;
+  if (head == NULL) {
+    arena->blocks = from->blocks;
+    from->blocks = NULL;
+    return;
+  }
+
+  /* keep our newest block in front, it may still have room */
+  for (tail = (ARENA_BLOCK *)from->blocks; tail->next != NULL;
+       tail = tail->next)
+    ;
+  tail->next = head->next;
+  head->next = (ARENA_BLOCK *)from->blocks;
+  from->blocks = NULL;
+}
+
+/*
+ * release all memory of the arena at once
+ */
+
+void arena_release(ARENA *arena)
+{
+  ARENA_BLOCK *b, *next;
+
+  for (b = (ARENA_BLOCK *)arena->blocks; b != NULL; b = next) {
+    next = b->next;
+    free(b);
+  }
+  arena->blocks = NULL;
+}
+
+#ifdef JSON
+
+// -----------------------------------------------------------
+//                             TESTS
+// -----------------------------------------------------------
+
+void test_arena()
+{
+    ARENA arena = { NULL };
+    ARENA other = { NULL };
+    char *small, *large;
+
+    /* Allocations are aligned and don't overlap. */
+    small = arena_alloc(&arena, 3);
+    memset(small, 'a', 3);
+    large = arena_alloc(&arena, 3 * MAX_BLOCK_SIZE);
+    memset(large, 'b', 3 * MAX_BLOCK_SIZE);
+    assert(((size_t) large % ARENA_ALIGN) == 0);
+    assert(small[2] == 'a');
+
+    /* Adopted memory stays valid until the adopting arena goes away. */
+    small = arena_alloc(&other, 16);
+    strcpy(small, "adopted");
+    arena_adopt(&arena, &other);
+    assert(other.blocks == NULL);
+    assert(equal_chars(small, "adopted"));
+
+    arena_release(&arena);
+    assert(arena.blocks == NULL);
+}
+
+#endif
+
+/* EOF */
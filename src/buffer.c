@@ -42,9 +42,17 @@
    chunk size */
 #define MINBLOCKSIZE (256)
 
-/* a simple hash function */
-#define HASHSIZE (13)
-#define HASHFUNC(start) (((start)>>CHUNKBITS) % HASHSIZE)
+/* hash table sizing, the table doubles when it gets too crowded */
+#define MINHASHSIZE (64)
+#define HASHLOAD (2)
+#define HASHFUNC(start, size) ((u4)((start)>>CHUNKBITS) & ((size) - 1))
+
+/* default memory cap for all cached chunks together */
+#define DEFAULT_CACHE_LIMIT (64*1024*1024)
+
+/* the start of a sequential source is kept, most detectors look there
+   and going back to it would mean starting over */
+#define SEQ_KEEP_HEAD (64*1024)
 
 /* convenience */
 #define MINIMUM(a,b) (((a) < (b)) ? (a) : (b))
@@ -62,23 +70,165 @@ typedef struct chunk {
   */
   u8 start, end, len;
   void *buf;
-  /* links within a hash bucket, organized as a ring list */
-  struct chunk *next, *prev;
+  /* the cache this chunk belongs to */
+  struct cache *cache;
+  /* link within a hash bucket */
+  struct chunk *hnext;
+  /* links within the global LRU list, most recently used first */
+  struct chunk *lru_prev, *lru_next;
+  /* set while the chunk is being filled, it must not be evicted then;
+     FILLER identifies the thread doing it */
+  int busy;
+  int *filler;
+  /* threads waiting for the chunk to be filled */
+  int waiters;
+  /* number of running detector calls holding a pointer into it */
+  int pins;
 } CHUNK;
 
 typedef struct cache {
-  /* chunks stored as a hash table of ring lists */
-  CHUNK *hashtab[HASHSIZE];
-  /* temporary buffer for requests involving several chunks */
-  void *tempbuf;
+  /* chunks stored as a hash table of singly linked chains */
+  CHUNK **hashtab;
+  u4 hashsize;  /* always a power of two */
+  u4 count;
+  /* chunks before this position are never evicted; sequential sources
+     keep their head, or everything if they can't start over */
+  u8 keep_below;
 } CACHE;
 
+#define EVICTABLE(cache, c) ((c)->start >= (cache)->keep_below)
+
+/* Something a running detector call holds on to: a pinned chunk, or a
+   temporary buffer for a request involving several chunks. */
+typedef struct pin {
+  CHUNK *chunk;
+  void *tempbuf;
+  CACHE *cache;  /* the temporary buffer was filled from this cache */
+} PIN;
+
+/*
+ * global cache state
+ */
+
+/* the LRU list spans all sources, so the memory cap applies to the
+   whole process */
+static CHUNK *lru_head = NULL, *lru_tail = NULL;
+static u8 cache_bytes = 0;
+static u8 cache_limit = DEFAULT_CACHE_LIMIT;
+
+/* Sources may be read by several threads at once, see
+   analyze_recursive(). All cache structures are protected by one lock,
+   which is released while a chunk is being filled. */
+#ifdef USE_THREADS
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t chunk_filled = PTHREAD_COND_INITIALIZER;
+#define LOCK_CACHE() pthread_mutex_lock(&cache_lock)
+#define UNLOCK_CACHE() pthread_mutex_unlock(&cache_lock)
+#else
+#define LOCK_CACHE()
+#define UNLOCK_CACHE()
+#endif
+
+/* its address identifies the thread */
+static THREAD_LOCAL int thread_token;
+
+/* Pointers handed out by get_buffer() stay valid until the detector that
+   received them returns. Every running detector call of a thread gets a
+   frame on the thread's pin stack; what the call holds on to is pushed
+   there and released when the frame is left. Requests made outside of
+   any detector call go to the bottom of the stack, they don't pin
+   chunks and their temporary buffers are replaced by the next one. */
+static THREAD_LOCAL PIN *pin_stack = NULL;
+static THREAD_LOCAL int pin_count = 0, pin_alloc = 0;
+static THREAD_LOCAL int *frame_marks = NULL;  /* pin_count at frame entry */
+static THREAD_LOCAL int frame_depth = 0, frame_alloc = 0;
+
 /*
  * helper functions
  */
 
+static CACHE * get_cache(SOURCE *s);
 static CHUNK * ensure_chunk(SOURCE *s, CACHE *cache, u8 start);
+static void skip_sequential(SOURCE *s);
 static CHUNK * get_chunk_alloc(CACHE *cache, u8 start);
+static CHUNK * evict_chunk(void);
+static void grow_hashtab(CACHE *cache);
+static void lru_unlink(CHUNK *c);
+static void lru_push_front(CHUNK *c);
+static PIN * push_pin(void);
+static void pin_chunk(CHUNK *c);
+static void *get_tempbuf(CACHE *cache, u8 len);
+
+/*
+ * set the memory cap for cached data, zero means no limit
+ */
+
+void set_cache_limit(u8 bytes)
+{
+  cache_limit = bytes;
+}
+
+/*
+ * detector call frames, see the comment on pin_stack
+ */
+
+void pin_frame_enter(void)
+{
+  frame_depth++;
+  if (frame_depth >= frame_alloc) {
+    frame_alloc = frame_alloc ? frame_alloc * 2 : 16;
+    frame_marks = (int *)realloc(frame_marks, frame_alloc * sizeof(int));
+    if (frame_marks == NULL)
+      bailout("Out of memory");
+  }
+  frame_marks[frame_depth] = pin_count;
+}
+
+void pin_frame_leave(void)
+{
+  int mark, i;
+
+  if (frame_depth == 0)
+    return;
+  mark = frame_marks[frame_depth];
+  frame_depth--;
+  if (pin_count == mark)
+    return;
+
+  LOCK_CACHE();
+  for (i = mark; i < pin_count; i++) {
+    if (pin_stack[i].chunk != NULL)
+      pin_stack[i].chunk->pins--;
+  }
+  UNLOCK_CACHE();
+  for (i = mark; i < pin_count; i++) {
+    if (pin_stack[i].tempbuf != NULL)
+      free(pin_stack[i].tempbuf);
+  }
+  pin_count = mark;
+}
+
+/*
+ * free the pin stack of a thread that is about to exit, it must not be
+ * inside a detector call any more
+ */
+
+void pin_stack_release(void)
+{
+  int i;
+
+  /* only temporary buffers are left at the bottom of the stack */
+  for (i = 0; i < pin_count; i++) {
+    if (pin_stack[i].tempbuf != NULL)
+      free(pin_stack[i].tempbuf);
+  }
+  free(pin_stack);
+  free(frame_marks);
+  pin_stack = NULL;
+  frame_marks = NULL;
+  pin_count = pin_alloc = 0;
+  frame_depth = frame_alloc = 0;
+}
 
 /*
  * retrieve a piece of the source, entry point for detection
@@ -95,6 +245,61 @@ u8 get_buffer(SECTION *section, u8 pos, u8 len, void **buf)
   return get_buffer_real(s, pos, len, NULL, buf);
 }
 
+/*
+ * hint that a piece of the source will be needed soon
+ */
+
+void prefetch_buffer(SECTION *section, u8 pos, u8 len)
+{
+  SOURCE *s;
+
+  s = section->source;
+  pos += section->pos;
+  if (s->prefetch == NULL || len == 0)
+    return;
+
+  if (s->size_known) {
+    if (pos >= s->size)
+      return;
+    if (pos + len > s->size)
+      len = s->size - pos;
+  }
+
+  s->prefetch(s, pos, len);
+}
+
+/*
+ * read a piece of the source into the cache and keep it there until the
+ * current detector frame is left; for sequential sources, where going
+ * back means starting over
+ */
+
+void stage_buffer(SECTION *section, u8 pos, u8 len)
+{
+  SOURCE *s;
+  CACHE *cache;
+  CHUNK *c;
+  u8 end, curr_chunk;
+
+  s = section->source;
+  pos += section->pos;
+  if (len == 0 || (s->size_known && pos >= s->size))
+    return;
+  end = pos + len;
+
+  LOCK_CACHE();
+  cache = get_cache(s);
+  for (curr_chunk = pos & ~CHUNKMASK; curr_chunk < end;
+       curr_chunk += CHUNKSIZE) {
+    c = ensure_chunk(s, cache, curr_chunk);
+    if (frame_depth > 0)
+      pin_chunk(c);
+    if (c->len < CHUNKSIZE)
+      break;  /* end of data */
+  }
+  UNLOCK_CACHE();
+}
+
 /*
  * actual retrieval, entry point for layering
  */
@@ -122,22 +327,23 @@ u8 get_buffer_real(SOURCE *s, u8 pos, u8 len, void *inbuf, void **outbuf)
     len = end - pos;
   }
 
-  /* get cache head */
-  cache = (CACHE *)s->cache_head;
-  if (cache == NULL) {
-    /* allocate and initialize new cache head */
-    cache = (CACHE *)malloc(sizeof(CACHE));
-    if (cache == NULL)
-      bailout("Out of memory");
-    memset(cache, 0, sizeof(CACHE));
-    s->cache_head = (void *)cache;
-  }
-  /* free old temp buffer if present */
-  if (cache->tempbuf != NULL) {
-    free(cache->tempbuf);
-    cache->tempbuf = NULL;
+  /* memory-mapped sources hand out pointers into the mapping directly */
+  if (s->map_bytes != NULL) {
+    mybuf = s->map_bytes(s, pos, len);
+    if (mybuf != NULL) {
+      if (inbuf)
+	memcpy(inbuf, mybuf, len);
+      if (outbuf)
+	*outbuf = mybuf;
+      return len;
+    }
+    /* not mappable, fall back to the cache */
   }
 
+  /* get cache head */
+  LOCK_CACHE();
+  cache = get_cache(s);
+
   /* calculate involved chunks */
   first_chunk = pos & ~CHUNKMASK;
   last_chunk = (end - 1) & ~CHUNKMASK;
@@ -147,17 +353,24 @@ u8 get_buffer_real(SOURCE *s, u8 pos, u8 len, void *inbuf, void **outbuf)
     c = ensure_chunk(s, cache, first_chunk);
     /* NOTE: first_chunk == c->start */
 
-    if (pos >= c->end)  /* chunk is incomplete and doesn't have our data */
+    if (pos >= c->end) {  /* chunk is incomplete and doesn't have our data */
+      UNLOCK_CACHE();
       return 0;
+    }
 
     /* calculate return data */
     len = MINIMUM(len, c->end - pos);  /* guaranteed to be > 0 */
     mybuf = c->buf + (pos - c->start);
     if (inbuf)
       memcpy(inbuf, mybuf, len);
-    if (outbuf)
+    if (outbuf) {
       *outbuf = mybuf;
+      /* keep the chunk until the current detector is done with it */
+      if (frame_depth > 0)
+	pin_chunk(c);
+    }
 
+    UNLOCK_CACHE();
     return len;
 
   } else {
@@ -171,13 +384,13 @@ u8 get_buffer_real(SOURCE *s, u8 pos, u8 len, void *inbuf, void **outbuf)
       printf("Temporary buffer for request %llu:%llu\n", pos, len);
 #endif
 
-      /* allocate one temporarily, will be free()'d at the next call */
-      cache->tempbuf = malloc(len);
-      if (cache->tempbuf == NULL) {
+      /* allocate one temporarily, see get_tempbuf() */
+      mybuf = get_tempbuf(cache, len);
+      if (mybuf == NULL) {
+	UNLOCK_CACHE();
 	error("Out of memory, still going");
 	return 0;
       }
-      mybuf = cache->tempbuf;
     }
 
     /* draw data from all covered chunks */
@@ -217,6 +430,8 @@ u8 get_buffer_real(SOURCE *s, u8 pos, u8 len, void *inbuf, void **outbuf)
 	break;
     }
 
+    UNLOCK_CACHE();
+
     /* calculate return data */
     len = MINIMUM(len, got);  /* may be zero */
     if (outbuf)
@@ -226,42 +441,120 @@ u8 get_buffer_real(SOURCE *s, u8 pos, u8 len, void *inbuf, void **outbuf)
   }
 }
 
+/*
+ * get the cache head of a source, setting it up on first use; the cache
+ * lock must be held
+ */
+
+static CACHE * get_cache(SOURCE *s)
+{
+  CACHE *cache;
+
+  cache = (CACHE *)s->cache_head;
+  if (cache != NULL)
+    return cache;
+
+  /* allocate and initialize new cache head */
+  cache = (CACHE *)malloc(sizeof(CACHE));
+  if (cache == NULL)
+    bailout("Out of memory");
+  memset(cache, 0, sizeof(CACHE));
+  cache->hashsize = MINHASHSIZE;
+  cache->hashtab = (CHUNK **)malloc(cache->hashsize * sizeof(CHUNK *));
+  if (cache->hashtab == NULL)
+    bailout("Out of memory");
+  memset(cache->hashtab, 0, cache->hashsize * sizeof(CHUNK *));
+  if (!s->sequential)
+    cache->keep_below = 0;
+  else if (s->rewind != NULL)
+    cache->keep_below = SEQ_KEEP_HEAD;
+  else
+    cache->keep_below = ~(u8)0;
+  s->cache_head = (void *)cache;
+  return cache;
+}
+
+/*
+ * make sure a chunk holds all data available for it, the cache lock
+ * must be held; it is released while reading
+ */
+
 static CHUNK * ensure_chunk(SOURCE *s, CACHE *cache, u8 start)
 {
-  CHUNK *c;
+  CHUNK *c, *d;
   u8 pos, rel_start, rel_end;
-  u8 toread, result, curr_chunk;
+  u8 toread, result, curr_chunk, new_size;
+  int size_shrunk, rewound;
 
   c = get_chunk_alloc(cache, start);
+
+#ifdef USE_THREADS
+  /* another thread is filling it, wait for that */
+  while (c->busy && c->filler != &thread_token) {
+    c->waiters++;
+    pthread_cond_wait(&chunk_filled, &cache_lock);
+    c->waiters--;
+  }
+#endif
+
   if (c->len >= CHUNKSIZE || (s->size_known && c->end >= s->size)) {
     /* chunk is complete  or  complete until EOF */
     return c;
   }
+  if (c->busy)
+    return c;  /* we're filling it further up the call chain */
+
+  /* lower layers may allocate chunks while we read, keep this one */
+  c->busy = 1;
+  c->filler = &thread_token;
 
   if (s->sequential) {
     /* sequential source: ensure all data before this chunk was read */
 
+    if (s->seq_pos > c->end && s->rewind != NULL) {
+      /* the data went by and was evicted since, start over */
+      UNLOCK_CACHE();
+      rewound = s->rewind(s);
+      LOCK_CACHE();
+      if (rewound)
+	s->seq_pos = 0;
+    }
+
     if (s->seq_pos < start) {
       /* try to read data between seq_pos and start */
       curr_chunk = s->seq_pos & ~CHUNKMASK;
       while (curr_chunk < start) {  /* runs at least once, due to the if()
 				       and the formula of curr_chunk */
-	ensure_chunk(s, cache, curr_chunk);
+	d = ensure_chunk(s, cache, curr_chunk);
+	/* after starting over, the chunks still cached are read past */
+	if (s->seq_pos == d->start && d->len == CHUNKSIZE)
+	  skip_sequential(s);
 	curr_chunk += CHUNKSIZE;
 	if (s->seq_pos < curr_chunk)
 	  break;  /* it didn't work out... */
       }
 
       /* re-check precondition since s->size may have changed */
-      if (s->size_known && c->end >= s->size)
+      if (s->size_known && c->end >= s->size) {
+	c->busy = 0;
+	c->filler = NULL;
 	return c;  /* there is no more data to read */
+      }
     }
 
-    if (s->seq_pos != c->end)   /* c->end is where we'll continue reading */
+    if (s->seq_pos != c->end) {  /* c->end is where we'll continue reading */
+      c->busy = 0;
+      c->filler = NULL;
       return c;  /* we're not in a sane state, give up */
+    }
   }
 
-  /* try to read the missing piece */
+  /* try to read the missing piece; the chunk is ours while it is busy,
+     but the source's size must only be changed with the lock held */
+  size_shrunk = 0;
+  new_size = 0;
+  UNLOCK_CACHE();
+
   if (s->read_block != NULL) {
     /* use block-oriented read_block() method */
 
@@ -288,11 +581,9 @@ static CHUNK * ensure_chunk(SOURCE *s, CACHE *cache, u8 start)
 	/* failure */
 	c->len = rel_start;  /* this is safe as it can only mean a shrink */
 	c->end = c->start + c->len;
-	/* note the new end of file if necessary */
-	if (!s->size_known || s->size > c->end) {
-	  s->size_known = 1;
-	  s->size = c->end;
-	}
+	/* note the new end of file */
+	size_shrunk = 1;
+	new_size = c->end;
 	break;
       }
     }
@@ -319,69 +610,252 @@ static CHUNK * ensure_chunk(SOURCE *s, CACHE *cache, u8 start)
     if (result < toread) {
       /* we fell short, so it must have been an error or end-of-file */
       /* make sure we don't try again */
-      if (!s->size_known || s->size > c->end) {
-	s->size_known = 1;
-	s->size = c->end;
-      }
+      size_shrunk = 1;
+      new_size = c->end;
     }
   }
 
+  LOCK_CACHE();
+  if (size_shrunk && (!s->size_known || s->size > new_size)) {
+    s->size_known = 1;
+    s->size = new_size;
+  }
+
+  c->busy = 0;
+  c->filler = NULL;
+#ifdef USE_THREADS
+  if (c->waiters)
+    pthread_cond_broadcast(&chunk_filled);
+#endif
   return c;
 }
 
+/*
+ * read past a chunk of a sequential source that is cached already, the
+ * cache lock must be held; it is released while reading
+ */
+
+static void skip_sequential(SOURCE *s)
+{
+  void *buf;
+  u8 result;
+
+  buf = malloc(CHUNKSIZE);
+  if (buf == NULL)
+    bailout("Out of memory");
+
+  UNLOCK_CACHE();
+  result = s->read_bytes(s, s->seq_pos, CHUNKSIZE, buf);
+  LOCK_CACHE();
+  s->seq_pos += result;
+
+  free(buf);
+}
+
 static CHUNK * get_chunk_alloc(CACHE *cache, u8 start)
 {
-  int hpos;
-  CHUNK *chain, *trav, *c;
+  u4 hpos;
+  CHUNK *c;
 
-  /* get hash bucket (chain) */
-  hpos = HASHFUNC(start);
-  chain = cache->hashtab[hpos];
+  /* look for the wanted chunk in its hash bucket */
+  hpos = HASHFUNC(start, cache->hashsize);
+  for (c = cache->hashtab[hpos]; c != NULL; c = c->hnext) {
+    if (c->start == start) {
+      /* found existing chunk, mark it as recently used */
+      if (EVICTABLE(cache, c) && c != lru_head) {
+	lru_unlink(c);
+	lru_push_front(c);
+      }
+      return c;
+    }
+  }
 
-  if (chain == NULL) {
-    /* bucket is empty, allocate new chunk */
+  /* not found, recycle an old chunk if we're at the memory cap */
+  c = NULL;
+  if (cache_limit && cache_bytes + CHUNKSIZE > cache_limit)
+    c = evict_chunk();
+  if (c == NULL) {
     c = (CHUNK *)malloc(sizeof(CHUNK));
     if (c == NULL)
       bailout("Out of memory");
     c->buf = malloc(CHUNKSIZE);
     if (c->buf == NULL)
       bailout("Out of memory");
-    c->start = start;
-    c->end = start;
-    c->len = 0;
-    /* create a new ring list */
-    c->prev = c->next = c;
-    cache->hashtab[hpos] = c;
-    return c;
+    cache_bytes += CHUNKSIZE;
   }
-
-  /* travel the ring list, looking for the wanted chunk */
-  trav = chain;
-  do {
-    if (trav->start == start)  /* found existing chunk */
-      return trav;
-    trav = trav->next;
-  } while (trav != chain);
-
-  /* not found, allocate new chunk */
-  c = (CHUNK *)malloc(sizeof(CHUNK));
-  if (c == NULL)
-    bailout("Out of memory");
-  c->buf = malloc(CHUNKSIZE);
-  if (c->buf == NULL)
-    bailout("Out of memory");
   c->start = start;
   c->end = start;
   c->len = 0;
-  /* add to ring list before chain, becomes new head */
-  c->prev = chain->prev;
-  c->next = chain;
-  c->prev->next = c;
-  c->next->prev = c;
+  c->cache = cache;
+  c->busy = 0;
+  c->filler = NULL;
+  c->waiters = 0;
+  c->pins = 0;
+
+  /* add to the hash table (the table may have grown in the meantime) */
+  if (cache->count >= cache->hashsize * HASHLOAD)
+    grow_hashtab(cache);
+  hpos = HASHFUNC(start, cache->hashsize);
+  c->hnext = cache->hashtab[hpos];
   cache->hashtab[hpos] = c;
+  cache->count++;
+
+  if (EVICTABLE(cache, c))
+    lru_push_front(c);
+  else
+    c->lru_prev = c->lru_next = NULL;
   return c;
 }
 
+/*
+ * remove the least recently used chunk that is not in use from its cache,
+ * returns NULL if there is none
+ */
+
+static CHUNK * evict_chunk(void)
+{
+  CHUNK *c, **link;
+  CACHE *cache;
+
+  for (c = lru_tail; c != NULL; c = c->lru_prev) {
+    if (!c->busy && !c->waiters && !c->pins)
+      break;
+  }
+  if (c == NULL)
+    return NULL;
+
+  /* unlink it from its hash bucket */
+  cache = c->cache;
+  link = &cache->hashtab[HASHFUNC(c->start, cache->hashsize)];
+  while (*link != c)
+    link = &(*link)->hnext;
+  *link = c->hnext;
+  cache->count--;
+
+  lru_unlink(c);
+  return c;
+}
+
+static void grow_hashtab(CACHE *cache)
+{
+  CHUNK **newtab, *c, *next;
+  u4 newsize, i, hpos;
+
+  newsize = cache->hashsize * 2;
+  newtab = (CHUNK **)malloc(newsize * sizeof(CHUNK *));
+  if (newtab == NULL)
+    return;  /* just live with longer chains */
+  memset(newtab, 0, newsize * sizeof(CHUNK *));
+
+  for (i = 0; i < cache->hashsize; i++) {
+    for (c = cache->hashtab[i]; c != NULL; c = next) {
+      next = c->hnext;
+      hpos = HASHFUNC(c->start, newsize);
+      c->hnext = newtab[hpos];
+      newtab[hpos] = c;
+    }
+  }
+
+  free(cache->hashtab);
+  cache->hashtab = newtab;
+  cache->hashsize = newsize;
+}
+
+/*
+ * LRU list maintenance
+ */
+
+static void lru_unlink(CHUNK *c)
+{
+  if (c->lru_prev != NULL)
+    c->lru_prev->lru_next = c->lru_next;
+  else
+    lru_head = c->lru_next;
+  if (c->lru_next != NULL)
+    c->lru_next->lru_prev = c->lru_prev;
+  else
+    lru_tail = c->lru_prev;
+  c->lru_prev = c->lru_next = NULL;
+}
+
+static void lru_push_front(CHUNK *c)
+{
+  c->lru_prev = NULL;
+  c->lru_next = lru_head;
+  if (lru_head != NULL)
+    lru_head->lru_prev = c;
+  else
+    lru_tail = c;
+  lru_head = c;
+}
+
+/*
+ * pin stack maintenance, see the comment on pin_stack
+ */
+
+static PIN * push_pin(void)
+{
+  PIN *p;
+
+  if (pin_count >= pin_alloc) {
+    pin_alloc = pin_alloc ? pin_alloc * 2 : 64;
+    pin_stack = (PIN *)realloc(pin_stack, pin_alloc * sizeof(PIN));
+    if (pin_stack == NULL)
+      bailout("Out of memory");
+  }
+  p = &pin_stack[pin_count++];
+  p->chunk = NULL;
+  p->tempbuf = NULL;
+  p->cache = NULL;
+  return p;
+}
+
+/*
+ * keep a chunk until the current detector call returns, the cache lock
+ * must be held
+ */
+
+static void pin_chunk(CHUNK *c)
+{
+  int mark = frame_marks[frame_depth];
+
+  /* detectors tend to ask for the same chunk several times in a row */
+  if (pin_count > mark && pin_stack[pin_count - 1].chunk == c)
+    return;
+
+  push_pin()->chunk = c;
+  c->pins++;
+}
+
+/*
+ * get a temporary buffer for a request involving several chunks; it is
+ * released when the current detector call returns, or when the call
+ * makes the next such request to the same source
+ */
+
+static void *get_tempbuf(CACHE *cache, u8 len)
+{
+  int mark, i;
+  void *buf;
+
+  buf = malloc(len);
+  if (buf == NULL)
+    return NULL;
+
+  mark = frame_depth ? frame_marks[frame_depth] : 0;
+  for (i = pin_count - 1; i >= mark; i--) {
+    if (pin_stack[i].tempbuf != NULL && pin_stack[i].cache == cache) {
+      free(pin_stack[i].tempbuf);
+      pin_stack[i].tempbuf = buf;
+      return buf;
+    }
+  }
+
+  push_pin()->tempbuf = buf;
+  pin_stack[pin_count - 1].cache = cache;
+  return buf;
+}
+
 /*
  * dispose of a source
  */
@@ -389,45 +863,55 @@ static CHUNK * get_chunk_alloc(CACHE *cache, u8 start)
 void close_source(SOURCE *s)
 {
   CACHE *cache;
-  int hpos;
-  CHUNK *chain, *trav, *nexttrav;
+  u4 hpos;
+  CHUNK *trav, *nexttrav;
+  int i;
 
   /* drop the cache */
+  LOCK_CACHE();
   cache = (CACHE *)s->cache_head;
   if (cache != NULL) {
 #if PROFILE
-    printf("Cache profile:\n");
+    printf("Cache profile (%lu chunks):\n", cache->count);
 #endif
-    if (cache->tempbuf != NULL)
-      free(cache->tempbuf);
-    for (hpos = 0; hpos < HASHSIZE; hpos++) {
-#if PROFILE
-      printf(" hash position %d:", hpos);
-#endif
-      chain = cache->hashtab[hpos];
-      if (chain != NULL) {
-	trav = chain;
-	do {
+    /* forget what we hold on to, other threads are done with the
+       source at this point */
+    for (i = 0; i < pin_count; i++) {
+      if (pin_stack[i].chunk != NULL && pin_stack[i].chunk->cache == cache)
+	pin_stack[i].chunk = NULL;
+      if (pin_stack[i].tempbuf != NULL && pin_stack[i].cache == cache) {
+	free(pin_stack[i].tempbuf);
+	pin_stack[i].tempbuf = NULL;
+      }
+    }
+    for (hpos = 0; hpos < cache->hashsize; hpos++) {
 #if PROFILE
-	  printf(" %lluK", trav->start >> 10);
-	  if (trav->len != CHUNKSIZE)
-	    printf(":%llu", trav->len);
+      if (cache->hashtab[hpos] != NULL)
+	printf(" hash position %lu:", hpos);
 #endif
-	  nexttrav = trav->next;
-	  free(trav->buf);
-	  free(trav);
-	  trav = nexttrav;
-	} while (trav != chain);
+      for (trav = cache->hashtab[hpos]; trav != NULL; trav = nexttrav) {
 #if PROFILE
-	printf("\n");
+	printf(" %lluK", trav->start >> 10);
+	if (trav->len != CHUNKSIZE)
+	  printf(":%llu", trav->len);
 #endif
+	nexttrav = trav->hnext;
+	if (EVICTABLE(cache, trav))
+	  lru_unlink(trav);
+	cache_bytes -= CHUNKSIZE;
+	free(trav->buf);
+	free(trav);
       }
 #if PROFILE
-      else
-	printf(" empty\n");
+      if (cache->hashtab[hpos] != NULL)
+	printf("\n");
 #endif
     }
+    free(cache->hashtab);
+    free(cache);
+    s->cache_head = NULL;
   }
+  UNLOCK_CACHE();
 
   /* type-specific cleanup */
   if (s->close != NULL)
@@ -437,4 +921,171 @@ void close_source(SOURCE *s)
   free(s);
 }
 
+#ifdef JSON
+
+// -----------------------------------------------------------
+//                             TESTS
+// -----------------------------------------------------------
+
+/* A source that yields the low byte of each position as its data. */
+static u8 read_test_pattern(SOURCE *s, u8 pos, u8 len, void *buf)
+{
+    for (u8 i = 0; i < len; i++)
+    {
+        ((unsigned char *) buf)[i] = (unsigned char) (pos + i);
+    }
+    return len;
+}
+
+/* A sequential source with the same data. It has to be read in order
+   and counts how often it started over. */
+static u8 test_stream_pos;
+static int test_rewinds;
+
+static u8 read_test_stream(SOURCE *s, u8 pos, u8 len, void *buf)
+{
+    assert(pos == test_stream_pos);
+    test_stream_pos += len;
+    return read_test_pattern(s, pos, len, buf);
+}
+
+static int rewind_test_stream(SOURCE *s)
+{
+    test_stream_pos = 0;
+    test_rewinds++;
+    return 1;
+}
+
+static void test_sequential_window()
+{
+    SOURCE *s = (SOURCE *) malloc(sizeof(SOURCE));
+    memset(s, 0, sizeof(SOURCE));
+    s->sequential = 1;
+    s->read_bytes = read_test_stream;
+    s->rewind = rewind_test_stream;
+    test_stream_pos = 0;
+    test_rewinds = 0;
+
+    SECTION section = { 0, 0, 0, s };
+    unsigned char *buf;
+    u8 old_limit = cache_limit;
+    u8 old_bytes = cache_bytes;
+
+    /* Allow 16 chunks beyond the head of the stream. */
+    set_cache_limit(cache_bytes + SEQ_KEEP_HEAD + 16 * CHUNKSIZE);
+
+    assert(get_buffer(&section, 3, 1, (void **) &buf) == 1 && buf[0] == 3);
+    assert(get_buffer(&section, 1000 * CHUNKSIZE + 9, 1, (void **) &buf) == 1);
+    assert(buf[0] == 9);
+
+    /* The cache didn't keep everything the stream went through. */
+    assert(cache_bytes <= old_bytes + SEQ_KEEP_HEAD + 16 * CHUNKSIZE);
+
+    /* The head is still there, a recent chunk as well. */
+    assert(get_buffer(&section, 5, 1, (void **) &buf) == 1 && buf[0] == 5);
+    assert(get_buffer(&section, 999 * CHUNKSIZE, 1, (void **) &buf) == 1);
+    assert(test_rewinds == 0);
+
+    /* Dropped data is read again by starting over. */
+    assert(get_buffer(&section, 500 * CHUNKSIZE + 77, 1,
+                      (void **) &buf) == 1);
+    assert(buf[0] == 77);
+    assert(test_rewinds == 1);
+
+    close_source(s);
+    assert(cache_bytes == old_bytes);
+    set_cache_limit(old_limit);
+}
+
+static void test_stage_buffer()
+{
+    SOURCE *s = (SOURCE *) malloc(sizeof(SOURCE));
+    memset(s, 0, sizeof(SOURCE));
+    s->sequential = 1;
+    s->read_bytes = read_test_stream;
+    s->rewind = rewind_test_stream;
+    test_stream_pos = 0;
+    test_rewinds = 0;
+
+    SECTION section = { 0, 0, 0, s };
+    unsigned char *buf;
+    u8 old_limit = cache_limit;
+    u8 old_bytes = cache_bytes;
+
+    set_cache_limit(cache_bytes + SEQ_KEEP_HEAD + 16 * CHUNKSIZE);
+
+    /* Staged pieces stay while the stream goes far beyond them. */
+    pin_frame_enter();
+    stage_buffer(&section, 100 * CHUNKSIZE + 1, 2 * CHUNKSIZE);
+    stage_buffer(&section, 500 * CHUNKSIZE, 1);
+    assert(test_stream_pos == 501 * CHUNKSIZE);
+
+    assert(get_buffer(&section, 101 * CHUNKSIZE + 3, 1,
+                      (void **) &buf) == 1);
+    assert(buf[0] == 3);
+    assert(get_buffer(&section, 100 * CHUNKSIZE + 1, 2 * CHUNKSIZE,
+                      (void **) &buf) == 2 * CHUNKSIZE);
+    assert(buf[0] == 1 && buf[CHUNKSIZE] == 1);
+    assert(test_rewinds == 0);
+    pin_frame_leave();
+
+    /* Pinning them didn't push the cache over its limit. */
+    assert(cache_bytes <= old_bytes + SEQ_KEEP_HEAD + 16 * CHUNKSIZE);
+
+    close_source(s);
+    assert(cache_bytes == old_bytes);
+    set_cache_limit(old_limit);
+}
+
+void test_buffer()
+{
+    SOURCE *s = (SOURCE *) malloc(sizeof(SOURCE));
+    memset(s, 0, sizeof(SOURCE));
+    s->size_known = 1;
+    s->size = 1024 * CHUNKSIZE;
+    s->read_bytes = read_test_pattern;
+
+    SECTION section = { 0, 1024 * CHUNKSIZE, 0, s };
+    unsigned char *pinned, *buf;
+    u8 old_limit = cache_limit;
+    u8 old_bytes = cache_bytes;
+
+    /* Allow just four chunks beyond what is cached already. */
+    set_cache_limit(cache_bytes + 4 * CHUNKSIZE);
+
+    /* A pointer handed to a running detector must survive eviction. */
+    pin_frame_enter();
+    assert(get_buffer(&section, 5, 16, (void **) &pinned) == 16);
+    assert(pinned[0] == 5);
+
+    /* Each nested detector call only pins what it got itself. */
+    for (u8 pos = CHUNKSIZE; pos < 64 * CHUNKSIZE; pos += CHUNKSIZE)
+    {
+        pin_frame_enter();
+        assert(get_buffer(&section, pos + 7, 1, (void **) &buf) == 1);
+        assert(buf[0] == 7);
+        pin_frame_leave();
+    }
+
+    assert(pinned[0] == 5 && pinned[15] == 20);
+    pin_frame_leave();
+
+    /* The cache stayed within its limit despite reading 64 chunks. */
+    assert(((CACHE *) s->cache_head)->count <= 4);
+    assert(cache_bytes <= old_bytes + 4 * CHUNKSIZE);
+
+    /* Evicted chunks are read again transparently. */
+    assert(get_buffer(&section, CHUNKSIZE + 1, 2, (void **) &buf) == 2);
+    assert(buf[0] == 1 && buf[1] == 2);
+
+    close_source(s);
+    assert(cache_bytes == old_bytes);
+    set_cache_limit(old_limit);
+
+    test_sequential_window();
+    test_stage_buffer();
+}
+
+#endif
+
 /* EOF */
@@ -121,6 +121,8 @@ static SOURCE *init_cdimage_source(SOURCE *foundation, u8 offset)
   src->c.foundation = foundation;
   src->c.read_block = read_block_cdimage;
   src->c.close = NULL;
+  /* stateless translation, as concurrent as what's below */
+  src->c.concurrent = foundation->concurrent;
   src->off = offset;
 
   return (SOURCE *)src;
@@ -28,6 +28,57 @@
 
 #include "global.h"
 
+#ifdef USE_ZLIB
+#include <zlib.h>
+#endif
+
+/*
+ * The image is cut into blocks of the same size, each compressed with
+ * zlib by itself. A table of their offsets follows the header and is
+ * read up front; blocks are inflated when first read and kept in a
+ * small LRU cache, so analyzing a live CD only inflates the few blocks
+ * the detectors look at.
+ */
+
+#define CLOOP_HEADER (136)
+
+#define CACHE_SIZE (8)
+
+/*
+ * types
+ */
+
+typedef struct cloop_block {
+  u4 block;        /* its number plus one, 0 if the slot is free */
+  u8 last_use;
+  unsigned char *data;
+} CLOOP_BLOCK;
+
+typedef struct cloop_source {
+  SOURCE c;
+  u8 off;
+  u4 block_size, block_count;
+  unsigned char *offsets;  /* block_count + 1 of them */
+  CLOOP_BLOCK cache[CACHE_SIZE];
+  u8 clock;
+  unsigned char *packed;
+  u8 packed_alloc;
+  int inflate_failed;
+} CLOOP_SOURCE;
+
+/*
+ * helper functions
+ */
+
+#ifdef USE_ZLIB
+static SOURCE *init_cloop_source(SECTION *section, int level,
+				 u4 block_size, u4 block_count);
+static unsigned char *get_block(CLOOP_SOURCE *cs, u4 block);
+static int inflate_block(CLOOP_SOURCE *cs, u4 block, unsigned char *to);
+static u8 read_cloop(SOURCE *s, u8 pos, u8 len, void *buf);
+static void close_cloop(SOURCE *s);
+#endif
+
 /*
  * image file detection
  */
@@ -38,6 +89,9 @@ void detect_cloop(SECTION *section, int level)
   u4 blocksize, blockcount;
   char s[256];
   const char *sig_20 = "#!/bin/sh\n#V2.0 Format\nmodprobe cloop";
+#ifdef USE_ZLIB
+  SOURCE *src;
+#endif
 
   /* check for signature */
   if (get_buffer(section, 0, 256, (void **)&buf) < 256)
@@ -55,9 +109,300 @@ void detect_cloop(SECTION *section, int level)
   #ifdef JSON
   add_content_object(level, "Cloop image", "Q55340914");
 
-  add_property_u8("volume_size", (u8) (blocksize * blockcount));
+  add_property_u8("volume_size", (u8)blocksize * blockcount);
   #endif
 
+#ifdef USE_ZLIB
+  src = init_cloop_source(section, level, blocksize, blockcount);
+  if (src != NULL) {
+    analyze_source(src, level);
+    close_source(src);
+    stop_detect();
+  }
+#else
+  print_line(level + 1, "Contents not analyzed, built without zlib");
+#endif
+}
+
+#ifdef USE_ZLIB
+
+/*
+ * initialize the block source
+ */
+
+static SOURCE *init_cloop_source(SECTION *section, int level,
+				 u4 block_size, u4 block_count)
+{
+  CLOOP_SOURCE *cs;
+  u8 table_len;
+  unsigned char last[8];
+
+  if (block_size == 0 || block_size % 512 != 0 ||
+      block_size > 64*1024*1024) {
+    print_line(level + 1, "Error: Invalid block size (%lu bytes)",
+	       block_size);
+    return NULL;
+  }
+  if (block_count == 0 || block_count > 0x10000000) {
+    print_line(level + 1, "Error: Invalid block count");
+    return NULL;
+  }
+
+  /* the offsets of all blocks, and where the last one ends; the table
+     must be there before we make room for it */
+  table_len = ((u8)block_count + 1) * 8;
+  if (section->size > 0 ? CLOOP_HEADER + table_len > section->size :
+      get_buffer_real(section->source, section->pos + CLOOP_HEADER
+		      + table_len - 8, 8, last, NULL) < 8) {
+    print_line(level + 1, "Error: Invalid block count, the offset table"
+	       " doesn't fit in the image");
+    return NULL;
+  }
+
+  cs = (CLOOP_SOURCE *)malloc(sizeof(CLOOP_SOURCE));
+  if (cs == NULL)
+    bailout("Out of memory");
+  memset(cs, 0, sizeof(CLOOP_SOURCE));
+
+  cs->c.size_known = 1;
+  cs->c.size = (u8)block_size * block_count;
+  cs->c.foundation = section->source;
+  cs->c.read_bytes = read_cloop;
+  cs->c.close = close_cloop;
+  cs->off = section->pos;
+  cs->block_size = block_size;
+  cs->block_count = block_count;
+
+  cs->offsets = (unsigned char *)malloc(table_len);
+  if (cs->offsets == NULL)
+    bailout("Out of memory");
+  if (get_buffer_real(section->source, cs->off + CLOOP_HEADER, table_len,
+		      cs->offsets, NULL) < table_len) {
+    print_line(level + 1, "Error reading the block offsets");
+    close_cloop((SOURCE *)cs);
+    free(cs);
+    return NULL;
+  }
+
+  return (SOURCE *)cs;
+}
+
+/*
+ * get a block from the cache, inflating it in place of the one used
+ * least recently if needed; NULL if that's not possible
+ */
+
+static unsigned char *get_block(CLOOP_SOURCE *cs, u4 block)
+{
+  CLOOP_BLOCK *e, *victim;
+  int i;
+
+  victim = &cs->cache[0];
+  for (i = 0; i < CACHE_SIZE; i++) {
+    e = &cs->cache[i];
+    if (e->block == block + 1) {
+      e->last_use = ++cs->clock;
+      return e->data;
+    }
+    if (e->last_use < victim->last_use)
+      victim = e;
+  }
+
+  victim->block = 0;
+  victim->last_use = 0;
+  if (victim->data == NULL) {
+    /* slots get their memory when first used */
+    victim->data = (unsigned char *)malloc(cs->block_size);
+    if (victim->data == NULL)
+      bailout("Out of memory");
+  }
+  if (!inflate_block(cs, block, victim->data)) {
+    if (!cs->inflate_failed) {
+      cs->inflate_failed = 1;
+      error("cloop: can't inflate block %lu, reading it as zeros", block);
+    }
+    return NULL;
+  }
+  victim->block = block + 1;
+  victim->last_use = ++cs->clock;
+  return victim->data;
+}
+
+/*
+ * inflate a block into TO, returns 0 if it is damaged
+ */
+
+static int inflate_block(CLOOP_SOURCE *cs, u4 block, unsigned char *to)
+{
+  u8 start, end, len;
+  uLongf out_len;
+
+  start = get_be_quad(cs->offsets + (u8)block * 8);
+  end = get_be_quad(cs->offsets + (u8)block * 8 + 8);
+  if (end < start || end - start > (u8)cs->block_size * 2 + 4096)
+    return 0;
+  len = end - start;
+  if (len == 0) {
+    /* nothing stored, all zeros */
+    memset(to, 0, cs->block_size);
+    return 1;
+  }
+
+  if (cs->packed_alloc < len) {
+    free(cs->packed);
+    cs->packed = (unsigned char *)malloc(len);
+    if (cs->packed == NULL)
+      bailout("Out of memory");
+    cs->packed_alloc = len;
+  }
+  if (get_buffer_real(cs->c.foundation, cs->off + start, len, cs->packed,
+		      NULL) < len)
+    return 0;
+
+  out_len = cs->block_size;
+  if (uncompress(to, &out_len, cs->packed, (uLong)len) != Z_OK)
+    return 0;
+  /* the last block may be short */
+  memset(to + out_len, 0, cs->block_size - out_len);
+  return 1;
+}
+
+/*
+ * block read
+ */
+
+static u8 read_cloop(SOURCE *s, u8 pos, u8 len, void *buf)
+{
+  CLOOP_SOURCE *cs = (CLOOP_SOURCE *)s;
+  u8 got, run, rel;
+  u4 block;
+  unsigned char *data, *out;
+
+  if (pos >= s->size)
+    return 0;
+  if (len > s->size - pos)
+    len = s->size - pos;
+
+  for (got = 0; got < len; got += run) {
+    block = (u4)((pos + got) / cs->block_size);
+    rel = (pos + got) % cs->block_size;
+    run = cs->block_size - rel;
+    if (run > len - got)
+      run = len - got;
+    out = (unsigned char *)buf + got;
+
+    data = get_block(cs, block);
+    if (data != NULL)
+      memcpy(out, data + rel, run);
+    else
+      memset(out, 0, run);
+  }
+  return got;
+}
+
+/*
+ * cleanup
+ */
+
+static void close_cloop(SOURCE *s)
+{
+  CLOOP_SOURCE *cs = (CLOOP_SOURCE *)s;
+  int i;
+
+  free(cs->offsets);
+  for (i = 0; i < CACHE_SIZE; i++)
+    free(cs->cache[i].data);
+  free(cs->packed);
+}
+
+#endif
+
+#ifdef JSON
+
+#ifdef USE_ZLIB
+
+/* An image in memory with twenty blocks of 512 bytes, more than fit in
+ * the cache. Block 5 has nothing stored and reads as zeros.
+ */
+#define TEST_CLOOP_BLOCK (512)
+#define TEST_CLOOP_BLOCKS (20)
+
+static unsigned char *test_cloop_image;
+
+/* Whether the byte at POS reads as zero. */
+static int test_cloop_zero(u8 pos)
+{
+    return pos / TEST_CLOOP_BLOCK == 5;
+}
+
+#endif
+
+/* This is the main function responsible for tests in this class (cloop.c). */
+void test_cloop()
+{
+#ifdef USE_ZLIB
+    unsigned char data[TEST_CLOOP_BLOCK];
+    u8 at = CLOOP_HEADER + (TEST_CLOOP_BLOCKS + 1) * 8;
+    u8 total = TEST_CLOOP_BLOCKS * TEST_CLOOP_BLOCK;
+    uLongf len;
+    TEST_IMAGE foundation;
+    SECTION section;
+    SOURCE *s;
+
+    test_cloop_image = (unsigned char *) malloc(at + TEST_CLOOP_BLOCKS
+                                                * 2 * TEST_CLOOP_BLOCK);
+    memset(test_cloop_image, 0, CLOOP_HEADER);
+    for (u4 b = 0; b <= TEST_CLOOP_BLOCKS; b++)
+    {
+        put_test_be(test_cloop_image + CLOOP_HEADER + b * 8, at, 8);
+        if (b == 5 || b == TEST_CLOOP_BLOCKS)
+        {
+            continue;
+        }
+        for (int i = 0; i < TEST_CLOOP_BLOCK; i++)
+        {
+            data[i] = test_image_pattern(b * TEST_CLOOP_BLOCK + i);
+        }
+        len = 2 * TEST_CLOOP_BLOCK;
+        assert(compress(test_cloop_image + at, &len, data, TEST_CLOOP_BLOCK)
+               == Z_OK);
+        at += len;
+    }
+
+    init_test_image(&foundation, test_cloop_image, at);
+    init_test_section(&section, &foundation);
+
+    /* A block count whose offsets don't fit is refused, before the
+       table is read. */
+    assert(init_cloop_source(&section, 0, TEST_CLOOP_BLOCK, at / 8) == NULL);
+    assert(foundation.reads == 0);
+
+    /* The block offsets only. */
+    s = init_cloop_source(&section, 0, TEST_CLOOP_BLOCK, TEST_CLOOP_BLOCKS);
+    assert(s != NULL && s->size == total && foundation.reads == 1);
+
+    /* A block is inflated once, then kept; the cache takes memory for
+       it only now. Nothing stored, nothing to read. */
+    assert(((CLOOP_SOURCE *) s)->cache[0].data == NULL);
+    assert(count_test_reads(&foundation, s, 100, 100, test_cloop_zero) == 1);
+    assert(count_test_reads(&foundation, s, 300, 200, test_cloop_zero) == 0);
+    assert(((CLOOP_SOURCE *) s)->cache[1].data == NULL);
+    assert(count_test_reads(&foundation, s, 400, 1000, test_cloop_zero) == 2);
+    assert(count_test_reads(&foundation, s, 5 * TEST_CLOOP_BLOCK,
+                            TEST_CLOOP_BLOCK, test_cloop_zero) == 0);
+
+    /* All of it, then the last blocks are still cached, the first ones
+       aren't. */
+    check_test_read_all(s, 1000, test_cloop_zero);
+    assert(count_test_reads(&foundation, s, total - 100, 100,
+                            test_cloop_zero) == 0);
+    assert(count_test_reads(&foundation, s, 0, 100, test_cloop_zero) == 1);
+    assert(s->read_bytes(s, total - 10, 100, data) == 10);
+
+    close_source(s);
+    free(test_cloop_image);
+#endif
 }
+#endif
 
 /* EOF */
@@ -53,7 +53,15 @@ typedef struct compressed_source {
   u8 offset, write_pos, write_max;
   int write_pipe, read_pipe, nfds;
   pid_t pid;
+  const char *program;
 } COMPRESSED_SOURCE;
+
+#ifdef USE_THREADS
+/* keeps other threads from forking while our pipe ends are still
+   inheritable, a decompressor holding a copy of another one's input
+   pipe would keep it from ever seeing the end of its input */
+static pthread_mutex_t spawn_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
 #endif
 
 /*
@@ -61,12 +69,16 @@ typedef struct compressed_source {
  */
 
 static void handle_compressed(SECTION *section, int level,
-			      int off, const char *program);
+			      int off, const char *program, int format);
 
 #if DECOMPRESS
 static SOURCE *init_compressed_source(SOURCE *foundation, u8 offset, u8 size,
 				      const char *program);
+static void start_decompressor(COMPRESSED_SOURCE *cs);
+static void stop_decompressor(COMPRESSED_SOURCE *cs);
+static void set_cloexec(int fd);
 static u8 read_compressed(SOURCE *s, u8 pos, u8 len, void *buf);
+static int rewind_compressed(SOURCE *s);
 static void close_compressed(SOURCE *s);
 #endif
 
@@ -104,7 +116,7 @@ void detect_compressed(SECTION *section, int level)
       {
 	print_line(level, "compress-compressed data");
       }
-      handle_compressed(section, level, off, "gzip");
+      handle_compressed(section, level, off, "gzip", DECOMPRESS_NONE);
 
       break;
     }
@@ -129,7 +141,8 @@ void detect_compressed(SECTION *section, int level)
       {
 	print_line(level, "gzip-compressed data");
       }
-      handle_compressed(section, level, off, "gzip");
+      handle_compressed(section, level, off, "gzip",
+			(buf[off+1] == 0213) ? DECOMPRESS_GZIP : DECOMPRESS_NONE);
 
       break;
     }
@@ -153,7 +166,79 @@ void detect_compressed(SECTION *section, int level)
       {
 	print_line(level, "bzip2-compressed data");
       }
-      handle_compressed(section, level, off, "bzip2");
+      handle_compressed(section, level, off, "bzip2", DECOMPRESS_BZIP2);
+
+      break;
+    }
+
+    /* xz */
+    if (memcmp(buf + off, "\3757zXZ", 6) == 0) {
+
+      #ifdef JSON
+      add_content_object(level, "xz archive", "");
+      #endif
+
+      if (sector > 0)
+      {
+	print_line(level, "xz-compressed data at sector %d", sector);
+
+        #ifdef JSON
+        add_property_int("start_sector", sector);
+        #endif
+      }
+      else
+      {
+	print_line(level, "xz-compressed data");
+      }
+      handle_compressed(section, level, off, "xz", DECOMPRESS_XZ);
+
+      break;
+    }
+
+    /* zstd */
+    if (get_le_long(buf + off) == 0xfd2fb528) {
+
+      #ifdef JSON
+      add_content_object(level, "zstd archive", "");
+      #endif
+
+      if (sector > 0)
+      {
+	print_line(level, "zstd-compressed data at sector %d", sector);
+
+        #ifdef JSON
+        add_property_int("start_sector", sector);
+        #endif
+      }
+      else
+      {
+	print_line(level, "zstd-compressed data");
+      }
+      handle_compressed(section, level, off, "zstd", DECOMPRESS_ZSTD);
+
+      break;
+    }
+
+    /* lz4 */
+    if (get_le_long(buf + off) == 0x184d2204) {
+
+      #ifdef JSON
+      add_content_object(level, "lz4 archive", "");
+      #endif
+
+      if (sector > 0)
+      {
+	print_line(level, "lz4-compressed data at sector %d", sector);
+
+        #ifdef JSON
+        add_property_int("start_sector", sector);
+        #endif
+      }
+      else
+      {
+	print_line(level, "lz4-compressed data");
+      }
+      handle_compressed(section, level, off, "lz4", DECOMPRESS_LZ4);
 
       break;
     }
@@ -161,23 +246,30 @@ void detect_compressed(SECTION *section, int level)
 }
 
 static void handle_compressed(SECTION *section, int level,
-			      int off, const char *program)
+			      int off, const char *program, int format)
 {
-#if DECOMPRESS
   SOURCE *s;
   u8 size;
 
-  /* create decompression data source */
+  /* create decompression data source, in-process if possible,
+     otherwise running PROGRAM */
   size = section->size;
   if (size > 0)
     size -= off;
-  s = init_compressed_source(section->source,
-			     section->pos + off, size, program);
+  s = init_decompress_source(section->source,
+			     section->pos + off, size, format);
+#if DECOMPRESS
+  if (s == NULL)
+    s = init_compressed_source(section->source,
+			       section->pos + off, size, program);
+#endif
+  if (s == NULL) {
+    print_line(level + 1, "Decompression disabled on this system");
+    return;
+  }
+
   analyze_source(s, level + 1);
   close_source(s);
-#else
-  print_line(level + 1, "Decompression disabled on this system");
-#endif
 }
 
 /*
@@ -190,7 +282,6 @@ static SOURCE *init_compressed_source(SOURCE *foundation, u8 offset, u8 size,
 				      const char *program)
 {
   COMPRESSED_SOURCE *cs;
-  int write_pipe[2], read_pipe[2], flags;
 
   cs = (COMPRESSED_SOURCE *)malloc(sizeof(COMPRESSED_SOURCE));
   if (cs == NULL)
@@ -201,14 +292,34 @@ static SOURCE *init_compressed_source(SOURCE *foundation, u8 offset, u8 size,
   cs->c.seq_pos = 0;
   cs->c.foundation = foundation;
   cs->c.read_bytes = read_compressed;
+  cs->c.rewind = rewind_compressed;
   cs->c.close = close_compressed;
   /* size is not known in advance by definition */
 
   cs->offset = offset;
-  cs->write_pos = 0;
   cs->write_max = size;
+  cs->program = program;
+
+  start_decompressor(cs);
+
+  return (SOURCE *)cs;
+}
+
+/*
+ * run the decompressor on the data from its start
+ */
+
+static void start_decompressor(COMPRESSED_SOURCE *cs)
+{
+  const char *program = cs->program;
+  int write_pipe[2], read_pipe[2], flags;
+
+  cs->write_pos = 0;
 
   /* open "gzip -dc" in a dual pipe */
+#ifdef USE_THREADS
+  pthread_mutex_lock(&spawn_lock);
+#endif
   if (pipe(write_pipe) < 0)
     bailoute("pipe for decompression");
   if (pipe(read_pipe) < 0)
@@ -216,6 +327,10 @@ static SOURCE *init_compressed_source(SOURCE *foundation, u8 offset, u8 size,
   cs->write_pipe = write_pipe[1];
   cs->read_pipe = read_pipe[0];
 
+  /* decompressors started later must not inherit our ends */
+  set_cloexec(write_pipe[1]);
+  set_cloexec(read_pipe[0]);
+
   cs->pid = fork();
   if (cs->pid < 0) {
     bailoute("fork");
@@ -238,6 +353,9 @@ static SOURCE *init_compressed_source(SOURCE *foundation, u8 offset, u8 size,
   /* we're the parent process */
   close(write_pipe[0]);
   close(read_pipe[1]);
+#ifdef USE_THREADS
+  pthread_mutex_unlock(&spawn_lock);
+#endif
 
   /* set non-blocking I/O */
   if ((flags = fcntl(cs->write_pipe, F_GETFL, 0)) >= 0)
@@ -250,8 +368,26 @@ static SOURCE *init_compressed_source(SOURCE *foundation, u8 offset, u8 size,
     bailoute("set pipe flags");
   cs->nfds = ((cs->read_pipe > cs->write_pipe) ?
 	      cs->read_pipe : cs->write_pipe) + 1;
+}
 
-  return (SOURCE *)cs;
+static void stop_decompressor(COMPRESSED_SOURCE *cs)
+{
+  int status;
+
+  if (cs->write_pipe >= 0)
+    close(cs->write_pipe);
+  if (cs->read_pipe >= 0)
+    close(cs->read_pipe);
+  kill(cs->pid, SIGHUP);
+  waitpid(cs->pid, &status, 0);
+}
+
+static void set_cloexec(int fd)
+{
+  int flags;
+
+  if ((flags = fcntl(fd, F_GETFD, 0)) >= 0)
+    fcntl(fd, F_SETFD, flags | FD_CLOEXEC);
 }
 
 /*
@@ -393,20 +529,25 @@ static u8 read_compressed(SOURCE *s, u8 pos, u8 len, void *buf)
 }
 
 /*
- * close cleanup
+ * start over, the cache dropped data that is needed again
  */
 
-static void close_compressed(SOURCE *s)
+static int rewind_compressed(SOURCE *s)
 {
   COMPRESSED_SOURCE *cs = (COMPRESSED_SOURCE *)s;
-  int status;
 
-  if (cs->write_pipe >= 0)
-    close(cs->write_pipe);
-  if (cs->read_pipe >= 0)
-    close(cs->read_pipe);
-  kill(cs->pid, SIGHUP);
-  waitpid(cs->pid, &status, 0);
+  stop_decompressor(cs);
+  start_decompressor(cs);
+  return 1;
+}
+
+/*
+ * close cleanup
+ */
+
+static void close_compressed(SOURCE *s)
+{
+  stop_decompressor((COMPRESSED_SOURCE *)s);
 }
 
 #endif /* DECOMPRESS */
@@ -0,0 +1,2352 @@
+/*
+ * decompress.c
+ * Layered data source decompressing gzip, bzip2, xz, zstd and lz4 data
+ * in-process.
+ *
+ * Copyright (c) 2018 Felix Baumann
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "global.h"
+
+/*
+ * The libraries are optional, see the Makefile. Without them
+ * init_decompress_source() declines and compressed.c runs the external
+ * programs instead.
+ *
+ * bzip2 blocks and BGZF members can be decompressed on their own. They
+ * are found ahead of time and decompressed in batches, concurrently if
+ * the task pool is running (-p). Whenever that doesn't work out, the
+ * data is decompressed the plain way, which deals with damage as usual.
+ *
+ * xz, zstd and lz4 are streamed. zstd data in the seekable format has a
+ * table of its frames at the end; those are decompressed as needed.
+ */
+
+#ifdef USE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef USE_BZIP2
+#include <bzlib.h>
+#endif
+#ifdef USE_LZMA
+#include <lzma.h>
+#endif
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef USE_LZ4
+#include <lz4frame.h>
+#endif
+
+#if defined(USE_ZLIB) || defined(USE_BZIP2) || defined(USE_LZMA) || \
+    defined(USE_ZSTD) || defined(USE_LZ4)
+#define DECOMPRESS_LIBS
+#endif
+
+#ifdef DECOMPRESS_LIBS
+
+/*
+ * constants
+ */
+
+/* compressed data is drawn from the foundation in pieces of this size */
+#define INBUFSIZE (64*1024)
+
+/* distance between checkpoints of the gzip index, in decompressed bytes */
+#define INDEX_SPAN (4*1024*1024)
+
+/* deflate looks back at most this far */
+#define WINDOW_SIZE (32768)
+
+/* data skipped on the way to a requested position goes here */
+#define SKIPBUFSIZE (64*1024)
+
+/* gzip index files start with this */
+#define INDEX_MAGIC "DTGZIX01"
+
+/* pieces decompressed at once by the task pool at most, see
+   decode_batch() */
+#define BATCH_UNITS (16)
+
+/* a bzip2 block of long runs may decompress to some 45 MiB, more than
+   this is left for when it's needed */
+#define UNIT_OUT_MAX (1024*1024)
+
+/* bzip2 block and end of stream markers, they aren't byte-aligned */
+#define BZ_BLOCK_MAGIC (0x314159265359ULL)
+#define BZ_EOS_MAGIC (0x177245385090ULL)
+#define BZ_MAGIC_MASK (0xffffffffffffULL)
+
+/* BGZF members hold at most 64 KiB, anything much larger is suspect */
+#define BGZF_MAX_ISIZE (1024*1024)
+
+/* magic numbers of the frames and streams that may follow each other */
+#define XZ_MAGIC "\3757zXZ"  /* and a zero byte */
+#define ZSTD_MAGIC (0xfd2fb528)
+#define LZ4_MAGIC (0x184d2204)
+#define SKIPPABLE_MAGIC (0x184d2a50)  /* for zstd and lz4, low 4 bits vary */
+#define SKIPPABLE_MASK (0xfffffff0)
+
+/* the footer of the zstd seekable format, and the most a frame of it
+   may decompress to */
+#define SEEKABLE_MAGIC (0x8f92eab1)
+#define SEEKABLE_TABLE_MAGIC (0x184d2a5e)
+#define SEEKABLE_FRAME_MAX (64*1024*1024)
+
+/*
+ * types
+ */
+
+#ifdef USE_ZLIB
+/* A position where decompression can be resumed: the first byte of a
+   deflate block. IN is where it starts in the compressed data, BITS of
+   the byte before it belong to it as well. WINDOW is the data before
+   OUT that the block may refer back to. */
+typedef struct checkpoint {
+  u8 out, in;
+  int bits;
+  u4 window_len;
+  unsigned char *window;
+} CHECKPOINT;
+#endif
+
+/* A piece of the compressed data that can be decompressed on its own,
+   a bzip2 block or a BGZF member. Bit positions for bzip2 blocks, byte
+   positions for BGZF members. */
+typedef struct unit {
+  TASK t;
+  struct decompress_source *ds;
+  u8 in_start, in_end;
+  int level;  /* block size digit of the bzip2 stream */
+  unsigned char *in;  /* the member, or the block as a stream of its own */
+  u8 in_len;
+  u8 out_start, out_len;
+  unsigned char *out;
+  int result;  /* zero if it went fine */
+#ifdef USE_BZIP2
+  /* kept open while there is more than UNIT_OUT_MAX */
+  bz_stream bs;
+  int bs_open;
+#endif
+} UNIT;
+
+#if defined(USE_ZLIB) || defined(USE_ZSTD)
+/* where a BGZF member or a zstd seekable frame starts, compressed and
+   decompressed */
+typedef struct member {
+  u8 in, out;
+} MEMBER;
+#endif
+
+typedef struct decompress_source {
+  SOURCE c;
+  int format;
+  /* where the compressed data is in the foundation, in_max is zero if
+     it extends to the end */
+  u8 offset, in_pos, in_max;
+  int in_eof;
+  /* compressed data not yet consumed */
+  unsigned char *inbuf, *in_next;
+  u4 in_avail;
+  /* set once the end of the data or an error was reached */
+  int done;
+  /* decompressed position of the stream; gzip data may be read in any
+     order, see seek_gzip() */
+  u8 out_pos;
+  /* the pieces decoded last, in order, see decode_batch() */
+  UNIT *batch;
+  int batch_size, batch_count, batch_next;
+  unsigned char *skipbuf;
+#ifdef USE_ZLIB
+  z_stream zs;
+  /* set while resumed at a checkpoint, zlib doesn't see gzip headers
+     and trailers then */
+  int raw;
+  CHECKPOINT *index;
+  int index_count, index_alloc;
+  /* checkpoints that were read from a file, see gzip_index */
+  int index_loaded;
+  /* set while the data looks like BGZF, its members are mapped as far
+     as they were needed */
+  int bgzf;
+  MEMBER *members;
+  int member_count, member_alloc;
+  u8 map_in, map_out;
+  int map_done;
+#endif
+#ifdef USE_BZIP2
+  bz_stream bs;
+  int bs_open;  /* libbz2 needs a new stream for every concatenated one */
+  /* set while blocks are decoded on the task pool; the compressed data
+     scanned for them is kept in scan_buf from byte scan_base on */
+  int parallel;
+  unsigned char *scan_buf;
+  u8 scan_base, scan_len, scan_alloc;
+  u8 scan_reg;     /* the last 64 bits scanned */
+  int scan_level;  /* zero while looking for a stream header */
+  u8 scan_hdr;     /* where that header should be */
+  int scan_done;
+  int block_open, block_level;
+  u8 block_start;
+#endif
+#ifdef USE_LZMA
+  lzma_stream xs;
+  int xs_open;  /* a new stream for every concatenated one, as well */
+#endif
+#ifdef USE_ZSTD
+  ZSTD_DStream *zds;
+  /* the frames of the seekable format, with one more for the end; the
+     one decompressed last is kept */
+  ZSTD_DCtx *zdc;
+  MEMBER *frames;
+  int frame_count, frame_kept;
+  unsigned char *frame_in, *frame_out;  /* big enough for any frame */
+#endif
+#ifdef USE_LZ4
+  LZ4F_dctx *lz4;
+#endif
+} DECOMPRESS_SOURCE;
+
+/*
+ * helper functions
+ */
+
+static u4 need_input(DECOMPRESS_SOURCE *ds, u4 want);
+static void restart_input(DECOMPRESS_SOURCE *ds);
+#if defined(USE_ZLIB) || defined(USE_BZIP2)
+static void new_batch(DECOMPRESS_SOURCE *ds);
+static void decode_batch(DECOMPRESS_SOURCE *ds, void (*run)(TASK *t));
+#endif
+static void free_batch(DECOMPRESS_SOURCE *ds);
+#ifdef USE_ZLIB
+static u8 read_gzip(SOURCE *s, u8 pos, u8 len, void *buf);
+static u8 inflate_gzip(DECOMPRESS_SOURCE *ds, unsigned char *buf, u8 len);
+static void seek_gzip(DECOMPRESS_SOURCE *ds, u8 pos);
+static void resume_gzip(DECOMPRESS_SOURCE *ds, CHECKPOINT *cp);
+static void add_checkpoint(DECOMPRESS_SOURCE *ds);
+static char *index_filename(DECOMPRESS_SOURCE *ds);
+static u8 stream_identity(DECOMPRESS_SOURCE *ds);
+static void load_index(DECOMPRESS_SOURCE *ds);
+static void save_index(DECOMPRESS_SOURCE *ds);
+static u8 read_compressed(DECOMPRESS_SOURCE *ds, u8 pos, u8 len, void *buf);
+static u8 read_bgzf(DECOMPRESS_SOURCE *ds, u8 pos, u8 len, unsigned char *buf);
+static UNIT *find_bgzf_unit(DECOMPRESS_SOURCE *ds, u8 pos);
+static int map_bgzf_member(DECOMPRESS_SOURCE *ds);
+static void run_bgzf_unit(TASK *t);
+#endif
+#ifdef USE_BZIP2
+static u8 read_bzip2(SOURCE *s, u8 pos, u8 len, void *buf);
+static u8 read_bzip2_parallel(DECOMPRESS_SOURCE *ds, u8 len,
+			      unsigned char *buf);
+static int scan_bzip2(DECOMPRESS_SOURCE *ds);
+static void run_bzip2_unit(TASK *t);
+static void inflate_bzip2_unit(UNIT *u);
+static int rewind_bzip2(SOURCE *s);
+#endif
+#ifdef USE_LZMA
+static int start_xz(DECOMPRESS_SOURCE *ds);
+static u8 read_xz(SOURCE *s, u8 pos, u8 len, void *buf);
+static int rewind_xz(SOURCE *s);
+#endif
+#ifdef USE_ZSTD
+static u8 read_zstd(SOURCE *s, u8 pos, u8 len, void *buf);
+static int rewind_zstd(SOURCE *s);
+static int load_seek_table(DECOMPRESS_SOURCE *ds);
+static u8 read_zstd_seekable(SOURCE *s, u8 pos, u8 len, void *buf);
+static int decompress_frame(DECOMPRESS_SOURCE *ds, int frame);
+#endif
+#ifdef USE_LZ4
+static u8 read_lz4(SOURCE *s, u8 pos, u8 len, void *buf);
+static int rewind_lz4(SOURCE *s);
+#endif
+#if defined(USE_ZSTD) || defined(USE_LZ4)
+static int frame_follows(DECOMPRESS_SOURCE *ds, u4 magic);
+#endif
+static void close_decompress(SOURCE *s);
+
+#endif
+
+/* set by --gzip-index: keep the index of a gzip file in a file next to
+   it, so later runs can start with it */
+int gzip_index = 0;
+
+/*
+ * initialize the decompression, returns NULL if FORMAT can't be
+ * decompressed in-process
+ */
+
+SOURCE *init_decompress_source(SOURCE *foundation, u8 offset, u8 size,
+			       int format)
+{
+#ifdef DECOMPRESS_LIBS
+  DECOMPRESS_SOURCE *ds;
+
+  switch (format) {
+#ifdef USE_ZLIB
+  case DECOMPRESS_GZIP:
+#endif
+#ifdef USE_BZIP2
+  case DECOMPRESS_BZIP2:
+#endif
+#ifdef USE_LZMA
+  case DECOMPRESS_XZ:
+#endif
+#ifdef USE_ZSTD
+  case DECOMPRESS_ZSTD:
+#endif
+#ifdef USE_LZ4
+  case DECOMPRESS_LZ4:
+#endif
+    break;
+  default:
+    return NULL;
+  }
+
+  ds = (DECOMPRESS_SOURCE *)malloc(sizeof(DECOMPRESS_SOURCE));
+  if (ds == NULL)
+    bailout("Out of memory");
+  memset(ds, 0, sizeof(DECOMPRESS_SOURCE));
+  ds->inbuf = (unsigned char *)malloc(INBUFSIZE);
+  if (ds->inbuf == NULL)
+    bailout("Out of memory");
+
+  ds->c.sequential = 1;
+  ds->c.seq_pos = 0;
+  ds->c.foundation = foundation;
+  ds->c.close = close_decompress;
+  /* size is not known in advance by definition */
+
+  ds->format = format;
+  ds->offset = offset;
+  ds->in_pos = 0;
+  ds->in_max = size;
+  ds->in_next = ds->inbuf;
+  ds->in_avail = 0;
+
+#ifdef USE_ZLIB
+  if (format == DECOMPRESS_GZIP) {
+    /* 16 selects the gzip wrapper */
+    if (inflateInit2(&ds->zs, 15 + 16) != Z_OK)
+      bailout("Can't initialize zlib");
+    ds->skipbuf = (unsigned char *)malloc(SKIPBUFSIZE);
+    if (ds->skipbuf == NULL)
+      bailout("Out of memory");
+    ds->c.read_bytes = read_gzip;
+
+    /* with the index, any part can be decompressed on its own, so the
+       cache may drop chunks and read them again later */
+    ds->c.sequential = 0;
+    if (gzip_index)
+      load_index(ds);
+
+    /* BGZF members can be found without decompressing them, that makes
+       for an index of its own; map_bgzf_member() finds out */
+    ds->bgzf = 1;
+  }
+#endif
+#ifdef USE_BZIP2
+  if (format == DECOMPRESS_BZIP2) {
+    if (BZ2_bzDecompressInit(&ds->bs, 0, 0) != BZ_OK)
+      bailout("Can't initialize libbz2");
+    ds->bs_open = 1;
+    ds->c.read_bytes = read_bzip2;
+    ds->c.rewind = rewind_bzip2;
+
+    /* the blocks can be decoded on their own, worth it if there is
+       someone to do it */
+    ds->parallel = task_pool_active();
+    ds->skipbuf = (unsigned char *)malloc(SKIPBUFSIZE);
+    if (ds->skipbuf == NULL)
+      bailout("Out of memory");
+  }
+#endif
+#ifdef USE_LZMA
+  if (format == DECOMPRESS_XZ) {
+    if (!start_xz(ds))
+      bailout("Can't initialize liblzma");
+    ds->c.read_bytes = read_xz;
+    ds->c.rewind = rewind_xz;
+  }
+#endif
+#ifdef USE_ZSTD
+  if (format == DECOMPRESS_ZSTD) {
+    ds->zds = ZSTD_createDStream();
+    if (ds->zds == NULL || ZSTD_isError(ZSTD_initDStream(ds->zds)))
+      bailout("Can't initialize libzstd");
+    ds->c.read_bytes = read_zstd;
+    ds->c.rewind = rewind_zstd;
+
+    /* with the seek table of the seekable format, each frame can be
+       decompressed on its own, and the size is known */
+    if (load_seek_table(ds)) {
+      ds->zdc = ZSTD_createDCtx();
+      if (ds->zdc == NULL)
+	bailout("Can't initialize libzstd");
+      ds->frame_kept = -1;
+      ds->c.read_bytes = read_zstd_seekable;
+      ds->c.rewind = NULL;
+      ds->c.sequential = 0;
+      ds->c.size_known = 1;
+      ds->c.size = ds->frames[ds->frame_count].out;
+    }
+  }
+#endif
+#ifdef USE_LZ4
+  if (format == DECOMPRESS_LZ4) {
+    if (LZ4F_isError(LZ4F_createDecompressionContext(&ds->lz4,
+						      LZ4F_VERSION)))
+      bailout("Can't initialize liblz4");
+    ds->c.read_bytes = read_lz4;
+    ds->c.rewind = rewind_lz4;
+  }
+#endif
+
+  return (SOURCE *)ds;
+#else
+  return NULL;
+#endif
+}
+
+#ifdef DECOMPRESS_LIBS
+
+/*
+ * make at least WANT bytes of compressed data available unless the end
+ * was reached, returns how many there are
+ */
+
+static u4 need_input(DECOMPRESS_SOURCE *ds, u4 want)
+{
+  u8 askfor, got;
+
+  if (ds->in_avail >= want || ds->in_eof)
+    return ds->in_avail;
+
+  /* keep what's left at the start of the buffer */
+  memmove(ds->inbuf, ds->in_next, ds->in_avail);
+  ds->in_next = ds->inbuf;
+
+  askfor = INBUFSIZE - ds->in_avail;
+  if (ds->in_max && ds->in_pos + askfor > ds->in_max)
+    askfor = ds->in_max - ds->in_pos;
+  got = get_buffer_real(ds->c.foundation, ds->offset + ds->in_pos, askfor,
+			ds->inbuf + ds->in_avail, NULL);
+  if (got < askfor)
+    ds->in_eof = 1;  /* end of compressed input */
+
+  ds->in_pos += got;
+  ds->in_avail += got;
+  return ds->in_avail;
+}
+
+/*
+ * go back to the start of the compressed data
+ */
+
+static void restart_input(DECOMPRESS_SOURCE *ds)
+{
+  ds->in_pos = 0;
+  ds->in_next = ds->inbuf;
+  ds->in_avail = 0;
+  ds->in_eof = 0;
+  ds->done = 0;
+  ds->out_pos = 0;
+}
+
+#if defined(USE_ZLIB) || defined(USE_BZIP2)
+
+/*
+ * start a batch, as large as it takes to keep the task pool busy
+ */
+
+static void new_batch(DECOMPRESS_SOURCE *ds)
+{
+  free_batch(ds);
+  if (ds->batch == NULL) {
+    ds->batch_size = 2 * (task_pool_active() + 1);
+    if (ds->batch_size > BATCH_UNITS)
+      ds->batch_size = BATCH_UNITS;
+    ds->batch = (UNIT *)malloc(ds->batch_size * sizeof(UNIT));
+    if (ds->batch == NULL)
+      bailout("Out of memory");
+  }
+}
+
+/*
+ * decompress the units of the batch, concurrently if the task pool is
+ * running; the compressed data was read beforehand, the foundation may
+ * not be read from several threads
+ */
+
+static void decode_batch(DECOMPRESS_SOURCE *ds, void (*run)(TASK *t))
+{
+  TASK_GROUP group;
+  int i;
+
+  memset(&group, 0, sizeof(group));
+  for (i = 0; i < ds->batch_count; i++) {
+    ds->batch[i].t.run = run;
+    ds->batch[i].ds = ds;
+    spawn_task(&ds->batch[i].t, &group);
+  }
+  wait_task_group_io(&group);
+  ds->batch_next = 0;
+}
+
+#endif
+
+/*
+ * release the decompressed data of the batch
+ */
+
+static void free_batch(DECOMPRESS_SOURCE *ds)
+{
+  int i;
+
+  for (i = 0; i < ds->batch_count; i++) {
+    free(ds->batch[i].in);
+    free(ds->batch[i].out);
+#ifdef USE_BZIP2
+    if (ds->batch[i].bs_open)
+      BZ2_bzDecompressEnd(&ds->batch[i].bs);
+#endif
+  }
+  ds->batch_count = 0;
+  ds->batch_next = 0;
+}
+
+/*
+ * raw read
+ */
+
+#ifdef USE_ZLIB
+
+static u8 read_gzip(SOURCE *s, u8 pos, u8 len, void *buf)
+{
+  DECOMPRESS_SOURCE *ds = (DECOMPRESS_SOURCE *)s;
+  u8 got;
+
+  if (ds->bgzf) {
+    got = read_bgzf(ds, pos, len, (unsigned char *)buf);
+    if (ds->bgzf || got == len)
+      return got;
+    /* not BGZF after all, or damaged; the plain way sorts it out */
+    free_batch(ds);
+    pos += got;
+    len -= got;
+    buf = (unsigned char *)buf + got;
+    return got + read_gzip(s, pos, len, buf);
+  }
+
+  if (pos != ds->out_pos)
+    seek_gzip(ds, pos);
+  if (pos != ds->out_pos)
+    return 0;  /* the data ends before POS */
+
+  return inflate_gzip(ds, (unsigned char *)buf, len);
+}
+
+/*
+ * decompress the next LEN bytes of the stream, noting checkpoints on
+ * the way
+ */
+
+static u8 inflate_gzip(DECOMPRESS_SOURCE *ds, unsigned char *buf, u8 len)
+{
+  u8 got;
+  int result;
+
+  got = 0;
+  while (got < len && !ds->done) {
+    if (need_input(ds, 1) == 0) {
+      /* truncated, deliver what we have */
+      ds->done = 1;
+      break;
+    }
+
+    ds->zs.next_in = ds->in_next;
+    ds->zs.avail_in = ds->in_avail;
+    ds->zs.next_out = buf + got;
+    ds->zs.avail_out = (uInt)(len - got);
+
+    /* stop at block boundaries, checkpoints can only be put there */
+    result = inflate(&ds->zs, Z_BLOCK);
+
+    ds->out_pos += (ds->zs.next_out - buf) - got;
+    got = ds->zs.next_out - buf;
+    ds->in_next = ds->zs.next_in;
+    ds->in_avail = ds->zs.avail_in;
+
+    if (result == Z_OK) {
+      /* 128: at the end of a block or header, 64: it was the last one */
+      if ((ds->zs.data_type & 128) && !(ds->zs.data_type & 64))
+	add_checkpoint(ds);
+    } else if (result == Z_STREAM_END) {
+      /* zlib skips the trailer only if it saw the header */
+      if (ds->raw) {
+	need_input(ds, 8);
+	if (ds->in_avail < 8) {
+	  ds->done = 1;
+	  break;
+	}
+	ds->in_next += 8;
+	ds->in_avail -= 8;
+      }
+
+      /* another member may follow, gzip -dc would decompress it as well */
+      if (need_input(ds, 2) >= 2 &&
+	  ds->in_next[0] == 037 && ds->in_next[1] == 0213) {
+	inflateReset2(&ds->zs, 15 + 16);
+	ds->raw = 0;
+      } else {
+	ds->done = 1;
+      }
+    } else {
+      if (result != Z_BUF_ERROR)
+	error("gzip: %s", ds->zs.msg ? ds->zs.msg : "corrupt data");
+      ds->done = 1;
+    }
+  }
+
+  return got;
+}
+
+/*
+ * get the stream to POS, starting over at the closest checkpoint if
+ * that is closer than where we are
+ */
+
+static void seek_gzip(DECOMPRESS_SOURCE *ds, u8 pos)
+{
+  CHECKPOINT *cp;
+  int lo, hi, mid;
+  u8 toskip;
+
+  /* find the last checkpoint at or before POS */
+  cp = NULL;
+  lo = 0;
+  hi = ds->index_count - 1;
+  while (lo <= hi) {
+    mid = (lo + hi) / 2;
+    if (ds->index[mid].out <= pos) {
+      cp = &ds->index[mid];
+      lo = mid + 1;
+    } else
+      hi = mid - 1;
+  }
+
+  if (pos < ds->out_pos || (cp != NULL && cp->out > ds->out_pos))
+    resume_gzip(ds, cp);
+
+  /* decompress the rest of the way */
+  while (ds->out_pos < pos && !ds->done) {
+    toskip = pos - ds->out_pos;
+    if (toskip > SKIPBUFSIZE)
+      toskip = SKIPBUFSIZE;
+    inflate_gzip(ds, ds->skipbuf, toskip);
+  }
+}
+
+/*
+ * restart decompression at a checkpoint, or at the start if CP is NULL
+ */
+
+static void resume_gzip(DECOMPRESS_SOURCE *ds, CHECKPOINT *cp)
+{
+  unsigned char c;
+
+  ds->in_next = ds->inbuf;
+  ds->in_avail = 0;
+  ds->in_eof = 0;
+  ds->done = 0;
+
+  if (cp == NULL) {
+    inflateReset2(&ds->zs, 15 + 16);
+    ds->raw = 0;
+    ds->in_pos = 0;
+    ds->out_pos = 0;
+    return;
+  }
+
+  /* no gzip header in front of a block */
+  inflateReset2(&ds->zs, -15);
+  ds->raw = 1;
+  if (cp->bits) {
+    if (get_buffer_real(ds->c.foundation, ds->offset + cp->in - 1, 1,
+			&c, NULL) < 1) {
+      ds->done = 1;
+      return;
+    }
+    inflatePrime(&ds->zs, cp->bits, c >> (8 - cp->bits));
+  }
+  if (cp->window_len)
+    inflateSetDictionary(&ds->zs, cp->window, cp->window_len);
+  ds->in_pos = cp->in;
+  ds->out_pos = cp->out;
+}
+
+/*
+ * remember the current position of the stream as a checkpoint, if the
+ * last one is far enough behind
+ */
+
+static void add_checkpoint(DECOMPRESS_SOURCE *ds)
+{
+  CHECKPOINT *cp;
+  u8 last;
+  uInt window_len;
+
+  last = ds->index_count ? ds->index[ds->index_count - 1].out : 0;
+  if (ds->out_pos < last + INDEX_SPAN)
+    return;
+
+  if (ds->index_count >= ds->index_alloc) {
+    ds->index_alloc = ds->index_alloc ? ds->index_alloc * 2 : 16;
+    ds->index = (CHECKPOINT *)realloc(ds->index,
+				      ds->index_alloc * sizeof(CHECKPOINT));
+    if (ds->index == NULL)
+      bailout("Out of memory");
+  }
+  cp = &ds->index[ds->index_count];
+
+  cp->out = ds->out_pos;
+  cp->in = ds->in_pos - ds->in_avail;
+  cp->bits = ds->zs.data_type & 7;
+  cp->window = (unsigned char *)malloc(WINDOW_SIZE);
+  if (cp->window == NULL)
+    bailout("Out of memory");
+  window_len = WINDOW_SIZE;
+  inflateGetDictionary(&ds->zs, cp->window, &window_len);
+  cp->window_len = window_len;
+
+  ds->index_count++;
+}
+
+/*
+ * index files, see gzip_index
+ */
+
+/* the index can be kept for whole files only, NULL otherwise */
+static char *index_filename(DECOMPRESS_SOURCE *ds)
+{
+  char *name;
+
+  if (ds->offset != 0 || ds->c.foundation->foundation != NULL ||
+      current_analysis == NULL || current_analysis->path == NULL)
+    return NULL;
+
+  name = (char *)malloc(strlen(current_analysis->path) + 9);
+  if (name == NULL)
+    bailout("Out of memory");
+  sprintf(name, "%s.dtgzidx", current_analysis->path);
+  return name;
+}
+
+/* tells whether an index file belongs to the data: its compressed size
+   and the last member's trailer, which holds a CRC of the data */
+static u8 stream_identity(DECOMPRESS_SOURCE *ds)
+{
+  SOURCE *fs = ds->c.foundation;
+  unsigned char trailer[8];
+
+  if (!fs->size_known || fs->size < 8 ||
+      get_buffer_real(fs, fs->size - 8, 8, trailer, NULL) < 8)
+    return 0;
+  return get_le_quad(trailer) ^ fs->size;
+}
+
+static void put_index_quad(FILE *f, u8 value)
+{
+  unsigned char buf[8];
+  int i;
+
+  for (i = 0; i < 8; i++)
+    buf[i] = (unsigned char)(value >> (i * 8));
+  fwrite(buf, 1, 8, f);
+}
+
+static int get_index_quad(FILE *f, u8 *value)
+{
+  unsigned char buf[8];
+
+  if (fread(buf, 1, 8, f) < 8)
+    return 0;
+  *value = get_le_quad(buf);
+  return 1;
+}
+
+static void load_index(DECOMPRESS_SOURCE *ds)
+{
+  char *name, magic[8];
+  FILE *f;
+  u8 identity, count, out, in, bits, window_len;
+  CHECKPOINT *cp;
+
+  name = index_filename(ds);
+  if (name == NULL)
+    return;
+  f = fopen(name, "rb");
+  free(name);
+  if (f == NULL)
+    return;
+
+  if (fread(magic, 1, 8, f) < 8 || memcmp(magic, INDEX_MAGIC, 8) != 0 ||
+      !get_index_quad(f, &identity) || identity != stream_identity(ds) ||
+      !get_index_quad(f, &count) || count > 0x7fffffff) {
+    fclose(f);
+    return;  /* not ours, it will be replaced */
+  }
+
+  for (; count > 0; count--) {
+    if (!get_index_quad(f, &out) || !get_index_quad(f, &in) ||
+	!get_index_quad(f, &bits) || !get_index_quad(f, &window_len) ||
+	bits > 7 || window_len > WINDOW_SIZE)
+      break;
+
+    /* add_checkpoint() keeps the index ordered, so do we */
+    if (ds->index_count > 0 && out <= ds->index[ds->index_count - 1].out)
+      break;
+    if (ds->index_count >= ds->index_alloc) {
+      ds->index_alloc = ds->index_alloc ? ds->index_alloc * 2 : 16;
+      ds->index = (CHECKPOINT *)realloc(ds->index,
+					ds->index_alloc * sizeof(CHECKPOINT));
+      if (ds->index == NULL)
+	bailout("Out of memory");
+    }
+    cp = &ds->index[ds->index_count];
+    cp->out = out;
+    cp->in = in;
+    cp->bits = (int)bits;
+    cp->window_len = (u4)window_len;
+    cp->window = (unsigned char *)malloc(WINDOW_SIZE);
+    if (cp->window == NULL)
+      bailout("Out of memory");
+    if (fread(cp->window, 1, cp->window_len, f) < cp->window_len) {
+      free(cp->window);
+      break;
+    }
+    ds->index_count++;
+  }
+  fclose(f);
+
+  ds->index_loaded = ds->index_count;
+}
+
+static void save_index(DECOMPRESS_SOURCE *ds)
+{
+  char *name;
+  FILE *f;
+  int i;
+
+  name = index_filename(ds);
+  if (name == NULL)
+    return;
+  f = fopen(name, "wb");
+  if (f == NULL) {
+    errore("Can't write index %.300s", name);
+    free(name);
+    return;
+  }
+
+  fwrite(INDEX_MAGIC, 1, 8, f);
+  put_index_quad(f, stream_identity(ds));
+  put_index_quad(f, ds->index_count);
+  for (i = 0; i < ds->index_count; i++) {
+    put_index_quad(f, ds->index[i].out);
+    put_index_quad(f, ds->index[i].in);
+    put_index_quad(f, ds->index[i].bits);
+    put_index_quad(f, ds->index[i].window_len);
+    fwrite(ds->index[i].window, 1, ds->index[i].window_len, f);
+  }
+  if (fclose(f) != 0)
+    errore("Can't write index %.300s", name);
+  free(name);
+}
+
+/*
+ * BGZF, as written by bgzip: gzip members of at most 64 KiB, each one
+ * noting its compressed size in the header
+ */
+
+/* read compressed data at a given position, bypassing the input
+   buffer */
+static u8 read_compressed(DECOMPRESS_SOURCE *ds, u8 pos, u8 len, void *buf)
+{
+  if (ds->in_max) {
+    if (pos >= ds->in_max)
+      return 0;
+    if (pos + len > ds->in_max)
+      len = ds->in_max - pos;
+  }
+  return get_buffer_real(ds->c.foundation, ds->offset + pos, len, buf, NULL);
+}
+
+
+static u8 read_bgzf(DECOMPRESS_SOURCE *ds, u8 pos, u8 len, unsigned char *buf)
+{
+  UNIT *u;
+  u8 got, tocopy, rel;
+
+  got = 0;
+  while (got < len) {
+    u = find_bgzf_unit(ds, pos + got);
+    if (u == NULL)
+      break;
+    if (u->result) {
+      ds->bgzf = 0;
+      break;
+    }
+    rel = pos + got - u->out_start;
+    tocopy = u->out_len - rel;
+    if (tocopy > len - got)
+      tocopy = len - got;
+    memcpy(buf + got, u->out + rel, tocopy);
+    got += tocopy;
+  }
+  return got;
+}
+
+/*
+ * get the decompressed member holding POS, decompressing it and the
+ * ones after it if needed; NULL at the end of the data or when it
+ * isn't BGZF after all
+ */
+
+static UNIT *find_bgzf_unit(DECOMPRESS_SOURCE *ds, u8 pos)
+{
+  UNIT *u;
+  MEMBER *m;
+  int i, lo, hi, mid, first;
+  u8 next_out;
+
+  for (i = 0; i < ds->batch_count; i++) {
+    u = &ds->batch[i];
+    if (pos >= u->out_start && pos < u->out_start + u->out_len)
+      return u;
+  }
+
+  while (ds->bgzf && !ds->map_done && ds->map_out <= pos)
+    map_bgzf_member(ds);
+  if (!ds->bgzf || pos >= ds->map_out)
+    return NULL;
+
+  /* the last member starting at or before POS */
+  first = 0;
+  lo = 0;
+  hi = ds->member_count - 1;
+  while (lo <= hi) {
+    mid = (lo + hi) / 2;
+    if (ds->members[mid].out <= pos) {
+      first = mid;
+      lo = mid + 1;
+    } else
+      hi = mid - 1;
+  }
+
+  /* decompress it and the ones following */
+  new_batch(ds);
+  for (i = first; ds->batch_count < ds->batch_size; i++) {
+    if (i >= ds->member_count && !ds->map_done)
+      map_bgzf_member(ds);
+    if (!ds->bgzf)
+      return NULL;
+    if (i >= ds->member_count)
+      break;
+    m = &ds->members[i];
+    next_out = (i + 1 < ds->member_count) ? ds->members[i+1].out :
+      ds->map_out;
+
+    u = &ds->batch[ds->batch_count++];
+    memset(u, 0, sizeof(UNIT));
+    u->in_start = m->in;
+    u->in_end = (i + 1 < ds->member_count) ? ds->members[i+1].in :
+      ds->map_in;
+    u->out_start = m->out;
+    u->out_len = next_out - m->out;
+    u->in_len = u->in_end - u->in_start;
+    u->in = (unsigned char *)malloc(u->in_len);
+    u->out = (unsigned char *)malloc(u->out_len ? u->out_len : 1);
+    if (u->in == NULL || u->out == NULL)
+      bailout("Out of memory");
+    if (read_compressed(ds, u->in_start, u->in_len, u->in) < u->in_len)
+      u->result = 1;
+  }
+  decode_batch(ds, run_bgzf_unit);
+
+  return &ds->batch[0];
+}
+
+/*
+ * add the next member to the map, returns 0 if there is none; drops
+ * out of BGZF mode if it isn't one
+ */
+
+static int map_bgzf_member(DECOMPRESS_SOURCE *ds)
+{
+  unsigned char head[12], tail[4], *extra;
+  u8 got, size;
+  u4 xlen, i, isize;
+  int bsize;
+
+  got = read_compressed(ds, ds->map_in, 12, head);
+  if (got < 2 || head[0] != 037 || head[1] != 0213) {
+    /* the end, or trailing garbage gzip -dc stops at as well */
+    ds->map_done = 1;
+    return 0;
+  }
+  if (got < 12 || head[2] != 8 || (head[3] & 4) == 0) {
+    ds->bgzf = 0;
+    return 0;
+  }
+
+  /* look for the BC subfield holding the member size */
+  xlen = get_le_short(head + 10);
+  extra = (unsigned char *)malloc(xlen ? xlen : 1);
+  if (extra == NULL)
+    bailout("Out of memory");
+  bsize = -1;
+  if (read_compressed(ds, ds->map_in + 12, xlen, extra) == xlen) {
+    for (i = 0; i + 4 <= xlen; i += 4 + get_le_short(extra + i + 2)) {
+      if (extra[i] == 'B' && extra[i+1] == 'C' &&
+	  get_le_short(extra + i + 2) == 2 && i + 6 <= xlen) {
+	bsize = get_le_short(extra + i + 4);
+	break;
+      }
+    }
+  }
+  free(extra);
+
+  size = (u8)bsize + 1;
+  if (bsize < 0 || size < 12 + xlen + 8 ||
+      read_compressed(ds, ds->map_in + size - 4, 4, tail) < 4) {
+    ds->bgzf = 0;
+    return 0;
+  }
+  isize = get_le_long(tail);
+  if (isize > BGZF_MAX_ISIZE) {
+    ds->bgzf = 0;
+    return 0;
+  }
+
+  if (ds->member_count >= ds->member_alloc) {
+    ds->member_alloc = ds->member_alloc ? ds->member_alloc * 2 : 256;
+    ds->members = (MEMBER *)realloc(ds->members,
+				    ds->member_alloc * sizeof(MEMBER));
+    if (ds->members == NULL)
+      bailout("Out of memory");
+  }
+  ds->members[ds->member_count].in = ds->map_in;
+  ds->members[ds->member_count].out = ds->map_out;
+  ds->member_count++;
+  ds->map_in += size;
+  ds->map_out += isize;
+  return 1;
+}
+
+/*
+ * decompress a BGZF member, runs on the task pool
+ */
+
+static void run_bgzf_unit(TASK *t)
+{
+  UNIT *u = (UNIT *)t;
+  z_stream zs;
+  int result;
+
+  if (u->result)
+    return;  /* the member couldn't be read */
+
+  memset(&zs, 0, sizeof(zs));
+  if (inflateInit2(&zs, 15 + 16) != Z_OK) {
+    u->result = 1;
+    return;
+  }
+  zs.next_in = u->in;
+  zs.avail_in = (uInt)u->in_len;
+  zs.next_out = u->out;
+  zs.avail_out = (uInt)u->out_len;
+  result = inflate(&zs, Z_FINISH);
+  if (result != Z_STREAM_END || zs.total_out != u->out_len ||
+      zs.avail_in != 0)
+    u->result = 1;
+  inflateEnd(&zs);
+}
+
+#endif
+
+#ifdef USE_BZIP2
+
+static u8 read_bzip2(SOURCE *s, u8 pos, u8 len, void *buf)
+{
+  DECOMPRESS_SOURCE *ds = (DECOMPRESS_SOURCE *)s;
+  u8 got;
+  int result;
+
+  if (ds->parallel)
+    return read_bzip2_parallel(ds, len, (unsigned char *)buf);
+
+  got = 0;
+  while (got < len && !ds->done) {
+    if (need_input(ds, 1) == 0) {
+      /* truncated, deliver what we have */
+      ds->done = 1;
+      break;
+    }
+
+    ds->bs.next_in = (char *)ds->in_next;
+    ds->bs.avail_in = ds->in_avail;
+    ds->bs.next_out = (char *)buf + got;
+    ds->bs.avail_out = (unsigned int)(len - got);
+
+    result = BZ2_bzDecompress(&ds->bs);
+
+    got = ds->bs.next_out - (char *)buf;
+    ds->in_next = (unsigned char *)ds->bs.next_in;
+    ds->in_avail = ds->bs.avail_in;
+
+    if (result == BZ_STREAM_END) {
+      /* concatenated streams are decompressed as one, like bzip2 -dc */
+      BZ2_bzDecompressEnd(&ds->bs);
+      ds->bs_open = 0;
+      if (need_input(ds, 3) >= 3 && memcmp(ds->in_next, "BZh", 3) == 0 &&
+	  BZ2_bzDecompressInit(&ds->bs, 0, 0) == BZ_OK) {
+	ds->bs_open = 1;
+	continue;
+      }
+      ds->done = 1;
+    } else if (result != BZ_OK) {
+      error("bzip2: corrupt data (error %d)", result);
+      ds->done = 1;
+    }
+  }
+
+  return got;
+}
+
+/*
+ * deliver the blocks decoded on the task pool, in order
+ */
+
+static u8 read_bzip2_parallel(DECOMPRESS_SOURCE *ds, u8 len,
+			      unsigned char *buf)
+{
+  UNIT *u;
+  u8 got, tocopy, rel, skip;
+
+  got = 0;
+  while (got < len) {
+    if (ds->batch_next >= ds->batch_count) {
+      free_batch(ds);
+      if (!scan_bzip2(ds))
+	break;
+      decode_batch(ds, run_bzip2_unit);
+    }
+    u = &ds->batch[ds->batch_next];
+    if (ds->out_pos >= u->out_start + u->out_len && u->bs_open) {
+      /* the block has more, get the next part */
+      u->out_start = ds->out_pos;
+      inflate_bzip2_unit(u);
+    }
+
+    if (u->result) {
+      /* corrupt data, or what looked like the start of a block wasn't
+	 one; let the plain decompressor go through the same data, it
+	 knows what to make of it */
+      skip = ds->out_pos;
+      ds->parallel = 0;
+      free_batch(ds);
+      if (!rewind_bzip2(&ds->c))
+	break;
+      while (skip > 0 && !ds->done) {
+	tocopy = (skip > SKIPBUFSIZE) ? SKIPBUFSIZE : skip;
+	tocopy = read_bzip2(&ds->c, 0, tocopy, ds->skipbuf);
+	if (tocopy == 0)
+	  break;
+	skip -= tocopy;
+      }
+      if (skip > 0)
+	break;
+      return got + read_bzip2(&ds->c, 0, len - got, buf + got);
+    }
+
+    rel = ds->out_pos - u->out_start;
+    tocopy = u->out_len - rel;
+    if (tocopy > len - got)
+      tocopy = len - got;
+    memcpy(buf + got, u->out + rel, tocopy);
+    got += tocopy;
+    ds->out_pos += tocopy;
+    if (ds->out_pos >= u->out_start + u->out_len && !u->bs_open) {
+      ds->batch_next++;
+      if (ds->batch_next < ds->batch_count)
+	ds->batch[ds->batch_next].out_start = ds->out_pos;
+    }
+  }
+  return got;
+}
+
+/*
+ * find the next blocks by their start markers, which may be at any bit
+ * position; returns the number of blocks found
+ */
+
+static int scan_bzip2(DECOMPRESS_SOURCE *ds)
+{
+  UNIT *u;
+  u8 keep, bits, p, v;
+  int k, c;
+
+  new_batch(ds);
+
+  /* only the open block is needed from what was scanned before */
+  keep = ds->block_open ? ds->block_start / 8 : ds->scan_base + ds->scan_len;
+  if (keep > ds->scan_base) {
+    memmove(ds->scan_buf, ds->scan_buf + (keep - ds->scan_base),
+	    ds->scan_base + ds->scan_len - keep);
+    ds->scan_len -= keep - ds->scan_base;
+    ds->scan_base = keep;
+  }
+
+  while (ds->batch_count < ds->batch_size && !ds->scan_done) {
+    if (need_input(ds, 1) == 0) {
+      /* a block cut short is lost, as it is for the plain way */
+      ds->scan_done = 1;
+      break;
+    }
+    c = *ds->in_next++;
+    ds->in_avail--;
+
+    if (ds->scan_len >= ds->scan_alloc) {
+      ds->scan_alloc = ds->scan_alloc ? ds->scan_alloc * 2 : INBUFSIZE;
+      ds->scan_buf = (unsigned char *)realloc(ds->scan_buf, ds->scan_alloc);
+      if (ds->scan_buf == NULL)
+	bailout("Out of memory");
+    }
+    ds->scan_buf[ds->scan_len++] = (unsigned char)c;
+    ds->scan_reg = (ds->scan_reg << 8) | c;
+    bits = (ds->scan_base + ds->scan_len) * 8;
+
+    if (ds->scan_level == 0) {
+      /* a stream header is next, another stream may follow the last */
+      if (bits == (ds->scan_hdr + 4) * 8) {
+	if (((ds->scan_reg >> 8) & 0xffffff) != 0x425a68 ||
+	    (ds->scan_reg & 0xff) < '1' || (ds->scan_reg & 0xff) > '9') {
+	  ds->scan_done = 1;
+	  break;
+	}
+	ds->scan_level = (int)(ds->scan_reg & 0xff) - '0';
+      }
+      continue;
+    }
+
+    /* check the 8 new positions a marker may end at, oldest first */
+    for (k = 7; k >= 0; k--) {
+      v = (ds->scan_reg >> k) & BZ_MAGIC_MASK;
+      if (v != BZ_BLOCK_MAGIC && v != BZ_EOS_MAGIC)
+	continue;
+      p = bits - 48 - k;
+      if (p < (ds->scan_hdr + 4) * 8)
+	continue;  /* overlaps the stream header */
+
+      if (ds->block_open) {
+	u = &ds->batch[ds->batch_count++];
+	memset(u, 0, sizeof(UNIT));
+	u->in_start = ds->block_start;
+	u->in_end = p;
+	u->level = ds->block_level;
+	ds->block_open = 0;
+      }
+      if (v == BZ_BLOCK_MAGIC) {
+	ds->block_open = 1;
+	ds->block_start = p;
+	ds->block_level = ds->scan_level;
+      } else {
+	/* the combined CRC follows, then padding to the next byte */
+	ds->scan_level = 0;
+	ds->scan_hdr = (p + 48 + 32 + 7) / 8;
+	break;
+      }
+    }
+  }
+
+  if (ds->batch_count > 0)
+    ds->batch[0].out_start = ds->out_pos;
+  return ds->batch_count;
+}
+
+/*
+ * put a block into a stream of its own and decompress that, runs on
+ * the task pool
+ */
+
+static void put_bits(unsigned char *buf, u8 *bitpos, u8 value, int count)
+{
+  int i;
+
+  for (i = count - 1; i >= 0; i--, (*bitpos)++) {
+    if ((value >> i) & 1)
+      buf[*bitpos / 8] |= 0x80 >> (*bitpos % 8);
+  }
+}
+
+static void run_bzip2_unit(TASK *t)
+{
+  UNIT *u = (UNIT *)t;
+  DECOMPRESS_SOURCE *ds = u->ds;
+  unsigned char *stream, *from;
+  u8 bits, bytes, i, bitpos;
+  u4 crc;
+  int shift;
+
+  /* the header, the block shifted to a byte boundary, the end marker
+     and the block's CRC as the stream's, which it is for one block */
+  bits = u->in_end - u->in_start;
+  bytes = 4 + (bits + 48 + 32 + 7) / 8;
+  stream = (unsigned char *)malloc(bytes);
+  if (stream == NULL)
+    bailout("Out of memory");
+  memset(stream, 0, bytes);
+  stream[0] = 'B';
+  stream[1] = 'Z';
+  stream[2] = 'h';
+  stream[3] = '0' + u->level;
+
+  from = ds->scan_buf + (u->in_start / 8 - ds->scan_base);
+  shift = (int)(u->in_start % 8);
+  for (i = 0; i < (bits + 7) / 8; i++) {
+    stream[4 + i] = from[i] << shift;
+    if (shift && u->in_start / 8 + i + 1 < ds->scan_base + ds->scan_len)
+      stream[4 + i] |= from[i + 1] >> (8 - shift);
+  }
+  if (bits % 8)
+    stream[4 + bits / 8] &= 0xff << (8 - bits % 8);
+
+  crc = get_be_long(stream + 4 + 6);
+  bitpos = 32 + bits;
+  put_bits(stream, &bitpos, BZ_EOS_MAGIC, 48);
+  put_bits(stream, &bitpos, crc, 32);
+
+  u->in = stream;
+  u->in_len = bytes;
+  if (BZ2_bzDecompressInit(&u->bs, 0, 0) != BZ_OK) {
+    u->result = 1;
+    return;
+  }
+  u->bs_open = 1;
+  u->bs.next_in = (char *)u->in;
+  u->bs.avail_in = (unsigned int)u->in_len;
+  u->out = (unsigned char *)malloc(UNIT_OUT_MAX);
+  if (u->out == NULL)
+    bailout("Out of memory");
+
+  inflate_bzip2_unit(u);
+}
+
+/*
+ * decompress the next part of a block, up to UNIT_OUT_MAX bytes
+ */
+
+static void inflate_bzip2_unit(UNIT *u)
+{
+  int result;
+
+  u->bs.next_out = (char *)u->out;
+  u->bs.avail_out = UNIT_OUT_MAX;
+  result = BZ2_bzDecompress(&u->bs);
+  u->out_len = (unsigned char *)u->bs.next_out - u->out;
+
+  if (result == BZ_OK && u->bs.avail_out == 0)
+    return;  /* there's more */
+  if (result != BZ_STREAM_END)
+    u->result = 1;
+  BZ2_bzDecompressEnd(&u->bs);
+  u->bs_open = 0;
+}
+
+/*
+ * start over, the cache dropped data that is needed again
+ */
+
+static int rewind_bzip2(SOURCE *s)
+{
+  DECOMPRESS_SOURCE *ds = (DECOMPRESS_SOURCE *)s;
+
+  if (ds->parallel) {
+    free_batch(ds);
+    ds->scan_base = 0;
+    ds->scan_len = 0;
+    ds->scan_reg = 0;
+    ds->scan_level = 0;
+    ds->scan_hdr = 0;
+    ds->scan_done = 0;
+    ds->block_open = 0;
+  }
+
+  if (ds->bs_open)
+    BZ2_bzDecompressEnd(&ds->bs);
+  ds->bs_open = 0;
+  if (BZ2_bzDecompressInit(&ds->bs, 0, 0) != BZ_OK)
+    return 0;
+  ds->bs_open = 1;
+
+  restart_input(ds);
+  return 1;
+}
+
+#endif
+
+#ifdef USE_LZMA
+
+/*
+ * xz: one decoder per stream, concatenated streams and the padding
+ * between them are dealt with here, like xz -dc does
+ */
+
+static int start_xz(DECOMPRESS_SOURCE *ds)
+{
+  lzma_stream init = LZMA_STREAM_INIT;
+
+  ds->xs = init;
+  if (lzma_stream_decoder(&ds->xs, UINT64_MAX, 0) != LZMA_OK)
+    return 0;
+  ds->xs_open = 1;
+  return 1;
+}
+
+static u8 read_xz(SOURCE *s, u8 pos, u8 len, void *buf)
+{
+  DECOMPRESS_SOURCE *ds = (DECOMPRESS_SOURCE *)s;
+  u8 got, before;
+  u4 used;
+  lzma_ret result;
+
+  got = 0;
+  while (got < len && !ds->done) {
+    need_input(ds, 1);
+
+    ds->xs.next_in = ds->in_next;
+    ds->xs.avail_in = ds->in_avail;
+    ds->xs.next_out = (unsigned char *)buf + got;
+    ds->xs.avail_out = (size_t)(len - got);
+
+    result = lzma_code(&ds->xs, LZMA_RUN);
+
+    before = got;
+    used = ds->in_avail - ds->xs.avail_in;
+    got = ds->xs.next_out - (unsigned char *)buf;
+    ds->in_next = (unsigned char *)ds->xs.next_in;
+    ds->in_avail = ds->xs.avail_in;
+
+    if (result == LZMA_STREAM_END) {
+      lzma_end(&ds->xs);
+      ds->xs_open = 0;
+      /* skip the stream padding, multiples of four zero bytes */
+      while (need_input(ds, 4) >= 4 && get_le_long(ds->in_next) == 0) {
+	ds->in_next += 4;
+	ds->in_avail -= 4;
+      }
+      if (need_input(ds, 6) >= 6 && memcmp(ds->in_next, XZ_MAGIC, 6) == 0 &&
+	  start_xz(ds))
+	continue;
+      ds->done = 1;
+    } else if (result != LZMA_OK && result != LZMA_BUF_ERROR) {
+      error("xz: corrupt data (error %d)", (int)result);
+      ds->done = 1;
+    } else if (used == 0 && got == before) {
+      /* truncated, deliver what we have */
+      ds->done = 1;
+    }
+  }
+
+  return got;
+}
+
+static int rewind_xz(SOURCE *s)
+{
+  DECOMPRESS_SOURCE *ds = (DECOMPRESS_SOURCE *)s;
+
+  if (ds->xs_open)
+    lzma_end(&ds->xs);
+  ds->xs_open = 0;
+  if (!start_xz(ds))
+    return 0;
+
+  restart_input(ds);
+  return 1;
+}
+
+#endif
+
+#if defined(USE_ZSTD) || defined(USE_LZ4)
+
+/*
+ * check if another frame follows the one just finished, skippable
+ * frames count as well
+ */
+
+static int frame_follows(DECOMPRESS_SOURCE *ds, u4 magic)
+{
+  u4 found;
+
+  if (need_input(ds, 4) < 4)
+    return 0;
+  found = get_le_long(ds->in_next);
+  return found == magic || (found & SKIPPABLE_MASK) == SKIPPABLE_MAGIC;
+}
+
+#endif
+
+#ifdef USE_ZSTD
+
+/*
+ * zstd: frames follow each other, the decoder takes them one after the
+ * other and skips skippable frames by itself
+ */
+
+static u8 read_zstd(SOURCE *s, u8 pos, u8 len, void *buf)
+{
+  DECOMPRESS_SOURCE *ds = (DECOMPRESS_SOURCE *)s;
+  ZSTD_inBuffer in;
+  ZSTD_outBuffer out;
+  size_t result;
+  u8 got;
+
+  got = 0;
+  while (got < len && !ds->done) {
+    need_input(ds, 1);
+
+    in.src = ds->in_next;
+    in.size = ds->in_avail;
+    in.pos = 0;
+    out.dst = (unsigned char *)buf + got;
+    out.size = (size_t)(len - got);
+    out.pos = 0;
+
+    result = ZSTD_decompressStream(ds->zds, &out, &in);
+
+    got += out.pos;
+    ds->in_next += in.pos;
+    ds->in_avail -= in.pos;
+
+    if (ZSTD_isError(result)) {
+      error("zstd: corrupt data (%s)", ZSTD_getErrorName(result));
+      ds->done = 1;
+    } else if (result == 0) {
+      /* end of a frame */
+      if (!frame_follows(ds, ZSTD_MAGIC))
+	ds->done = 1;
+    } else if (in.pos == 0 && out.pos == 0) {
+      /* truncated, deliver what we have */
+      ds->done = 1;
+    }
+  }
+
+  return got;
+}
+
+static int rewind_zstd(SOURCE *s)
+{
+  DECOMPRESS_SOURCE *ds = (DECOMPRESS_SOURCE *)s;
+
+  if (ZSTD_isError(ZSTD_initDStream(ds->zds)))
+    return 0;
+
+  restart_input(ds);
+  return 1;
+}
+
+/*
+ * the seekable format: independent frames, followed by a skippable
+ * frame listing their sizes; the footer at the very end tells
+ */
+
+static int load_seek_table(DECOMPRESS_SOURCE *ds)
+{
+  SOURCE *fs = ds->c.foundation;
+  unsigned char footer[9], *table, *entry;
+  u8 end, count, entry_size, table_size, in, out, in_len, out_len;
+  u8 in_max, out_max;
+  int i;
+
+  /* the end of the compressed data */
+  if (ds->in_max)
+    end = ds->offset + ds->in_max;
+  else if (fs->size_known)
+    end = fs->size;
+  else
+    return 0;
+  if (end < ds->offset + 8 + 9 ||
+      get_buffer_real(fs, end - 9, 9, footer, NULL) < 9 ||
+      get_le_long(footer + 5) != SEEKABLE_MAGIC ||
+      (footer[4] & 0x7c) != 0)
+    return 0;
+
+  /* with checksums, the entries have four more bytes */
+  count = get_le_long(footer);
+  entry_size = (footer[4] & 0x80) ? 12 : 8;
+  table_size = count * entry_size + 9;
+  if (count == 0 || count > 0x7fffffff ||
+      table_size + 8 > end - ds->offset)
+    return 0;
+
+  table = (unsigned char *)malloc(table_size + 8);
+  if (table == NULL)
+    bailout("Out of memory");
+  if (get_buffer_real(fs, end - table_size - 8, table_size + 8, table,
+		      NULL) < table_size + 8 ||
+      get_le_long(table) != SEEKABLE_TABLE_MAGIC ||
+      get_le_long(table + 4) != table_size) {
+    free(table);
+    return 0;
+  }
+
+  ds->frames = (MEMBER *)malloc((count + 1) * sizeof(MEMBER));
+  if (ds->frames == NULL)
+    bailout("Out of memory");
+  in = out = 0;
+  in_max = out_max = 0;
+  for (i = 0; i < count; i++) {
+    entry = table + 8 + i * entry_size;
+    in_len = get_le_long(entry);
+    out_len = get_le_long(entry + 4);
+    if (in_len > SEEKABLE_FRAME_MAX || out_len > SEEKABLE_FRAME_MAX)
+      break;
+    ds->frames[i].in = in;
+    ds->frames[i].out = out;
+    in += in_len;
+    out += out_len;
+    if (in_max < in_len)
+      in_max = in_len;
+    if (out_max < out_len)
+      out_max = out_len;
+  }
+  ds->frames[i].in = in;
+  ds->frames[i].out = out;
+  free(table);
+
+  /* the frames must take up everything up to the table */
+  if (i < count || in != end - ds->offset - table_size - 8) {
+    free(ds->frames);
+    ds->frames = NULL;
+    return 0;
+  }
+  ds->frame_count = count;
+
+  ds->frame_in = (unsigned char *)malloc(in_max + 1);
+  ds->frame_out = (unsigned char *)malloc(out_max + 1);
+  if (ds->frame_in == NULL || ds->frame_out == NULL)
+    bailout("Out of memory");
+  return 1;
+}
+
+static u8 read_zstd_seekable(SOURCE *s, u8 pos, u8 len, void *buf)
+{
+  DECOMPRESS_SOURCE *ds = (DECOMPRESS_SOURCE *)s;
+  int lo, hi, mid;
+  u8 got, rel, tocopy;
+
+  got = 0;
+  while (got < len && pos < ds->frames[ds->frame_count].out) {
+    /* the last frame starting at or before POS */
+    lo = 0;
+    hi = ds->frame_count - 1;
+    while (lo < hi) {
+      mid = (lo + hi + 1) / 2;
+      if (ds->frames[mid].out <= pos)
+	lo = mid;
+      else
+	hi = mid - 1;
+    }
+
+    if (lo != ds->frame_kept && !decompress_frame(ds, lo))
+      break;
+
+    rel = pos - ds->frames[lo].out;
+    tocopy = ds->frames[lo + 1].out - pos;
+    if (tocopy > len - got)
+      tocopy = len - got;
+    memcpy((unsigned char *)buf + got, ds->frame_out + rel, tocopy);
+    got += tocopy;
+    pos += tocopy;
+  }
+
+  return got;
+}
+
+static int decompress_frame(DECOMPRESS_SOURCE *ds, int frame)
+{
+  u8 in_len, out_len;
+  size_t result;
+
+  in_len = ds->frames[frame + 1].in - ds->frames[frame].in;
+  out_len = ds->frames[frame + 1].out - ds->frames[frame].out;
+  if (get_buffer_real(ds->c.foundation, ds->offset + ds->frames[frame].in,
+		      in_len, ds->frame_in, NULL) < in_len)
+    return 0;
+
+  ds->frame_kept = -1;
+  result = ZSTD_decompressDCtx(ds->zdc, ds->frame_out, out_len,
+			       ds->frame_in, in_len);
+  if (ZSTD_isError(result) || result != out_len) {
+    error("zstd: corrupt data in frame %d", frame);
+    return 0;
+  }
+  ds->frame_kept = frame;
+  return 1;
+}
+
+#endif
+
+#ifdef USE_LZ4
+
+/*
+ * lz4: frames follow each other, as for zstd
+ */
+
+static u8 read_lz4(SOURCE *s, u8 pos, u8 len, void *buf)
+{
+  DECOMPRESS_SOURCE *ds = (DECOMPRESS_SOURCE *)s;
+  size_t in_len, out_len, result;
+  u8 got;
+
+  got = 0;
+  while (got < len && !ds->done) {
+    need_input(ds, 1);
+
+    in_len = ds->in_avail;
+    out_len = (size_t)(len - got);
+    result = LZ4F_decompress(ds->lz4, (unsigned char *)buf + got, &out_len,
+			     ds->in_next, &in_len, NULL);
+
+    got += out_len;
+    ds->in_next += in_len;
+    ds->in_avail -= in_len;
+
+    if (LZ4F_isError(result)) {
+      error("lz4: corrupt data (%s)", LZ4F_getErrorName(result));
+      ds->done = 1;
+    } else if (result == 0) {
+      /* end of a frame */
+      if (!frame_follows(ds, LZ4_MAGIC))
+	ds->done = 1;
+    } else if (in_len == 0 && out_len == 0) {
+      /* truncated, deliver what we have */
+      ds->done = 1;
+    }
+  }
+
+  return got;
+}
+
+static int rewind_lz4(SOURCE *s)
+{
+  DECOMPRESS_SOURCE *ds = (DECOMPRESS_SOURCE *)s;
+
+  LZ4F_resetDecompressionContext(ds->lz4);
+
+  restart_input(ds);
+  return 1;
+}
+
+#endif
+
+/*
+ * close cleanup
+ */
+
+static void close_decompress(SOURCE *s)
+{
+  DECOMPRESS_SOURCE *ds = (DECOMPRESS_SOURCE *)s;
+
+#ifdef USE_ZLIB
+  int i;
+
+  if (ds->format == DECOMPRESS_GZIP) {
+    /* the checkpoints only ever get added at the end, an index that
+       grew is better than the old one */
+    if (gzip_index && ds->index_count > ds->index_loaded)
+      save_index(ds);
+    inflateEnd(&ds->zs);
+    for (i = 0; i < ds->index_count; i++)
+      free(ds->index[i].window);
+    free(ds->index);
+    free(ds->members);
+  }
+#endif
+#ifdef USE_BZIP2
+  if (ds->format == DECOMPRESS_BZIP2 && ds->bs_open)
+    BZ2_bzDecompressEnd(&ds->bs);
+  free(ds->scan_buf);
+#endif
+#ifdef USE_LZMA
+  if (ds->format == DECOMPRESS_XZ && ds->xs_open)
+    lzma_end(&ds->xs);
+#endif
+#ifdef USE_ZSTD
+  if (ds->format == DECOMPRESS_ZSTD) {
+    ZSTD_freeDStream(ds->zds);
+    ZSTD_freeDCtx(ds->zdc);
+    free(ds->frames);
+    free(ds->frame_in);
+    free(ds->frame_out);
+  }
+#endif
+#ifdef USE_LZ4
+  if (ds->format == DECOMPRESS_LZ4)
+    LZ4F_freeDecompressionContext(ds->lz4);
+#endif
+  free_batch(ds);
+  free(ds->batch);
+  free(ds->skipbuf);
+  free(ds->inbuf);
+}
+
+#endif
+
+#ifdef JSON
+
+// -----------------------------------------------------------
+//                             TESTS
+// -----------------------------------------------------------
+
+#ifdef DECOMPRESS_LIBS
+
+static unsigned char *test_gzip_data;
+static u8 test_gzip_size;
+
+/* The decompressed test data, each run of 16 bytes is the same. Unlike
+ * test_image_pattern(), it doesn't compress so well that a deflate
+ * block covers more than a checkpoint span.
+ */
+static unsigned char test_pattern(u8 pos)
+{
+    return (unsigned char) (((u4) (pos >> 4) * 2654435761UL) >> 24);
+}
+
+/* Sets up a source for the compressed test data. */
+static SOURCE *new_test_foundation()
+{
+    TEST_IMAGE *foundation = (TEST_IMAGE *) malloc(sizeof(TEST_IMAGE));
+
+    assert(foundation != NULL);
+    init_test_image(foundation, test_gzip_data, test_gzip_size);
+    return &foundation->c;
+}
+
+/* Reads LEN bytes at POS and compares them to the pattern. */
+static void check_test_output(SOURCE *s, u8 pos, u8 len)
+{
+    unsigned char buf[4096];
+
+    assert(s->read_bytes(s, pos, len, buf) == len);
+    for (u8 i = 0; i < len; i++)
+    {
+        assert(buf[i] == test_pattern(pos + i));
+    }
+}
+
+#endif
+#if defined(USE_LZMA) || defined(USE_ZSTD) || defined(USE_LZ4)
+
+/* Fills BUF with the pattern from START to END. */
+static unsigned char *make_test_pattern(u8 start, u8 end)
+{
+    unsigned char *buf = (unsigned char *) malloc(end - start);
+
+    for (u8 pos = start; pos < end; pos++)
+    {
+        buf[pos - start] = test_pattern(pos);
+    }
+    return buf;
+}
+
+/* Reads a sequential source through the way the cache does. */
+static void check_test_read_through(SOURCE *s, u8 total)
+{
+    unsigned char buf[4096];
+
+    for (u8 pos = 0; pos < total; pos += 4096)
+    {
+        check_test_output(s, pos, total - pos < 4096 ? total - pos : 4096);
+    }
+    assert(s->read_bytes(s, total, 4096, buf) == 0);
+}
+
+#endif
+
+#ifdef USE_ZLIB
+
+/* Appends a gzip member holding the pattern from START to END. */
+static void add_test_member(z_stream *zs, u8 start, u8 end)
+{
+    unsigned char in[4096];
+    u8 pos = start;
+
+    assert(deflateInit2(zs, 1, Z_DEFLATED, 15 + 16, 8,
+                        Z_DEFAULT_STRATEGY) == Z_OK);
+    do
+    {
+        zs->avail_in = 0;
+        while (pos < end && zs->avail_in < sizeof(in))
+        {
+            in[zs->avail_in++] = test_pattern(pos++);
+        }
+        zs->next_in = in;
+        do
+        {
+            zs->next_out = test_gzip_data + test_gzip_size;
+            zs->avail_out = 65536;
+            deflate(zs, pos < end ? Z_NO_FLUSH : Z_FINISH);
+            test_gzip_size = zs->next_out - test_gzip_data;
+        } while (zs->avail_out == 0);
+    } while (pos < end);
+    deflateEnd(zs);
+}
+
+/* Appends a BGZF member holding the pattern from START to END, the way
+   bgzip writes them. */
+static void add_test_bgzf_member(u8 start, u8 end)
+{
+    static const unsigned char head[16] = {
+        037, 0213, 8, 4, 0, 0, 0, 0, 0, 0xff, 6, 0, 'B', 'C', 2, 0 };
+    unsigned char in[65536], *member = test_gzip_data + test_gzip_size;
+    z_stream zs;
+
+    for (u8 pos = start; pos < end; pos++)
+    {
+        in[pos - start] = test_pattern(pos);
+    }
+    memset(&zs, 0, sizeof(zs));
+    assert(deflateInit2(&zs, 1, Z_DEFLATED, -15, 8,
+                        Z_DEFAULT_STRATEGY) == Z_OK);
+    zs.next_in = in;
+    zs.avail_in = (uInt) (end - start);
+    zs.next_out = member + 18;
+    zs.avail_out = 65536;
+    assert(deflate(&zs, Z_FINISH) == Z_STREAM_END);
+    deflateEnd(&zs);
+
+    u8 size = 18 + zs.total_out + 8;
+    u4 crc = crc32(0, in, (uInt) (end - start));
+    memcpy(member, head, 16);
+    member[16] = (unsigned char) (size - 1);
+    member[17] = (unsigned char) ((size - 1) >> 8);
+    for (int i = 0; i < 4; i++)
+    {
+        member[size - 8 + i] = (unsigned char) (crc >> (i * 8));
+        member[size - 4 + i] = (unsigned char) ((end - start) >> (i * 8));
+    }
+    test_gzip_size += size;
+}
+
+static void test_bgzf()
+{
+    u8 total = 100 * 60000 + 1234;
+    unsigned char buf[16];
+
+    test_gzip_data = (unsigned char *) malloc(total);
+    test_gzip_size = 0;
+    for (u8 pos = 0; pos < total; pos += 60000)
+    {
+        add_test_bgzf_member(pos, pos + 60000 < total ? pos + 60000 : total);
+    }
+    add_test_bgzf_member(total, total);  /* the empty one at the end */
+
+    SOURCE *foundation = new_test_foundation();
+    SOURCE *s = init_decompress_source(foundation, 0, test_gzip_size,
+                                       DECOMPRESS_GZIP);
+    DECOMPRESS_SOURCE *ds = (DECOMPRESS_SOURCE *) s;
+
+    /* The members are mapped, not decompressed, on the way there. */
+    check_test_output(s, 50 * 60000 - 100, 4096);
+    assert(ds->bgzf && ds->member_count == 51);
+    assert(ds->out_pos == 0 && ds->index_count == 0);
+
+    /* Any member can be got at directly. */
+    check_test_output(s, 7, 100);
+    check_test_output(s, total - 10, 10);
+    assert(s->read_bytes(s, total, 10, buf) == 0);
+    assert(ds->bgzf && ds->map_done);
+
+    close_source(s);
+    close_source(foundation);
+
+    /* A member not telling its size makes it fall back to the plain
+       way, the data is the same. */
+    test_gzip_data[test_gzip_size - 28 + 13] = 'X';  /* the empty one */
+    foundation = new_test_foundation();
+    s = init_decompress_source(foundation, 0, test_gzip_size,
+                               DECOMPRESS_GZIP);
+    ds = (DECOMPRESS_SOURCE *) s;
+    check_test_output(s, total - 4096, 4096);
+    assert(ds->bgzf);
+    assert(s->read_bytes(s, total, 10, buf) == 0);
+    assert(!ds->bgzf);
+    check_test_output(s, 60000 - 10, 20);
+
+    close_source(s);
+    close_source(foundation);
+    free(test_gzip_data);
+}
+
+#endif
+
+#ifdef USE_BZIP2
+
+/* The test data for bzip2, long runs at the end. */
+static unsigned char test_bzip2_pattern(u8 pos, u8 runs_from)
+{
+    return pos < runs_from ? test_pattern(pos) : 0;
+}
+
+/* Appends a bzip2 stream holding the test data from START to END. */
+static void add_test_bzip2_stream(u8 start, u8 end, u8 runs_from)
+{
+    char in[4096];
+    u8 pos = start;
+    bz_stream bs;
+    int result;
+
+    memset(&bs, 0, sizeof(bs));
+    assert(BZ2_bzCompressInit(&bs, 1, 0, 0) == BZ_OK);
+    do
+    {
+        bs.avail_in = 0;
+        while (pos < end && bs.avail_in < sizeof(in))
+        {
+            in[bs.avail_in++] = (char) test_bzip2_pattern(pos++, runs_from);
+        }
+        bs.next_in = in;
+        do
+        {
+            bs.next_out = (char *) test_gzip_data + test_gzip_size;
+            bs.avail_out = 65536;
+            result = BZ2_bzCompress(&bs, pos < end ? BZ_RUN : BZ_FINISH);
+            test_gzip_size = (unsigned char *) bs.next_out - test_gzip_data;
+        } while (bs.avail_out == 0 || (pos >= end && result != BZ_STREAM_END));
+    } while (pos < end);
+    BZ2_bzCompressEnd(&bs);
+}
+
+static void test_parallel_bzip2()
+{
+    u8 runs_from = 1500000, total = runs_from + 5 * UNIT_OUT_MAX;
+    unsigned char buf[4096];
+
+    test_gzip_data = (unsigned char *) malloc(total);
+    test_gzip_size = 0;
+
+    /* Two streams, the first one of several blocks. */
+    add_test_bzip2_stream(0, 1000000, runs_from);
+    add_test_bzip2_stream(1000000, total, runs_from);
+
+    SOURCE *foundation = new_test_foundation();
+    SOURCE *s = init_decompress_source(foundation, 0, test_gzip_size,
+                                       DECOMPRESS_BZIP2);
+    DECOMPRESS_SOURCE *ds = (DECOMPRESS_SOURCE *) s;
+    ds->parallel = 1;
+
+    /* Read through the way the cache does. */
+    for (u8 pos = 0; pos < total; pos += 4096)
+    {
+        u8 len = total - pos < 4096 ? total - pos : 4096;
+        assert(s->read_bytes(s, pos, len, buf) == len);
+        for (u8 i = 0; i < len; i++)
+        {
+            assert(buf[i] == test_bzip2_pattern(pos + i, runs_from));
+        }
+        /* Blocks are found on their own, runs come in parts. */
+        assert(ds->parallel);
+    }
+    assert(s->read_bytes(s, total, 4096, buf) == 0);
+
+    /* Starting over. */
+    assert(s->rewind(s));
+    check_test_output(s, 0, 4096);
+    assert(ds->parallel);
+
+    close_source(s);
+    close_source(foundation);
+
+    /* Damage makes it fall back to the plain way, which tells about it
+       as it always does. */
+    test_gzip_data[100] ^= 0x55;
+    foundation = new_test_foundation();
+    s = init_decompress_source(foundation, 0, test_gzip_size,
+                               DECOMPRESS_BZIP2);
+    ds = (DECOMPRESS_SOURCE *) s;
+    ds->parallel = 1;
+    s->read_bytes(s, 0, 4096, buf);
+    assert(!ds->parallel);
+
+    close_source(s);
+    close_source(foundation);
+    free(test_gzip_data);
+}
+
+#endif
+#ifdef USE_LZMA
+
+/* Appends an xz stream holding the test data from START to END. */
+static void add_test_xz_stream(u8 start, u8 end, u8 room)
+{
+    unsigned char *in = make_test_pattern(start, end);
+    size_t out_pos = test_gzip_size;
+
+    assert(lzma_easy_buffer_encode(1, LZMA_CHECK_CRC32, NULL, in,
+                                   end - start, test_gzip_data, &out_pos,
+                                   room) == LZMA_OK);
+    test_gzip_size = out_pos;
+    free(in);
+}
+
+static void test_xz()
+{
+    u8 total = 300000, room = 2 * total;
+
+    test_gzip_data = (unsigned char *) malloc(room);
+    test_gzip_size = 0;
+
+    /* Two streams with padding between them. */
+    add_test_xz_stream(0, 100000, room);
+    memset(test_gzip_data + test_gzip_size, 0, 8);
+    test_gzip_size += 8;
+    add_test_xz_stream(100000, total, room);
+
+    SOURCE *foundation = new_test_foundation();
+    SOURCE *s = init_decompress_source(foundation, 0, test_gzip_size,
+                                       DECOMPRESS_XZ);
+    assert(s->sequential);
+    check_test_read_through(s, total);
+
+    /* Starting over. */
+    assert(s->rewind(s));
+    check_test_output(s, 0, 4096);
+
+    close_source(s);
+    close_source(foundation);
+
+    /* Cut off, what is there gets delivered quietly. */
+    test_gzip_size -= 100;
+    foundation = new_test_foundation();
+    s = init_decompress_source(foundation, 0, test_gzip_size,
+                               DECOMPRESS_XZ);
+    check_test_output(s, 0, 4096);
+
+    close_source(s);
+    close_source(foundation);
+    free(test_gzip_data);
+}
+
+#endif
+#ifdef USE_ZSTD
+
+/* Appends a zstd frame holding the test data from START to END. */
+static void add_test_zstd_frame(u8 start, u8 end, u8 room)
+{
+    unsigned char *in = make_test_pattern(start, end);
+    size_t result;
+
+    result = ZSTD_compress(test_gzip_data + test_gzip_size,
+                           room - test_gzip_size, in, end - start, 1);
+    assert(!ZSTD_isError(result));
+    test_gzip_size += result;
+    free(in);
+}
+
+static void put_test_long(u4 value)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        test_gzip_data[test_gzip_size++] = (unsigned char) (value >> (i * 8));
+    }
+}
+
+static void test_zstd_seekable()
+{
+    u8 frame_size = 70000, count = 5, total = count * frame_size;
+    u8 room = 2 * total, starts[6];
+    unsigned char buf[4096];
+
+    test_gzip_data = (unsigned char *) malloc(room);
+    test_gzip_size = 0;
+
+    for (u8 i = 0; i < count; i++)
+    {
+        starts[i] = test_gzip_size;
+        add_test_zstd_frame(i * frame_size, (i + 1) * frame_size, room);
+    }
+    starts[count] = test_gzip_size;
+
+    /* The seek table, with checksums (not checked) to make it 12 bytes
+       per frame. */
+    put_test_long(SEEKABLE_TABLE_MAGIC);
+    put_test_long(count * 12 + 9);
+    for (u8 i = 0; i < count; i++)
+    {
+        put_test_long(starts[i + 1] - starts[i]);
+        put_test_long(frame_size);
+        put_test_long(0);
+    }
+    put_test_long(count);
+    test_gzip_data[test_gzip_size++] = 0x80;
+    put_test_long(SEEKABLE_MAGIC);
+
+    SOURCE *foundation = new_test_foundation();
+    SOURCE *s = init_decompress_source(foundation, 0, test_gzip_size,
+                                       DECOMPRESS_ZSTD);
+    DECOMPRESS_SOURCE *ds = (DECOMPRESS_SOURCE *) s;
+    assert(!s->sequential && s->size_known && s->size == total);
+
+    /* The far end first, only the last frame is needed. */
+    check_test_output(s, total - 4096, 4096);
+    assert(ds->frame_kept == count - 1);
+    assert(s->read_bytes(s, total, 4096, buf) == 0);
+
+    /* Across the end of a frame. */
+    check_test_output(s, 2 * frame_size - 100, 4096);
+    assert(ds->frame_kept == 2);
+    check_test_output(s, 0, 4096);
+
+    close_source(s);
+    close_source(foundation);
+
+    /* Without a valid footer, the frames are read one after the other,
+       the table is skipped as the skippable frame it is. */
+    test_gzip_data[test_gzip_size - 1] ^= 0x55;
+    foundation = new_test_foundation();
+    s = init_decompress_source(foundation, 0, test_gzip_size,
+                               DECOMPRESS_ZSTD);
+    assert(s->sequential);
+    check_test_read_through(s, total);
+    assert(s->rewind(s));
+    check_test_output(s, 0, 4096);
+
+    close_source(s);
+    close_source(foundation);
+    free(test_gzip_data);
+}
+
+#endif
+#ifdef USE_LZ4
+
+/* Appends an lz4 frame holding the test data from START to END. */
+static void add_test_lz4_frame(u8 start, u8 end, u8 room)
+{
+    unsigned char *in = make_test_pattern(start, end);
+    size_t result;
+
+    result = LZ4F_compressFrame(test_gzip_data + test_gzip_size,
+                                room - test_gzip_size, in, end - start,
+                                NULL);
+    assert(!LZ4F_isError(result));
+    test_gzip_size += result;
+    free(in);
+}
+
+static void test_lz4()
+{
+    u8 total = 300000, room = 2 * total;
+
+    test_gzip_data = (unsigned char *) malloc(room);
+    test_gzip_size = 0;
+
+    /* Two frames. */
+    add_test_lz4_frame(0, 100000, room);
+    add_test_lz4_frame(100000, total, room);
+
+    SOURCE *foundation = new_test_foundation();
+    SOURCE *s = init_decompress_source(foundation, 0, test_gzip_size,
+                                       DECOMPRESS_LZ4);
+    check_test_read_through(s, total);
+
+    /* Starting over. */
+    assert(s->rewind(s));
+    check_test_output(s, 0, 4096);
+
+    close_source(s);
+    close_source(foundation);
+    free(test_gzip_data);
+}
+
+#endif
+
+void test_decompress()
+{
+#ifdef USE_ZLIB
+    u8 total = 2 * INDEX_SPAN + INDEX_SPAN / 2;
+    unsigned char buf[4096];
+    z_stream zs;
+
+    test_gzip_data = (unsigned char *) malloc(total);
+    test_gzip_size = 0;
+    memset(&zs, 0, sizeof(zs));
+
+    /* two members, the second one starts with the last checkpoint span */
+    add_test_member(&zs, 0, INDEX_SPAN + INDEX_SPAN / 2);
+    add_test_member(&zs, INDEX_SPAN + INDEX_SPAN / 2, total);
+
+    SOURCE *foundation = new_test_foundation();
+    SOURCE *s = init_decompress_source(foundation, 0, test_gzip_size,
+                                       DECOMPRESS_GZIP);
+    DECOMPRESS_SOURCE *ds = (DECOMPRESS_SOURCE *) s;
+    assert(!s->sequential);
+
+    /* The far end first, checkpoints are put down on the way. */
+    check_test_output(s, total - 4096, 4096);
+    assert(ds->index_count == 2);
+    assert(s->read_bytes(s, total, 4096, buf) == 0);
+
+    /* Going back starts over from the closest checkpoint. */
+    check_test_output(s, 100, 1000);
+    assert(ds->out_pos == 1100);
+    check_test_output(s, ds->index[1].out + 5, 4000);
+    assert(ds->raw);
+
+    /* Across the end of the first member, resumed without its header. */
+    check_test_output(s, INDEX_SPAN + INDEX_SPAN / 2 - 2000, 4096);
+    assert(ds->raw == 0);
+    check_test_output(s, total - 10, 10);
+
+    close_source(s);
+    close_source(foundation);
+    free(test_gzip_data);
+
+    test_bgzf();
+#endif
+#ifdef USE_BZIP2
+    test_parallel_bzip2();
+#endif
+#ifdef USE_LZMA
+    test_xz();
+#endif
+#ifdef USE_ZSTD
+    test_zstd_seekable();
+#endif
+#ifdef USE_LZ4
+    test_lz4();
+#endif
+}
+
+#endif
+
+/* EOF */
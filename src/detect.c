@@ -39,7 +39,6 @@ void detect_amiga_fs(SECTION *section, int level);
 /* in apple.c */
 void detect_apple_partmap(SECTION *section, int level);
 void detect_apple_volume(SECTION *section, int level);
-void detect_udif(SECTION *section, int level);
 
 /* in atari.c */
 void detect_atari_partmap(SECTION *section, int level);
@@ -96,6 +95,18 @@ void detect_cdimage(SECTION *section, int level);
 /* in vpc.c */
 void detect_vhd(SECTION *section, int level);
 
+/* in qcow.c */
+void detect_qcow(SECTION *section, int level);
+
+/* in vmdk.c */
+void detect_vmdk(SECTION *section, int level);
+
+/* in vhdx.c */
+void detect_vhdx(SECTION *section, int level);
+
+/* in udif.c */
+void detect_udif(SECTION *section, int level);
+
 /* in cloop.c */
 void detect_cloop(SECTION *section, int level);
 
@@ -105,71 +116,312 @@ void detect_archive(SECTION *section, int level);
 /* in blank.c */
 void detect_blank(SECTION *section, int level);
 
+/*
+ * probe ranges, i.e. the fixed places the detectors look at first
+ */
+
+/* A probe is relative to the start of the section, unless from_end is
+   set. In that case, the end of the section is rounded down to a
+   multiple of from_end, and pos is counted backwards from there. */
+typedef struct probe {
+  u8 pos;
+  u4 len;
+  u4 from_end;
+} PROBE;
+
+#define PROBES_END { 0, 0, 0 }
+
+static const PROBE probe_vhd[] = { { 0, 511, 0 }, { 511, 511, 1 }, PROBES_END };
+static const PROBE probe_qcow[] = { { 0, 512, 0 }, PROBES_END };
+static const PROBE probe_vmdk[] = { { 0, 512, 0 }, PROBES_END };
+static const PROBE probe_vhdx[] = { { 0, 520, 0 }, PROBES_END };
+static const PROBE probe_cdimage[] = { { 0, 2352, 0 }, PROBES_END };
+static const PROBE probe_cloop[] = { { 0, 256, 0 }, PROBES_END };
+static const PROBE probe_udif[] = { { 512, 512, 1 }, PROBES_END };
+static const PROBE probe_sector0[] = { { 0, 512, 0 }, PROBES_END };
+static const PROBE probe_sector1[] = { { 512, 512, 0 }, PROBES_END };
+static const PROBE probe_head2k[] = { { 0, 2048, 0 }, PROBES_END };
+static const PROBE probe_bsd_loader[] = { { 0, 512, 0 }, { 1024, 512, 0 },
+					  PROBES_END };
+static const PROBE probe_amiga_partmap[] = { { 0, 16*512, 0 }, PROBES_END };
+static const PROBE probe_apple_volume[] = { { 1024, 512, 0 }, PROBES_END };
+static const PROBE probe_hpfs[] = { { 16*512, 512, 0 }, PROBES_END };
+static const PROBE probe_udf[] = { { 16*2048, 48*2048, 0 }, PROBES_END };
+static const PROBE probe_cdrom_misc[] = { { 0, 2048, 0 }, { 32*2048, 2048, 0 },
+					  PROBES_END };
+static const PROBE probe_iso[] = { { 32768, 2048, 0 }, PROBES_END };
+static const PROBE probe_ext234[] = { { 1024, 1024, 0 }, PROBES_END };
+static const PROBE probe_reiser[] = { { 8*1024, 1024, 0 }, { 64*1024, 1024, 0 },
+				      PROBES_END };
+static const PROBE probe_reiser4[] = { { 16*4096, 1024, 0 }, PROBES_END };
+static const PROBE probe_linux_raid[] = { { 65536, 4096, 65536 }, PROBES_END };
+static const PROBE probe_linux_lvm[] = { { 0, 1024, 0 }, PROBES_END };
+static const PROBE probe_linux_swap[] = { { 1024, 512, 0 }, { 4096-512, 512, 0 },
+					  { 8192-512, 512, 0 }, PROBES_END };
+static const PROBE probe_jfs[] = { { 32768, 512, 0 }, PROBES_END };
+static const PROBE probe_ufs[] = { { 0, 1536, 0 }, { 8*1024, 1536, 0 },
+				   { 64*1024, 1536, 0 }, { 256*1024, 1536, 0 },
+				   PROBES_END };
+static const PROBE probe_sysv[] = { { 512, 1536, 0 }, PROBES_END };
+static const PROBE probe_vxfs[] = { { 1024, 1024, 0 }, PROBES_END };
+static const PROBE probe_bfs[] = { { 0, 1024, 0 }, PROBES_END };
+static const PROBE probe_compressed[] = { { 0, 4096, 0 }, PROBES_END };
+
+/*
+ * signatures, i.e. magic numbers a detector can't do without
+ */
+
+/* A detector that lists signatures is only run if at least one of them
+   matches. Detectors that work on heuristics list none and always run.
+   Positions work like those of the probes. */
+typedef struct signature {
+  u8 pos;
+  u4 from_end;
+  int len;
+  const char *magic;
+} SIGNATURE;
+
+#define SIGS_END { 0, 0, 0, NULL }
+#define SIG(pos, magic) { (pos), 0, sizeof(magic) - 1, (magic) }
+#define SIG_AT_END(pos, align, magic) { (pos), (align), sizeof(magic) - 1, \
+					(magic) }
+/* a 32-bit magic number stored in either byte order */
+#define SIG_VE(pos, b0, b1, b2, b3) SIG(pos, b0 b1 b2 b3), \
+                                    SIG(pos, b3 b2 b1 b0)
+
+static const SIGNATURE sig_vhd[] = {
+  SIG(0, "conectix"), SIG_AT_END(511, 1, "conectix"), SIGS_END };
+static const SIGNATURE sig_qcow[] = { SIG(0, "QFI\xfb"), SIGS_END };
+static const SIGNATURE sig_vmdk[] = { SIG(0, "KDMV"), SIGS_END };
+static const SIGNATURE sig_vhdx[] = { SIG(0, "vhdxfile"), SIGS_END };
+static const SIGNATURE sig_cdimage[] = {
+  SIG(0, "\x00\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\x00"), SIGS_END };
+static const SIGNATURE sig_cloop[] = {
+  SIG(0, "#!/bin/sh\n#V2.0 Format\nmodprobe cloop"), SIGS_END };
+static const SIGNATURE sig_udif[] = { SIG_AT_END(512, 1, "koly"), SIGS_END };
+static const SIGNATURE sig_bsd_disklabel[] = {
+  SIG(512, "\x57\x45\x56\x82"), SIGS_END };
+static const SIGNATURE sig_solaris_disklabel[] = {
+  SIG(508, "\xda\xbe"), SIGS_END };
+static const SIGNATURE sig_solaris_vtoc[] = {
+  SIG(512 + 12, "\xee\xde\x0d\x60"), SIGS_END };
+static const SIGNATURE sig_amiga_partmap[] = {
+  SIG(0*512, "RDSK"), SIG(1*512, "RDSK"), SIG(2*512, "RDSK"),
+  SIG(3*512, "RDSK"), SIG(4*512, "RDSK"), SIG(5*512, "RDSK"),
+  SIG(6*512, "RDSK"), SIG(7*512, "RDSK"), SIG(8*512, "RDSK"),
+  SIG(9*512, "RDSK"), SIG(10*512, "RDSK"), SIG(11*512, "RDSK"),
+  SIG(12*512, "RDSK"), SIG(13*512, "RDSK"), SIG(14*512, "RDSK"),
+  SIG(15*512, "RDSK"), SIGS_END };
+static const SIGNATURE sig_apple_partmap[] = {
+  SIG(512, "TS"), SIG(512, "PM"), SIGS_END };
+static const SIGNATURE sig_dos_partmap[] = { SIG(510, "\x55\xaa"), SIGS_END };
+static const SIGNATURE sig_gpt_partmap[] = { SIG(512, "EFI PART"), SIGS_END };
+static const SIGNATURE sig_apple_volume[] = {
+  SIG(1024, "\xd2\xd7"), SIG(1024, "BD"), SIG(1024, "H+"), SIGS_END };
+static const SIGNATURE sig_exfat[] = { SIG(3, "EXFAT "), SIGS_END };
+static const SIGNATURE sig_ntfs[] = { SIG(3, "NTFS    "), SIGS_END };
+static const SIGNATURE sig_hpfs[] = {
+  SIG(16*512, "\xf9\x95\xe8\x49\xfa\x53\xe9\xc5"), SIGS_END };
+static const SIGNATURE sig_cdrom_misc[] = {
+  SIG(0, "SEGA SEGAKATANA SEGA ENTERPRISES"),
+  SIG(0, "\x01\x5a\x5a\x5a\x5a\x5a\x01\x00"),
+  SIG(32*2048, "MICROSOFT*XBOX*MEDIA"), SIGS_END };
+static const SIGNATURE sig_iso[] = { SIG(32768, "\001CD001"), SIGS_END };
+static const SIGNATURE sig_ext234[] = { SIG(1024 + 56, "\x53\xef"), SIGS_END };
+static const SIGNATURE sig_reiser[] = {
+  SIG(8*1024 + 52, "ReIsEr"), SIG(64*1024 + 52, "ReIsEr"), SIGS_END };
+static const SIGNATURE sig_reiser4[] = { SIG(16*4096, "ReIsEr4"), SIGS_END };
+static const SIGNATURE sig_linux_raid[] = {
+  SIG_AT_END(65536, 65536, "\xfc\x4e\x2b\xa9"), SIGS_END };
+static const SIGNATURE sig_linux_lvm[] = { SIG(0, "HM"), SIGS_END };
+static const SIGNATURE sig_linux_lvm2[] = {
+  SIG(0*512, "LABELONE"), SIG(1*512, "LABELONE"), SIG(2*512, "LABELONE"),
+  SIG(3*512, "LABELONE"), SIGS_END };
+static const SIGNATURE sig_linux_swap[] = {
+  SIG(4096 - 10, "SWAP-SPACE"), SIG(4096 - 10, "SWAPSPACE2"),
+  SIG(8192 - 10, "SWAP-SPACE"), SIG(8192 - 10, "SWAPSPACE2"), SIGS_END };
+static const SIGNATURE sig_jfs[] = { SIG(32768, "JFS1"), SIGS_END };
+static const SIGNATURE sig_xfs[] = { SIG(0, "XFSB"), SIGS_END };
+#define SIG_UFS(at) \
+  SIG_VE((at) + 1372, "\x00", "\x01", "\x19", "\x54"), \
+  SIG_VE((at) + 1372, "\x00", "\x09", "\x50", "\x14"), \
+  SIG_VE((at) + 1372, "\x00", "\x19", "\x56", "\x12"), \
+  SIG_VE((at) + 1372, "\x05", "\x23", "\x19", "\x94"), \
+  SIG_VE((at) + 1372, "\x19", "\x54", "\x01", "\x19")
+static const SIGNATURE sig_ufs[] = {
+  SIG_UFS(0), SIG_UFS(8*1024), SIG_UFS(64*1024), SIG_UFS(256*1024),
+  SIGS_END };
+static const SIGNATURE sig_sysv[] = {
+  SIG_VE(512 + 1016, "\x00", "\x2b", "\x55", "\x44"),
+  SIG_VE(1024 + 1016, "\x00", "\x2b", "\x55", "\x44"),
+  SIG_VE(512 + 504, "\xfd", "\x18", "\x7e", "\x20"),
+  SIG_VE(1024 + 504, "\xfd", "\x18", "\x7e", "\x20"), SIGS_END };
+static const SIGNATURE sig_qnx[] = { SIG(512, "\x2f\x00\x00\x00"), SIGS_END };
+static const SIGNATURE sig_vxfs[] = {
+  SIG_VE(1024, "\xa5", "\x01", "\xfc", "\xf5"), SIGS_END };
+static const SIGNATURE sig_bfs[] = {
+  SIG_VE(32, "B", "F", "S", "1"), SIG_VE(512 + 32, "B", "F", "S", "1"),
+  SIGS_END };
+#define SIG_COMPRESSED(at) \
+  SIG(at, "\037\235"), SIG(at, "\037\213"), SIG(at, "\037\236"), \
+  SIG(at, "BZh"), SIG(at, "\3757zXZ"), SIG(at, "\x28\xb5\x2f\xfd"), \
+  SIG(at, "\x04\x22\x4d\x18")
+static const SIGNATURE sig_compressed[] = {
+  SIG_COMPRESSED(0*512), SIG_COMPRESSED(1*512), SIG_COMPRESSED(2*512),
+  SIG_COMPRESSED(3*512), SIG_COMPRESSED(4*512), SIG_COMPRESSED(5*512),
+  SIG_COMPRESSED(6*512), SIG_COMPRESSED(7*512), SIGS_END };
+
 /*
  * list of detectors
  */
 
-DETECTOR detectors[] = {
+typedef struct detector_entry {
+  DETECTOR detect;
+  const PROBE *probes;         /* may be NULL */
+  const SIGNATURE *signatures; /* NULL means the detector always runs */
+} DETECTOR_ENTRY;
+
+static const DETECTOR_ENTRY detectors[] = {
   /* 1: disk image formats */
-  detect_vhd,               /* may stop */
-  detect_cdimage,           /* may stop */
-  detect_cloop,
-  detect_udif,
+  { detect_vhd, probe_vhd, sig_vhd },                    /* may stop */
+  { detect_qcow, probe_qcow, sig_qcow },                 /* may stop */
+  { detect_vmdk, probe_vmdk, sig_vmdk },                 /* may stop */
+  { detect_vhdx, probe_vhdx, sig_vhdx },                 /* may stop */
+  { detect_cdimage, probe_cdimage, sig_cdimage },        /* may stop */
+  { detect_cloop, probe_cloop, sig_cloop },              /* may stop */
+  { detect_udif, probe_udif, sig_udif },
   /* 2: boot code */
-  detect_linux_loader,
-  detect_bsd_loader,
-  detect_dos_loader,
-  detect_beos_loader,
+  { detect_linux_loader, probe_head2k, NULL },
+  { detect_bsd_loader, probe_bsd_loader, NULL },
+  { detect_dos_loader, probe_head2k, NULL },
+  { detect_beos_loader, probe_sector0, NULL },
   /* 3: partition tables */
-  detect_bsd_disklabel,     /* may stop, recurses with FLAG_IN_DISKLABEL */
-  detect_solaris_disklabel, /* may stop, recurses with FLAG_IN_DISKLABEL */
-  detect_solaris_vtoc,
-  detect_amiga_partmap,
-  detect_apple_partmap,
-  detect_atari_partmap,
-  detect_dos_partmap,
-  detect_gpt_partmap,
+  { detect_bsd_disklabel, probe_sector1, sig_bsd_disklabel },
+					/* may stop, recurses with
+					   FLAG_IN_DISKLABEL */
+  { detect_solaris_disklabel, probe_sector0, sig_solaris_disklabel },
+					/* may stop, recurses with
+					   FLAG_IN_DISKLABEL */
+  { detect_solaris_vtoc, probe_sector1, sig_solaris_vtoc },
+  { detect_amiga_partmap, probe_amiga_partmap, sig_amiga_partmap },
+  { detect_apple_partmap, probe_sector1, sig_apple_partmap },
+  { detect_atari_partmap, probe_sector0, NULL },
+  { detect_dos_partmap, probe_sector0, sig_dos_partmap },
+  { detect_gpt_partmap, probe_sector1, sig_gpt_partmap },
   /* 4: file systems */
-  detect_amiga_fs,
-  detect_apple_volume,
-  detect_fat,
-  detect_exfat,
-  detect_ntfs,
-  detect_hpfs,
-  detect_udf,
-  detect_cdrom_misc,
-  detect_iso,
-  detect_ext234,
-  detect_reiser,
-  detect_reiser4,
-  detect_linux_raid,
-  detect_linux_lvm,
-  detect_linux_lvm2,
-  detect_linux_swap,
-  detect_linux_misc,
-  detect_jfs,
-  detect_xfs,
-  detect_ufs,
-  detect_sysv,
-  detect_qnx,
-  detect_vxfs,
-  detect_bfs,
+  { detect_amiga_fs, probe_sector0, NULL },
+  { detect_apple_volume, probe_apple_volume, sig_apple_volume },
+  { detect_fat, probe_sector0, NULL },
+  { detect_exfat, probe_sector0, sig_exfat },
+  { detect_ntfs, probe_sector0, sig_ntfs },
+  { detect_hpfs, probe_hpfs, sig_hpfs },
+  { detect_udf, probe_udf, NULL },
+  { detect_cdrom_misc, probe_cdrom_misc, sig_cdrom_misc },
+  { detect_iso, probe_iso, sig_iso },
+  { detect_ext234, probe_ext234, sig_ext234 },
+  { detect_reiser, probe_reiser, sig_reiser },
+  { detect_reiser4, probe_reiser4, sig_reiser4 },
+  { detect_linux_raid, probe_linux_raid, sig_linux_raid },
+  { detect_linux_lvm, probe_linux_lvm, sig_linux_lvm },
+  { detect_linux_lvm2, probe_head2k, sig_linux_lvm2 },
+  { detect_linux_swap, probe_linux_swap, sig_linux_swap },
+  { detect_linux_misc, probe_head2k, NULL },
+  { detect_jfs, probe_jfs, sig_jfs },
+  { detect_xfs, probe_sector0, sig_xfs },
+  { detect_ufs, probe_ufs, sig_ufs },
+  { detect_sysv, probe_sysv, sig_sysv },
+  { detect_qnx, probe_sector1, sig_qnx },
+  { detect_vxfs, probe_vxfs, sig_vxfs },
+  { detect_bfs, probe_bfs, sig_bfs },
   /* 5: file formats */
-  detect_archive,
-  detect_compressed,  /* this is here because of boot disks */
+  { detect_archive, probe_sector0, NULL },
+  { detect_compressed, probe_compressed, sig_compressed },
+					/* this is here because of
+					   boot disks */
   /* 6: blank formatted disk */
-  detect_blank,
+  { detect_blank, NULL, NULL },
+
+  { NULL, NULL, NULL } };
+
+#define DETECTOR_COUNT (sizeof(detectors) / sizeof(detectors[0]))
+
+/* built on first use by build_signature_index() */
+#define MAX_SIG_SITES (128)
+#define MAX_SIG_REFS (256)
+
+typedef struct sig_site {
+  u8 pos;
+  u4 from_end;
+  int len;          /* longest signature found here */
+  int first_ref, ref_count;  /* in site_refs[] */
+} SIG_SITE;
+
+typedef struct sig_ref {
+  int site;
+  int detector;
+  const SIGNATURE *sig;
+} SIG_REF;
+
+#ifdef USE_THREADS
+static pthread_once_t index_once = PTHREAD_ONCE_INIT;
+#else
+static int index_built = 0;
+#endif
+static SIG_SITE sites[MAX_SIG_SITES];
+static int site_count;
+static SIG_REF refs[MAX_SIG_REFS];       /* in detector order */
+static SIG_REF site_refs[MAX_SIG_REFS];  /* in site order */
+static int det_first_ref[DETECTOR_COUNT];
+
+/* the places at the start of a section read by any detector, sorted
+   and merged, see stage_probes() */
+#define MAX_STAGE_RANGES (256)
+static PROBE stage_ranges[MAX_STAGE_RANGES];
+static int stage_range_count;
+
+
+/*
+ * sections analyzed by the task pool
+ */
 
- NULL };
+#ifdef JSON
 
+typedef struct section_task {
+  TASK t;
+  SECTION section;
+  int level;
+  /* position of the section's objects in the content list */
+  int at;
+  /* the results, collected separately */
+  ANALYSIS *analysis;
+  /* spawned by the same detector call, newest first */
+  struct section_task *next;
+} SECTION_TASK;
+
+struct section_tasks {
+  TASK_GROUP group;
+  SECTION_TASK *first;
+};
+
+#endif
 
 /*
  * internal stuff
  */
 
 static void detect(SECTION *section, int level);
-
-static int stop_flag = 0;
+#ifdef JSON
+static void spawn_section_task(SECTION *section, int level);
+static void run_section_task(TASK *t);
+static void join_section_tasks(struct section_tasks *tasks);
+#endif
+static void prefetch_probes(SECTION *section);
+static void stage_probes(SECTION *section);
+static void build_signature_index(void);
+static void build_stage_ranges(void);
+static void add_stage_range(u8 pos, u4 len);
+static void check_signature_site(SECTION *section, int site,
+				 unsigned char *candidate);
 
 /*
  * analyze a given source
@@ -233,6 +485,16 @@ void analyze_recursive(SECTION *section, int level,
   rs.size = size;
   rs.flags = section->flags | flags;
 
+#ifdef JSON
+  /* sibling partitions don't depend on each other, analyze them
+     concurrently if the source allows it */
+  if (current_analysis->spawned != NULL && s->concurrent &&
+      task_pool_active()) {
+    spawn_section_task(&rs, level);
+    return;
+  }
+#endif
+
   detect(&rs, level);
 }
 
@@ -241,13 +503,350 @@ void analyze_recursive(SECTION *section, int level,
  */
 
 static void detect(SECTION *section, int level)
+{
+  int i, j, site;
+  unsigned char site_done[MAX_SIG_SITES];
+  unsigned char candidate[DETECTOR_COUNT];
+#ifdef JSON
+  struct section_tasks tasks, *outer_tasks;
+#endif
+
+#ifdef USE_THREADS
+  pthread_once(&index_once, build_signature_index);
+#else
+  if (!index_built)
+    build_signature_index();
+#endif
+
+  /* let the data source fetch all probed places at once */
+  prefetch_probes(section);
+
+  /* a sequential source is read through once, in offset order, before
+     the detectors run in their usual order; what they look at stays
+     in the cache until all of them are done */
+  pin_frame_enter();
+  stage_probes(section);
+
+  /* each signature site is read at most once per section, and only
+     when a detector still in the running asks for it */
+  memset(site_done, 0, sizeof(site_done));
+  memset(candidate, 0, sizeof(candidate));
+
+  /* run the modularized detectors, each one may hold on to the
+     buffers it got until it returns */
+  for (i = 0; detectors[i].detect && !current_analysis->stop_flag; i++) {
+    if (detectors[i].signatures != NULL) {
+      for (j = det_first_ref[i]; j < det_first_ref[i+1]; j++) {
+	site = refs[j].site;
+	if (!site_done[site]) {
+	  check_signature_site(section, site, candidate);
+	  site_done[site] = 1;
+	}
+      }
+      if (!candidate[i])
+	continue;
+    }
+
+#ifdef JSON
+    /* sections spawned by the detector must be done before its
+       results are complete and any source it set up goes away */
+    memset(&tasks, 0, sizeof(tasks));
+    outer_tasks = current_analysis->spawned;
+    current_analysis->spawned = &tasks;
+#endif
+
+    pin_frame_enter();
+    (*detectors[i].detect)(section, level);
+    pin_frame_leave();
+
+#ifdef JSON
+    current_analysis->spawned = outer_tasks;
+    if (tasks.first != NULL)
+      join_section_tasks(&tasks);
+#endif
+  }
+  current_analysis->stop_flag = 0;
+
+  pin_frame_leave();
+}
+
+#ifdef JSON
+
+/*
+ * hand a section to the task pool, its content objects are put back
+ * in place by join_section_tasks()
+ */
+
+static void spawn_section_task(SECTION *section, int level)
+{
+  struct section_tasks *tasks = current_analysis->spawned;
+  SECTION_TASK *st;
+
+  st = (SECTION_TASK *)malloc(sizeof(SECTION_TASK));
+  if (st == NULL)
+    bailout("Out of memory");
+  memset(st, 0, sizeof(SECTION_TASK));
+
+  st->t.run = run_section_task;
+  st->section = *section;
+  st->level = level;
+  st->at = given_file.number_of_objects;
+  st->next = tasks->first;
+  tasks->first = st;
+
+  spawn_task(&st->t, &tasks->group);
+}
+
+static void run_section_task(TASK *t)
+{
+  SECTION_TASK *st = (SECTION_TASK *)t;
+  ANALYSIS *outer;
+
+  /* the running thread may be in the middle of an analysis itself */
+  outer = current_analysis;
+  st->analysis = new_analysis();
+  current_analysis = st->analysis;
+
+  detect(&st->section, st->level);
+
+  current_analysis = outer;
+}
+
+static void join_section_tasks(struct section_tasks *tasks)
+{
+  SECTION_TASK *st, *next;
+  int from;
+
+  wait_task_group(&tasks->group);
+
+  /* newest first, so the positions of the older ones stay valid */
+  from = given_file.number_of_objects;
+  for (st = tasks->first; st != NULL; st = next) {
+    next = st->next;
+    insert_content_objects(st->at, &st->analysis->file);
+    from = st->at;
+    free_analysis(st->analysis);
+    free(st);
+  }
+  tasks->first = NULL;
+
+  relink_content_objects(from);
+}
+
+#endif
+
+/*
+ * announce the probe ranges of all detectors to the data source
+ */
+
+static void prefetch_probes(SECTION *section)
 {
   int i;
+  const PROBE *p;
+  u8 pos, end, head_end;
+
+  if (section->source->prefetch == NULL || section->source->sequential)
+    return;
+
+  /* most probes are in the first few hundred KiB, coalesce those into
+     one range */
+  head_end = 0;
+  for (i = 0; detectors[i].detect; i++) {
+    for (p = detectors[i].probes; p != NULL && p->len; p++) {
+      if (p->from_end) {
+	if (section->size == 0)
+	  continue;
+	end = section->size & ~((u8)p->from_end - 1);
+	if (end < p->pos)
+	  continue;
+	pos = end - p->pos;
+	prefetch_buffer(section, pos, p->len);
+      } else if (p->pos + p->len > head_end) {
+	head_end = p->pos + p->len;
+      }
+    }
+  }
+  if (section->size && head_end > section->size)
+    head_end = section->size;
+  if (head_end)
+    prefetch_buffer(section, 0, head_end);
+}
+
+/*
+ * read the probed places of a sequential source in offset order
+ */
+
+static void stage_probes(SECTION *section)
+{
+  int i;
+
+  if (!section->source->sequential)
+    return;
+
+  /* the end of a sequential source is left out, just like in
+     check_signature_site() */
+  for (i = 0; i < stage_range_count; i++) {
+    if (section->size && stage_ranges[i].pos >= section->size)
+      break;
+    stage_buffer(section, stage_ranges[i].pos, stage_ranges[i].len);
+  }
+}
+
+/*
+ * signature index: the signatures of all detectors, grouped by the
+ * place they are found at
+ */
+
+static void build_signature_index(void)
+{
+  int i, k, n, site;
+  const SIGNATURE *sig;
+  SIG_REF tmp;
+
+  site_count = 0;
+  n = 0;
+  for (i = 0; detectors[i].detect; i++) {
+    det_first_ref[i] = n;
+    for (sig = detectors[i].signatures; sig != NULL && sig->len; sig++) {
+      for (site = 0; site < site_count; site++)
+	if (sites[site].pos == sig->pos &&
+	    sites[site].from_end == sig->from_end)
+	  break;
+      if (site == site_count) {
+	if (site_count >= MAX_SIG_SITES)
+	  bailout("Too many signature sites, increase MAX_SIG_SITES");
+	sites[site].pos = sig->pos;
+	sites[site].from_end = sig->from_end;
+	sites[site].len = 0;
+	site_count++;
+      }
+      if (sites[site].len < sig->len)
+	sites[site].len = sig->len;
+
+      if (n >= MAX_SIG_REFS)
+	bailout("Too many signatures, increase MAX_SIG_REFS");
+      refs[n].site = site;
+      refs[n].detector = i;
+      refs[n].sig = sig;
+      n++;
+    }
+  }
+  det_first_ref[i] = n;
+
+  /* list the references by site, keeping detector order within
+     a site (insertion sort, the table is small) */
+  for (i = 0; i < n; i++) {
+    tmp = refs[i];
+    for (k = i; k > 0 && site_refs[k-1].site > tmp.site; k--)
+      site_refs[k] = site_refs[k-1];
+    site_refs[k] = tmp;
+  }
+  for (site = 0, k = 0; site < site_count; site++) {
+    sites[site].first_ref = k;
+    while (k < n && site_refs[k].site == site)
+      k++;
+    sites[site].ref_count = k - sites[site].first_ref;
+  }
 
-  /* run the modularized detectors */
-  for (i = 0; detectors[i] && !stop_flag; i++)
-    (*detectors[i])(section, level);
-  stop_flag = 0;
+  build_stage_ranges();
+
+#ifndef USE_THREADS
+  index_built = 1;
+#endif
+}
+
+/*
+ * stage ranges: the probes and signature sites relative to the start
+ * of a section, in offset order with overlapping ones merged
+ */
+
+static void build_stage_ranges(void)
+{
+  int i, site;
+  const PROBE *p;
+
+  stage_range_count = 0;
+  for (i = 0; detectors[i].detect; i++) {
+    for (p = detectors[i].probes; p != NULL && p->len; p++) {
+      if (!p->from_end)
+	add_stage_range(p->pos, p->len);
+    }
+  }
+  for (site = 0; site < site_count; site++) {
+    if (!sites[site].from_end)
+      add_stage_range(sites[site].pos, sites[site].len);
+  }
+}
+
+static void add_stage_range(u8 pos, u4 len)
+{
+  int i, k;
+  u8 end = pos + len;
+
+  /* find the first range that ends at or after the new one's start */
+  for (i = 0; i < stage_range_count; i++)
+    if (stage_ranges[i].pos + stage_ranges[i].len >= pos)
+      break;
+
+  if (i < stage_range_count && stage_ranges[i].pos <= end) {
+    /* overlaps or touches, grow it and swallow the ones it reaches */
+    if (stage_ranges[i].pos > pos)
+      stage_ranges[i].pos = pos;
+    for (k = i + 1; k < stage_range_count && stage_ranges[k].pos <= end; k++)
+      ;
+    if (stage_ranges[k-1].pos + stage_ranges[k-1].len > end)
+      end = stage_ranges[k-1].pos + stage_ranges[k-1].len;
+    stage_ranges[i].len = end - stage_ranges[i].pos;
+    memmove(&stage_ranges[i+1], &stage_ranges[k],
+	    (stage_range_count - k) * sizeof(PROBE));
+    stage_range_count -= k - (i + 1);
+    return;
+  }
+
+  /* insert it in front of range i */
+  if (stage_range_count >= MAX_STAGE_RANGES)
+    bailout("Too many probe ranges, increase MAX_STAGE_RANGES");
+  memmove(&stage_ranges[i+1], &stage_ranges[i],
+	  (stage_range_count - i) * sizeof(PROBE));
+  stage_ranges[i].pos = pos;
+  stage_ranges[i].len = len;
+  stage_ranges[i].from_end = 0;
+  stage_range_count++;
+}
+
+static void check_signature_site(SECTION *section, int site,
+				 unsigned char *candidate)
+{
+  const SIG_SITE *st = &sites[site];
+  const SIG_REF *ref;
+  u8 pos, end;
+  int i, fetched;
+  unsigned char *buf;
+
+  if (st->from_end) {
+    /* the end of a sequential source is not worth waiting for; the
+       detectors don't look there either */
+    if (section->size == 0 || section->source->sequential)
+      return;
+    end = section->size & ~((u8)st->from_end - 1);
+    if (end < st->pos)
+      return;
+    pos = end - st->pos;
+  } else {
+    pos = st->pos;
+    if (section->size && pos >= section->size)
+      return;
+  }
+
+  pin_frame_enter();
+  fetched = get_buffer(section, pos, st->len, (void **)&buf);
+  for (i = 0; i < st->ref_count; i++) {
+    ref = &site_refs[st->first_ref + i];
+    if (fetched >= ref->sig->len &&
+	memcmp(buf, ref->sig->magic, ref->sig->len) == 0)
+      candidate[ref->detector] = 1;
+  }
+  pin_frame_leave();
 }
 
 /*
@@ -256,7 +855,7 @@ static void detect(SECTION *section, int level)
 
 void stop_detect(void)
 {
-  stop_flag = 1;
+  current_analysis->stop_flag = 1;
 }
 
 /* EOF */
@@ -1,6 +1,6 @@
 /*
  * file.c
- * Data source for files and block devices.
+ * Data source for files, block devices and split images.
  *
  * Copyright (c) 2003 Christoph Pfisterer
  *
@@ -27,6 +27,8 @@
 
 #include "global.h"
 
+#include <ctype.h>
+
 #define USE_BINARY_SEARCH 0
 #define DEBUG_SIZE 0
 
@@ -45,6 +47,32 @@
 #include <sys/disk.h>
 #endif
 
+#if defined(__amigaos__) && !defined(__ixemul__)
+#define USE_MMAP 0
+#else
+#define USE_MMAP 1
+#include <sys/mman.h>
+#endif
+
+#if USE_MMAP
+/* sources up to this size are mapped as a whole */
+#define MAP_WHOLE_LIMIT ((u8)1 << ((sizeof(void *) >= 8) ? 36 : 28))
+/* larger ones are mapped in windows; the windows overlap, so a request
+   of up to MAP_OVERLAP bytes always fits into one of them */
+#define MAP_WINDOWBITS ((sizeof(void *) >= 8) ? 26 : 23)
+#define MAP_WINDOW ((u8)1 << MAP_WINDOWBITS)
+#define MAP_OVERLAP (1024*1024)
+/* bound on the address space used by windows, they are kept until the
+   source is closed so that handed out pointers stay valid */
+#define MAP_MAX_WINDOWS ((sizeof(void *) >= 8) ? 1024 : 32)
+#endif
+
+/* split images: default bound on the pieces held open at once */
+#define SPLIT_MAX_OPEN (32)
+
+/* convenience */
+#define MINIMUM(a,b) (((a) < (b)) ? (a) : (b))
+
 /*
  * types
  */
@@ -52,15 +80,63 @@
 typedef struct file_source {
   SOURCE c;
   int fd;
+#if USE_MMAP
+  /* mapping of the whole file, or NULL */
+  void *map;
+  /* windowed mappings, indexed by window number */
+  void **windows;
+  u4 window_count, windows_mapped;
+#ifdef USE_THREADS
+  pthread_mutex_t window_lock;
+#endif
+#endif
 } FILE_SOURCE;
 
+typedef struct split_segment {
+  char *path;
+  u8 start, size;
+  int fd;         /* -1 while closed */
+  int users;      /* reads in progress, keeps it from being closed */
+  int failed;     /* couldn't be opened, don't try again */
+  u8 last_use;
+} SPLIT_SEGMENT;
+
+typedef struct split_source {
+  SOURCE c;
+  SPLIT_SEGMENT *segments;
+  int count;
+  /* descriptor pool: at most max_open pieces open, the one used
+     longest ago is closed first */
+  int open_count, max_open;
+  u8 clock;
+#ifdef USE_THREADS
+  pthread_mutex_t pool_lock;
+#endif
+} SPLIT_SOURCE;
+
 /*
  * helper functions
  */
 
 static int analyze_file(SOURCE *s, int level);
 static u8 read_file(SOURCE *s, u8 pos, u8 len, void *buf);
+static void prefetch_file(SOURCE *s, u8 pos, u8 len);
 static void close_file(SOURCE *s);
+static u8 read_fd(int fd, u8 pos, u8 len, void *buf);
+
+static int first_segment_name(const char *name);
+static int next_segment_name(char *name);
+static int find_segment(SPLIT_SOURCE *ss, u8 pos);
+static int acquire_segment(SPLIT_SOURCE *ss, int i);
+static void release_segment(SPLIT_SOURCE *ss, int i);
+static u8 read_split(SOURCE *s, u8 pos, u8 len, void *buf);
+static void prefetch_split(SOURCE *s, u8 pos, u8 len);
+static void close_split(SOURCE *s);
+
+#if USE_MMAP
+static void init_file_map(FILE_SOURCE *fs);
+static void *map_file(SOURCE *s, u8 pos, u8 len);
+#endif
 
 #if USE_BINARY_SEARCH
 static int check_position(int fd, u8 pos);
@@ -83,8 +159,13 @@ SOURCE *init_file_source(int fd, int filekind)
   if (filekind != 0)  /* special treatment hook for devices */
     fs->c.analyze = analyze_file;
   fs->c.read_bytes = read_file;
+  fs->c.prefetch = prefetch_file;
   fs->c.close = close_file;
+  fs->c.concurrent = 1;
   fs->fd = fd;
+#if USE_MMAP && defined(USE_THREADS)
+  pthread_mutex_init(&fs->window_lock, NULL);
+#endif
 
   /*
    * Determine the size using various methods. The first method that
@@ -224,9 +305,99 @@ SOURCE *init_file_source(int fd, int filekind)
   }
 #endif
 
+#if USE_MMAP
+  /* regular files can be read without copying; devices keep using
+     reads, where a media error is reported instead of killing us */
+  if (fs->c.size_known && fs->c.size > 0 && filekind == 0)
+    init_file_map(fs);
+#endif
+
   return (SOURCE *)fs;
 }
 
+#if USE_MMAP
+
+/*
+ * set up memory mapping, either as a whole or on demand in windows
+ */
+
+static void init_file_map(FILE_SOURCE *fs)
+{
+  void *p;
+
+  if (fs->c.size <= MAP_WHOLE_LIMIT) {
+    p = mmap(NULL, (size_t)fs->c.size, PROT_READ, MAP_SHARED, fs->fd, 0);
+    if (p != MAP_FAILED) {
+      fs->map = p;
+      fs->c.map_bytes = map_file;
+      return;
+    }
+    if (errno == ENODEV || errno == EACCES)
+      return;  /* can't be mapped at all, use plain reads */
+  }
+
+  fs->window_count = (u4)((fs->c.size + MAP_WINDOW - 1) >> MAP_WINDOWBITS);
+  fs->windows = (void **)malloc(fs->window_count * sizeof(void *));
+  if (fs->windows == NULL)
+    return;
+  memset(fs->windows, 0, fs->window_count * sizeof(void *));
+  fs->c.map_bytes = map_file;
+}
+
+/*
+ * mapped access, returns NULL when the caller must use plain reads
+ */
+
+static void *map_file(SOURCE *s, u8 pos, u8 len)
+{
+  FILE_SOURCE *fs = (FILE_SOURCE *)s;
+  u4 window;
+  u8 start;
+  void *p;
+  struct stat sb;
+
+  /* NOTE: the buffer layer keeps pos + len within the size. The size is
+     checked when a mapping is made; like with any mapped reader, a
+     file that gets shorter while it is being read raises SIGBUS. */
+  if (fs->map != NULL)
+    return fs->map + pos;
+
+  if (len > MAP_OVERLAP)
+    return NULL;
+  window = (u4)(pos >> MAP_WINDOWBITS);
+  start = (u8)window << MAP_WINDOWBITS;
+
+#ifdef USE_THREADS
+  pthread_mutex_lock(&fs->window_lock);
+#endif
+  p = fs->windows[window];
+  if (p == NULL && fs->windows_mapped < MAP_MAX_WINDOWS &&
+      fstat(fs->fd, &sb) == 0 && (u8)sb.st_size >= s->size) {
+    p = mmap(NULL, (size_t)MINIMUM(MAP_WINDOW + MAP_OVERLAP, s->size - start),
+	     PROT_READ, MAP_SHARED, fs->fd, (off_t)start);
+    if (p != MAP_FAILED) {
+      fs->windows[window] = p;
+      fs->windows_mapped++;
+    } else {
+      /* don't try again */
+      fs->windows_mapped = MAP_MAX_WINDOWS;
+      p = NULL;
+    }
+  } else if (p == NULL) {
+    /* the file got shorter, don't map any more of it */
+    fs->windows_mapped = MAP_MAX_WINDOWS;
+  }
+#ifdef USE_THREADS
+  pthread_mutex_unlock(&fs->window_lock);
+#endif
+
+  if (p == NULL)
+    return NULL;
+  return p + (pos - start);
+}
+
+#endif
+
 /*
  * special handling hook: devices may have out-of-band structure
  */
@@ -245,24 +416,21 @@ static int analyze_file(SOURCE *s, int level)
 
 static u8 read_file(SOURCE *s, u8 pos, u8 len, void *buf)
 {
-  off_t result_seek;
+  return read_fd(((FILE_SOURCE *)s)->fd, pos, len, buf);
+}
+
+static u8 read_fd(int fd, u8 pos, u8 len, void *buf)
+{
   ssize_t result_read;
   char *p;
   u8 got;
-  int fd = ((FILE_SOURCE *)s)->fd;
-
-  /* seek to the requested position */
-  result_seek = lseek(fd, pos, SEEK_SET);
-  if (result_seek != pos) {
-    errore("Seek to %llu failed", pos);
-    return 0;
-  }
 
-  /* read from there */
+  /* read at the requested position, pread() leaves the file offset
+     alone so several threads can read at once */
   p = (char *)buf;
   got = 0;
   while (len > 0) {
-    result_read = read(fd, p, len);
+    result_read = pread(fd, p, len, (off_t)(pos + got));
     if (result_read < 0) {
       if (errno == EINTR || errno == EAGAIN)
 	continue;
@@ -281,16 +449,402 @@ static u8 read_file(SOURCE *s, u8 pos, u8 len, void *buf)
   return got;
 }
 
+/*
+ * read-ahead hint: the kernel starts reading all announced ranges in
+ * the background, so the detectors find them in the page cache
+ */
+
+static void prefetch_file(SOURCE *s, u8 pos, u8 len)
+{
+  FILE_SOURCE *fs = (FILE_SOURCE *)s;
+#if USE_MMAP && defined(MADV_WILLNEED)
+  u8 offset;
+  long pagesize;
+
+  if (fs->map != NULL) {
+    /* madvise() wants a page-aligned address */
+    pagesize = sysconf(_SC_PAGESIZE);
+    offset = (pagesize > 0) ? pos % pagesize : 0;
+    madvise(fs->map + pos - offset, (size_t)(len + offset), MADV_WILLNEED);
+    return;
+  }
+#endif
+#ifdef POSIX_FADV_WILLNEED
+  posix_fadvise(fs->fd, (off_t)pos, (off_t)len, POSIX_FADV_WILLNEED);
+#endif
+}
+
 /*
  * dispose of everything
  */
 
 static void close_file(SOURCE *s)
 {
-  int fd = ((FILE_SOURCE *)s)->fd;
+  FILE_SOURCE *fs = (FILE_SOURCE *)s;
+#if USE_MMAP
+  u4 window;
+  u8 start;
+
+  if (fs->map != NULL)
+    munmap(fs->map, (size_t)s->size);
+  if (fs->windows != NULL) {
+    for (window = 0; window < fs->window_count; window++) {
+      if (fs->windows[window] == NULL)
+	continue;
+      start = (u8)window << MAP_WINDOWBITS;
+      munmap(fs->windows[window],
+	     (size_t)MINIMUM(MAP_WINDOW + MAP_OVERLAP, s->size - start));
+    }
+    free(fs->windows);
+  }
+#ifdef USE_THREADS
+  pthread_mutex_destroy(&fs->window_lock);
+#endif
+#endif
 
-  if (fd >= 0)
-    close(fd);
+  if (fs->fd >= 0)
+    close(fs->fd);
+}
+
+/*
+ * split images: the pieces written by acquisition tools and split(1),
+ * named NAME.001, NAME.002, ... or NAME.aa, NAME.ab, ..., read as one
+ * image; PATHS lists them in order
+ */
+
+SOURCE *init_split_source(char **paths, int count)
+{
+  SPLIT_SOURCE *ss;
+  SPLIT_SEGMENT *seg;
+  struct stat sb;
+  long limit;
+  int i;
+
+  ss = (SPLIT_SOURCE *)malloc(sizeof(SPLIT_SOURCE));
+  if (ss == NULL)
+    bailout("Out of memory");
+  memset(ss, 0, sizeof(SPLIT_SOURCE));
+#ifdef USE_THREADS
+  pthread_mutex_init(&ss->pool_lock, NULL);
+#endif
+  ss->segments = (SPLIT_SEGMENT *)malloc(count * sizeof(SPLIT_SEGMENT));
+  if (ss->segments == NULL)
+    bailout("Out of memory");
+
+  for (i = 0; i < count; i++) {
+    if (stat(paths[i], &sb) < 0) {
+      errore("Can't stat %.300s", paths[i]);
+      break;
+    }
+    if (!S_ISREG(sb.st_mode)) {
+      error("%.300s: Split image piece is not a regular file", paths[i]);
+      break;
+    }
+    /* an empty piece means the acquisition went wrong, everything
+       after it would be in the wrong place */
+    if (sb.st_size == 0) {
+      error("%.300s: Split image piece is empty", paths[i]);
+      break;
+    }
+
+    seg = &ss->segments[ss->count++];
+    memset(seg, 0, sizeof(SPLIT_SEGMENT));
+    seg->path = (char *)malloc(strlen(paths[i]) + 1);
+    if (seg->path == NULL)
+      bailout("Out of memory");
+    strcpy(seg->path, paths[i]);
+    seg->start = ss->c.size;
+    seg->size = sb.st_size;
+    seg->fd = -1;
+    ss->c.size += sb.st_size;
+  }
+  if (i < count) {
+    close_split((SOURCE *)ss);
+    free(ss);
+    return NULL;
+  }
+
+  /* leave descriptors for other files analyzed at the same time */
+  ss->max_open = SPLIT_MAX_OPEN;
+  limit = sysconf(_SC_OPEN_MAX);
+  if (limit > 0 && limit / 4 < ss->max_open)
+    ss->max_open = (limit >= 8) ? (int)(limit / 4) : 1;
+
+  ss->c.size_known = 1;
+  ss->c.read_bytes = read_split;
+  ss->c.prefetch = prefetch_split;
+  ss->c.close = close_split;
+  ss->c.concurrent = 1;
+
+  return (SOURCE *)ss;
+}
+
+/*
+ * the pieces of the split image whose first piece is FIRST, up to the
+ * first name that doesn't exist; NULL if FIRST isn't named like a first
+ * piece
+ */
+
+char **find_split_pieces(const char *first, int *count)
+{
+  char **pieces, *name;
+  struct stat sb;
+  int capacity;
+
+  if (!first_segment_name(first))
+    return NULL;
+
+  pieces = NULL;
+  capacity = 0;
+  *count = 0;
+  name = (char *)malloc(strlen(first) + 1);
+  if (name == NULL)
+    bailout("Out of memory");
+  strcpy(name, first);
+  do {
+    if (*count > 0 && stat(name, &sb) < 0)
+      break;
+    if (*count == capacity) {
+      capacity = capacity ? capacity * 2 : 16;
+      pieces = (char **)realloc(pieces, capacity * sizeof(char *));
+      if (pieces == NULL)
+	bailout("Out of memory");
+    }
+    pieces[*count] = (char *)malloc(strlen(name) + 1);
+    if (pieces[*count] == NULL)
+      bailout("Out of memory");
+    strcpy(pieces[(*count)++], name);
+  } while (next_segment_name(name));
+  free(name);
+
+  return pieces;
+}
+
+void free_split_pieces(char **pieces, int count)
+{
+  int i;
+
+  for (i = 0; i < count; i++)
+    free(pieces[i]);
+  free(pieces);
+}
+
+/*
+ * name checks: the first piece ends in .001 (any number of digits) or
+ * .aa (any number of letters)
+ */
+
+static int first_segment_name(const char *name)
+{
+  const char *suffix;
+  size_t len;
+
+  suffix = strrchr(name, '.');
+  if (suffix == NULL)
+    return 0;
+  suffix++;
+  len = strlen(suffix);
+  if (len < 2)
+    return 0;
+
+  if (strspn(suffix, "0") == len - 1 && suffix[len - 1] == '1')
+    return 1;
+  if (strspn(suffix, "a") == len)
+    return 1;
+  return 0;
+}
+
+/*
+ * step the name suffix on like a counter, 0 when it runs out
+ */
+
+static int next_segment_name(char *name)
+{
+  char *p, *suffix;
+  char first, last;
+
+  suffix = strrchr(name, '.') + 1;
+  if (isdigit((unsigned char)*suffix)) {
+    first = '0';
+    last = '9';
+  } else {
+    first = 'a';
+    last = 'z';
+  }
+
+  for (p = suffix + strlen(suffix) - 1; p >= suffix; p--) {
+    if (*p != last) {
+      (*p)++;
+      return 1;
+    }
+    *p = first;
+  }
+  return 0;
+}
+
+/*
+ * the piece holding the given position, by binary search over the
+ * start offsets
+ */
+
+static int find_segment(SPLIT_SOURCE *ss, u8 pos)
+{
+  int lower, upper, middle;
+
+  lower = 0;
+  upper = ss->count - 1;
+  while (lower < upper) {
+    middle = (lower + upper + 1) / 2;
+    if (ss->segments[middle].start <= pos)
+      lower = middle;
+    else
+      upper = middle - 1;
+  }
+  return lower;
+}
+
+/*
+ * descriptor pool: open a piece for reading, closing the one used
+ * longest ago when too many are open already
+ */
+
+static int acquire_segment(SPLIT_SOURCE *ss, int i)
+{
+  SPLIT_SEGMENT *seg = &ss->segments[i];
+  int fd, j, victim;
+
+#ifdef USE_THREADS
+  pthread_mutex_lock(&ss->pool_lock);
+#endif
+  if (seg->fd < 0 && !seg->failed) {
+    while (ss->open_count >= ss->max_open) {
+      victim = -1;
+      for (j = 0; j < ss->count; j++) {
+	if (ss->segments[j].fd >= 0 && ss->segments[j].users == 0 &&
+	    (victim < 0 ||
+	     ss->segments[j].last_use < ss->segments[victim].last_use))
+	  victim = j;
+      }
+      if (victim < 0)
+	break;  /* all of them are being read, go over for a moment */
+      close(ss->segments[victim].fd);
+      ss->segments[victim].fd = -1;
+      ss->open_count--;
+    }
+
+    seg->fd = open(seg->path, O_RDONLY);
+    if (seg->fd < 0) {
+      seg->failed = 1;
+      errore("Can't open %.300s", seg->path);
+    } else
+      ss->open_count++;
+  }
+
+  fd = seg->fd;
+  if (fd >= 0) {
+    seg->users++;
+    seg->last_use = ++ss->clock;
+  }
+#ifdef USE_THREADS
+  pthread_mutex_unlock(&ss->pool_lock);
+#endif
+
+  return fd;
+}
+
+static void release_segment(SPLIT_SOURCE *ss, int i)
+{
+#ifdef USE_THREADS
+  pthread_mutex_lock(&ss->pool_lock);
+#endif
+  ss->segments[i].users--;
+#ifdef USE_THREADS
+  pthread_mutex_unlock(&ss->pool_lock);
+#endif
+}
+
+/*
+ * raw read, split where the request crosses from one piece into the
+ * next
+ */
+
+static u8 read_split(SOURCE *s, u8 pos, u8 len, void *buf)
+{
+  SPLIT_SOURCE *ss = (SPLIT_SOURCE *)s;
+  SPLIT_SEGMENT *seg;
+  char *p;
+  u8 got, offset, chunk, result;
+  int i, fd;
+
+  p = (char *)buf;
+  got = 0;
+  for (i = find_segment(ss, pos); len > 0 && i < ss->count; i++) {
+    seg = &ss->segments[i];
+    offset = pos + got - seg->start;
+    if (offset >= seg->size)
+      break;
+    chunk = MINIMUM(len, seg->size - offset);
+
+    fd = acquire_segment(ss, i);
+    if (fd < 0)
+      break;
+    result = read_fd(fd, offset, chunk, p);
+    release_segment(ss, i);
+
+    got += result;
+    p += result;
+    len -= result;
+    if (result < chunk)
+      break;  /* the piece got shorter since we looked */
+  }
+
+  return got;
+}
+
+/*
+ * read-ahead hint, passed on to each piece in the range
+ */
+
+static void prefetch_split(SOURCE *s, u8 pos, u8 len)
+{
+#ifdef POSIX_FADV_WILLNEED
+  SPLIT_SOURCE *ss = (SPLIT_SOURCE *)s;
+  SPLIT_SEGMENT *seg;
+  u8 offset, chunk;
+  int i, fd;
+
+  for (i = find_segment(ss, pos); len > 0 && i < ss->count; i++) {
+    seg = &ss->segments[i];
+    offset = pos - seg->start;
+    if (offset >= seg->size)
+      break;
+    chunk = MINIMUM(len, seg->size - offset);
+
+    fd = acquire_segment(ss, i);
+    if (fd >= 0) {
+      posix_fadvise(fd, (off_t)offset, (off_t)chunk, POSIX_FADV_WILLNEED);
+      release_segment(ss, i);
+    }
+    pos += chunk;
+    len -= chunk;
+  }
+#endif
+}
+
+static void close_split(SOURCE *s)
+{
+  SPLIT_SOURCE *ss = (SPLIT_SOURCE *)s;
+  int i;
+
+  for (i = 0; i < ss->count; i++) {
+    if (ss->segments[i].fd >= 0)
+      close(ss->segments[i].fd);
+    free(ss->segments[i].path);
+  }
+  free(ss->segments);
+#ifdef USE_THREADS
+  pthread_mutex_destroy(&ss->pool_lock);
+#endif
 }
 
 /*
@@ -314,4 +868,122 @@ static int check_position(int fd, u8 pos)
 }
 #endif
 
+#ifdef JSON
+
+/* Pieces of a split image in a temporary directory, sizes in order.
+ * The image holds the test pattern.
+ */
+#define TEST_SPLIT_PIECES (4)
+
+static const u8 test_split_sizes[TEST_SPLIT_PIECES] = {
+    1000, 3000, 24, 2000
+};
+
+void test_file()
+{
+    char dir[] = "/tmp/disktype-test-XXXXXX";
+    char path[TEST_SPLIT_PIECES][64], name[64];
+    unsigned char data[4096];
+    SPLIT_SOURCE *ss;
+    SOURCE *s;
+    u8 pos = 0;
+    FILE *f;
+    char **pieces;
+    int fd, count;
+
+    /* Piece names count up, numbers and letters alike. */
+    strcpy(name, "disk.009");
+    assert(next_segment_name(name) && strcmp(name, "disk.010") == 0);
+    strcpy(name, "disk.999");
+    assert(!next_segment_name(name));
+    strcpy(name, "disk.az");
+    assert(next_segment_name(name) && strcmp(name, "disk.ba") == 0);
+    strcpy(name, "disk.zz");
+    assert(!next_segment_name(name));
+    assert(first_segment_name("disk.001") && first_segment_name("disk.01"));
+    assert(first_segment_name("disk.aa") && first_segment_name("x.img.aaa"));
+    assert(!first_segment_name("disk.002") && !first_segment_name("disk.ab"));
+    assert(!first_segment_name("disk.img") && !first_segment_name("disk.1"));
+    assert(!first_segment_name("dir.001/disk"));
+
+    assert(mkdtemp(dir) != NULL);
+    for (int k = 0; k < TEST_SPLIT_PIECES; k++)
+    {
+        sprintf(path[k], "%s/disk.%03d", dir, k + 1);
+        f = fopen(path[k], "wb");
+        assert(f != NULL);
+        for (u8 i = 0; i < test_split_sizes[k]; i++)
+        {
+            data[i] = test_image_pattern(pos + i);
+        }
+        assert(fwrite(data, 1, test_split_sizes[k], f) == test_split_sizes[k]);
+        fclose(f);
+        pos += test_split_sizes[k];
+    }
+
+    /* The pieces are found from the first one. */
+    assert(find_split_pieces(path[2], &count) == NULL);
+    pieces = find_split_pieces(path[0], &count);
+    assert(pieces != NULL && count == TEST_SPLIT_PIECES);
+    for (int k = 0; k < TEST_SPLIT_PIECES; k++)
+    {
+        assert(strcmp(pieces[k], path[k]) == 0);
+    }
+    s = init_split_source(pieces, count);
+    assert(s != NULL && s->size_known && s->size == pos);
+    ss = (SPLIT_SOURCE *) s;
+    assert(ss->count == TEST_SPLIT_PIECES);
+    ss->max_open = 2;
+
+    /* Reads are split where they cross pieces, the 24 byte piece is
+       crossed as a whole, and no more than two pieces stay open. */
+    check_test_read(s, 0, pos, NULL);
+    assert(ss->open_count <= 2);
+    check_test_read(s, 990, 20, NULL);
+    check_test_read(s, 3990, 100, NULL);
+    assert(ss->open_count <= 2);
+    check_test_read(s, 4000, 24, NULL);
+    assert(s->read_bytes(s, 6000, 100, data) == 24);
+    check_test_read(s, 6000, 24, NULL);
+    check_test_read(s, 500, 10, NULL);
+    assert(ss->open_count <= 2 && ss->segments[0].fd >= 0);
+    s->prefetch(s, 900, 5000);
+    assert(ss->open_count <= 2);
+    close_source(s);
+
+    /* An empty piece would shift everything after it. */
+    assert(truncate(path[1], 0) == 0);
+    assert(init_split_source(pieces, count) == NULL);
+    free_split_pieces(pieces, count);
+
+    /* The pieces end before a missing one. */
+    unlink(path[2]);
+    pieces = find_split_pieces(path[0], &count);
+    assert(pieces != NULL && count == 2);
+    free_split_pieces(pieces, count);
+
+    for (int k = 0; k < TEST_SPLIT_PIECES; k++)
+    {
+        unlink(path[k]);
+    }
+
+    /* Regular files are mapped with the size they have when opened. */
+    f = fopen(path[0], "wb");
+    assert(f != NULL);
+    memset(data, 'x', sizeof(data));
+    assert(fwrite(data, 1, sizeof(data), f) == sizeof(data));
+    fclose(f);
+    fd = open(path[0], O_RDONLY);
+    assert(fd >= 0);
+    s = init_file_source(fd, 0);
+    assert(s->size == sizeof(data) && s->map_bytes != NULL);
+    assert(memcmp(s->map_bytes(s, 1024, 1024), data + 1024, 1024) == 0);
+    close_source(s);
+    unlink(path[0]);
+
+    rmdir(dir);
+}
+
+#endif
+
 /* EOF */
@@ -54,6 +54,19 @@
 #include <sys/time.h>
 #include <fcntl.h>
 
+#ifdef USE_THREADS
+#include <pthread.h>
+#endif
+
+
+/* Per-thread variables, only needed when several files may be
+ * analyzed at once (see the -j option).
+ */
+#ifdef USE_THREADS
+#define THREAD_LOCAL __thread
+#else
+#define THREAD_LOCAL
+#endif
 
 /* constants */
 
@@ -79,11 +92,18 @@ typedef struct source {
   u8 seq_pos;
   int blocksize;
   struct source *foundation;
+  /* set if the read functions may be called from several threads */
+  int concurrent;
 
   int (*analyze)(struct source *s, int level);
   u8 (*read_bytes)(struct source *s, u8 pos, u8 len, void *buf);
   int (*read_block)(struct source *s, u8 pos, void *buf);
+  void *(*map_bytes)(struct source *s, u8 pos, u8 len);
+  void (*prefetch)(struct source *s, u8 pos, u8 len);
   void (*close)(struct source *s);
+  /* for sequential sources: start over at position 0, returns 0 if
+     that's not possible */
+  int (*rewind)(struct source *s);
 
   /* private data may follow */
 } SOURCE;
@@ -96,6 +116,26 @@ typedef struct section {
 
 typedef void (*DETECTOR)(SECTION *section, int level);
 
+/* A unit of work for the task pool, see task.c. GROUP counts the tasks
+ * that still have to finish.
+ */
+typedef struct task_group {
+  int pending;
+} TASK_GROUP;
+
+typedef struct task {
+  void (*run)(struct task *t);
+  TASK_GROUP *group;
+  struct task *above, *below;
+
+  /* private data may follow */
+} TASK;
+
+/* Memory that is released all at once, see arena.c. */
+typedef struct arena {
+  void *blocks;
+} ARENA;
+
 
 #ifdef JSON
 
@@ -108,11 +148,15 @@ typedef struct {
 
 /* String functions */
 void initialize_String(String *s, size_t init_size);
+void reserve_String(String *str, size_t extra);
 void insert_chars(String *str, char insert[]);
+void insert_n_chars(String *str, const char *insert, size_t length);
 void insert_single_char(String *str, char element);
 void insert_string(String *str, String *insert);
+void insert_printf(String *str, const char *format, ...);
 void extract_chars(String *str, char chars[]);
 void free_String(String *s);
+void arena_String(String *str, ARENA *arena, char chars[]);
 
 
 /* Specific information about a detected object is stored in its properties.
@@ -148,6 +192,10 @@ struct property
  *           objects intact.
  *           A parent_id of -1 indicates no existing parent.
  *
+ * FIRST_CHILD and NEXT_SIBLING link the objects to a tree when it is
+ *             converted to JSON: the first sub-object and the next object
+ *             in the same content list, -1 if there's none.
+ *
  * OBJECT_TYPE refers to the name of this type of object. 
  *             Say 'FAT12', 'ReiserFS' or 'FreeBSD boot loader'...
  *
@@ -155,7 +203,9 @@ struct property
  *          E.g. 'Q3063042' for FAT12.
  * 
  * NUMBER_OF_PROPERTIES is the number of properties assigned to this object.
- *                      It may not be larger than 100.
+ *
+ * PROPERTY_CAPACITY is the number of properties there is room for
+ *                   in PROPERTIES, which grows as needed.
  */
 struct content_object
 {
@@ -165,13 +215,19 @@ struct content_object
   
   int parent_id;
 
+  int first_child;
+
+  int next_sibling;
+
   String object_type;
 
   String wikidata;
   
   int number_of_properties;
+
+  int property_capacity;
   
-  struct property properties[100];
+  struct property *properties;
 
 };
 
@@ -181,7 +237,8 @@ struct content_object
  *
  * FILE_KIND contains the kind of file handed to disktype.
  *           It's domain is:
- *           {Regular file, Block device, Character device, Unknown kind}
+ *           {Regular file, Split image, Block device, Character device,
+ *            Unknown kind}
  *
  * PATH is the current location of the file.
  *
@@ -190,12 +247,19 @@ struct content_object
  *      is not enough.
  *
  * NUMBER_OF_OBJECTS contains the number of content objects found in content.
+ *
+ * OBJECT_CAPACITY is the number of objects there is room for in CONTENT,
+ *                 which grows as needed.
  * 
  * CONTENT contains all the objects found in the file.
  *         Those may be file systems, partitions, boot loaders, ...
  *
+ * ARENA provides the memory for the content objects, their properties
+ *       and all Strings above. It is released in one step once the file
+ *       is done.
+ *
  */
-extern struct file_info 
+struct file_info 
 {
   String file_kind;
   
@@ -204,10 +268,14 @@ extern struct file_info
   unsigned long long int size;
   
   int number_of_objects;
+
+  int object_capacity;
   
-  struct content_object content[500];
+  struct content_object *content;
+
+  ARENA arena;
 
-}given_file;
+};
 
 
 /* There's an option to interpret textual properties
@@ -237,12 +305,26 @@ void add_property_u8(char key[], u8 value);
 
 void add_property_endianness(int endianness);
 
+void insert_content_objects(int at, struct file_info *from);
 
-void convert_to_json();
+void relink_content_objects(int from);
 
-void reset_json();
+/* Where convert_to_json() writes the document to. WRITE is called with
+ * TARGET for every piece of the document, see json_sink_file() and
+ * json_sink_string().
+ */
+typedef struct json_sink {
+  void (*write)(void *target, const char *data, size_t length);
+  void *target;
+} JSON_SINK;
 
-extern char json_output[];
+void json_sink_file(JSON_SINK *sink, FILE *f);
+
+void json_sink_string(JSON_SINK *sink, String *str);
+
+void convert_to_json(JSON_SINK *sink);
+
+void reset_json();
 
 
 /* test.c */
@@ -250,15 +332,70 @@ void test();
 
 int equal_chars(char* first, char* second);
 
+/* An image in memory, to be read through by the tests of the sources
+ * that translate positions. READS counts the calls of map_bytes, each
+ * get_buffer_real() from the image makes one. HINTS and HINT_LEN add
+ * up the calls of prefetch and the bytes they announce.
+ */
+typedef struct test_image {
+    SOURCE c;
+    unsigned char *data;
+    int reads, hints;
+    u8 hint_len;
+} TEST_IMAGE;
+
+void init_test_image(TEST_IMAGE *image, unsigned char *data, u8 size);
+unsigned char test_image_pattern(u8 pos);
+void init_test_section(SECTION *section, TEST_IMAGE *image);
+void check_test_read(SOURCE *s, u8 pos, u8 len, int (*zero)(u8 pos));
+void check_test_read_all(SOURCE *s, u8 step, int (*zero)(u8 pos));
+int count_test_reads(TEST_IMAGE *image, SOURCE *s, u8 pos, u8 len,
+                     int (*zero)(u8 pos));
+void put_test_be(unsigned char *to, u8 value, int len);
+void put_test_le(unsigned char *to, u8 value, int len);
+
 /* amiga.c */
 void test_amiga();
 
+/* arena.c */
+void test_arena();
+
+/* buffer.c */
+void test_buffer();
+
 /* cdaccess.c */
 void test_cdaccess();
 
+/* decompress.c */
+void test_decompress();
+
 /* vpc.c */
 void test_vpc();
 
+/* qcow.c */
+void test_qcow();
+
+/* vmdk.c */
+void test_vmdk();
+
+/* vhdx.c */
+void test_vhdx();
+
+/* udif.c */
+void test_udif();
+
+/* cloop.c */
+void test_cloop();
+
+/* lvm.c */
+void test_lvm();
+
+/* md.c */
+void test_md();
+
+/* file.c */
+void test_file();
+
 /* json.c */
 void test_json();
 
@@ -269,6 +406,45 @@ void test_string();
 #endif
 
 
+/* Everything belonging to the analysis of one given file.
+ * Each file gets an analysis of its own, which is owned by the thread
+ * working on it and found through CURRENT_ANALYSIS.
+ *
+ * FILE collects the detected information.
+ *
+ * PATH is the name of the file as it was given.
+ *
+ * STOP_FLAG is set by stop_detect() to end the current detection loop.
+ *
+ * LINE_AKKU holds a line while it is put together by start_line() and
+ * continue_line().
+ *
+ * SPAWNED collects the sections handed to the task pool by the detector
+ * currently running, see analyze_recursive().
+ */
+typedef struct analysis {
+#ifdef JSON
+  struct file_info file;
+#endif
+
+  const char *path;
+
+  int stop_flag;
+
+  struct section_tasks *spawned;
+
+  char line_akku[4096];
+} ANALYSIS;
+
+extern THREAD_LOCAL ANALYSIS *current_analysis;
+
+#ifdef JSON
+/* The information gathered about the file currently analyzed. */
+#define given_file (current_analysis->file)
+#endif
+
+ANALYSIS *new_analysis(void);
+void free_analysis(ANALYSIS *a);
 
 
 /* detection dispatching functions */
@@ -279,17 +455,72 @@ void analyze_recursive(SECTION *section, int level,
 		       u8 rel_pos, u8 size, int flags);
 void stop_detect(void);
 
+/* arena functions */
+
+void *arena_alloc(ARENA *arena, size_t size);
+void arena_adopt(ARENA *arena, ARENA *from);
+void arena_release(ARENA *arena);
+
+/* task pool functions */
+
+void start_task_pool(int threads);
+int task_pool_active(void);
+void spawn_task(TASK *t, TASK_GROUP *group);
+void wait_task_group(TASK_GROUP *group);
+void wait_task_group_io(TASK_GROUP *group);
+
 /* file source functions */
 
 SOURCE *init_file_source(int fd, int filekind);
+SOURCE *init_split_source(char **paths, int count);
+char **find_split_pieces(const char *first, int *count);
+void free_split_pieces(char **pieces, int count);
+
+/* decompression source functions, FORMAT is one of these */
+
+#define DECOMPRESS_NONE (0)
+#define DECOMPRESS_GZIP (1)
+#define DECOMPRESS_BZIP2 (2)
+#define DECOMPRESS_XZ (3)
+#define DECOMPRESS_ZSTD (4)
+#define DECOMPRESS_LZ4 (5)
+
+SOURCE *init_decompress_source(SOURCE *foundation, u8 offset, u8 size,
+			       int format);
+extern int gzip_index;
 
 int analyze_cdaccess(int fd, SOURCE *s, int level);
 
+/* Linux MD RAID functions. An array is put together from the members
+ * among the files given, see md.c. NAME stands in for its path.
+ */
+typedef struct md_array {
+  struct md_array *next;
+  char name[64];
+
+  /* private data follows */
+} MD_ARRAY;
+
+MD_ARRAY *assemble_md_arrays(char *paths[], int count);
+void analyze_md_array(MD_ARRAY *md);
+void free_md_arrays(MD_ARRAY *arrays);
+
+/* LVM2 volume group functions */
+
+void analyze_lvm2_metadata(SECTION *section, int level,
+			   const char *text, u8 len, const char *pv_id);
+
 /* buffer functions */
 
 u8 get_buffer(SECTION *section, u8 pos, u8 len, void **buf);
 u8 get_buffer_real(SOURCE *s, u8 pos, u8 len, void *inbuf, void **outbuf);
+void prefetch_buffer(SECTION *section, u8 pos, u8 len);
+void stage_buffer(SECTION *section, u8 pos, u8 len);
 void close_source(SOURCE *s);
+void set_cache_limit(u8 bytes);
+void pin_frame_enter(void);
+void pin_frame_leave(void);
+void pin_stack_release(void);
 
 /* output functions */
 
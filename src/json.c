@@ -34,14 +34,65 @@
 // ARRANGE DATA
 // ---------------------------------------------------------------------
 
-/* Counter providing the next content object id. */
-int id = 0;
-
-/* Counter for the number of properties the latest content object has. */
-int property_counter = 0;
+/* The id of the next content object is given_file.number_of_objects,
+ * the properties of the latest one are counted in its
+ * number_of_properties.
+ *
+ * All memory for the objects comes from the arena of given_file.
+ * Growing a list takes a new, twice as large piece of it, the old one
+ * is simply left behind until the arena is released.
+ */
 
 char *clean_char(unsigned char value[]);
 
+
+/* Local function that makes room for COUNT more content objects. */
+void reserve_content_objects(int count)
+{
+    int capacity = given_file.object_capacity;
+    struct content_object *content;
+
+    if (given_file.number_of_objects + count <= capacity) {return;}
+
+    capacity = capacity ? capacity * 2 : 16;
+    while (capacity < given_file.number_of_objects + count)
+    {
+        capacity *= 2;
+    }
+
+    content = arena_alloc(&given_file.arena,
+                          capacity * sizeof(struct content_object));
+    if (given_file.number_of_objects > 0)
+    {
+        memcpy(content, given_file.content,
+               given_file.number_of_objects * sizeof(struct content_object));
+    }
+
+    given_file.content = content;
+    given_file.object_capacity = capacity;
+}
+
+/* Local function that makes room for one more property of OBJ. */
+void reserve_property(struct content_object *obj)
+{
+    int capacity = obj->property_capacity;
+    struct property *properties;
+
+    if (obj->number_of_properties < capacity) {return;}
+
+    capacity = capacity ? capacity * 2 : 8;
+    properties = arena_alloc(&given_file.arena,
+                             capacity * sizeof(struct property));
+    if (obj->number_of_properties > 0)
+    {
+        memcpy(properties, obj->properties,
+               obj->number_of_properties * sizeof(struct property));
+    }
+
+    obj->properties = properties;
+    obj->property_capacity = capacity;
+}
+
 /* This function stores directory and name of the given file.
  * 
  * PATH is the current location of the file including it's name.
@@ -51,17 +102,12 @@ void add_file_path(char path[])
     /* If the latin1 option is disabled clean_char() will just return 'path'. */
     char *u_path = clean_char((unsigned char *) path);
     
-    int len = strlen(u_path);
-    initialize_String(&given_file.path, len+1);
+    arena_String(&given_file.path, &given_file.arena, u_path);
 
-    /* Copy the string char by char including the ending char '\0'. */
-    for (int i = 0; i < len+1; i++)
+    if (u_path != path)
     {
-        given_file.path.string[i] = u_path[i];
+        free(u_path);
     }
-
-    /* Note that the string is full. */
-    given_file.path.used_size = len+1;
 }
 
 
@@ -69,41 +115,51 @@ void add_file_path(char path[])
  * 
  * FILE_KIND contains the kind of file handed to disktype.
  *           It's domain is:
- *           {Regular file, Block device, Character device, Unknown kind}
+ *           {Regular file, Split image, Block device, Character device,
+ *            Unknown kind}
  * 
- * SIZE is the size of the file in bytes.
+ * SIZE is the size of the file in bytes, NULL if it is unknown.
  * 
  */
 void add_file_characteristics(char file_kind[], unsigned long long int *size)
 {
-    initialize_String(&given_file.file_kind, 3);
-    insert_chars(&given_file.file_kind, file_kind);
-    given_file.size = *size;
+    arena_String(&given_file.file_kind, &given_file.arena, file_kind);
+    given_file.size = (size != NULL) ? *size : 0;
 }
 
 
-/* Local function that identifies the parent of an object using it's
- * level and the list of content objects.
+/* Local function that identifies the parent of the object at position ID
+ * using it's level and the objects before it in the list.
  * If there's no parent, the function returns -1.
  *
+ * The parent is the closest object before ID with a lower level. Only the
+ * object right before ID and its ancestors can be that one, every object
+ * in between two of them has a level at least as high as the later one.
+ * So the search climbs up the parents instead of going through the list,
+ * and objects it climbs over are never looked at again by later searches.
+ *
  * LEVEL references the former indent of the print statement of this object.
  */
-int identify_parent_id(int level)
+int find_parent_id(int id, int level)
 {
   /* The first object can't have a parent. */
   if (id == 0 || level == 0) {return -1;}
  
-  /* Iterate backwards through the content list */
-  for (int i = id - 1; i > -1; i--)
+  /* the first object with a level lower than this one's is the parent. */
+  int i = id - 1;
+  while (i > -1 && given_file.content[i].level >= level)
   {
-      /* the first object with a level lower than this one's is the parent. */
-      if (given_file.content[i].level < level) 
-      {
-          return i;
-      }
+      i = given_file.content[i].parent_id;
   }
-  /* No parent has been found. */
-  return -1;
+  return i;
+}
+
+/* Identifies the parent of a new object with the given level,
+ * see find_parent_id().
+ */
+int identify_parent_id(int level)
+{
+  return find_parent_id(given_file.number_of_objects, level);
 }
 
 
@@ -128,14 +184,16 @@ char *clean_char(unsigned char value[])
      * That says an array 7 times as large as the given one will definitely
      * be large enough to contain the cleaned one.
      */
-    char* clean = malloc(MAX(1, ((int) strlen((char *) value) * 7)) 
-                         * sizeof(char));
+    char* clean;
     
     /* If the latin1 assumption is deactivated, we can't clean anything. */
     if (!latin1)
     {
         return (char*) value;
     }
+
+    clean = malloc(MAX(1, ((int) strlen((char *) value) * 7)) 
+                   * sizeof(char));
     
     /* Since we will escape illegal chars, the index of the clean (output)
      * array is not identical to the one of the input. */
@@ -216,26 +274,78 @@ char *clean_char(unsigned char value[])
  */
 void add_content_object(int level, char object_type[], char wikidata[])
 {
+  int id = given_file.number_of_objects;
+
+  reserve_content_objects(1);
+
   /* Create a new content object with the given values. */
   given_file.content[id].id = id;
   given_file.content[id].level = level;
   given_file.content[id].parent_id = identify_parent_id(level);
   
   /* object type */
-  initialize_String(&given_file.content[id].object_type, 25);
-  insert_chars(&given_file.content[id].object_type, object_type);
+  arena_String(&given_file.content[id].object_type, &given_file.arena,
+               object_type);
   
   /* wikidata */
-  initialize_String(&given_file.content[id].wikidata, 25);
-  insert_chars(&given_file.content[id].wikidata, wikidata);
+  arena_String(&given_file.content[id].wikidata, &given_file.arena,
+               wikidata);
   
-  /* Reset property counter. */
-  property_counter = 0;
+  /* No properties yet. */
   given_file.content[id].number_of_properties = 0;
-  given_file.number_of_objects++;
-  
+  given_file.content[id].property_capacity = 0;
+  given_file.content[id].properties = NULL;
+
   /* Increment content object counter for a new id for the next object. */
-  id += 1;
+  given_file.number_of_objects++;
+}
+
+
+/* This function moves all content objects found in a separately analyzed
+ * part of the file into the content list, in front of the object at
+ * position AT. Sections analyzed by the task pool are put back in place
+ * this way, see analyze_recursive().
+ *
+ * The moved objects keep their levels, ids and parents have to be fixed
+ * with relink_content_objects() afterwards.
+ *
+ * FROM is left empty, given_file takes over its arena.
+ */
+void insert_content_objects(int at, struct file_info *from)
+{
+    int count = from->number_of_objects;
+
+    if (count == 0) {return;}
+
+    reserve_content_objects(count);
+
+    memmove(&given_file.content[at + count], &given_file.content[at],
+            (given_file.number_of_objects - at)
+            * sizeof(struct content_object));
+    memcpy(&given_file.content[at], from->content,
+           count * sizeof(struct content_object));
+
+    given_file.number_of_objects += count;
+    from->number_of_objects = 0;
+
+    /* The objects' Strings and properties live in FROM's arena. */
+    arena_adopt(&given_file.arena, &from->arena);
+    from->content = NULL;
+    from->object_capacity = 0;
+}
+
+/* Recalculates ids and parents of all objects from position FROM on,
+ * after objects were inserted there. The objects before FROM keep theirs,
+ * which is all find_parent_id() relies on.
+ */
+void relink_content_objects(int from)
+{
+    for (int i = from; i < given_file.number_of_objects; i++)
+    {
+        given_file.content[i].id = i;
+        given_file.content[i].parent_id =
+            find_parent_id(i, given_file.content[i].level);
+    }
 }
 
 
@@ -256,11 +366,13 @@ void add_content_object(int level, char object_type[], char wikidata[])
  */
 void add_property(char key[], char value[])
 {
+  int id = given_file.number_of_objects;
+  int property_counter;
+
   /* Make sure, the object even exists. */
   assert(id > 0);
 
-  /* There can't and won't be more than 100 properties for a single object. */
-  assert(property_counter < 100);
+  property_counter = given_file.content[id-1].number_of_properties;
   
   /* Make sure the property doesn't exist already. */
   for (int index = 0; index < property_counter; index++)
@@ -280,20 +392,21 @@ void add_property(char key[], char value[])
   char *clean_value = clean_char((unsigned char *) value);
 
   /* id-1 is the latest content object, where this property belongs to */
+  reserve_property(&given_file.content[id-1]);
   
   /* Add property key */
-  initialize_String(&given_file.content[id-1]
-                    .properties[property_counter].key, 4);
-  insert_chars(&given_file.content[id-1]
-               .properties[property_counter].key, key);
+  arena_String(&given_file.content[id-1].properties[property_counter].key,
+               &given_file.arena, key);
 
   /* Add property value */
-  initialize_String(&given_file.content[id-1]
-                    .properties[property_counter].value, 4);
-  insert_chars(&given_file.content[id-1]
-               .properties[property_counter].value, clean_value);
+  arena_String(&given_file.content[id-1].properties[property_counter].value,
+               &given_file.arena, clean_value);
+
+  if (clean_value != value)
+  {
+      free(clean_value);
+  }
 
-  property_counter += 1;
   given_file.content[id-1].number_of_properties++;
 }
 
@@ -382,61 +495,118 @@ void add_property_endianness(int endianness)
 // CONVERT TO JSON
 // ---------------------------------------------------------------------
 
-/* The String holding the output text while it's under construction */
-String json;
+/* The document is written piece by piece while the content list is
+ * walked. The pieces are collected in the buffer of a JSON_WRITER and
+ * handed to the sink whenever it is full, so the memory needed doesn't
+ * depend on the number of objects found.
+ */
+#define JSON_BUFFER_SIZE (4096)
 
-/* The output text once it's finished */
-char json_output[] = "";
+typedef struct json_writer {
+    JSON_SINK *sink;
+    size_t used;
+    char buffer[JSON_BUFFER_SIZE];
+} JSON_WRITER;
 
-/* Content objects within a content list are seperated by commas.
- * According to JSON there's no comma neither at the beginning nor
- * at the end of the list.
- * 
- * Therefore, whenever a new list is started, this has to be noted
- * in order to leave out the comma at the very beginning.
+
+/* Local function that hands the buffered text to the sink. */
+void flush_json(JSON_WRITER *w)
+{
+    if (w->used > 0)
+    {
+        (*w->sink->write)(w->sink->target, w->buffer, w->used);
+        w->used = 0;
+    }
+}
+
+/* Local function that writes LENGTH chars of DATA. */
+void write_json(JSON_WRITER *w, const char *data, size_t length)
+{
+    /* Anything larger than the buffer goes to the sink directly. */
+    if (length >= JSON_BUFFER_SIZE)
+    {
+        flush_json(w);
+        (*w->sink->write)(w->sink->target, data, length);
+        return;
+    }
+
+    if (w->used + length > JSON_BUFFER_SIZE)
+    {
+        flush_json(w);
+    }
+    memcpy(w->buffer + w->used, data, length);
+    w->used += length;
+}
+
+/* Local function that writes a char array. */
+void write_json_chars(JSON_WRITER *w, const char *chars)
+{
+    write_json(w, chars, strlen(chars));
+}
+
+/* Local function that writes the chars of a String.
+ * A String that has never been set is written as an empty one.
  */
-//int new_content_list = 1;
+void write_json_string(JSON_WRITER *w, String *str)
+{
+    if (str->string != NULL && str->used_size > 1)
+    {
+        write_json(w, str->string, str->used_size - 1);
+    }
+}
 
 
-/* Add file kind, path and size of the file to the json String. */
-void add_file_characteristics_json()
-{    
-    /* The following statements will add text to the json String. */
-    
-    /* {"file kind": " */
-    insert_chars(&json, "{\"file kind\": \"");
+/* Sink writing to a stdio stream. */
+static void write_to_file(void *target, const char *data, size_t length)
+{
+    fwrite(data, 1, length, (FILE *) target);
+}
 
-    /* <file_kind> */
-    insert_string(&json, &given_file.file_kind);
+/* Sink appending to a String, which has to be initialized. */
+static void write_to_String(void *target, const char *data, size_t length)
+{
+    insert_n_chars((String *) target, data, length);
+}
 
-    /* ", "path": " */
-    insert_chars(&json, "\", \"path\": \"");
+/* Prepares SINK to write the document to the stream F. */
+void json_sink_file(JSON_SINK *sink, FILE *f)
+{
+    sink->write = write_to_file;
+    sink->target = f;
+}
 
-    /* <path> */
-    insert_string(&json, &given_file.path);
+/* Prepares SINK to append the document to the String STR. */
+void json_sink_string(JSON_SINK *sink, String *str)
+{
+    sink->write = write_to_String;
+    sink->target = str;
+}
 
-    /* ", "size": " */
-    insert_chars(&json, "\", \"size\": \"");
-    
-    /* Calculate number of digits of the size */
-    int digits = floor(log10(given_file.size)) + 1;
-    
-    /* Create a String temporarily storing the size */
-    String size;
-    initialize_String(&size, 100);
-    sprintf(size.string, "%llud", given_file.size);
-    size.used_size = digits;
-    size.total_size = digits;
-    
-    /* <size> */
-    insert_string(&json, &size);
-    
-    /* ", "content": [ */
-    insert_chars(&json, "\", \"content\": [");
+
+/* Write file kind, path and size of the file. */
+void add_file_characteristics_json(JSON_WRITER *w)
+{
+    char size[24];
+
+    /* {"file kind": "<file_kind>", */
+    write_json_chars(w, "{\"file kind\": \"");
+    write_json_string(w, &given_file.file_kind);
+
+    /* "path": "<path>", */
+    write_json_chars(w, "\", \"path\": \"");
+    write_json_string(w, &given_file.path);
+
+    /* "size": "<size>", */
+    write_json_chars(w, "\", \"size\": \"");
+    sprintf(size, "%llu", given_file.size);
+    write_json_chars(w, size);
+
+    /* "content": [ */
+    write_json_chars(w, "\", \"content\": [");
 }
 
 
-/* Add one single property to the json String.
+/* Write one single property.
  * 
  * Properties are divided by commas.
  * Brackets are not included.
@@ -445,28 +615,27 @@ void add_file_characteristics_json()
  * 
  * PROP_ID the id of this property
  */
-void add_property_json(int obj_id, int prop_id)
+void add_property_json(JSON_WRITER *w, int obj_id, int prop_id)
 {
     /* Seperate properties with commas */
     if (prop_id != 0)
     {
-        insert_chars(&json, ", ");
+        write_json_chars(w, ", ");
     }
 
     /* Syntax: "key": "value" */
-    insert_chars(&json, "\"");
-    insert_string(&json, 
-                  &given_file.content[obj_id].properties[prop_id].key);
-
-    insert_chars(&json, "\": \"");
-    insert_string(&json, 
-                  &given_file.content[obj_id].properties[prop_id].value);
-    insert_chars(&json, "\"");
-    
+    write_json_chars(w, "\"");
+    write_json_string(w,
+                      &given_file.content[obj_id].properties[prop_id].key);
+
+    write_json_chars(w, "\": \"");
+    write_json_string(w,
+                      &given_file.content[obj_id].properties[prop_id].value);
+    write_json_chars(w, "\"");
 }
 
-/* Add one single content object along with its sub-objects 
- * and properties to the json String.
+/* Write one single content object along with its sub-objects 
+ * and properties.
  * 
  * OBJ_ID the content object which shall be added.
  * 
@@ -474,125 +643,134 @@ void add_property_json(int obj_id, int prop_id)
  * top level (0) objects . The function then calls itself recursively
  * for the sub-objects.
  */
-void add_obj_json(int obj_id, int first_in_a_list)
+void add_obj_json(JSON_WRITER *w, int obj_id, int first_in_a_list)
 {
     /* add a comma to seperate the object from the one before */
     if (!first_in_a_list) 
     {
-        insert_chars(&json, ", ");
+        write_json_chars(w, ", ");
     }
 
     /* type */
-    insert_chars(&json, "{\"type\": \"");
-    insert_string(&json, &given_file.content[obj_id].object_type);
-    insert_chars(&json, "\",");
+    write_json_chars(w, "{\"type\": \"");
+    write_json_string(w, &given_file.content[obj_id].object_type);
+    write_json_chars(w, "\",");
 
     /* wikidata */
-    insert_chars(&json, " \"wikidata\": \"");
-    insert_string(&json, &given_file.content[obj_id].wikidata);
-    insert_chars(&json, "\",");
+    write_json_chars(w, " \"wikidata\": \"");
+    write_json_string(w, &given_file.content[obj_id].wikidata);
+    write_json_chars(w, "\",");
 
     /* properties */
-    insert_chars(&json, " \"properties\": {");
+    write_json_chars(w, " \"properties\": {");
 
     for (int i = 0; i < given_file.content[obj_id].number_of_properties; i++)
     {
-        add_property_json(obj_id, i);
+        add_property_json(w, obj_id, i);
     }
 
-    insert_chars(&json, "}, \"content\": [");
+    write_json_chars(w, "}, \"content\": [");
 
-    /* We're starting a new (sub-)content list here. */
-    int new_content_list = 1;
-    
-    /* content sub-objects */
-    for (int x = 0; x < given_file.number_of_objects ; x++)
+    /* content sub-objects, the first one starts a new content list */
+    for (int x = given_file.content[obj_id].first_child; x != -1;
+         x = given_file.content[x].next_sibling)
     {
-        if (given_file.content[x].parent_id == obj_id)
-        {
-            /* add a sub-object 
-               and inform it about being the first one or not */
-            add_obj_json(x, new_content_list);
+        add_obj_json(w, x, x == given_file.content[obj_id].first_child);
+    }
 
-            /* after a first object, 
-               there won't be another first one, you know... */
-            new_content_list = 0;
-        }
+    write_json_chars(w, "]}");
+}
+
+/* Local function that links every content object to its first sub-object
+ * and to the next object in the same content list, see first_child and
+ * next_sibling. Returns the first top level object, -1 if there's none.
+ *
+ * Going backwards through the list, every object is put in front of the
+ * content list of its parent, which keeps the lists in order.
+ */
+int link_content_objects()
+{
+  int first_top_level = -1;
+
+  for (int i = 0; i < given_file.number_of_objects; i++)
+  {
+    given_file.content[i].first_child = -1;
+  }
+
+  for (int i = given_file.number_of_objects - 1; i > -1; i--)
+  {
+    struct content_object *obj = &given_file.content[i];
+
+    if (obj->parent_id != -1)
+    {
+        obj->next_sibling = given_file.content[obj->parent_id].first_child;
+        given_file.content[obj->parent_id].first_child = i;
+    }
+    /* a level of 0 indicates a top level object */
+    else if (obj->level == 0)
+    {
+        obj->next_sibling = first_top_level;
+        first_top_level = i;
     }
+    /* without parent or top level, there's no place for it */
+    else
+    {
+        obj->next_sibling = -1;
+    }
+  }
 
-    insert_chars(&json, "]}");
+  return first_top_level;
 }
 
 /* Once the file is analyzed, the structured data has to be converted 
- * to JSON. The intermediate result will be stored in 'String json'.
- * 
- * Afterwards, the char array in this string will be extracted
- * and stored in the global 'char[] json' for the main function to 'return'.
+ * to JSON. The document of the current analysis is written to SINK
+ * while the content list is walked, nothing is kept afterwards.
  */
-void convert_to_json()
+void convert_to_json(JSON_SINK *sink)
 {
-  initialize_String(&json, 1000);
+  JSON_WRITER w;
+
+  w.sink = sink;
+  w.used = 0;
 
   /* include filekind, path and size */
-  add_file_characteristics_json();
+  add_file_characteristics_json(&w);
   
   /* Consider all top level objects and add them and their sub-objects. */
-  for (int i = 0; i < given_file.number_of_objects; i++)
+  int first = link_content_objects();
+  for (int i = first; i != -1; i = given_file.content[i].next_sibling)
   {
-    /* a level of 0 indicates a top level object */
-    if (given_file.content[i].level == 0)
-    {
-        /* This is the first object and therefore the first one in the list. */
-        if (i == 0) 
-        {
-            add_obj_json(i, 1);
-        }
-        /* if it isn't the first object, it can't be the first one in
-         * the highest level list and therefore will need a comma first
-         * to seperate it from the one before */
-        else
-        {
-            add_obj_json(i, 0);
-        }
-    }
+    /* Only the first one goes without a comma in front of it. */
+    add_obj_json(&w, i, i == first);
   }
 
   /* Closing brackets for the whole file */
-  insert_chars(&json, "]}");
+  write_json_chars(&w, "]}");
 
-  /* Extract char array. */
-  extract_chars(&json, json_output);
+  flush_json(&w);
 }
 
 
 
-
 // ---------------------------------------------------------------------
 //                             RESET
 // ---------------------------------------------------------------------
 
-/* This function clears all variables storing detected data for json.
- * That is, given_file, json, json_output, property_counter and object id.
- * Calling reset creates an environment comparable to the beginning of the
- * programm's execution.
+/* This function clears all variables storing detected data for json
+ * in the current analysis, that is given_file.
+ * Calling reset creates an environment comparable to the beginning of
+ * the analysis.
  * 
  * This allows to first run some tests and delete all test data afterwards
  * before performing the analysis of the actual file given.
  */
 void reset_json()
 {
-    /* Delete json_output */
-    memset(json_output, 0, sizeof(json_output));
-
-    /* Delete json String*/
-    free_String(&json);
-
-    /* Reset property_counter and object counter */
-    property_counter = 0;
-    id = 0;
+    /* Everything found in the file lives in its arena. */
+    arena_release(&given_file.arena);
 
     /* Reset given_file */
-    given_file = (const struct file_info) { 0 };
+    memset(&given_file, 0, sizeof(given_file));
 }
 
 
@@ -674,6 +852,22 @@ void test_identify_parent_id()
     
     //int identify_parent_id(int level)
     reset_json();
+
+    /* levels 0 1 2 3 1 2 0 2 */
+    int levels[] = {0, 1, 2, 3, 1, 2, 0, 2};
+    int parents[] = {-1, 0, 1, 2, 0, 4, -1, 6};
+    for (int i = 0; i < 8; i++)
+    {
+        add_content_object(levels[i], "some type", "Qxxx");
+        assert(given_file.content[i].parent_id == parents[i]);
+    }
+
+    // climbs from object 7 over 6 without finding anything
+    assert(identify_parent_id(0) == -1);
+    assert(identify_parent_id(3) == 7);
+    assert(identify_parent_id(1) == 6);
+
+    reset_json();
 }
 
 void test_clean_char()
@@ -827,21 +1021,125 @@ void test_convert_to_json()
     char *path = "/some/imaginary/path/";
     add_file_path(path);
     
-    convert_to_json();
-    //printf("'%s' \n", json_output);
+    String json;
+    JSON_SINK sink;
+    initialize_String(&json, 16);
+    json_sink_string(&sink, &json);
+
+    convert_to_json(&sink);
     
     char output[] = "{\"file kind\": \"Regular file\", "
                      "\"path\": \"/some/imaginary/path/"
                      "\", \"size\": \"987654321\", \"co"
                      "ntent\": []}";
 
-    assert(equal_chars(json_output, output));
+    assert(equal_chars(json.string, output));
+    reset_json();
 
-    // TODO add some more tests
-    
+    /* A document larger than the buffer of the writer, with objects
+     * and properties nested in each other. */
+    free_String(&json);
+    initialize_String(&json, 16);
+    s = 0;
+    add_file_characteristics("Block device", NULL);
+    add_content_object(0, "MBR partition table", "Q55357515");
+    for (int i = 0; i < 200; i++)
+    {
+        add_content_object(1, "Partition", "Q255215");
+        add_property_int("number", i);
+    }
+    add_content_object(2, "FAT12", "Q3063042");
+    add_property("volume name", "NO NAME");
+    add_content_object(0, "Blank disk", "Qxxx");
+
+    convert_to_json(&sink);
+
+    char begin[] = "{\"file kind\": \"Block device\", \"path\": \"\", "
+                   "\"size\": \"0\", \"content\": [{\"type\": \"MBR part"
+                   "ition table\", \"wikidata\": \"Q55357515\", \"proper"
+                   "ties\": {}, \"content\": [{\"type\": \"Partition\", "
+                   "\"wikidata\": \"Q255215\", \"properties\": {\"numbe"
+                   "r\": \"0\"}, \"content\": []}, {\"type\": ";
+    char end[] = "{\"type\": \"FAT12\", \"wikidata\": \"Q3063042\", "
+                 "\"properties\": {\"volume name\": \"NO NAME\"}, "
+                 "\"content\": []}]}]}, {\"type\": \"Blank disk\", "
+                 "\"wikidata\": \"Qxxx\", \"properties\": {}, "
+                 "\"content\": []}]}";
+
+    assert(json.used_size > 4096);
+    assert(strncmp(json.string, begin, strlen(begin)) == 0);
+    assert(equal_chars(json.string + json.used_size - 1 - strlen(end), end));
+
+    free_String(&json);
     reset_json();
 }
 
+void test_insert_content_objects()
+{
+    ANALYSIS *part = new_analysis();
+    ANALYSIS *saved = current_analysis;
+
+    add_content_object(0, "MBR partition table", "Q55357515");
+    add_content_object(0, "Partition", "Q255215");
+    add_content_object(0, "Partition", "Q255215");
+
+    /* the contents of the first partition, found separately */
+    current_analysis = part;
+    add_content_object(1, "FAT12", "Q3063042");
+    add_property("volume_name", "NO NAME");
+    add_content_object(2, "some type", "Qxxx");
+    current_analysis = saved;
+
+    insert_content_objects(2, &part->file);
+    relink_content_objects(2);
+
+    assert(given_file.number_of_objects == 5);
+    assert(part->file.number_of_objects == 0);
+
+    assert(equal_chars(given_file.content[2].object_type.string, "FAT12"));
+    assert(given_file.content[2].id == 2);
+    assert(given_file.content[2].parent_id == 1);
+    assert(given_file.content[2].number_of_properties == 1);
+    assert(given_file.content[3].parent_id == 2);
+
+    /* the second partition moved behind the inserted objects */
+    assert(equal_chars(given_file.content[4].object_type.string,
+                       "Partition"));
+    assert(given_file.content[4].id == 4);
+    assert(given_file.content[4].parent_id == -1);
+
+    free_analysis(part);
+    reset_json();
+}
+
+void test_many_content_objects()
+{
+    char key[12];
+
+    /* Far more objects and properties than there used to be room for. */
+    for (int i = 0; i < 1000; i++)
+    {
+        add_content_object(i % 3, "Partition", "Q255215");
+    }
+    for (int k = 0; k < 250; k++)
+    {
+        sprintf(key, "key%d", k);
+        add_property_int(key, k);
+    }
+
+    assert(given_file.number_of_objects == 1000);
+    assert(given_file.content[999].id == 999);
+    assert(given_file.content[998].parent_id == 997);
+    assert(equal_chars(given_file.content[500].wikidata.string, "Q255215"));
+    assert(given_file.content[999].number_of_properties == 250);
+    assert(equal_chars(given_file.content[999].properties[249].value.string,
+                       "249"));
+
+    reset_json();
+    assert(given_file.number_of_objects == 0);
+    assert(given_file.arena.blocks == NULL);
+}
+
 /* Main function responsible for json tests. */
 void test_json()
 {
@@ -859,6 +1157,10 @@ void test_json()
     
     test_add_property();
 
+    test_insert_content_objects();
+
+    test_many_content_objects();
+
     test_convert_to_json();   
 }
 
@@ -43,7 +43,8 @@ static const char *insets[LEVELS] = {
   "            ",
   "              ",
 };
-static char line_akku[4096];
+/* the line under construction belongs to the current analysis */
+#define line_akku (current_analysis->line_akku)
 
 void print_line(int level, const char *fmt, ...)
 {
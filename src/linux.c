@@ -580,13 +580,14 @@ void detect_linux_lvm(SECTION *section, int level)
 
 void detect_linux_lvm2(SECTION *section, int level)
 {
-  unsigned char *buf;
+  unsigned char *buf, *part;
   int at, i;
-  char s[256];
+  char s[256], pv_id[64];
   u8 labelsector;
   u4 labeloffset;
-  u8 pvsize, mdoffset, mdsize;
+  u8 pvsize, mdoffset, mdsize, textoffset, textsize, first;
   int mda_version;
+  char *text;
 
   for (at = 0; at < 4; at++) {
     if (get_buffer(section, at * 512, 512, (void **)&buf) < 512)
@@ -629,6 +630,7 @@ void detect_linux_lvm2(SECTION *section, int level)
     /* "UUID" of this physical volume */
     format_uuid_lvm(buf + labeloffset, s);
     print_line(level + 1, "PV UUID %s", s);
+    strcpy(pv_id, s);
 
     #ifdef JSON
     add_property("physical_volume_UUID", s);
@@ -656,7 +658,8 @@ void detect_linux_lvm2(SECTION *section, int level)
     if (mdoffset == 0)
       return;
 
-    if (get_buffer(section, mdoffset, mdsize, (void **)&buf) < mdsize)
+    if (mdsize <= 512 ||
+	get_buffer(section, mdoffset, 512, (void **)&buf) < 512)
       return;
 
     if (memcmp(buf + 4, " LVM2 x[5A%r0N*>", 16) != 0)
@@ -669,8 +672,41 @@ void detect_linux_lvm2(SECTION *section, int level)
     add_property_int("meta_data_version", mda_version);
     #endif
 
-    /* TODO: parse the metadata area (big task...) */
+    /* the text of the latest metadata, in a ring buffer that follows
+       the header */
+    textoffset = get_le_quad(buf + 40);
+    textsize = get_le_quad(buf + 48);
+    if (textoffset == 0 || textsize == 0)
+      return;
+    if (textoffset < 512 || textoffset >= mdsize ||
+	textsize > mdsize - 512 || textsize > 16*1024*1024) {
+      print_line(level + 1, "Meta-data location inconsistent");
+      return;
+    }
+
+    text = (char *)malloc(textsize);
+    if (text == NULL)
+      bailout("Out of memory");
+    first = mdsize - textoffset;
+    if (first > textsize)
+      first = textsize;
+    if (get_buffer(section, mdoffset + textoffset, first,
+		   (void **)&part) < first) {
+      free(text);
+      return;
+    }
+    memcpy(text, part, first);
+    if (first < textsize) {
+      if (get_buffer(section, mdoffset + 512, textsize - first,
+		     (void **)&part) < textsize - first) {
+	free(text);
+	return;
+      }
+      memcpy(text + first, part, textsize - first);
+    }
 
+    analyze_lvm2_metadata(section, level + 1, text, textsize, pv_id);
+    free(text);
     return;
   }
 }
@@ -0,0 +1,1001 @@
+/*
+ * lvm.c
+ * Volume group model and logical volume mapping for Linux LVM2.
+ *
+ * Copyright (c) 2003 Christoph Pfisterer
+ * Copyright (c) 2018 Felix Baumann on modifications
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "global.h"
+
+#include <ctype.h>
+
+/*
+ * The metadata area of a physical volume holds the configuration of
+ * the whole volume group as text, in the same syntax as lvm.conf:
+ * sections in braces, "key = value" settings, strings, numbers and
+ * lists in brackets. It is parsed into a tree first, then the parts
+ * needed for the mapping are picked from it.
+ *
+ * Each logical volume is a list of segments, each a run of logical
+ * extents mapped to physical extents. "striped" segments with one
+ * stripe are what LVM calls linear. Only volumes that lie entirely on
+ * the physical volume at hand get a mapping source, the others are
+ * just listed. Everything lives in an arena that is released when the
+ * analysis of the volume group is done.
+ */
+
+/* nesting of sections and lists, real metadata goes three deep */
+#define MAX_DEPTH (16)
+
+/* more stripes than LVM allows */
+#define MAX_STRIPES (128)
+
+/*
+ * types
+ */
+
+#define NODE_SECTION (0)
+#define NODE_LIST (1)
+#define NODE_STRING (2)
+#define NODE_NUMBER (3)
+
+typedef struct lvm_node {
+  int kind;
+  char *name;              /* NULL for list items */
+  char *value;             /* for strings and numbers */
+  struct lvm_node *child;  /* for sections and lists */
+  struct lvm_node *next;
+} LVM_NODE;
+
+typedef struct lvm_parser {
+  const char *p, *end;
+  ARENA *arena;
+  int failed;
+} LVM_PARSER;
+
+typedef struct lvm_stripe {
+  int pv;        /* index into the physical volumes, -1 if unknown */
+  u8 start;      /* first physical extent */
+} LVM_STRIPE;
+
+typedef struct lvm_segment {
+  u8 start, count;   /* logical extents */
+  u4 stripe_count;
+  u8 stripe_size;    /* in bytes, for more than one stripe */
+  LVM_STRIPE *stripes;
+} LVM_SEGMENT;
+
+typedef struct lvm_lv {
+  char *name;
+  u8 extents;
+  int segment_count;
+  LVM_SEGMENT *segments;  /* sorted by start */
+  const char *problem;    /* why it can't be mapped, NULL if it can */
+} LVM_LV;
+
+typedef struct lvm_pv {
+  char *name;
+  char *id;
+  u8 pe_start;   /* in bytes */
+} LVM_PV;
+
+typedef struct lvm_vg {
+  char *name;
+  u8 extent_size;  /* in bytes */
+  int pv_count, lv_count;
+  LVM_PV *pvs;
+  LVM_LV *lvs;
+} LVM_VG;
+
+typedef struct lvm_source {
+  SOURCE c;
+  u8 off;        /* where the physical volume starts */
+  u8 extent_size;
+  int pv;
+  LVM_PV *pvs;
+  int segment_count;
+  LVM_SEGMENT *segments;
+} LVM_SOURCE;
+
+/*
+ * helper functions
+ */
+
+static LVM_NODE *parse_metadata(const char *text, u8 len, ARENA *arena);
+static LVM_NODE *parse_items(LVM_PARSER *ps, int depth, int in_list);
+static LVM_NODE *parse_value(LVM_PARSER *ps, int depth);
+static char *parse_word(LVM_PARSER *ps);
+static char *parse_string(LVM_PARSER *ps);
+static void skip_space(LVM_PARSER *ps);
+static LVM_NODE *find_node(LVM_NODE *parent, const char *name, int kind);
+static int get_number(LVM_NODE *parent, const char *name, u8 *value);
+static int count_nodes(LVM_NODE *first, int kind);
+static LVM_VG *build_vg(LVM_NODE *root, ARENA *arena);
+static void build_lv(LVM_VG *vg, LVM_LV *lv, LVM_NODE *n, ARENA *arena);
+static int build_segment(LVM_VG *vg, LVM_SEGMENT *seg, LVM_NODE *n,
+			 ARENA *arena);
+static int compare_segments(const void *a, const void *b);
+static int lv_on_pv(LVM_LV *lv, int pv);
+static SOURCE *init_lvm_source(SECTION *section, LVM_VG *vg, LVM_LV *lv,
+			       int pv);
+static u8 find_run(LVM_SOURCE *ls, u8 pos, u8 len,
+		   int *present, u8 *data_off);
+static u8 read_lvm(SOURCE *s, u8 pos, u8 len, void *buf);
+static void prefetch_lvm(SOURCE *s, u8 pos, u8 len);
+
+/*
+ * analyze the volume group described by the metadata TEXT found on
+ * the physical volume PV_ID, which starts at the beginning of SECTION
+ */
+
+void analyze_lvm2_metadata(SECTION *section, int level,
+			   const char *text, u8 len, const char *pv_id)
+{
+  ARENA arena;
+  LVM_NODE *root;
+  LVM_VG *vg;
+  LVM_LV *lv;
+  SOURCE *src;
+  int pv, i;
+  char s[256];
+
+  arena.blocks = NULL;
+  root = parse_metadata(text, len, &arena);
+  vg = (root != NULL) ? build_vg(root, &arena) : NULL;
+  if (vg == NULL) {
+    print_line(level, "Meta-data can't be parsed");
+    arena_release(&arena);
+    return;
+  }
+
+  print_line(level, "Volume group name \"%s\"", vg->name);
+  format_size(s, vg->extent_size);
+  print_line(level, "Extent size %s, %d physical volume%s",
+	     s, vg->pv_count, vg->pv_count == 1 ? "" : "s");
+
+  #ifdef JSON
+  add_property("volume_group_name", vg->name);
+  add_property_u8("extent_size", vg->extent_size);
+  add_property_int("physical_volumes", vg->pv_count);
+  add_property_int("logical_volumes", vg->lv_count);
+  #endif
+
+  /* find ourselves in the list */
+  for (pv = 0; pv < vg->pv_count; pv++)
+    if (vg->pvs[pv].id != NULL && strcmp(vg->pvs[pv].id, pv_id) == 0)
+      break;
+  if (pv == vg->pv_count) {
+    print_line(level, "This physical volume is not listed");
+    pv = -1;
+  }
+
+  for (i = 0; i < vg->lv_count; i++) {
+    lv = &vg->lvs[i];
+    format_blocky_size(s, lv->extents, vg->extent_size, "extents", NULL);
+    print_line(level, "Logical volume \"%s\", %s", lv->name, s);
+
+    #ifdef JSON
+    add_content_object(level, "Partition", "Q255215");
+
+    add_property("kind", "lvm");
+    add_property("name", lv->name);
+    add_property_int("number", i + 1);
+    add_property_u8("size", lv->extents * vg->extent_size);
+    #endif
+
+    if (lv->problem == NULL && !lv_on_pv(lv, pv))
+      lv->problem = "spans other physical volumes";
+    if (lv->problem != NULL) {
+      print_line(level + 1, "Not analyzed, %s", lv->problem);
+      continue;
+    }
+
+    src = init_lvm_source(section, vg, lv, pv);
+    analyze_source(src, level + 1);
+    close_source(src);
+  }
+
+  arena_release(&arena);
+}
+
+/*
+ * metadata text parsing, returns the list of top level items or NULL
+ */
+
+static LVM_NODE *parse_metadata(const char *text, u8 len, ARENA *arena)
+{
+  LVM_PARSER ps;
+  LVM_NODE *root;
+
+  ps.p = text;
+  ps.end = text + len;
+  ps.arena = arena;
+  ps.failed = 0;
+
+  root = parse_items(&ps, 0, 0);
+  skip_space(&ps);
+  /* the text may be padded with zeros */
+  if (ps.failed || (ps.p < ps.end && *ps.p != 0))
+    return NULL;
+  return root;
+}
+
+/*
+ * the items of a section or list, up to the closing brace or bracket
+ * which is left for the caller
+ */
+
+static LVM_NODE *parse_items(LVM_PARSER *ps, int depth, int in_list)
+{
+  LVM_NODE *first, **link, *n;
+  char *name;
+
+  if (depth > MAX_DEPTH) {
+    ps->failed = 1;
+    return NULL;
+  }
+
+  first = NULL;
+  link = &first;
+  for (;;) {
+    skip_space(ps);
+    if (ps->p >= ps->end || *ps->p == 0 ||
+	*ps->p == (in_list ? ']' : '}'))
+      break;
+
+    if (in_list) {
+      n = parse_value(ps, depth);
+      if (n == NULL)
+	break;
+      skip_space(ps);
+      if (ps->p < ps->end && *ps->p == ',')
+	ps->p++;
+    } else {
+      name = parse_word(ps);
+      if (name == NULL) {
+	ps->failed = 1;
+	break;
+      }
+      skip_space(ps);
+      if (ps->p < ps->end && *ps->p == '{') {
+	ps->p++;
+	n = (LVM_NODE *)arena_alloc(ps->arena, sizeof(LVM_NODE));
+	memset(n, 0, sizeof(LVM_NODE));
+	n->kind = NODE_SECTION;
+	n->child = parse_items(ps, depth + 1, 0);
+	if (ps->failed || ps->p >= ps->end || *ps->p != '}') {
+	  ps->failed = 1;
+	  break;
+	}
+	ps->p++;
+      } else if (ps->p < ps->end && *ps->p == '=') {
+	ps->p++;
+	n = parse_value(ps, depth);
+	if (n == NULL)
+	  break;
+      } else {
+	ps->failed = 1;
+	break;
+      }
+      n->name = name;
+    }
+
+    *link = n;
+    link = &n->next;
+  }
+  return first;
+}
+
+/*
+ * a string, number or list
+ */
+
+static LVM_NODE *parse_value(LVM_PARSER *ps, int depth)
+{
+  LVM_NODE *n;
+
+  skip_space(ps);
+  if (ps->p >= ps->end) {
+    ps->failed = 1;
+    return NULL;
+  }
+
+  n = (LVM_NODE *)arena_alloc(ps->arena, sizeof(LVM_NODE));
+  memset(n, 0, sizeof(LVM_NODE));
+  if (*ps->p == '[') {
+    ps->p++;
+    n->kind = NODE_LIST;
+    n->child = parse_items(ps, depth + 1, 1);
+    if (ps->failed || ps->p >= ps->end || *ps->p != ']') {
+      ps->failed = 1;
+      return NULL;
+    }
+    ps->p++;
+  } else if (*ps->p == '"') {
+    n->kind = NODE_STRING;
+    n->value = parse_string(ps);
+  } else {
+    n->kind = NODE_NUMBER;
+    n->value = parse_word(ps);
+  }
+
+  if (n->kind != NODE_LIST && n->value == NULL) {
+    ps->failed = 1;
+    return NULL;
+  }
+  return n;
+}
+
+/*
+ * names and numbers, copied to the arena
+ */
+
+static char *parse_word(LVM_PARSER *ps)
+{
+  const char *start = ps->p;
+  char *word;
+
+  while (ps->p < ps->end &&
+	 (isalnum((unsigned char)*ps->p) || strchr("_.+-", *ps->p) != NULL) &&
+	 *ps->p != 0)
+    ps->p++;
+  if (ps->p == start)
+    return NULL;
+
+  word = (char *)arena_alloc(ps->arena, ps->p - start + 1);
+  memcpy(word, start, ps->p - start);
+  word[ps->p - start] = 0;
+  return word;
+}
+
+/*
+ * a quoted string with backslash escapes, copied to the arena
+ */
+
+static char *parse_string(LVM_PARSER *ps)
+{
+  const char *q;
+  char *str, *to;
+
+  /* the unescaped string is no longer than the quoted one */
+  for (q = ps->p + 1; q < ps->end && *q != '"'; q++)
+    if (*q == '\\' && q + 1 < ps->end)
+      q++;
+  if (q >= ps->end)
+    return NULL;
+
+  str = to = (char *)arena_alloc(ps->arena, q - ps->p);
+  for (ps->p++; ps->p < q; ps->p++) {
+    if (*ps->p == '\\')
+      ps->p++;
+    *to++ = *ps->p;
+  }
+  *to = 0;
+  ps->p = q + 1;
+  return str;
+}
+
+/*
+ * white space and comments
+ */
+
+static void skip_space(LVM_PARSER *ps)
+{
+  while (ps->p < ps->end) {
+    if (*ps->p == '#') {
+      while (ps->p < ps->end && *ps->p != '\n')
+	ps->p++;
+    } else if (isspace((unsigned char)*ps->p)) {
+      ps->p++;
+    } else
+      break;
+  }
+}
+
+/*
+ * tree access
+ */
+
+static LVM_NODE *find_node(LVM_NODE *parent, const char *name, int kind)
+{
+  LVM_NODE *n;
+
+  if (parent == NULL)
+    return NULL;
+  for (n = parent->child; n != NULL; n = n->next)
+    if (n->kind == kind && n->name != NULL && strcmp(n->name, name) == 0)
+      return n;
+  return NULL;
+}
+
+static int get_number(LVM_NODE *parent, const char *name, u8 *value)
+{
+  LVM_NODE *n = find_node(parent, name, NODE_NUMBER);
+  char *end;
+
+  if (n == NULL || !isdigit((unsigned char)n->value[0]))
+    return 0;
+  *value = strtoull(n->value, &end, 10);
+  return *end == 0;
+}
+
+static int count_nodes(LVM_NODE *first, int kind)
+{
+  int count = 0;
+
+  for (; first != NULL; first = first->next)
+    if (first->kind == kind)
+      count++;
+  return count;
+}
+
+/*
+ * pick the volume group from the tree, NULL if it's not usable
+ */
+
+static LVM_VG *build_vg(LVM_NODE *root, ARENA *arena)
+{
+  LVM_NODE *n, *pvs, *lvs;
+  LVM_VG *vg;
+  u8 value;
+  int i;
+
+  /* the only section at the top level is the volume group */
+  for (n = root; n != NULL; n = n->next)
+    if (n->kind == NODE_SECTION)
+      break;
+  if (n == NULL)
+    return NULL;
+
+  vg = (LVM_VG *)arena_alloc(arena, sizeof(LVM_VG));
+  memset(vg, 0, sizeof(LVM_VG));
+  vg->name = n->name;
+  if (!get_number(n, "extent_size", &value) || value == 0 ||
+      value > 0x100000000ULL)
+    return NULL;
+  vg->extent_size = value * 512;
+
+  pvs = find_node(n, "physical_volumes", NODE_SECTION);
+  lvs = find_node(n, "logical_volumes", NODE_SECTION);
+
+  vg->pv_count = pvs ? count_nodes(pvs->child, NODE_SECTION) : 0;
+  vg->pvs = (LVM_PV *)arena_alloc(arena, vg->pv_count * sizeof(LVM_PV));
+  i = 0;
+  for (n = pvs ? pvs->child : NULL; n != NULL; n = n->next) {
+    if (n->kind != NODE_SECTION)
+      continue;
+    vg->pvs[i].name = n->name;
+    vg->pvs[i].id = NULL;
+    vg->pvs[i].pe_start = 0;
+    if (find_node(n, "id", NODE_STRING) != NULL)
+      vg->pvs[i].id = find_node(n, "id", NODE_STRING)->value;
+    if (get_number(n, "pe_start", &value))
+      vg->pvs[i].pe_start = value * 512;
+    i++;
+  }
+
+  vg->lv_count = lvs ? count_nodes(lvs->child, NODE_SECTION) : 0;
+  vg->lvs = (LVM_LV *)arena_alloc(arena, vg->lv_count * sizeof(LVM_LV));
+  i = 0;
+  for (n = lvs ? lvs->child : NULL; n != NULL; n = n->next) {
+    if (n->kind != NODE_SECTION)
+      continue;
+    build_lv(vg, &vg->lvs[i], n, arena);
+    i++;
+  }
+
+  return vg;
+}
+
+/*
+ * collect the segments of a logical volume and put them in order
+ */
+
+static void build_lv(LVM_VG *vg, LVM_LV *lv, LVM_NODE *n, ARENA *arena)
+{
+  LVM_NODE *seg;
+  LVM_SEGMENT *prev;
+  u8 value;
+  int i, result;
+  char name[32];
+
+  memset(lv, 0, sizeof(LVM_LV));
+  lv->name = n->name;
+
+  if (!get_number(n, "segment_count", &value) || value == 0 ||
+      value > (u8)count_nodes(n->child, NODE_SECTION)) {
+    lv->problem = "invalid segment list";
+    return;
+  }
+  lv->segment_count = (int)value;
+  lv->segments = (LVM_SEGMENT *)arena_alloc(arena, lv->segment_count *
+					    sizeof(LVM_SEGMENT));
+
+  /* they are numbered from 1, but not necessarily listed in order */
+  for (i = 0; i < lv->segment_count; i++) {
+    sprintf(name, "segment%d", i + 1);
+    seg = find_node(n, name, NODE_SECTION);
+    result = seg ? build_segment(vg, &lv->segments[i], seg, arena) : 0;
+    if (result < 0) {
+      lv->problem = "segment type not supported";
+      return;
+    }
+    if (result == 0) {
+      lv->problem = "invalid segment list";
+      return;
+    }
+  }
+
+  qsort(lv->segments, lv->segment_count, sizeof(LVM_SEGMENT),
+	compare_segments);
+  for (i = 1; i < lv->segment_count; i++) {
+    prev = &lv->segments[i - 1];
+    if (lv->segments[i].start < prev->start + prev->count) {
+      lv->problem = "overlapping segments";
+      return;
+    }
+  }
+  prev = &lv->segments[lv->segment_count - 1];
+  lv->extents = prev->start + prev->count;
+  if (lv->extents > ~(u8)0 / vg->extent_size)
+    lv->problem = "invalid size";
+}
+
+/*
+ * one segment, returns 1 if it's usable, -1 if it's of an unsupported
+ * type and 0 if it's damaged
+ */
+
+static int build_segment(LVM_VG *vg, LVM_SEGMENT *seg, LVM_NODE *n,
+			 ARENA *arena)
+{
+  LVM_NODE *type, *stripes, *item;
+  u8 value;
+  u4 i;
+  int pv;
+
+  type = find_node(n, "type", NODE_STRING);
+  if (type == NULL || strcmp(type->value, "striped") != 0)
+    return -1;
+
+  if (!get_number(n, "start_extent", &seg->start) ||
+      !get_number(n, "extent_count", &seg->count) || seg->count == 0 ||
+      seg->start + seg->count < seg->start ||
+      seg->start + seg->count > 0x100000000ULL)
+    return 0;
+  if (!get_number(n, "stripe_count", &value) || value == 0 ||
+      value > MAX_STRIPES || seg->count % value != 0)
+    return 0;
+  seg->stripe_count = (u4)value;
+  seg->stripe_size = 0;
+  if (seg->stripe_count > 1) {
+    if (!get_number(n, "stripe_size", &value) || value == 0 ||
+	(value * 512) > vg->extent_size ||
+	vg->extent_size % (value * 512) != 0)
+      return 0;
+    seg->stripe_size = value * 512;
+  }
+
+  /* pairs of physical volume name and first extent */
+  stripes = find_node(n, "stripes", NODE_LIST);
+  if (stripes == NULL)
+    return 0;
+  seg->stripes = (LVM_STRIPE *)arena_alloc(arena, seg->stripe_count *
+					   sizeof(LVM_STRIPE));
+  item = stripes->child;
+  for (i = 0; i < seg->stripe_count; i++) {
+    if (item == NULL || item->kind != NODE_STRING ||
+	item->next == NULL || item->next->kind != NODE_NUMBER ||
+	!isdigit((unsigned char)item->next->value[0]))
+      return 0;
+    seg->stripes[i].pv = -1;
+    for (pv = 0; pv < vg->pv_count; pv++)
+      if (strcmp(vg->pvs[pv].name, item->value) == 0)
+	seg->stripes[i].pv = pv;
+    seg->stripes[i].start = strtoull(item->next->value, NULL, 10);
+    item = item->next->next;
+  }
+  return 1;
+}
+
+static int compare_segments(const void *a, const void *b)
+{
+  const LVM_SEGMENT *sa = (const LVM_SEGMENT *)a;
+  const LVM_SEGMENT *sb = (const LVM_SEGMENT *)b;
+
+  if (sa->start < sb->start)
+    return -1;
+  return sa->start > sb->start;
+}
+
+/*
+ * check if all of a logical volume is on physical volume PV
+ */
+
+static int lv_on_pv(LVM_LV *lv, int pv)
+{
+  int i;
+  u4 j;
+
+  if (pv < 0)
+    return 0;
+  for (i = 0; i < lv->segment_count; i++)
+    for (j = 0; j < lv->segments[i].stripe_count; j++)
+      if (lv->segments[i].stripes[j].pv != pv)
+	return 0;
+  return 1;
+}
+
+/*
+ * initialize the mapping source of a logical volume, it refers to the
+ * volume group model which must outlive it
+ */
+
+static SOURCE *init_lvm_source(SECTION *section, LVM_VG *vg, LVM_LV *lv,
+			       int pv)
+{
+  LVM_SOURCE *ls;
+
+  ls = (LVM_SOURCE *)malloc(sizeof(LVM_SOURCE));
+  if (ls == NULL)
+    bailout("Out of memory");
+  memset(ls, 0, sizeof(LVM_SOURCE));
+
+  ls->c.size_known = 1;
+  ls->c.size = lv->extents * vg->extent_size;
+  ls->c.foundation = section->source;
+  ls->c.read_bytes = read_lvm;
+  ls->c.prefetch = prefetch_lvm;
+  ls->c.close = NULL;
+  /* stateless translation, as concurrent as what's below */
+  ls->c.concurrent = section->source->concurrent;
+  ls->off = section->pos;
+  ls->extent_size = vg->extent_size;
+  ls->pv = pv;
+  ls->pvs = vg->pvs;
+  ls->segment_count = lv->segment_count;
+  ls->segments = lv->segments;
+
+  return (SOURCE *)ls;
+}
+
+/*
+ * find the run of bytes starting at POS that maps to one stretch of
+ * the physical volume, or isn't mapped at all; runs of consecutive
+ * linear segments that continue each other on disk are joined
+ */
+
+static u8 find_run(LVM_SOURCE *ls, u8 pos, u8 len,
+		   int *present, u8 *data_off)
+{
+  LVM_SEGMENT *seg;
+  LVM_STRIPE *st;
+  u8 extent, seg_start, seg_pos, within, chunk, run;
+  u4 stripe;
+  int lo, hi, mid;
+
+  /* binary search for the first segment ending after POS */
+  extent = pos / ls->extent_size;
+  lo = 0;
+  hi = ls->segment_count;
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    seg = &ls->segments[mid];
+    if (seg->start + seg->count <= extent)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  if (lo == ls->segment_count || ls->segments[lo].start > extent) {
+    /* a gap, up to the next segment */
+    *present = 0;
+    run = len;
+    if (lo < ls->segment_count &&
+	ls->segments[lo].start * ls->extent_size - pos < run)
+      run = ls->segments[lo].start * ls->extent_size - pos;
+    return run;
+  }
+
+  seg = &ls->segments[lo];
+  seg_start = seg->start * ls->extent_size;
+  seg_pos = pos - seg_start;
+  run = seg->count * ls->extent_size - seg_pos;
+  if (seg->stripe_count == 1) {
+    stripe = 0;
+    within = seg_pos;
+  } else {
+    /* stripe_size bytes go to each stripe in turn */
+    chunk = seg_pos / seg->stripe_size;
+    stripe = (u4)(chunk % seg->stripe_count);
+    within = (chunk / seg->stripe_count) * seg->stripe_size +
+      seg_pos % seg->stripe_size;
+    run = seg->stripe_size - seg_pos % seg->stripe_size;
+  }
+  if (run > len)
+    run = len;
+
+  st = &seg->stripes[stripe];
+  if (st->pv != ls->pv) {
+    *present = 0;
+    return run;
+  }
+  *present = 1;
+  *data_off = ls->off + ls->pvs[st->pv].pe_start +
+    st->start * ls->extent_size + within;
+
+  /* join the next linear segments while they continue this one */
+  while (seg->stripe_count == 1 && run < len &&
+	 lo + 1 < ls->segment_count) {
+    LVM_SEGMENT *next = &ls->segments[lo + 1];
+
+    if (next->start != seg->start + seg->count ||
+	next->stripe_count != 1 || next->stripes[0].pv != st->pv ||
+	next->stripes[0].start != st->start + seg->count)
+      break;
+    run += next->count * ls->extent_size;
+    if (run > len)
+      run = len;
+    seg = next;
+    st = &seg->stripes[0];
+    lo++;
+  }
+  return run;
+}
+
+/*
+ * raw read
+ */
+
+static u8 read_lvm(SOURCE *s, u8 pos, u8 len, void *buf)
+{
+  LVM_SOURCE *ls = (LVM_SOURCE *)s;
+  u8 got, run, data_off, done;
+  int present;
+  unsigned char *out;
+
+  if (pos >= s->size)
+    return 0;
+  if (len > s->size - pos)
+    len = s->size - pos;
+
+  for (got = 0; got < len; got += run) {
+    run = find_run(ls, pos + got, len - got, &present, &data_off);
+    out = (unsigned char *)buf + got;
+    done = 0;
+    if (present)
+      done = get_buffer_real(s->foundation, data_off, run, out, NULL);
+    /* beyond the end of the image or not mapped */
+    if (done < run)
+      memset(out + done, 0, run - done);
+  }
+  return got;
+}
+
+/*
+ * pass the hint on for the mapped runs, joined where they are next to
+ * each other on the physical volume
+ */
+
+static void prefetch_lvm(SOURCE *s, u8 pos, u8 len)
+{
+  LVM_SOURCE *ls = (LVM_SOURCE *)s;
+  SOURCE *fs = s->foundation;
+  u8 done, run, data_off, hint_off, hint_len;
+  int present;
+
+  if (fs->prefetch == NULL || pos >= s->size)
+    return;
+  if (len > s->size - pos)
+    len = s->size - pos;
+
+  hint_off = hint_len = 0;
+  for (done = 0; done < len; done += run) {
+    run = find_run(ls, pos + done, len - done, &present, &data_off);
+    if (!present)
+      continue;
+    if (hint_len > 0 && hint_off + hint_len == data_off) {
+      hint_len += run;
+      continue;
+    }
+    if (hint_len > 0)
+      fs->prefetch(fs, hint_off, hint_len);
+    hint_off = data_off;
+    hint_len = run;
+  }
+  if (hint_len > 0)
+    fs->prefetch(fs, hint_off, hint_len);
+}
+
+#ifdef JSON
+
+/* A physical volume in memory: one extent of 4 KiB before the first
+ * physical extent, then sixteen of them.
+ */
+#define TEST_LVM_EXTENT (4096)
+#define TEST_LVM_SIZE (17 * TEST_LVM_EXTENT)
+
+static const char test_lvm_text[] =
+    "# Generated by LVM2\n"
+    "vg0 {\n"
+    "id = \"vg-id\"\n"
+    "status = [\"RESIZEABLE\", \"READ\", \"WRITE\"]\n"
+    "extent_size = 8\t# 4 KiB\n"
+    "physical_volumes {\n"
+    "pv0 {\n"
+    "id = \"PV-A\"\n"
+    "pe_start = 8\n"
+    "pe_count = 16\n"
+    "}\n"
+    "pv1 { id = \"PV-B\" pe_start = 2048 }\n"
+    "}\n"
+    "logical_volumes {\n"
+    "lin {\n"
+    "segment_count = 3\n"
+    "segment2 { start_extent = 2 extent_count = 3 type = \"striped\"\n"
+    "stripe_count = 1 stripes = [ \"pv0\", 10 ] }\n"
+    "segment1 { start_extent = 0 extent_count = 2 type = \"striped\"\n"
+    "stripe_count = 1 stripes = [ \"pv0\", 5 ] }\n"
+    "segment3 { start_extent = 5 extent_count = 1 type = \"striped\"\n"
+    "stripe_count = 1 stripes = [\n\"pv0\", 13\n] }\n"
+    "}\n"
+    "str {\n"
+    "segment_count = 1\n"
+    "segment1 { start_extent = 0 extent_count = 4 type = \"striped\"\n"
+    "stripe_count = 2 stripe_size = 2 stripes = [ \"pv0\", 0, \"pv0\", 2 ] }\n"
+    "}\n"
+    "far { segment_count = 1 segment1 { start_extent = 0 extent_count = 1\n"
+    "type = \"striped\" stripe_count = 1 stripes = [ \"pv1\", 0 ] } }\n"
+    "thin { segment_count = 1 segment1 { start_extent = 0 extent_count = 1\n"
+    "type = \"thin\" thin_pool = \"pool\" } }\n"
+    "}\n"
+    "}\n"
+    "contents = \"Text Format Volume Group\"\n"
+    "description = \"say \\\"hi\\\"\"\n";
+
+static unsigned char *test_lvm_image;
+
+/* Where byte POS of the volume LV is on the physical volume; the
+ * volumes read as the pattern of their own positions.
+ */
+static u8 test_lvm_where(int lv, u8 pos)
+{
+    u8 extent = pos / TEST_LVM_EXTENT, rel = pos % TEST_LVM_EXTENT;
+    u8 chunk = pos / 1024;
+
+    if (lv == 0)
+    {
+        /* extents 0-1 at 5, 2-5 at 10 */
+        return TEST_LVM_EXTENT + (extent < 2 ? 5 + extent : 8 + extent)
+            * TEST_LVM_EXTENT + rel;
+    }
+    /* 1 KiB chunks, alternating between extents 0 and 2 */
+    return TEST_LVM_EXTENT + (chunk % 2 ? 2 : 0) * TEST_LVM_EXTENT
+        + (chunk / 2) * 1024 + pos % 1024;
+}
+
+/* Whether the byte at POS of the first volume is in a gap, once its
+ * first extent and the second segment are taken away.
+ */
+static int test_lvm_gap(u8 pos)
+{
+    u8 extent = pos / TEST_LVM_EXTENT;
+
+    return extent == 0 || (extent >= 2 && extent < 5);
+}
+
+/* This is the main function responsible for tests in this class (lvm.c). */
+void test_lvm()
+{
+    ARENA arena;
+    LVM_NODE *root, *n;
+    LVM_VG *vg;
+    TEST_IMAGE foundation;
+    SECTION section;
+    SOURCE *s;
+    unsigned char buf[16];
+
+    /* Parsing */
+    arena.blocks = NULL;
+    root = parse_metadata(test_lvm_text, strlen(test_lvm_text), &arena);
+    assert(root != NULL);
+    for (n = root; n != NULL && (n->name == NULL ||
+                                 strcmp(n->name, "description") != 0);
+         n = n->next)
+    {
+    }
+    assert(n != NULL && n->kind == NODE_STRING);
+    assert(strcmp(n->value, "say \"hi\"") == 0);
+    assert(parse_metadata("vg { a = [ 1, 2 }", 17, &arena) == NULL);
+    assert(parse_metadata("vg { a = \"x }", 13, &arena) == NULL);
+    assert(parse_metadata("vg { a b }", 10, &arena) == NULL);
+
+    /* The model */
+    vg = build_vg(root, &arena);
+    assert(vg != NULL && strcmp(vg->name, "vg0") == 0);
+    assert(vg->extent_size == TEST_LVM_EXTENT);
+    assert(vg->pv_count == 2 && strcmp(vg->pvs[1].id, "PV-B") == 0);
+    assert(vg->pvs[0].pe_start == TEST_LVM_EXTENT);
+    assert(vg->lv_count == 4);
+    assert(vg->lvs[0].problem == NULL && vg->lvs[0].extents == 6);
+    assert(vg->lvs[0].segments[0].start == 0);
+    assert(vg->lvs[0].segments[2].stripes[0].start == 13);
+    assert(vg->lvs[1].problem == NULL && vg->lvs[1].extents == 4);
+    assert(vg->lvs[1].segments[0].stripe_size == 1024);
+    assert(lv_on_pv(&vg->lvs[1], 0) && !lv_on_pv(&vg->lvs[2], 0));
+    assert(vg->lvs[3].problem != NULL);
+
+    test_lvm_image = (unsigned char *) malloc(TEST_LVM_SIZE);
+    memset(test_lvm_image, 0xaa, TEST_LVM_SIZE);
+    for (u8 pos = 0; pos < 6 * TEST_LVM_EXTENT; pos++)
+    {
+        test_lvm_image[test_lvm_where(0, pos)] = test_image_pattern(pos);
+    }
+    for (u8 pos = 0; pos < 4 * TEST_LVM_EXTENT; pos++)
+    {
+        test_lvm_image[test_lvm_where(1, pos)] = test_image_pattern(pos);
+    }
+    init_test_image(&foundation, test_lvm_image, TEST_LVM_SIZE);
+    init_test_section(&section, &foundation);
+
+    /* Linear: segments that continue each other on disk are read at
+       once, the others aren't. */
+    s = init_lvm_source(&section, vg, &vg->lvs[0], 0);
+    assert(s->size == 6 * TEST_LVM_EXTENT);
+    assert(count_test_reads(&foundation, s, 4 * TEST_LVM_EXTENT - 100, 200,
+                            NULL) == 1);
+    assert(count_test_reads(&foundation, s, 2 * TEST_LVM_EXTENT - 100, 200,
+                            NULL) == 2);
+    check_test_read_all(s, 3000, NULL);
+    assert(s->read_bytes(s, s->size - 10, 100, buf) == 10);
+    close_source(s);
+
+    /* Striped: one read per chunk. */
+    s = init_lvm_source(&section, vg, &vg->lvs[1], 0);
+    assert(s->size == 4 * TEST_LVM_EXTENT);
+    assert(count_test_reads(&foundation, s, 1000, 2100, NULL) == 4);
+    check_test_read_all(s, 700, NULL);
+    close_source(s);
+
+    /* Gaps and other volumes read as zeros, without a read. */
+    vg->lvs[0].segments[0].start = 1;
+    vg->lvs[0].segments[0].count = 1;
+    vg->lvs[0].segments[0].stripes[0].start = 6;
+    vg->lvs[0].segments[1].stripes[0].pv = 1;
+    s = init_lvm_source(&section, vg, &vg->lvs[0], 0);
+    assert(count_test_reads(&foundation, s, 0, TEST_LVM_EXTENT,
+                            test_lvm_gap) == 0);
+    assert(count_test_reads(&foundation, s, 2 * TEST_LVM_EXTENT,
+                            3 * TEST_LVM_EXTENT, test_lvm_gap) == 0);
+    assert(count_test_reads(&foundation, s, TEST_LVM_EXTENT, 100,
+                            test_lvm_gap) == 1);
+    check_test_read_all(s, 3000, test_lvm_gap);
+    close_source(s);
+
+    free(test_lvm_image);
+    arena_release(&arena);
+}
+#endif
+
+/* EOF */
@@ -34,33 +34,68 @@
 #endif
 
 
-#ifdef JSON
-/* Structure storing the information formerly printed. */
-struct file_info given_file;
+/* The analysis the calling thread is working on. */
+THREAD_LOCAL ANALYSIS *current_analysis = NULL;
 
+#ifdef JSON
 /* Assuming latin1 allows to clean strings from undesired characters
  * like quotes and backslashs. */
 int latin1 = 0;
 
 #endif
 
+/* Several files are only analyzed at once if each one ends up in a
+ * document of its own, the plain text output goes straight to stdout.
+ */
+#if defined(USE_THREADS) && defined(JSON)
+#define PARALLEL
+#endif
+
+#ifdef PARALLEL
+/* Number of files analyzed at once, see the -j option. */
+static int jobs = 1;
+
+/* Number of partitions of a file analyzed at once, see the -p option. */
+static int partition_jobs = 1;
+#endif
+
+/* If set, documents are printed as soon as they are finished instead of
+ * in the order the files were given. */
+static int unordered = 0;
+
+/* If set, Linux RAID arrays are put together from the files given and
+ * analyzed after them, see the --raid option. */
+static int assemble_raid = 0;
+
+/* If set, the first piece of a split image stands for all of them, see
+ * the --split option. */
+static int split_images = 0;
+
 
 
 /*
  * local functions
  */
 
+static ANALYSIS *analyze_path(char *path);
+static void print_analysis(ANALYSIS *a);
 static void analyze_file(const char *filename);
+static void analyze_arrays(char *paths[], int count);
+static int drop_split_pieces(char *paths[], int count);
 static void print_kind(int filekind, u8 size, int size_known);
 
 #ifdef USE_MACOS_TYPE
 static void show_macos_type(const char *filename);
 #endif
 
-int test_arg(int argc, char *argv[]);
-int latin1_arg(int argc, char *argv[]);
+static void usage(void);
 int optional_args(int argc, char *argv[]);
 
+#ifdef PARALLEL
+static void analyze_parallel(char *paths[], int count);
+static void *worker(void *arg);
+#endif
+
 
 /*
  * entry point
@@ -69,6 +104,13 @@ int optional_args(int argc, char *argv[]);
 int main(int argc, char *argv[])
 {
     
+  ANALYSIS *a;
+  char **paths;
+  int count;
+
+  /* The tests work on an analysis of their own. */
+  current_analysis = new_analysis();
+
   /* Determine the position of the first argument that is
    * actually a path. */
   int first_path = optional_args(argc, argv);
@@ -76,124 +118,386 @@ int main(int argc, char *argv[])
   /* wrong arguments */
   if (first_path == -1) {return 1;}
 
-  #ifdef JSON
-  given_file.number_of_objects = 0; 
-  #endif
-
-  /* loop over filenames */
   print_line(0, "");
-  for (int i = first_path; i < argc; i++) {
-    analyze_file(argv[i]);
 
-    #ifdef JSON
-    add_file_path(argv[i]);
+  free_analysis(current_analysis);
+  current_analysis = NULL;
 
-    convert_to_json();
-    
-    printf("%s", json_output);
+  paths = argv + first_path;
+  count = argc - first_path;
+  if (split_images)
+    count = drop_split_pieces(paths, count);
 
-    /* Reset all values to analyze the next file. */
-    reset_json(); 
-    #endif
+  #ifdef PARALLEL
+  /* the threads spawning partition tasks work on them as well */
+  if (partition_jobs > 1)
+    start_task_pool(partition_jobs - 1);
 
-    print_line(0, "");
+  if (jobs > 1 && count > 1)
+    analyze_parallel(paths, count);
+  else
+  #endif
+
+  /* loop over filenames */
+  for (int i = 0; i < count; i++) {
+    a = analyze_path(paths[i]);
+    print_analysis(a);
+    free_analysis(a);
   }
 
+  if (assemble_raid)
+    analyze_arrays(paths, count);
+
   return 0;
 }
 
 /* This function handles optional arguments.
+ * They have to precede the paths of the files to be analyzed.
+ * 
+ *   --latin1          interpret textual properties as latin1
+ *   --test            run the tests first
+ *   --cache-mb <N>    limit the memory used for cached data to N MiB,
+ *                     0 means no limit
+ *   -j <N>            analyze up to N files at once
+ *   -p <N>            analyze up to N partitions of a file at once,
+ *                     and decompress bzip2 and BGZF data on N threads
+ *   --unordered       print each document as soon as it is finished
+ *                     instead of in the order the files were given
+ *   --gzip-index      keep the index of gzip compressed files next to
+ *                     them as <file>.dtgzidx and use it in later runs
+ *   --raid            put Linux RAID arrays together from the files
+ *                     given and analyze them as well
+ *   --split           analyze the pieces of a split image (.001, .002,
+ *                     ... or .aa, .ab, ...) as one image, given the
+ *                     first one
  * 
  * It returns the position of the first argument pointing to a file
  * and -1 if there are wrong arguments.
  */
 int optional_args(int argc, char *argv[])
 {
-  /* argument check */
-  
-  /* too few arguments */
-  if (argc < 2) {
-    fprintf(stderr, "Usage: %s [--latin1] [--test] <device/file>...\n", PROGNAME);
-    return -1;
+  int i, run_tests = 0;
+  char *end;
+  long cache_mb, njobs;
+
+  #ifdef JSON
+  latin1 = 0;
+  #endif
+
+  for (i = 1; i < argc && (strncmp(argv[i], "--", 2) == 0 ||
+                            strcmp(argv[i], "-j") == 0 ||
+                            strcmp(argv[i], "-p") == 0); i++)
+  {
+      if (strcmp(argv[i], "--latin1") == 0)
+      {
+          #ifdef JSON
+          /* Use latin1 assumption */
+          latin1 = 1;
+          #endif
+      }
+      else if (strcmp(argv[i], "--test") == 0)
+      {
+          run_tests = 1;
+      }
+      else if (strcmp(argv[i], "--cache-mb") == 0 && i + 1 < argc)
+      {
+          i++;
+          cache_mb = strtol(argv[i], &end, 10);
+          if (*argv[i] == '\0' || *end != '\0' || cache_mb < 0)
+          {
+              usage();
+              return -1;
+          }
+          set_cache_limit((u8)cache_mb * 1024 * 1024);
+      }
+      else if ((strcmp(argv[i], "-j") == 0 || strcmp(argv[i], "-p") == 0)
+               && i + 1 < argc)
+      {
+          i++;
+          njobs = strtol(argv[i], &end, 10);
+          if (*argv[i] == '\0' || *end != '\0' || njobs < 1)
+          {
+              usage();
+              return -1;
+          }
+          #ifdef PARALLEL
+          if (argv[i-1][1] == 'j')
+              jobs = (int)njobs;
+          else
+              partition_jobs = (int)njobs;
+          #endif
+      }
+      else if (strcmp(argv[i], "--unordered") == 0)
+      {
+          unordered = 1;
+      }
+      else if (strcmp(argv[i], "--gzip-index") == 0)
+      {
+          gzip_index = 1;
+      }
+      else if (strcmp(argv[i], "--raid") == 0)
+      {
+          assemble_raid = 1;
+      }
+      else if (strcmp(argv[i], "--split") == 0)
+      {
+          split_images = 1;
+      }
+      else
+      {
+          usage();
+          return -1;
+      }
   }
-  
-  int use_latin = latin1_arg(argc, argv);
-  int run_tests = test_arg(argc, argv);
-  
-  if (use_latin == -1 || run_tests == -1) 
+
+  /* We still need a file path. */
+  if (i >= argc)
   {
-      fprintf(stderr, "Usage: %s [--latin1] [--test] <device/file>...\n", PROGNAME);
+      usage();
       return -1;
   }
 
-  return 1 + use_latin + run_tests;
+  #ifdef JSON
+  if (run_tests) { test(); }
+  #endif
+
+  return i;
 }
 
+static void usage(void)
+{
+  fprintf(stderr, "Usage: %s [--latin1] [--test] [--cache-mb <N>] "
+          "[-j <N>] [-p <N>] [--unordered] [--gzip-index] [--raid] "
+          "[--split] <device/file>...\n", PROGNAME);
+}
 
-/* This function checks whether one of the aruments
- * is --latin1 and the latin1 assumption may be used to
- * clean strings.
- * 
- * It will return 1 if a --latin1 argument is found,
- *                0 if none is found and
- *               -1 if there are wrong arguments.
- * 
+
+/*
+ * Analysis contexts
+ */
+
+ANALYSIS *new_analysis(void)
+{
+  ANALYSIS *a;
+
+  a = (ANALYSIS *)malloc(sizeof(ANALYSIS));
+  if (a == NULL)
+    bailout("Out of memory");
+  memset(a, 0, sizeof(ANALYSIS));
+  return a;
+}
+
+void free_analysis(ANALYSIS *a)
+{
+  ANALYSIS *saved = current_analysis;
+
+  #ifdef JSON
+  /* reset_json() works on the current analysis */
+  current_analysis = a;
+  reset_json();
+  current_analysis = saved;
+  #endif
+
+  free(a);
+}
+
+/*
+ * Analyze one file in an analysis of its own
  */
-int latin1_arg(int argc, char *argv[])
+
+static ANALYSIS *analyze_path(char *path)
 {
-    #ifdef JSON
-    /* Use latin1 assumption */
-    if (strcmp(argv[1], "--latin1") == 0)
-    {
-        latin1 = 1;
-        /* We still need a file path. */
-        if (argc < 3) { return -1; }
+  ANALYSIS *a;
+
+  a = new_analysis();
+  current_analysis = a;
+  a->path = path;
+
+  analyze_file(path);
+  print_line(0, "");
+
+  #ifdef JSON
+  add_file_path(path);
+  #endif
+
+  current_analysis = NULL;
+  return a;
+}
+
+/*
+ * Write the JSON document of a finished analysis to stdout
+ */
+
+static void print_analysis(ANALYSIS *a)
+{
+  #ifdef JSON
+  ANALYSIS *saved = current_analysis;
+  JSON_SINK sink;
+
+  /* convert_to_json() works on the current analysis */
+  current_analysis = a;
+  json_sink_file(&sink, stdout);
+  convert_to_json(&sink);
+  current_analysis = saved;
+  #endif
+}
+
+
+/*
+ * Analyze several files at once
+ */
+
+#ifdef PARALLEL
+
+/* The work shared by all workers. Files are handed out in the order they
+ * were given; finished analyses wait in DONE until all files before
+ * them were printed, unless the output is unordered.
+ */
+static struct {
+  pthread_mutex_t lock;
+  char **paths;
+  int count;
+  int next;          /* next file to hand out */
+  int next_print;    /* next file to print in ordered mode */
+  ANALYSIS **done;
+} batch = { PTHREAD_MUTEX_INITIALIZER };
+
+static void analyze_parallel(char *paths[], int count)
+{
+  pthread_t *threads;
+  int i, started;
+
+  if (jobs > count)
+    jobs = count;
+
+  batch.paths = paths;
+  batch.count = count;
+  batch.done = (ANALYSIS **)malloc(count * sizeof(ANALYSIS *));
+  threads = (pthread_t *)malloc(jobs * sizeof(pthread_t));
+  if (batch.done == NULL || threads == NULL)
+    bailout("Out of memory");
+  memset(batch.done, 0, count * sizeof(ANALYSIS *));
+
+  for (started = 0; started < jobs; started++) {
+    if (pthread_create(&threads[started], NULL, worker, NULL) != 0) {
+      if (started == 0)
+        bailout("Can't start worker threads");
+      error("Can't start more than %d worker threads", started);
+      break;
     }
-    else
-    {
-        latin1 = 0;
+  }
+  for (i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
+
+  free(threads);
+  free(batch.done);
+}
+
+static void *worker(void *arg)
+{
+  ANALYSIS *a;
+  int i;
+
+  for (;;) {
+    pthread_mutex_lock(&batch.lock);
+    i = batch.next++;
+    pthread_mutex_unlock(&batch.lock);
+    if (i >= batch.count)
+      break;
+
+    a = analyze_path(batch.paths[i]);
+
+    /* documents are printed as a whole while holding the lock, so they
+       never interleave */
+    pthread_mutex_lock(&batch.lock);
+    if (unordered) {
+      print_analysis(a);
+      free_analysis(a);
+    } else {
+      batch.done[i] = a;
+      while (batch.next_print < batch.count &&
+             batch.done[batch.next_print] != NULL) {
+        print_analysis(batch.done[batch.next_print]);
+        free_analysis(batch.done[batch.next_print]);
+        batch.done[batch.next_print] = NULL;
+        batch.next_print++;
+      }
     }
-    
-    return latin1;
+    fflush(stdout);
+    pthread_mutex_unlock(&batch.lock);
+  }
+
+  pin_stack_release();
+  return NULL;
+}
+
+#endif
+
+
+/*
+ * Analyze the RAID arrays found among the files, each in an analysis
+ * of its own
+ */
+
+static void analyze_arrays(char *paths[], int count)
+{
+  MD_ARRAY *arrays, *md;
+  ANALYSIS *a;
+
+  arrays = assemble_md_arrays(paths, count);
+  for (md = arrays; md != NULL; md = md->next) {
+    a = new_analysis();
+    current_analysis = a;
+    a->path = md->name;
+
+    analyze_md_array(md);
+    print_line(0, "");
+
+    #ifdef JSON
+    add_file_path(md->name);
     #endif
-    return 0;
+
+    current_analysis = NULL;
+    print_analysis(a);
+    free_analysis(a);
+  }
+  free_md_arrays(arrays);
 }
 
-/* This function checks whether one of the arguments
- * is --test and run tests if this is the case.
- * 
- * It will return 1 if a --test argument is found,
- *                0 if none is found and
- *               -1 if there are wrong arguments.
+
+/*
+ * Leave out the later pieces of split images whose first piece is given
+ * as well, it stands for them; returns the number of paths left
  */
-int test_arg(int argc, char *argv[])
+
+static int drop_split_pieces(char *paths[], int count)
 {
-  /* Test as first argument */
-  if (strcmp(argv[1], "--test") == 0)
-  {
-      /* We still need a file path. */
-      if (argc < 3) { return -1; }
-      #ifdef JSON
-      test();
-      #endif
+  char **pieces;
+  int i, j, k, n, kept, first;
+
+  for (i = 0; i < count; i++) {
+    pieces = find_split_pieces(paths[i], &n);
+    if (pieces == NULL)
+      continue;
+
+    kept = 0;
+    first = i;
+    for (j = 0; j < count; j++) {
+      for (k = 1; k < n; k++) {
+	if (strcmp(paths[j], pieces[k]) == 0)
+	  break;
+      }
+      if (k == n)
+	paths[kept++] = paths[j];
+      else if (j < first)
+	i--;  /* the first piece moves down */
+    }
+    count = kept;
 
-      return 1;
+    free_split_pieces(pieces, n);
   }
 
-  /* Test as second argument. */
-  if (argc < 3) {return 0; }
-  
-  if (strcmp(argv[2], "--test") == 0)
-  {
-      /* We still need a file path. */
-      if (argc < 4) { return -1; }
-      #ifdef JSON
-      test();
-      #endif
-
-      return 1;
-  }  
-  return 0;
+  return count;
 }
 
 
@@ -203,10 +507,10 @@ int test_arg(int argc, char *argv[])
 
 static void analyze_file(const char *filename)
 {
-  int fd, filekind;
+  int fd, filekind, count;
   u8 filesize;
   struct stat sb;
-  char *reason;
+  char *reason, **pieces;
   SOURCE *s;
 
   print_line(0, "--- %s", filename);
@@ -220,8 +524,19 @@ static void analyze_file(const char *filename)
   filekind = 0;
   filesize = 0;
   reason = NULL;
+  s = NULL;
   if (S_ISREG(sb.st_mode)) {
-    filesize = sb.st_size;
+    /* the first piece of a split image stands for the whole image */
+    pieces = split_images ? find_split_pieces(filename, &count) : NULL;
+    if (pieces != NULL) {
+      s = init_split_source(pieces, count);
+      free_split_pieces(pieces, count);
+      if (s == NULL)
+	return;
+      filekind = 3;
+      filesize = s->size;
+    } else
+      filesize = sb.st_size;
     print_kind(filekind, filesize, 1);
   } else if (S_ISBLK(sb.st_mode))
     filekind = 1;
@@ -253,27 +568,29 @@ static void analyze_file(const char *filename)
   if (filekind == 0 && filesize == 0)
     return;
 
-  /* open for reading */
-  fd = open(filename, O_RDONLY);
-  if (fd < 0) {
-    errore("Can't open %.300s", filename);
-    return;
-  }
-
-  /* (try to) guard against TTY character devices */
-  if (filekind == 2) {
-    if (isatty(fd)) {
-      error("%.300s: Is a TTY device", filename);
+  if (s == NULL) {
+    /* open for reading */
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+      errore("Can't open %.300s", filename);
       return;
     }
-  }
 
-  /* create a source */
-  s = init_file_source(fd, filekind);
+    /* (try to) guard against TTY character devices */
+    if (filekind == 2) {
+      if (isatty(fd)) {
+	error("%.300s: Is a TTY device", filename);
+	return;
+      }
+    }
+
+    /* create a source */
+    s = init_file_source(fd, filekind);
 
-  /* tell the user what it is */
-  if (filekind != 0)
-    print_kind(filekind, s->size, s->size_known);
+    /* tell the user what it is */
+    if (filekind != 0)
+      print_kind(filekind, s->size, s->size_known);
+  }
 
   /* now analyze it */
   analyze_source(s, 0);
@@ -288,6 +605,8 @@ static void print_kind(int filekind, u8 size, int size_known)
 
   if (filekind == 0)
     kindname = "Regular file";
+  else if (filekind == 3)
+    kindname = "Split image";
   else if (filekind == 1)
     kindname = "Block device";
   else if (filekind == 2)
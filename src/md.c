@@ -0,0 +1,1095 @@
+/*
+ * md.c
+ * Assembly of Linux MD RAID arrays from their members.
+ *
+ * Copyright (c) 2003 Christoph Pfisterer
+ * Copyright (c) 2018 Felix Baumann on modifications
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "global.h"
+
+/*
+ * Members are recognized by their superblock: version 0.90 near the
+ * end of the device, version 1.0 at the end, 1.1 at the start and 1.2
+ * 4 KiB in. Members with the same array UUID are put in place by their
+ * role. The superblock with the most events describes the array, the
+ * members that saw fewer events are left out as stale.
+ *
+ * The array source maps a read to runs on the members, up to a chunk
+ * each. When the task pool is running, the runs of each member are
+ * read in a task of their own, so a large read keeps all members busy
+ * at once. Read-ahead hints go to all members involved for the same
+ * reason. A RAID5 array missing one member is read by computing the
+ * missing chunks from the others.
+ */
+
+#define MD_MAGIC (0xa92b4efc)
+
+/* more than the superblocks describe in practice */
+#define MAX_MEMBERS (256)
+
+/* runs mapped and read at a time */
+#define BATCH_RUNS (64)
+
+/* mirrors take turns in pieces of this size */
+#define MIRROR_SPAN (256*1024)
+
+/* run members that aren't read from a member */
+#define RUN_ZERO (-1)
+#define RUN_REBUILD (-2)
+
+/*
+ * types
+ */
+
+typedef struct md_member {
+  struct md_member *next;
+  SOURCE *s;
+  const char *path;
+  u1 uuid[16];
+  char uuid_text[40];
+  char name[33];
+  int version;         /* 0 for 0.90, 1 for 1.x */
+  int level, layout, raid_disks;
+  int role;            /* -1 for spares and faulty members */
+  u8 chunk, data_offset, dev_size, events;
+  int reshape;
+} MD_MEMBER;
+
+typedef struct md_set {
+  MD_ARRAY a;
+  MD_MEMBER *members;
+  MD_MEMBER *newest;
+  /* filled in by place_members() */
+  MD_MEMBER **slots;
+  int present, stale, spares;
+  const char *problem;
+} MD_SET;
+
+typedef struct md_source {
+  SOURCE c;
+  int level, layout, raid_disks;
+  u8 chunk, dev_size;
+  SOURCE **members;    /* by role, NULL if missing */
+  u8 *offsets;         /* where the data starts on each */
+  int *present_list;   /* roles of the members present */
+  int present, missing;
+  /* RAID10 geometry */
+  int near, far, far_offset;
+  u8 stride;
+} MD_SOURCE;
+
+typedef struct md_run {
+  int member;          /* role, RUN_ZERO or RUN_REBUILD */
+  u8 off;              /* in the data area of the member */
+  u8 len;
+  unsigned char *out;
+} MD_RUN;
+
+typedef struct md_task {
+  TASK t;
+  MD_SOURCE *ms;
+  MD_RUN *runs;
+  int count, member;
+} MD_TASK;
+
+/*
+ * helper functions
+ */
+
+static int read_superblock(SOURCE *s, MD_MEMBER *m);
+static int read_superblock_0(SOURCE *s, MD_MEMBER *m);
+static int read_superblock_1(SOURCE *s, u8 pos, MD_MEMBER *m);
+static void place_members(MD_SET *set);
+static const char *level_name(int level);
+static SOURCE *init_md_source(int level, int layout, int raid_disks,
+			      u8 chunk, u8 dev_size,
+			      SOURCE **members, u8 *offsets);
+static const char *check_geometry(int level, int layout, int raid_disks,
+				  u8 chunk);
+static void map_run(MD_SOURCE *ms, u8 pos, u8 len, MD_RUN *run);
+static int find_raid10_copy(MD_SOURCE *ms, u8 chunk_no, u8 *dev_off);
+static u8 read_md(SOURCE *s, u8 pos, u8 len, void *buf);
+static void read_runs(MD_SOURCE *ms, MD_RUN *runs, int count);
+static void run_member_task(TASK *t);
+static void read_run(MD_SOURCE *ms, MD_RUN *run);
+static void rebuild_run(MD_SOURCE *ms, MD_RUN *run);
+static void prefetch_md(SOURCE *s, u8 pos, u8 len);
+static void close_md(SOURCE *s);
+
+/*
+ * read the superblocks of the files given and group them by array,
+ * files that aren't members are closed again
+ */
+
+MD_ARRAY *assemble_md_arrays(char *paths[], int count)
+{
+  MD_ARRAY *first, **link;
+  MD_SET *set;
+  MD_MEMBER *m, **tail;
+  struct stat sb;
+  SOURCE *s;
+  int i, fd;
+
+  first = NULL;
+  link = &first;
+  for (i = 0; i < count; i++) {
+    /* problems with the file were reported by its own analysis */
+    if (stat(paths[i], &sb) < 0 ||
+	!(S_ISREG(sb.st_mode) || S_ISBLK(sb.st_mode)))
+      continue;
+    fd = open(paths[i], O_RDONLY);
+    if (fd < 0)
+      continue;
+    s = init_file_source(fd, S_ISREG(sb.st_mode) ? 0 : 1);
+
+    m = (MD_MEMBER *)malloc(sizeof(MD_MEMBER));
+    if (m == NULL)
+      bailout("Out of memory");
+    memset(m, 0, sizeof(MD_MEMBER));
+    if (!read_superblock(s, m)) {
+      close_source(s);
+      free(m);
+      continue;
+    }
+    m->s = s;
+    m->path = paths[i];
+
+    /* find its array, in the order they were first seen */
+    for (set = (MD_SET *)first; set != NULL; set = (MD_SET *)set->a.next)
+      if (memcmp(set->newest->uuid, m->uuid, 16) == 0)
+	break;
+    if (set == NULL) {
+      set = (MD_SET *)malloc(sizeof(MD_SET));
+      if (set == NULL)
+	bailout("Out of memory");
+      memset(set, 0, sizeof(MD_SET));
+      sprintf(set->a.name, "md:%s", m->uuid_text);
+      set->newest = m;
+      *link = (MD_ARRAY *)set;
+      link = &set->a.next;
+    }
+
+    for (tail = &set->members; *tail != NULL; tail = &(*tail)->next)
+      ;
+    *tail = m;
+    if (m->events > set->newest->events)
+      set->newest = m;
+  }
+
+  return first;
+}
+
+/*
+ * describe an array and analyze its contents, as a document of its own
+ */
+
+void analyze_md_array(MD_ARRAY *md)
+{
+  MD_SET *set = (MD_SET *)md;
+  MD_MEMBER *sb = set->newest, *m;
+  SOURCE *src, **members;
+  u8 *offsets, dev_size;
+  int d;
+  char s[256];
+
+  print_line(0, "--- %s", md->name);
+
+  place_members(set);
+
+  /* the member sizes may differ a bit, use what all of them have */
+  src = NULL;
+  if (set->problem == NULL) {
+    members = (SOURCE **)malloc(sb->raid_disks * sizeof(SOURCE *));
+    offsets = (u8 *)malloc(sb->raid_disks * sizeof(u8));
+    if (members == NULL || offsets == NULL)
+      bailout("Out of memory");
+    dev_size = 0;
+    for (d = 0; d < sb->raid_disks; d++) {
+      m = set->slots[d];
+      members[d] = m ? m->s : NULL;
+      offsets[d] = m ? m->data_offset : 0;
+      if (m != NULL && (dev_size == 0 || m->dev_size < dev_size))
+	dev_size = m->dev_size;
+    }
+    src = init_md_source(sb->level, sb->layout, sb->raid_disks,
+			 sb->chunk, dev_size, members, offsets);
+    free(members);
+    free(offsets);
+    if (src == NULL)
+      set->problem = "no data area";
+  }
+
+  if (src != NULL) {
+    format_size_verbose(s, src->size);
+    print_line(0, "Linux RAID array, size %s", s);
+  } else
+    print_line(0, "Linux RAID array, unknown size");
+
+  #ifdef JSON
+  add_file_characteristics("Linux RAID array",
+			   src != NULL ? &src->size : NULL);
+
+  add_content_object(0, "RAID array", "Q79757");
+  add_property("raid_level", (char *)level_name(sb->level));
+  add_property("UUID", sb->uuid_text);
+  if (sb->name[0])
+    add_property("name", sb->name);
+  add_property("superblock_version", sb->version ? "1.x" : "0.90");
+  add_property_int("regular_disks", sb->raid_disks);
+  add_property_int("members_found", set->present);
+  add_property_int("stale_members", set->stale);
+  add_property_int("spare_disks", set->spares);
+  if (sb->level != 1)
+    add_property_u8("chunk_size", sb->chunk);
+  add_property("degraded",
+	       set->present < sb->raid_disks ? "true" : "false");
+  #endif
+
+  print_line(0, "%s set, %d of %d members found",
+	     level_name(sb->level), set->present, sb->raid_disks);
+  print_line(1, "RAID set UUID %s", sb->uuid_text);
+  if (sb->name[0])
+    print_line(1, "Name \"%s\"", sb->name);
+  if (sb->level != 1) {
+    format_size(s, sb->chunk);
+    print_line(1, "Chunk size %s", s);
+  }
+  for (d = 0; set->slots != NULL && d < sb->raid_disks; d++)
+    if (set->slots[d] != NULL)
+      print_line(1, "Member %d: %s", d, set->slots[d]->path);
+  if (set->stale > 0)
+    print_line(1, "%d stale member%s left out", set->stale,
+	       set->stale == 1 ? "" : "s");
+  if (set->spares > 0)
+    print_line(1, "%d spare%s", set->spares, set->spares == 1 ? "" : "s");
+
+  if (src == NULL) {
+    print_line(1, "Not assembled, %s", set->problem);
+    return;
+  }
+
+  analyze_source(src, 1);
+  close_source(src);
+}
+
+/*
+ * close all members and dispose of the arrays
+ */
+
+void free_md_arrays(MD_ARRAY *arrays)
+{
+  MD_ARRAY *next;
+  MD_MEMBER *m, *next_m;
+
+  for (; arrays != NULL; arrays = next) {
+    next = arrays->next;
+    for (m = ((MD_SET *)arrays)->members; m != NULL; m = next_m) {
+      next_m = m->next;
+      close_source(m->s);
+      free(m);
+    }
+    free(((MD_SET *)arrays)->slots);
+    free(arrays);
+  }
+}
+
+/*
+ * superblock parsing, returns 0 if there is none
+ */
+
+static int read_superblock(SOURCE *s, MD_MEMBER *m)
+{
+  u8 sectors;
+
+  if (read_superblock_0(s, m))
+    return 1;
+  if (read_superblock_1(s, 0, m) || read_superblock_1(s, 4096, m))
+    return 1;
+  if (s->size_known && s->size >= 16384) {
+    sectors = s->size / 512;
+    if (read_superblock_1(s, ((sectors - 16) & ~(u8)7) * 512, m))
+      return 1;
+  }
+  return 0;
+}
+
+static int read_superblock_0(SOURCE *s, MD_MEMBER *m)
+{
+  unsigned char buf[4096];
+  u8 pos;
+
+  if (!s->size_known || s->size < 65536 * 2)
+    return 0;
+  pos = (s->size & ~(u8)65535) - 65536;
+  if (get_buffer_real(s, pos, 4096, buf, NULL) < 4096)
+    return 0;
+  if (get_le_long(buf) != MD_MAGIC || get_le_long(buf + 4) != 0 ||
+      get_le_long(buf + 8) != 90)
+    return 0;
+
+  m->version = 0;
+  memcpy(m->uuid, buf + 20, 4);
+  memcpy(m->uuid + 4, buf + 52, 12);
+  sprintf(m->uuid_text, "%08lx:%08lx:%08lx:%08lx",
+	  get_le_long(buf + 20), get_le_long(buf + 52),
+	  get_le_long(buf + 56), get_le_long(buf + 60));
+  m->level = (int)(long)get_le_long(buf + 28);
+  m->raid_disks = (int)get_le_long(buf + 40);
+  m->layout = (int)get_le_long(buf + 256);
+  m->chunk = get_le_long(buf + 260);
+  m->events = ((u8)get_le_long(buf + 160) << 32) | get_le_long(buf + 156);
+  m->data_offset = 0;
+  m->dev_size = (u8)get_le_long(buf + 32) * 1024;
+  if (m->dev_size == 0)
+    m->dev_size = pos;
+
+  /* this_disk: the role, unless it is faulty */
+  m->role = (int)get_le_long(buf + 3980);
+  if (get_le_long(buf + 3984) & 1)
+    m->role = -1;
+  return 1;
+}
+
+static int read_superblock_1(SOURCE *s, u8 pos, MD_MEMBER *m)
+{
+  unsigned char buf[4096];
+  u4 feature_map, dev_number;
+  int i, role;
+
+  if (get_buffer_real(s, pos, 4096, buf, NULL) < 4096)
+    return 0;
+  if (get_le_long(buf) != MD_MAGIC || get_le_long(buf + 4) != 1 ||
+      get_le_quad(buf + 144) != pos / 512)
+    return 0;
+
+  m->version = 1;
+  memcpy(m->uuid, buf + 16, 16);
+  for (i = 0; i < 4; i++)
+    sprintf(m->uuid_text + i * 9, "%02x%02x%02x%02x%s",
+	    buf[16 + i*4], buf[17 + i*4], buf[18 + i*4], buf[19 + i*4],
+	    i < 3 ? ":" : "");
+  get_string(buf + 32, 32, m->name);
+  m->level = (int)(long)get_le_long(buf + 72);
+  m->layout = (int)get_le_long(buf + 76);
+  m->chunk = (u8)get_le_long(buf + 88) * 512;
+  m->raid_disks = (int)get_le_long(buf + 92);
+  m->data_offset = get_le_quad(buf + 128) * 512;
+  m->events = get_le_quad(buf + 200);
+
+  /* RAID0 members may differ in size, the others use the same */
+  m->dev_size = get_le_quad(buf + 80) * 512;
+  if (m->level == 0 || m->dev_size == 0)
+    m->dev_size = get_le_quad(buf + 136) * 512;
+
+  /* a reshape moves data around, a recovering member isn't complete */
+  feature_map = get_le_long(buf + 8);
+  m->reshape = (feature_map & 4) != 0;
+  dev_number = get_le_long(buf + 160);
+  role = -1;
+  if (dev_number < get_le_long(buf + 220) && dev_number < (4096 - 256) / 2)
+    role = get_le_short(buf + 256 + dev_number * 2);
+  if (role >= 0xff00 || (feature_map & 2))
+    role = -1;
+  m->role = role;
+  return 1;
+}
+
+/*
+ * put the members of an array in their slots, leaving out the stale
+ * ones and checking that enough are left
+ */
+
+static void place_members(MD_SET *set)
+{
+  MD_MEMBER *sb = set->newest, *m;
+  const char *problem;
+  int d, missing;
+
+  problem = check_geometry(sb->level, sb->layout, sb->raid_disks,
+			   sb->chunk);
+  if (problem == NULL && sb->reshape)
+    problem = "reshape in progress";
+  if (problem != NULL) {
+    set->problem = problem;
+    return;
+  }
+
+  set->slots = (MD_MEMBER **)malloc(sb->raid_disks * sizeof(MD_MEMBER *));
+  if (set->slots == NULL)
+    bailout("Out of memory");
+  memset(set->slots, 0, sb->raid_disks * sizeof(MD_MEMBER *));
+
+  for (m = set->members; m != NULL; m = m->next) {
+    if (m->events < sb->events || m->level != sb->level ||
+	m->layout != sb->layout || m->raid_disks != sb->raid_disks ||
+	m->chunk != sb->chunk) {
+      set->stale++;
+      continue;
+    }
+    if (m->role < 0 || m->role >= sb->raid_disks ||
+	set->slots[m->role] != NULL) {
+      set->spares++;
+      continue;
+    }
+    set->slots[m->role] = m;
+    set->present++;
+  }
+
+  missing = sb->raid_disks - set->present;
+  if (set->present == 0)
+    set->problem = "no members";
+  else if (sb->level == 0 && missing > 0)
+    set->problem = "members missing";
+  else if (sb->level == 5 && missing > 1)
+    set->problem = "more than one member missing";
+  else if (sb->level == 10) {
+    /* where the chunks go repeats after as many chunks as members */
+    MD_SOURCE probe;
+    SOURCE *members[MAX_MEMBERS];
+    u8 dev_off;
+
+    memset(&probe, 0, sizeof(probe));
+    probe.raid_disks = sb->raid_disks;
+    probe.chunk = sb->chunk;
+    probe.near = sb->layout & 0xff;
+    probe.far = (sb->layout >> 8) & 0xff;
+    probe.members = members;
+    for (d = 0; d < sb->raid_disks; d++)
+      members[d] = set->slots[d] ? set->slots[d]->s : NULL;
+    for (d = 0; d < sb->raid_disks; d++)
+      if (find_raid10_copy(&probe, d, &dev_off) == RUN_ZERO)
+	set->problem = "all copies of some chunks missing";
+  }
+}
+
+static const char *level_name(int level)
+{
+  switch (level) {
+  case 0:
+    return "RAID0";
+  case 1:
+    return "RAID1";
+  case 4:
+    return "RAID4";
+  case 5:
+    return "RAID5";
+  case 6:
+    return "RAID6";
+  case 10:
+    return "RAID10";
+  case -1:
+    return "Linear";
+  case -4:
+    return "Multipath";
+  }
+  return "Unknown";
+}
+
+/*
+ * check the array geometry, returns why it can't be mapped or NULL
+ */
+
+static const char *check_geometry(int level, int layout, int raid_disks,
+				  u8 chunk)
+{
+  int near, far;
+
+  if (level != 0 && level != 1 && level != 5 && level != 10)
+    return "RAID level not supported";
+  if (raid_disks < 1 || raid_disks > MAX_MEMBERS ||
+      (level == 5 && raid_disks < 2))
+    return "invalid number of members";
+  if (level != 1 &&
+      (chunk < 512 || chunk % 512 != 0 || chunk > 0x40000000))
+    return "invalid chunk size";
+  if (level == 5 && (layout < 0 || layout > 5))
+    return "RAID5 layout not supported";
+  if (level == 10) {
+    near = layout & 0xff;
+    far = (layout >> 8) & 0xff;
+    if ((layout & ~0x1ffff) != 0 || near < 1 || far < 1 ||
+	near * far > raid_disks)
+      return "RAID10 layout not supported";
+  }
+  return NULL;
+}
+
+/*
+ * initialize the array source, MEMBERS and OFFSETS are copied; NULL if
+ * the array holds no data
+ */
+
+static SOURCE *init_md_source(int level, int layout, int raid_disks,
+			      u8 chunk, u8 dev_size,
+			      SOURCE **members, u8 *offsets)
+{
+  MD_SOURCE *ms;
+  u8 chunks, size;
+  int d;
+
+  switch (level) {
+  case 0:
+    chunks = dev_size / chunk;
+    size = chunks * chunk * raid_disks;
+    break;
+  case 1:
+    chunks = 0;
+    size = dev_size;
+    break;
+  case 5:
+    chunks = dev_size / chunk;
+    size = chunks * chunk * (raid_disks - 1);
+    break;
+  case 10:
+    chunks = dev_size / chunk;
+    size = chunks / ((layout >> 8) & 0xff) * raid_disks /
+      (layout & 0xff) * chunk;
+    break;
+  default:
+    return NULL;
+  }
+  if (size == 0)
+    return NULL;
+
+  ms = (MD_SOURCE *)malloc(sizeof(MD_SOURCE));
+  if (ms == NULL)
+    bailout("Out of memory");
+  memset(ms, 0, sizeof(MD_SOURCE));
+  ms->members = (SOURCE **)malloc(raid_disks * sizeof(SOURCE *));
+  ms->offsets = (u8 *)malloc(raid_disks * sizeof(u8));
+  ms->present_list = (int *)malloc(raid_disks * sizeof(int));
+  if (ms->members == NULL || ms->offsets == NULL || ms->present_list == NULL)
+    bailout("Out of memory");
+
+  ms->c.size_known = 1;
+  ms->c.size = size;
+  ms->c.read_bytes = read_md;
+  ms->c.prefetch = prefetch_md;
+  ms->c.close = close_md;
+  ms->c.concurrent = 1;
+  ms->level = level;
+  ms->layout = layout;
+  ms->raid_disks = raid_disks;
+  ms->chunk = chunk;
+  ms->dev_size = dev_size;
+  ms->missing = -1;
+  for (d = 0; d < raid_disks; d++) {
+    ms->members[d] = members[d];
+    ms->offsets[d] = offsets[d];
+    if (members[d] != NULL) {
+      ms->present_list[ms->present++] = d;
+      /* stateless translation, as concurrent as what's below */
+      if (!members[d]->concurrent)
+	ms->c.concurrent = 0;
+    } else
+      ms->missing = d;
+  }
+
+  if (level == 10) {
+    ms->near = layout & 0xff;
+    ms->far = (layout >> 8) & 0xff;
+    ms->far_offset = (layout & 0x10000) != 0;
+    if (ms->far_offset)
+      ms->stride = chunk;
+    else
+      ms->stride = chunks / ms->far * chunk;
+  }
+
+  return (SOURCE *)ms;
+}
+
+/*
+ * map the bytes starting at POS up to the end of their chunk
+ */
+
+static void map_run(MD_SOURCE *ms, u8 pos, u8 len, MD_RUN *run)
+{
+  u8 chunk_no, rel, stripe;
+  int n = ms->raid_disks, data_disks, dd, pd, d;
+
+  if (ms->level == 1) {
+    /* the members present take turns */
+    rel = pos % MIRROR_SPAN;
+    run->len = MIRROR_SPAN - rel;
+    run->member = ms->present_list[(pos / MIRROR_SPAN) % ms->present];
+    run->off = pos;
+    if (run->len > len)
+      run->len = len;
+    return;
+  }
+
+  chunk_no = pos / ms->chunk;
+  rel = pos % ms->chunk;
+  run->len = ms->chunk - rel;
+  if (run->len > len)
+    run->len = len;
+
+  switch (ms->level) {
+  case 0:
+    d = (int)(chunk_no % n);
+    run->off = (chunk_no / n) * ms->chunk + rel;
+    break;
+
+  case 10:
+    d = find_raid10_copy(ms, chunk_no, &run->off);
+    run->off += rel;
+    break;
+
+  default:  /* 5 */
+    data_disks = n - 1;
+    stripe = chunk_no / data_disks;
+    dd = (int)(chunk_no % data_disks);
+    switch (ms->layout) {
+    case 0:  /* left asymmetric */
+      pd = data_disks - (int)(stripe % n);
+      d = (dd >= pd) ? dd + 1 : dd;
+      break;
+    case 1:  /* right asymmetric */
+      pd = (int)(stripe % n);
+      d = (dd >= pd) ? dd + 1 : dd;
+      break;
+    case 2:  /* left symmetric */
+      pd = data_disks - (int)(stripe % n);
+      d = (pd + 1 + dd) % n;
+      break;
+    case 3:  /* right symmetric */
+      pd = (int)(stripe % n);
+      d = (pd + 1 + dd) % n;
+      break;
+    case 4:  /* parity first */
+      d = dd + 1;
+      break;
+    default: /* parity last */
+      d = dd;
+      break;
+    }
+    run->off = stripe * ms->chunk + rel;
+    if (d == ms->missing)
+      d = RUN_REBUILD;
+    break;
+  }
+  run->member = d;
+}
+
+/*
+ * find a copy of a RAID10 chunk on a member that is present, the
+ * same way the kernel lays them out; returns RUN_ZERO if there is none
+ */
+
+static int find_raid10_copy(MD_SOURCE *ms, u8 chunk_no, u8 *dev_off)
+{
+  u8 stripe, start, off;
+  int n = ms->raid_disks, dev, d, i, f;
+
+  stripe = chunk_no * ms->near / n;
+  dev = (int)(chunk_no * ms->near % n);
+  if (ms->far_offset)
+    stripe *= ms->far;
+  start = stripe * ms->chunk;
+
+  /* near copies on the following members, each with its far copies */
+  for (i = 0; i < ms->near; i++) {
+    d = dev;
+    off = start;
+    for (f = 0; f < ms->far; f++) {
+      if (ms->members[d] != NULL) {
+	*dev_off = off;
+	return d;
+      }
+      d = (d + ms->near) % n;
+      off += ms->stride;
+    }
+    if (++dev >= n) {
+      dev = 0;
+      start += ms->chunk;
+    }
+  }
+  *dev_off = 0;
+  return RUN_ZERO;
+}
+
+/*
+ * raw read
+ */
+
+static u8 read_md(SOURCE *s, u8 pos, u8 len, void *buf)
+{
+  MD_SOURCE *ms = (MD_SOURCE *)s;
+  MD_RUN runs[BATCH_RUNS];
+  u8 got;
+  int count;
+
+  if (pos >= s->size)
+    return 0;
+  if (len > s->size - pos)
+    len = s->size - pos;
+
+  for (got = 0; got < len; ) {
+    for (count = 0; count < BATCH_RUNS && got < len; count++) {
+      map_run(ms, pos + got, len - got, &runs[count]);
+      runs[count].out = (unsigned char *)buf + got;
+      got += runs[count].len;
+    }
+    read_runs(ms, runs, count);
+  }
+  return got;
+}
+
+/*
+ * read a batch of runs, a task per member if more than one member is
+ * involved and the task pool is running
+ */
+
+static void read_runs(MD_SOURCE *ms, MD_RUN *runs, int count)
+{
+  MD_TASK *tasks;
+  TASK_GROUP group;
+  unsigned char *used;
+  int i, d, spread;
+
+  spread = 0;
+  for (i = 1; i < count; i++)
+    if (runs[i].member >= 0 && runs[i].member != runs[0].member)
+      spread = 1;
+  if (!spread || !task_pool_active()) {
+    for (i = 0; i < count; i++)
+      read_run(ms, &runs[i]);
+    return;
+  }
+
+  tasks = (MD_TASK *)malloc(ms->raid_disks * sizeof(MD_TASK));
+  used = (unsigned char *)malloc(ms->raid_disks);
+  if (tasks == NULL || used == NULL)
+    bailout("Out of memory");
+  memset(used, 0, ms->raid_disks);
+  for (i = 0; i < count; i++)
+    if (runs[i].member >= 0)
+      used[runs[i].member] = 1;
+
+  memset(&group, 0, sizeof(group));
+  for (d = 0; d < ms->raid_disks; d++) {
+    if (!used[d])
+      continue;
+    tasks[d].t.run = run_member_task;
+    tasks[d].ms = ms;
+    tasks[d].runs = runs;
+    tasks[d].count = count;
+    tasks[d].member = d;
+    spawn_task(&tasks[d].t, &group);
+  }
+  /* zeros and rebuilt chunks meanwhile */
+  for (i = 0; i < count; i++)
+    if (runs[i].member < 0)
+      read_run(ms, &runs[i]);
+  wait_task_group_io(&group);
+
+  free(used);
+  free(tasks);
+}
+
+static void run_member_task(TASK *t)
+{
+  MD_TASK *mt = (MD_TASK *)t;
+  int i;
+
+  for (i = 0; i < mt->count; i++)
+    if (mt->runs[i].member == mt->member)
+      read_run(mt->ms, &mt->runs[i]);
+}
+
+static void read_run(MD_SOURCE *ms, MD_RUN *run)
+{
+  u8 got = 0;
+
+  if (run->member == RUN_REBUILD) {
+    rebuild_run(ms, run);
+    return;
+  }
+  if (run->member >= 0)
+    got = get_buffer_real(ms->members[run->member],
+			  ms->offsets[run->member] + run->off, run->len,
+			  run->out, NULL);
+  /* beyond the end of the member or nowhere at all */
+  if (got < run->len)
+    memset(run->out + got, 0, run->len - got);
+}
+
+/*
+ * the chunk of the missing RAID5 member is the XOR of the same place
+ * on all others, parity included
+ */
+
+static void rebuild_run(MD_SOURCE *ms, MD_RUN *run)
+{
+  unsigned char *other;
+  u8 got, i;
+  int d;
+
+  other = (unsigned char *)malloc(run->len);
+  if (other == NULL)
+    bailout("Out of memory");
+  memset(run->out, 0, run->len);
+  for (d = 0; d < ms->raid_disks; d++) {
+    if (ms->members[d] == NULL)
+      continue;
+    got = get_buffer_real(ms->members[d], ms->offsets[d] + run->off,
+			  run->len, other, NULL);
+    for (i = 0; i < got; i++)
+      run->out[i] ^= other[i];
+  }
+  free(other);
+}
+
+/*
+ * pass the hint on to the members, joined where the runs of a member
+ * are next to each other
+ */
+
+static void prefetch_md(SOURCE *s, u8 pos, u8 len)
+{
+  MD_SOURCE *ms = (MD_SOURCE *)s;
+  MD_RUN run;
+  SOURCE *fs;
+  u8 done, *hint_off, *hint_len, off;
+  int d;
+
+  if (pos >= s->size)
+    return;
+  if (len > s->size - pos)
+    len = s->size - pos;
+
+  hint_off = (u8 *)malloc(2 * ms->raid_disks * sizeof(u8));
+  if (hint_off == NULL)
+    bailout("Out of memory");
+  hint_len = hint_off + ms->raid_disks;
+  memset(hint_len, 0, ms->raid_disks * sizeof(u8));
+
+  for (done = 0; done < len; done += run.len) {
+    map_run(ms, pos + done, len - done, &run);
+    for (d = 0; d < ms->raid_disks; d++) {
+      /* a rebuilt chunk needs all others */
+      if (d != run.member && !(run.member == RUN_REBUILD &&
+			       ms->members[d] != NULL))
+	continue;
+      off = ms->offsets[d] + run.off;
+      if (hint_len[d] > 0 && hint_off[d] + hint_len[d] == off) {
+	hint_len[d] += run.len;
+	continue;
+      }
+      fs = ms->members[d];
+      if (hint_len[d] > 0 && fs->prefetch != NULL)
+	fs->prefetch(fs, hint_off[d], hint_len[d]);
+      hint_off[d] = off;
+      hint_len[d] = run.len;
+    }
+  }
+  for (d = 0; d < ms->raid_disks; d++) {
+    fs = ms->members[d];
+    if (hint_len[d] > 0 && fs->prefetch != NULL)
+      fs->prefetch(fs, hint_off[d], hint_len[d]);
+  }
+
+  free(hint_off);
+}
+
+/*
+ * cleanup, the members belong to the array
+ */
+
+static void close_md(SOURCE *s)
+{
+  MD_SOURCE *ms = (MD_SOURCE *)s;
+
+  free(ms->members);
+  free(ms->offsets);
+  free(ms->present_list);
+}
+
+#ifdef JSON
+
+/* Members in memory, each with a data area of TEST_MD_DEV bytes after
+ * TEST_MD_OFFSET bytes of something else. The arrays hold a pattern of
+ * their position.
+ */
+#define TEST_MD_CHUNK (1024)
+#define TEST_MD_DEV (16 * TEST_MD_CHUNK)
+#define TEST_MD_OFFSET (512)
+#define TEST_MD_MEMBERS (4)
+
+static unsigned char test_md_data[TEST_MD_MEMBERS][TEST_MD_OFFSET
+                                                   + TEST_MD_DEV];
+static TEST_IMAGE test_md_members[TEST_MD_MEMBERS];
+
+/* Chunk C of the array goes to member D at chunk ROW. */
+static void test_md_put(int d, u8 row, u8 c)
+{
+    for (int i = 0; i < TEST_MD_CHUNK; i++)
+    {
+        test_md_members[d].data[TEST_MD_OFFSET + row * TEST_MD_CHUNK + i] =
+            test_image_pattern(c * TEST_MD_CHUNK + i);
+    }
+}
+
+/* Sets up members as needed for the layout, all present. */
+static SOURCE *test_md_source(int level, int layout, int n,
+                              SOURCE **members, u8 *offsets)
+{
+    for (int d = 0; d < TEST_MD_MEMBERS; d++)
+    {
+        memset(test_md_data[d], 0, sizeof(test_md_data[d]));
+        init_test_image(&test_md_members[d], test_md_data[d],
+                        sizeof(test_md_data[d]));
+        members[d] = &test_md_members[d].c;
+        offsets[d] = TEST_MD_OFFSET;
+    }
+    return init_md_source(level, layout, n, TEST_MD_CHUNK, TEST_MD_DEV,
+                          members, offsets);
+}
+
+/* This is the main function responsible for tests in this class (md.c). */
+void test_md()
+{
+    SOURCE *members[TEST_MD_MEMBERS], *s;
+    u8 offsets[TEST_MD_MEMBERS];
+    u8 c;
+    int d, parity;
+
+    /* RAID0: chunks go round the members. */
+    s = test_md_source(0, 0, 3, members, offsets);
+    assert(s->size == 3 * TEST_MD_DEV);
+    for (c = 0; c < 48; c++)
+    {
+        test_md_put(c % 3, c / 3, c);
+    }
+    check_test_read_all(s, 3000, NULL);
+    test_md_members[0].reads = test_md_members[1].reads = 0;
+    check_test_read(s, TEST_MD_CHUNK - 10, 20, NULL);
+    assert(test_md_members[0].reads == 1 && test_md_members[1].reads == 1);
+    close_source(s);
+
+    /* RAID1: the mirrors take turns. */
+    s = test_md_source(1, 0, 2, members, offsets);
+    assert(s->size == TEST_MD_DEV);
+    for (c = 0; c < 16; c++)
+    {
+        test_md_put(0, c, c);
+        test_md_put(1, c, c);
+    }
+    check_test_read_all(s, 3000, NULL);
+    close_source(s);
+    members[0] = NULL;
+    test_md_members[0].reads = 0;
+    s = init_md_source(1, 0, 2, TEST_MD_CHUNK, TEST_MD_DEV,
+                       members, offsets);
+    check_test_read_all(s, 3000, NULL);
+    assert(test_md_members[0].reads == 0);
+    close_source(s);
+
+    /* RAID10, two near copies on four members. */
+    s = test_md_source(10, 0x102, 4, members, offsets);
+    assert(s->size == 2 * TEST_MD_DEV);
+    for (c = 0; c < 32; c++)
+    {
+        test_md_put((c % 2) * 2, c / 2, c);
+        test_md_put((c % 2) * 2 + 1, c / 2, c);
+    }
+    check_test_read_all(s, 3000, NULL);
+    close_source(s);
+    members[0] = members[3] = NULL;
+    s = init_md_source(10, 0x102, 4, TEST_MD_CHUNK, TEST_MD_DEV,
+                       members, offsets);
+    check_test_read_all(s, 3000, NULL);
+    close_source(s);
+
+    /* RAID10, two far copies on three members: the second half of each
+       member holds the chunks of the first half, one member on. */
+    s = test_md_source(10, 0x201, 3, members, offsets);
+    assert(s->size == 3 * TEST_MD_DEV / 2);
+    for (c = 0; c < 24; c++)
+    {
+        test_md_put(c % 3, c / 3, c);
+        test_md_put((c + 1) % 3, 8 + c / 3, c);
+    }
+    check_test_read_all(s, 3000, NULL);
+    close_source(s);
+    members[1] = NULL;
+    s = init_md_source(10, 0x201, 3, TEST_MD_CHUNK, TEST_MD_DEV,
+                       members, offsets);
+    check_test_read_all(s, 3000, NULL);
+    close_source(s);
+
+    /* RAID5, left symmetric on four members: the parity moves one
+       member down each stripe, the data starts right after it. */
+    s = test_md_source(5, 2, 4, members, offsets);
+    assert(s->size == 3 * TEST_MD_DEV);
+    for (u8 row = 0; row < 16; row++)
+    {
+        parity = 3 - (int) (row % 4);
+        for (int i = 0; i < 3; i++)
+        {
+            test_md_put((parity + 1 + i) % 4, row, row * 3 + i);
+        }
+        for (int i = 0; i < TEST_MD_CHUNK; i++)
+        {
+            unsigned char x = 0;
+
+            for (d = 0; d < 4; d++)
+            {
+                if (d != parity)
+                {
+                    x ^= test_md_members[d].data[TEST_MD_OFFSET
+                                                 + row * TEST_MD_CHUNK + i];
+                }
+            }
+            test_md_members[parity].data[TEST_MD_OFFSET
+                                         + row * TEST_MD_CHUNK + i] = x;
+        }
+    }
+    check_test_read_all(s, 3000, NULL);
+    close_source(s);
+
+    /* Without member 2, its chunks are computed from the others. */
+    members[2] = NULL;
+    s = init_md_source(5, 2, 4, TEST_MD_CHUNK, TEST_MD_DEV,
+                       members, offsets);
+    check_test_read_all(s, 3000, NULL);
+    for (d = 0; d < 4; d++)
+    {
+        test_md_members[d].reads = 0;
+    }
+    /* chunk 1 is in stripe 0 on member 1, chunk 2 on member 2 */
+    check_test_read(s, TEST_MD_CHUNK, 2 * TEST_MD_CHUNK, NULL);
+    assert(test_md_members[0].reads == 1 && test_md_members[1].reads == 2
+           && test_md_members[3].reads == 1);
+    close_source(s);
+
+    /* Geometry checks. */
+    assert(check_geometry(6, 2, 4, TEST_MD_CHUNK) != NULL);
+    assert(check_geometry(5, 2, 4, 100) != NULL);
+    assert(check_geometry(10, 0x202, 3, TEST_MD_CHUNK) != NULL);
+    assert(check_geometry(1, 0, 2, 0) == NULL);
+}
+#endif
+
+/* EOF */
@@ -0,0 +1,675 @@
+/*
+ * qcow.c
+ * Layered data source for QEMU qcow2 disk images.
+ *
+ * Copyright (c) 2018 Felix Baumann
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "global.h"
+
+#ifdef USE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
+
+/*
+ * Guest clusters are found through two levels of tables. The L1 table
+ * is small and read up front, L2 tables take a cluster each and are
+ * kept in a small LRU cache. Clusters that are next to each other both
+ * in the guest and in the image are read in one go, unallocated ones
+ * cost no I/O at all.
+ */
+
+/*
+ * constants
+ */
+
+#define QCOW_OFFSET_MASK (0x00fffffffffffe00ULL)
+#define QCOW_COMPRESSED (1ULL << 62)
+#define QCOW_ZERO (1ULL)
+
+/* incompatible features we can't do without */
+#define QCOW_INCOMPAT_DATA_FILE (1ULL << 2)
+#define QCOW_INCOMPAT_EXTL2 (1ULL << 4)
+#define QCOW_INCOMPAT_KNOWN (0x1fULL)
+
+#define L2_CACHE_SIZE (16)
+
+/* the kinds of runs */
+#define RUN_DATA (0)
+#define RUN_ZERO (1)
+#define RUN_COMPRESSED (2)
+
+/*
+ * types
+ */
+
+typedef struct l2_table {
+  u8 offset;    /* in the image, 0 if the slot is free */
+  u8 last_use;
+  unsigned char *entries;
+} L2_TABLE;
+
+typedef struct qcow_source {
+  SOURCE c;
+  u8 off;
+  int cluster_bits, l2_bits;
+  u4 cluster_size;
+  int compression_type;  /* 0 deflate, 1 zstd */
+  u4 l1_size;
+  unsigned char *l1;
+  L2_TABLE l2_cache[L2_CACHE_SIZE];
+  u8 l2_clock;
+  /* the compressed cluster decompressed last, its number plus one */
+  u8 inflated_cluster;
+  unsigned char *inflated, *deflated;
+  int inflate_failed;
+} QCOW_SOURCE;
+
+/*
+ * helper functions
+ */
+
+static SOURCE *init_qcow_source(SECTION *section, int level,
+				unsigned char *header, u8 total_size);
+static u8 get_l2_entry(QCOW_SOURCE *qs, u8 cluster);
+static unsigned char *get_l2_table(QCOW_SOURCE *qs, u8 offset);
+static u8 find_run(QCOW_SOURCE *qs, u8 pos, u8 len, int *kind, u8 *where);
+static unsigned char *inflate_cluster(QCOW_SOURCE *qs, u8 cluster,
+				      u8 entry);
+static u8 read_qcow(SOURCE *s, u8 pos, u8 len, void *buf);
+static void close_qcow(SOURCE *s);
+
+/*
+ * qcow image detection
+ */
+
+void detect_qcow(SECTION *section, int level)
+{
+  unsigned char *buf, header[112];
+  u4 version, cluster_bits, crypt_method, backing_size, header_length;
+  u8 total_size, backing_offset, incompatible;
+  char s[256], backing[1024];
+  SOURCE *src;
+
+  if (get_buffer(section, 0, 112, (void **)&buf) < 72)
+    return;
+  if (memcmp(buf, "QFI\xfb", 4) != 0)
+    return;
+  memset(header, 0, 112);
+  memcpy(header, buf, 72);
+
+  version = get_be_long(header + 4);
+  if (version == 1) {
+    print_line(level, "QEMU QCOW disk image, version 1");
+    #ifdef JSON
+    add_content_object(level, "QEMU qcow disk image", "Q592312");
+    add_property_u4("version", version);
+    #endif
+    stop_detect();
+    return;
+  }
+  if (version != 2 && version != 3)
+    return;
+
+  /* version 3 headers are longer, and may say so */
+  header_length = 72;
+  if (version == 3) {
+    if (get_buffer(section, 0, 112, (void **)&buf) < 104)
+      return;
+    header_length = get_be_long(buf + 100);
+    if (header_length > 112)
+      header_length = 112;
+    if (header_length < 104)
+      header_length = 104;
+    memcpy(header, buf, header_length);
+  }
+
+  backing_offset = get_be_quad(header + 8);
+  backing_size = get_be_long(header + 16);
+  cluster_bits = get_be_long(header + 20);
+  total_size = get_be_quad(header + 24);
+  crypt_method = get_be_long(header + 32);
+  incompatible = (version == 3) ? get_be_quad(header + 72) : 0;
+
+  print_line(level, "QEMU QCOW2 disk image, version %lu", version);
+  #ifdef JSON
+  add_content_object(level, "QEMU qcow2 disk image", "Q592312");
+  add_property_u4("version", version);
+  add_property_u8("disk_size", total_size);
+  #endif
+  format_size_verbose(s, total_size);
+  print_line(level + 1, "Disk size %s", s);
+
+  if (cluster_bits < 9 || cluster_bits > 21) {
+    print_line(level + 1, "Error: Invalid cluster size (%lu bits)",
+	       cluster_bits);
+    stop_detect();
+    return;
+  }
+  format_size(s, (u8)1 << cluster_bits);
+  print_line(level + 1, "Cluster size %s", s);
+  #ifdef JSON
+  add_property_u4("cluster_size", (u4)1 << cluster_bits);
+  #endif
+
+  if (backing_offset != 0 && backing_size > 0) {
+    /* unallocated clusters come from there, we show zeros instead */
+    if (backing_size > 1023)
+      backing_size = 1023;
+    if (get_buffer_real(section->source, section->pos + backing_offset,
+			backing_size, backing, NULL) == backing_size) {
+      backing[backing_size] = 0;
+      print_line(level + 1, "Backing file %s", backing);
+      #ifdef JSON
+      add_property("backing_file", backing);
+      #endif
+    }
+  }
+
+  if (crypt_method != 0) {
+    print_line(level + 1, "Encrypted, contents not analyzed");
+    #ifdef JSON
+    add_property("encrypted", "true");
+    #endif
+  } else if (incompatible & QCOW_INCOMPAT_DATA_FILE) {
+    print_line(level + 1, "Data in an external file, contents not analyzed");
+  } else if (incompatible & QCOW_INCOMPAT_EXTL2) {
+    print_line(level + 1,
+	       "Extended L2 entries not supported, contents not analyzed");
+  } else if (incompatible & ~QCOW_INCOMPAT_KNOWN) {
+    print_line(level + 1,
+	       "Unknown incompatible features, contents not analyzed");
+  } else {
+    src = init_qcow_source(section, level, header, total_size);
+    if (src != NULL) {
+      analyze_source(src, level);
+      close_source(src);
+    }
+  }
+
+  stop_detect();
+}
+
+/*
+ * initialize the mapping source
+ */
+
+static SOURCE *init_qcow_source(SECTION *section, int level,
+				unsigned char *header, u8 total_size)
+{
+  QCOW_SOURCE *qs;
+  u8 l1_offset, l1_len;
+  int i;
+
+  qs = (QCOW_SOURCE *)malloc(sizeof(QCOW_SOURCE));
+  if (qs == NULL)
+    bailout("Out of memory");
+  memset(qs, 0, sizeof(QCOW_SOURCE));
+
+  qs->c.size_known = 1;
+  qs->c.size = total_size;
+  qs->c.foundation = section->source;
+  qs->c.read_bytes = read_qcow;
+  qs->c.close = close_qcow;
+  qs->off = section->pos;
+
+  qs->cluster_bits = get_be_long(header + 20);
+  qs->cluster_size = (u4)1 << qs->cluster_bits;
+  qs->l2_bits = qs->cluster_bits - 3;  /* 8 bytes per entry */
+  if (get_be_long(header + 4) == 3 && get_be_long(header + 100) > 104)
+    qs->compression_type = header[104];
+
+  /* the L1 table must cover the whole disk */
+  qs->l1_size = get_be_long(header + 36);
+  l1_offset = get_be_quad(header + 40);
+  if (((u8)qs->l1_size << (qs->l2_bits + qs->cluster_bits)) < total_size ||
+      qs->l1_size > 0x2000000) {
+    print_line(level + 1, "Error: L1 table too small for the disk size");
+    goto errorexit;
+  }
+  l1_len = (u8)qs->l1_size * 8;
+  qs->l1 = (unsigned char *)malloc(l1_len + 1);
+  if (qs->l1 == NULL)
+    bailout("Out of memory");
+  if (get_buffer_real(section->source, qs->off + l1_offset, l1_len,
+		      qs->l1, NULL) < l1_len) {
+    print_line(level + 1, "Error reading the L1 table");
+    goto errorexit;
+  }
+
+  for (i = 0; i < L2_CACHE_SIZE; i++) {
+    qs->l2_cache[i].entries = (unsigned char *)malloc(qs->cluster_size);
+    if (qs->l2_cache[i].entries == NULL)
+      bailout("Out of memory");
+  }
+
+  return (SOURCE *)qs;
+
+errorexit:
+  close_qcow((SOURCE *)qs);
+  free(qs);
+  return NULL;
+}
+
+/*
+ * get the L2 entry of a guest cluster, 0 if it isn't allocated
+ */
+
+static u8 get_l2_entry(QCOW_SOURCE *qs, u8 cluster)
+{
+  u8 l1_index, l2_offset;
+  unsigned char *table;
+
+  l1_index = cluster >> qs->l2_bits;
+  if (l1_index >= qs->l1_size)
+    return 0;
+  l2_offset = get_be_quad(qs->l1 + l1_index * 8) & QCOW_OFFSET_MASK;
+  if (l2_offset == 0)
+    return 0;
+
+  table = get_l2_table(qs, l2_offset);
+  if (table == NULL)
+    return 0;
+  return get_be_quad(table + (cluster & ((1 << qs->l2_bits) - 1)) * 8);
+}
+
+/*
+ * get an L2 table from the cache, reading it in place of the one used
+ * least recently if needed; NULL if it can't be read
+ */
+
+static unsigned char *get_l2_table(QCOW_SOURCE *qs, u8 offset)
+{
+  L2_TABLE *t, *victim;
+  int i;
+
+  victim = &qs->l2_cache[0];
+  for (i = 0; i < L2_CACHE_SIZE; i++) {
+    t = &qs->l2_cache[i];
+    if (t->offset == offset) {
+      t->last_use = ++qs->l2_clock;
+      return t->entries;
+    }
+    if (t->last_use < victim->last_use)
+      victim = t;
+  }
+
+  victim->offset = 0;
+  victim->last_use = 0;
+  if (get_buffer_real(qs->c.foundation, qs->off + offset, qs->cluster_size,
+		      victim->entries, NULL) < qs->cluster_size)
+    return NULL;
+  victim->offset = offset;
+  victim->last_use = ++qs->l2_clock;
+  return victim->entries;
+}
+
+/*
+ * find out how much from POS on, up to LEN bytes, is alike: data in
+ * the image at WHERE, zeros, or a single compressed cluster with the
+ * L2 entry in WHERE; returns 0 past the end
+ */
+
+static u8 find_run(QCOW_SOURCE *qs, u8 pos, u8 len, int *kind, u8 *where)
+{
+  u8 cluster, rel, run, entry, host, next_host;
+  int next_kind;
+
+  if (pos >= qs->c.size)
+    return 0;
+  if (len > qs->c.size - pos)
+    len = qs->c.size - pos;
+
+  cluster = pos >> qs->cluster_bits;
+  rel = pos & (qs->cluster_size - 1);
+  run = qs->cluster_size - rel;
+
+  entry = get_l2_entry(qs, cluster);
+  host = entry & QCOW_OFFSET_MASK;
+  if (entry & QCOW_COMPRESSED) {
+    *kind = RUN_COMPRESSED;
+    *where = entry;
+    return (run < len) ? run : len;
+  }
+  if ((entry & QCOW_ZERO) || host == 0) {
+    *kind = RUN_ZERO;
+  } else {
+    *kind = RUN_DATA;
+    *where = qs->off + host + rel;
+  }
+
+  /* take the following clusters along while they are alike */
+  next_host = host + qs->cluster_size;
+  while (run < len) {
+    entry = get_l2_entry(qs, ++cluster);
+    if (entry & QCOW_COMPRESSED)
+      break;
+    next_kind = ((entry & QCOW_ZERO) || (entry & QCOW_OFFSET_MASK) == 0) ?
+      RUN_ZERO : RUN_DATA;
+    if (next_kind != *kind ||
+	(next_kind == RUN_DATA && (entry & QCOW_OFFSET_MASK) != next_host))
+      break;
+    run += qs->cluster_size;
+    next_host += qs->cluster_size;
+  }
+
+  return (run < len) ? run : len;
+}
+
+/*
+ * decompress a compressed cluster, keeping it for the next read;
+ * NULL if that's not possible
+ */
+
+static unsigned char *inflate_cluster(QCOW_SOURCE *qs, u8 cluster,
+				      u8 entry)
+{
+  int x;
+  u8 offset, sectors, in_len;
+
+  if (qs->inflated_cluster == cluster + 1)
+    return qs->inflated;
+  if (qs->inflated == NULL) {
+    qs->inflated = (unsigned char *)malloc(qs->cluster_size);
+    qs->deflated = (unsigned char *)malloc(2 * qs->cluster_size);
+    if (qs->inflated == NULL || qs->deflated == NULL)
+      bailout("Out of memory");
+  }
+  qs->inflated_cluster = 0;
+
+  /* the offset and the number of 512-byte sectors after the first one */
+  x = 62 - (qs->cluster_bits - 8);
+  offset = entry & (((u8)1 << x) - 1);
+  sectors = (entry >> x) & (((u8)1 << (qs->cluster_bits - 8)) - 1);
+  in_len = (sectors + 1) * 512 - (offset & 511);
+  /* the last cluster may end before the sectors do */
+  in_len = get_buffer_real(qs->c.foundation, qs->off + offset, in_len,
+			   qs->deflated, NULL);
+
+#ifdef USE_ZLIB
+  if (qs->compression_type == 0) {
+    z_stream zs;
+    int result;
+
+    memset(&zs, 0, sizeof(zs));
+    /* raw deflate data, no header */
+    if (inflateInit2(&zs, -15) != Z_OK)
+      bailout("Can't initialize zlib");
+    zs.next_in = qs->deflated;
+    zs.avail_in = (uInt)in_len;
+    zs.next_out = qs->inflated;
+    zs.avail_out = qs->cluster_size;
+    result = inflate(&zs, Z_FINISH);
+    inflateEnd(&zs);
+    if ((result == Z_STREAM_END || result == Z_OK || result == Z_BUF_ERROR)
+	&& zs.avail_out == 0) {
+      qs->inflated_cluster = cluster + 1;
+      return qs->inflated;
+    }
+  }
+#endif
+#ifdef USE_ZSTD
+  if (qs->compression_type == 1) {
+    ZSTD_DStream *zds;
+    ZSTD_inBuffer in;
+    ZSTD_outBuffer out;
+    size_t result;
+
+    zds = ZSTD_createDStream();
+    if (zds == NULL || ZSTD_isError(ZSTD_initDStream(zds)))
+      bailout("Can't initialize libzstd");
+    in.src = qs->deflated;
+    in.size = in_len;
+    in.pos = 0;
+    out.dst = qs->inflated;
+    out.size = qs->cluster_size;
+    out.pos = 0;
+    /* the sectors may hold more than the frame, stop when it's all there */
+    do {
+      result = ZSTD_decompressStream(zds, &out, &in);
+    } while (!ZSTD_isError(result) && out.pos < out.size &&
+	     in.pos < in.size);
+    ZSTD_freeDStream(zds);
+    if (!ZSTD_isError(result) && out.pos == out.size) {
+      qs->inflated_cluster = cluster + 1;
+      return qs->inflated;
+    }
+  }
+#endif
+
+  if (!qs->inflate_failed) {
+    qs->inflate_failed = 1;
+    error("qcow2: can't decompress a compressed cluster, "
+	  "reading it as zeros");
+  }
+  return NULL;
+}
+
+/*
+ * mapping read
+ */
+
+static u8 read_qcow(SOURCE *s, u8 pos, u8 len, void *buf)
+{
+  QCOW_SOURCE *qs = (QCOW_SOURCE *)s;
+  u8 got, run, where;
+  unsigned char *data, *out;
+  int kind;
+
+  for (got = 0; got < len; got += run) {
+    run = find_run(qs, pos + got, len - got, &kind, &where);
+    if (run == 0)
+      break;
+    out = (unsigned char *)buf + got;
+
+    if (kind == RUN_DATA) {
+      if (get_buffer_real(s->foundation, where, run, out, NULL) < run)
+	break;
+    } else if (kind == RUN_COMPRESSED) {
+      data = inflate_cluster(qs, (pos + got) >> qs->cluster_bits, where);
+      if (data != NULL)
+	memcpy(out, data + ((pos + got) & (qs->cluster_size - 1)), run);
+      else
+	memset(out, 0, run);
+    } else {
+      /* unallocated or zeroed, nothing to read */
+      memset(out, 0, run);
+    }
+  }
+  return got;
+}
+
+/*
+ * cleanup
+ */
+
+static void close_qcow(SOURCE *s)
+{
+  QCOW_SOURCE *qs = (QCOW_SOURCE *)s;
+  int i;
+
+  free(qs->l1);
+  for (i = 0; i < L2_CACHE_SIZE; i++)
+    free(qs->l2_cache[i].entries);
+  free(qs->inflated);
+  free(qs->deflated);
+}
+
+#ifdef JSON
+
+/* An image in memory with clusters of 512 bytes, so each L2 table
+ * covers 64 clusters, and two tables more than fit in the cache. The
+ * guest clusters repeat a pattern of eight: four stored one after the
+ * other, one with the zero flag over junk, one unallocated, one
+ * compressed (if we can compress) and one stored by itself.
+ */
+#define TEST_QCOW_BITS (9)
+#define TEST_QCOW_CLUSTER (512)
+#define TEST_QCOW_TABLES (L2_CACHE_SIZE + 2)
+#define TEST_QCOW_CLUSTERS (TEST_QCOW_TABLES * 64)
+#define TEST_QCOW_DATA ((2 + TEST_QCOW_TABLES) * TEST_QCOW_CLUSTER)
+
+static unsigned char *test_qcow_image;
+
+/* Guest cluster kinds, in the order of the pattern above. */
+static int test_qcow_kind(u8 cluster)
+{
+    static const int kinds[8] = { RUN_DATA, RUN_DATA, RUN_DATA, RUN_DATA,
+                                  RUN_ZERO, -1, RUN_COMPRESSED, RUN_DATA };
+
+    return kinds[cluster % 8];
+}
+
+/* Builds the image, returns its size. */
+static u8 make_test_qcow()
+{
+    u8 at = TEST_QCOW_DATA, entry;
+    unsigned char data[TEST_QCOW_CLUSTER];
+    unsigned char *l2;
+
+    memset(test_qcow_image, 0, TEST_QCOW_DATA);
+    memcpy(test_qcow_image, "QFI\xfb", 4);
+    put_test_be(test_qcow_image + 4, 2, 4);
+    put_test_be(test_qcow_image + 20, TEST_QCOW_BITS, 4);
+    put_test_be(test_qcow_image + 24,
+                (u8) TEST_QCOW_CLUSTERS * TEST_QCOW_CLUSTER, 8);
+    put_test_be(test_qcow_image + 36, TEST_QCOW_TABLES, 4);
+    put_test_be(test_qcow_image + 40, TEST_QCOW_CLUSTER, 8);
+
+    for (u8 c = 0; c < TEST_QCOW_CLUSTERS; c++)
+    {
+        if (c % 64 == 0)
+        {
+            /* flags in the L1 entry are to be ignored */
+            put_test_be(test_qcow_image + TEST_QCOW_CLUSTER + c / 64 * 8,
+                        (1ULL << 63) | (2 + c / 64) * TEST_QCOW_CLUSTER, 8);
+        }
+        l2 = test_qcow_image + (2 + c / 64) * TEST_QCOW_CLUSTER;
+
+        for (u4 i = 0; i < TEST_QCOW_CLUSTER; i++)
+        {
+            data[i] = test_image_pattern(c * TEST_QCOW_CLUSTER + i);
+        }
+        entry = 0;
+        switch (test_qcow_kind(c))
+        {
+        case RUN_DATA:
+            memcpy(test_qcow_image + at, data, TEST_QCOW_CLUSTER);
+            entry = (1ULL << 63) | at;
+            at += TEST_QCOW_CLUSTER;
+            break;
+        case RUN_ZERO:
+            memset(test_qcow_image + at, 0xaa, TEST_QCOW_CLUSTER);
+            entry = at | QCOW_ZERO;
+            at += TEST_QCOW_CLUSTER;
+            break;
+        case RUN_COMPRESSED:
+#ifdef USE_ZLIB
+        {
+            z_stream zs;
+            u8 len;
+
+            memset(&zs, 0, sizeof(zs));
+            assert(deflateInit2(&zs, 9, Z_DEFLATED, -12, 8,
+                                Z_DEFAULT_STRATEGY) == Z_OK);
+            zs.next_in = data;
+            zs.avail_in = TEST_QCOW_CLUSTER;
+            zs.next_out = test_qcow_image + at + 100;
+            zs.avail_out = 2 * TEST_QCOW_CLUSTER - 100;
+            assert(deflate(&zs, Z_FINISH) == Z_STREAM_END);
+            len = 2 * TEST_QCOW_CLUSTER - 100 - zs.avail_out;
+            deflateEnd(&zs);
+            /* one bit for the sectors after the first, at bit 61 */
+            entry = QCOW_COMPRESSED | (at + 100) |
+                ((u8) ((100 + len + 511) / 512 - 1) << 61);
+            at += 2 * TEST_QCOW_CLUSTER;
+        }
+#else
+            memcpy(test_qcow_image + at, data, TEST_QCOW_CLUSTER);
+            entry = at;
+            at += TEST_QCOW_CLUSTER;
+#endif
+            break;
+        }
+        put_test_be(l2 + c % 64 * 8, entry, 8);
+    }
+    return at;
+}
+
+/* Whether the byte at POS reads as zero. */
+static int test_qcow_zero(u8 pos)
+{
+    int kind = test_qcow_kind(pos / TEST_QCOW_CLUSTER);
+
+    return kind == RUN_ZERO || kind == -1;
+}
+
+/* This is the main function responsible for tests in this class (qcow.c). */
+void test_qcow()
+{
+    TEST_IMAGE foundation;
+    SECTION section;
+    SOURCE *s;
+    u8 total = (u8) TEST_QCOW_CLUSTERS * TEST_QCOW_CLUSTER;
+
+    test_qcow_image = (unsigned char *) malloc(TEST_QCOW_DATA
+                                               + TEST_QCOW_CLUSTERS * 2
+                                               * TEST_QCOW_CLUSTER);
+    init_test_image(&foundation, test_qcow_image, make_test_qcow());
+    init_test_section(&section, &foundation);
+
+    /* The L1 table only. */
+    s = init_qcow_source(&section, 0, test_qcow_image, total);
+    assert(s != NULL && s->size == total && foundation.reads == 1);
+
+    /* The L2 table, then four clusters in one go; zero and unallocated
+       clusters need no reads at all. */
+    assert(count_test_reads(&foundation, s, 100, 2000, test_qcow_zero) == 2);
+    assert(count_test_reads(&foundation, s, 4 * TEST_QCOW_CLUSTER,
+                            2 * TEST_QCOW_CLUSTER, test_qcow_zero) == 0);
+
+#ifdef USE_ZLIB
+    /* A compressed cluster is read once, then kept. */
+    assert(count_test_reads(&foundation, s, 6 * TEST_QCOW_CLUSTER, 100,
+                            test_qcow_zero) == 1);
+    assert(count_test_reads(&foundation, s, 6 * TEST_QCOW_CLUSTER + 100,
+                            300, test_qcow_zero) == 0);
+#endif
+
+    /* After all of it, the last L2 tables are cached, the first ones
+       were evicted. */
+    check_test_read_all(s, 4000, test_qcow_zero);
+    assert(count_test_reads(&foundation, s, total - TEST_QCOW_CLUSTER, 100,
+                            test_qcow_zero) == 1);
+    assert(count_test_reads(&foundation, s, 0, 100, test_qcow_zero) == 2);
+    assert(s->read_bytes(s, total - 10, 100, test_qcow_image) == 10);
+
+    close_source(s);
+    free(test_qcow_image);
+}
+#endif
+
+/* EOF */
@@ -53,6 +53,8 @@ void initialize_String(String *str, size_t init_size)
     
     // Allocate memory.
     str->string = (char *)malloc(init_size * sizeof(char));
+    if (str->string == NULL)
+        bailout("Out of memory");
     
     str->string[0] = '\0';
     str->used_size = 1;
@@ -60,6 +62,36 @@ void initialize_String(String *str, size_t init_size)
 }
 
 
+/* Makes sure there's room for EXTRA more chars in the String,
+ * so appending them won't allocate memory again.
+ * 
+ * The String grows to at least twice its size. This way appending
+ * chars one by one costs constant time on average.
+ * 
+ * *STR pointer to the String
+ * 
+ * EXTRA number of chars to make room for, not counting the '\0'
+ */
+void reserve_String(String *str, size_t extra)
+{
+    size_t needed = str->used_size + extra;
+    size_t size;
+
+    if (needed <= str->total_size) {return;}
+
+    size = str->total_size * 2;
+    if (size < needed)
+    {
+        size = needed;
+    }
+
+    str->string = (char *)realloc(str->string, size * sizeof(char));
+    if (str->string == NULL)
+        bailout("Out of memory");
+    str->total_size = size;
+}
+
+
 /* Appends a single char to the string. 
  * If the string isn't large enough, expands it.
  * Makes sure, that the char array always ends with a '\0'
@@ -81,12 +113,7 @@ void insert_single_char(String *str, char element)
     if (element == '\0') {return;}
 
     /* If the String is entirely filled, expand it. */
-    if(str->used_size == str->total_size)
-    {
-        str->total_size *= 1.5;
-        str->string = (char *)realloc(str->string,
-                                      str->total_size * sizeof(char));
-    }
+    reserve_String(str, 1);
     
     /* Replace the '\0' at the end by the new char. */
     str->string[str->used_size-1] = element;
@@ -98,6 +125,36 @@ void insert_single_char(String *str, char element)
 }
 
 
+/* Appends LENGTH chars to the string in one go.
+ * Like insert_single_char(), it won't add a '\0', the chars end
+ * at the first one, if there is one.
+ * Note that the String has to be initialized first.
+ * 
+ * *STR pointer to the String
+ * 
+ * APPEND chars which should be appended to the String pointed at
+ * 
+ * LENGTH number of chars in APPEND
+ */
+void insert_n_chars(String *str, const char *append, size_t length)
+{
+    const char *end = memchr(append, '\0', length);
+
+    if (end != NULL)
+    {
+        length = end - append;
+    }
+    if (length == 0) {return;}
+
+    reserve_String(str, length);
+
+    /* Overwrite the '\0' at the end and append a new one. */
+    memcpy(str->string + str->used_size - 1, append, length);
+    str->used_size += length;
+    str->string[str->used_size - 1] = '\0';
+}
+
+
 /* Appends several chars to the string. 
  * Note that the String has to be initialized first.
  * 
@@ -107,10 +164,7 @@ void insert_single_char(String *str, char element)
  */
 void insert_chars(String *str, char append[])
 {
-    for (int i = 0; i < strlen(append); i++)
-    {
-        insert_single_char(str, append[i]);
-    }
+    insert_n_chars(str, append, strlen(append));
 }
 
 
@@ -123,10 +177,34 @@ void insert_chars(String *str, char append[])
  */
 void insert_string(String *str, String *append)
 {
-    for (int i = 0; i < append->used_size; i++)
-    {
-        insert_single_char(str, append->string[i]);
-    }
+    insert_n_chars(str, append->string, append->used_size - 1);
+}
+
+
+/* Appends formatted text to the string, like printf() would print it.
+ * Note that the String has to be initialized first.
+ * 
+ * *STR pointer to the String
+ * 
+ * FORMAT the printf() format, followed by its arguments
+ */
+void insert_printf(String *str, const char *format, ...)
+{
+    va_list args;
+    int length;
+
+    /* Measure first, then print right into the String. */
+    va_start(args, format);
+    length = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+    if (length <= 0) {return;}
+
+    reserve_String(str, length);
+
+    va_start(args, format);
+    vsnprintf(str->string + str->used_size - 1, length + 1, format, args);
+    va_end(args);
+    str->used_size += length;
 }
 
 
@@ -161,6 +239,26 @@ void free_String(String *str)
 }
 
 
+/* Initializes a String with a copy of a char array, using memory of
+ * an arena. Such a String is full and must neither be extended nor
+ * freed, its memory goes away along with the arena.
+ *
+ * *STR pointer to the String structure to be initialized.
+ *
+ * ARENA the arena providing the memory.
+ *
+ * CHARS the char array to be copied.
+ */
+void arena_String(String *str, ARENA *arena, char chars[])
+{
+    size_t len = strlen(chars);
+
+    str->string = (char *)arena_alloc(arena, len + 1);
+    memcpy(str->string, chars, len + 1);
+    str->used_size = str->total_size = len + 1;
+}
+
+
 
 // -----------------------------------------------------------
 //                             TESTS
@@ -239,8 +337,9 @@ void test_insert_String()
 
     insert_string(&str, &insert);
 
+    /* Doubling isn't enough here, it grows to what's needed. */
     assert(str.used_size == 7);
-    assert(str.total_size == 9);
+    assert(str.total_size == 7);
     assert(str.string[0] == ' ');
     assert(str.string[1] == 'h');
     assert(str.string[2] == 'e');
@@ -278,6 +377,84 @@ void test_extract_chars()
     assert(x[5] == '\0');   
 }
 
+void test_reserve_String()
+{
+    String str;
+    initialize_String(&str, 1);
+
+    /* A String of size 1 has to grow as well. */
+    insert_single_char(&str, 'a');
+    assert(str.total_size == 2);
+    insert_single_char(&str, 'b');
+    assert(str.total_size == 4);
+
+    /* Nothing to do if there's enough room already. */
+    reserve_String(&str, 1);
+    assert(str.total_size == 4);
+
+    reserve_String(&str, 100);
+    assert(str.total_size == 103);
+    assert(str.used_size == 3);
+    assert(equal_chars(str.string, "ab"));
+
+    free_String(&str);
+}
+
+void test_insert_n_chars()
+{
+    String str;
+    initialize_String(&str, 4);
+
+    insert_n_chars(&str, "hello world", 5);
+    assert(str.used_size == 6);
+    assert(equal_chars(str.string, "hello"));
+
+    /* The chars end at a '\0'. */
+    insert_n_chars(&str, "!\0?", 3);
+    assert(str.used_size == 7);
+    assert(equal_chars(str.string, "hello!"));
+
+    insert_n_chars(&str, "", 0);
+    assert(str.used_size == 7);
+
+    free_String(&str);
+}
+
+void test_insert_printf()
+{
+    String str;
+    initialize_String(&str, 2);
+
+    insert_chars(&str, "size ");
+    insert_printf(&str, "%llu bytes, %s", 987654321ULL, "ok");
+    assert(equal_chars(str.string, "size 987654321 bytes, ok"));
+    assert(str.used_size == strlen(str.string) + 1);
+
+    /* Nothing printed, nothing changed. */
+    insert_printf(&str, "%s", "");
+    assert(str.used_size == 25);
+
+    free_String(&str);
+}
+
+void test_arena_String()
+{
+    ARENA arena = { NULL };
+    String str;
+
+    arena_String(&str, &arena, "hello");
+
+    assert(str.used_size == 6);
+    assert(str.total_size == 6);
+    assert(equal_chars(str.string, "hello"));
+
+    arena_String(&str, &arena, "");
+    assert(str.used_size == 1);
+    assert(str.string[0] == '\0');
+
+    arena_release(&arena);
+}
+
 /* Main function responsible for string tests. */
 void test_string()
 {
@@ -290,6 +467,14 @@ void test_string()
     test_insert_String();
 
     test_extract_chars();
+
+    test_reserve_String();
+
+    test_insert_n_chars();
+
+    test_insert_printf();
+
+    test_arena_String();
 }
 
 #endif
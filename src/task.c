@@ -0,0 +1,298 @@
+/*
+ * task.c
+ * Work-stealing pool for running independent analyses concurrently.
+ *
+ * Copyright (c) 2018 Felix Baumann
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "global.h"
+
+/*
+ * Every thread that spawns tasks owns a deque. It pushes and pops its
+ * own tasks at the bottom, idle threads steal the oldest task from the
+ * top of someone else's deque. A thread waiting for a task group keeps
+ * running tasks meanwhile, so nested spawning can't deadlock.
+ *
+ * Tasks are whole analyses of a section, so a single lock for all
+ * deques is cheap compared to the work done by each task.
+ */
+
+#ifdef USE_THREADS
+
+typedef struct deque {
+  TASK *top, *bottom;
+  struct deque *next;  /* in the list of all deques */
+} DEQUE;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+/* signalled when a task was spawned or has finished */
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+
+static DEQUE *all_deques = NULL;
+static THREAD_LOCAL DEQUE *own_deque = NULL;
+static THREAD_LOCAL DEQUE *steal_from = NULL;
+
+static int pool_threads = 0;
+
+/*
+ * helper functions
+ */
+
+static void *pool_thread(void *arg);
+static TASK * take_task(void);
+static TASK * take_own_task(TASK_GROUP *group);
+static void run_task(TASK *t);
+static DEQUE * get_own_deque(void);
+
+#endif
+
+/*
+ * start the helper threads, the threads spawning tasks help as well
+ */
+
+void start_task_pool(int threads)
+{
+#ifdef USE_THREADS
+  pthread_t thread;
+
+  for (; threads > 0; threads--) {
+    if (pthread_create(&thread, NULL, pool_thread, NULL) != 0) {
+      error("Can't start more than %d helper threads", pool_threads);
+      break;
+    }
+    pthread_detach(thread);
+    pthread_mutex_lock(&pool_lock);
+    pool_threads++;
+    pthread_mutex_unlock(&pool_lock);
+  }
+#endif
+}
+
+/*
+ * check if spawned tasks may actually run concurrently, returns the
+ * number of helper threads
+ */
+
+int task_pool_active(void)
+{
+#ifdef USE_THREADS
+  return pool_threads;
+#else
+  return 0;
+#endif
+}
+
+/*
+ * hand a task to the pool, it counts as pending in its group until done
+ */
+
+void spawn_task(TASK *t, TASK_GROUP *group)
+{
+  t->group = group;
+#ifdef USE_THREADS
+  pthread_mutex_lock(&pool_lock);
+  {
+    DEQUE *d = get_own_deque();
+
+    group->pending++;
+    t->above = d->bottom;
+    t->below = NULL;
+    if (d->bottom != NULL)
+      d->bottom->below = t;
+    else
+      d->top = t;
+    d->bottom = t;
+  }
+  pthread_cond_signal(&pool_cond);
+  pthread_mutex_unlock(&pool_lock);
+#else
+  (*t->run)(t);
+#endif
+}
+
+/*
+ * wait until all tasks of a group are done, running tasks meanwhile
+ */
+
+void wait_task_group(TASK_GROUP *group)
+{
+#ifdef USE_THREADS
+  TASK *t;
+
+  pthread_mutex_lock(&pool_lock);
+  while (group->pending > 0) {
+    t = take_task();
+    if (t != NULL) {
+      pthread_mutex_unlock(&pool_lock);
+      run_task(t);
+      pthread_mutex_lock(&pool_lock);
+    } else {
+      pthread_cond_wait(&pool_cond, &pool_lock);
+    }
+  }
+  pthread_mutex_unlock(&pool_lock);
+#endif
+}
+
+/*
+ * wait until all tasks of a group are done, running only tasks of that
+ * group meanwhile; used while a chunk is being filled, where any other
+ * task might be an analysis that needs the very same chunk
+ */
+
+void wait_task_group_io(TASK_GROUP *group)
+{
+#ifdef USE_THREADS
+  TASK *t;
+
+  pthread_mutex_lock(&pool_lock);
+  while (group->pending > 0) {
+    t = take_own_task(group);
+    if (t != NULL) {
+      pthread_mutex_unlock(&pool_lock);
+      run_task(t);
+      pthread_mutex_lock(&pool_lock);
+    } else {
+      /* the rest is being run by other threads */
+      pthread_cond_wait(&pool_cond, &pool_lock);
+    }
+  }
+  pthread_mutex_unlock(&pool_lock);
+#endif
+}
+
+#ifdef USE_THREADS
+
+static void *pool_thread(void *arg)
+{
+  TASK *t;
+
+  pthread_mutex_lock(&pool_lock);
+  for (;;) {
+    t = take_task();
+    if (t != NULL) {
+      pthread_mutex_unlock(&pool_lock);
+      run_task(t);
+      pthread_mutex_lock(&pool_lock);
+    } else {
+      pthread_cond_wait(&pool_cond, &pool_lock);
+    }
+  }
+  return NULL;
+}
+
+/*
+ * get the next task to run, the pool lock must be held
+ */
+
+static TASK * take_task(void)
+{
+  DEQUE *d, *start;
+  TASK *t;
+
+  /* newest task of our own */
+  t = take_own_task(NULL);
+  if (t != NULL)
+    return t;
+
+  /* oldest task of someone else, go round the deques starting after
+     the one we stole from last */
+  if (all_deques == NULL)
+    return NULL;
+  start = (steal_from != NULL && steal_from->next != NULL) ?
+    steal_from->next : all_deques;
+  d = start;
+  do {
+    if (d->top != NULL) {
+      t = d->top;
+      d->top = t->below;
+      if (d->top != NULL)
+	d->top->above = NULL;
+      else
+	d->bottom = NULL;
+      steal_from = d;
+      return t;
+    }
+    d = (d->next != NULL) ? d->next : all_deques;
+  } while (d != start);
+
+  return NULL;
+}
+
+/*
+ * get the newest task of our own deque, if GROUP is given only when the
+ * task belongs to it; the pool lock must be held
+ */
+
+static TASK * take_own_task(TASK_GROUP *group)
+{
+  DEQUE *d = own_deque;
+  TASK *t;
+
+  if (d == NULL || d->bottom == NULL)
+    return NULL;
+  t = d->bottom;
+  if (group != NULL && t->group != group)
+    return NULL;  /* the rest of the group was stolen */
+
+  d->bottom = t->above;
+  if (d->bottom != NULL)
+    d->bottom->below = NULL;
+  else
+    d->top = NULL;
+  return t;
+}
+
+static void run_task(TASK *t)
+{
+  TASK_GROUP *group = t->group;
+
+  (*t->run)(t);
+  /* the task may be gone once the group is done, don't touch it */
+
+  pthread_mutex_lock(&pool_lock);
+  group->pending--;
+  pthread_cond_broadcast(&pool_cond);
+  pthread_mutex_unlock(&pool_lock);
+}
+
+/*
+ * the pool lock must be held
+ */
+
+static DEQUE * get_own_deque(void)
+{
+  if (own_deque == NULL) {
+    own_deque = (DEQUE *)malloc(sizeof(DEQUE));
+    if (own_deque == NULL)
+      bailout("Out of memory");
+    own_deque->top = own_deque->bottom = NULL;
+    own_deque->next = all_deques;
+    all_deques = own_deque;
+  }
+  return own_deque;
+}
+
+#endif
+
+/* EOF */
@@ -57,6 +57,132 @@ void test_equal_chars()
     assert(!equal_chars(" \n", " "));
 }
 
+static void *map_test_image(SOURCE *s, u8 pos, u8 len)
+{
+    TEST_IMAGE *image = (TEST_IMAGE *) s;
+
+    image->reads++;
+    return image->data + pos;
+}
+
+static u8 read_test_image(SOURCE *s, u8 pos, u8 len, void *buf)
+{
+    memcpy(buf, ((TEST_IMAGE *) s)->data + pos, len);
+    return len;
+}
+
+static void prefetch_test_image(SOURCE *s, u8 pos, u8 len)
+{
+    TEST_IMAGE *image = (TEST_IMAGE *) s;
+
+    image->hints++;
+    image->hint_len += len;
+}
+
+/* Makes a source of the SIZE bytes at DATA, see TEST_IMAGE.
+ * Global.
+ */
+void init_test_image(TEST_IMAGE *image, unsigned char *data, u8 size)
+{
+    memset(image, 0, sizeof(TEST_IMAGE));
+    image->c.size_known = 1;
+    image->c.size = size;
+    image->c.concurrent = 1;
+    image->c.map_bytes = map_test_image;
+    image->c.read_bytes = read_test_image;
+    image->c.prefetch = prefetch_test_image;
+    image->data = data;
+}
+
+/* Contents for test images that tell where a byte came from: the
+ * sector and the position in it.
+ * Global.
+ */
+unsigned char test_image_pattern(u8 pos)
+{
+    return (unsigned char) ((pos >> 9) * 7 + (pos & 511));
+}
+
+/* Makes SECTION all of IMAGE.
+ * Global.
+ */
+void init_test_section(SECTION *section, TEST_IMAGE *image)
+{
+    section->source = &image->c;
+    section->pos = 0;
+    section->size = image->c.size;
+    section->flags = 0;
+}
+
+/* Reads LEN bytes at POS through S and compares them to the pattern,
+ * or to zeros where ZERO, if given, says so.
+ * Global.
+ */
+void check_test_read(SOURCE *s, u8 pos, u8 len, int (*zero)(u8 pos))
+{
+    unsigned char *buf = (unsigned char *) malloc(len);
+
+    assert(buf != NULL);
+    assert(s->read_bytes(s, pos, len, buf) == len);
+    for (u8 i = 0; i < len; i++)
+    {
+        if (zero != NULL && zero(pos + i))
+        {
+            assert(buf[i] == 0);
+        }
+        else
+        {
+            assert(buf[i] == test_image_pattern(pos + i));
+        }
+    }
+    free(buf);
+}
+
+/* Checks all of S in reads of STEP bytes, see check_test_read().
+ * Global.
+ */
+void check_test_read_all(SOURCE *s, u8 step, int (*zero)(u8 pos))
+{
+    for (u8 pos = 0; pos < s->size; pos += step)
+    {
+        check_test_read(s, pos, pos + step < s->size ? step : s->size - pos,
+                        zero);
+    }
+}
+
+/* Like check_test_read(), returns how often it read from IMAGE.
+ * Global.
+ */
+int count_test_reads(TEST_IMAGE *image, SOURCE *s, u8 pos, u8 len,
+                     int (*zero)(u8 pos))
+{
+    image->reads = 0;
+    check_test_read(s, pos, len, zero);
+    return image->reads;
+}
+
+/* Stores VALUE big-endian in LEN bytes.
+ * Global.
+ */
+void put_test_be(unsigned char *to, u8 value, int len)
+{
+    for (int i = len - 1; i >= 0; i--, value >>= 8)
+    {
+        to[i] = (unsigned char) value;
+    }
+}
+
+/* Stores VALUE little-endian in LEN bytes.
+ * Global.
+ */
+void put_test_le(unsigned char *to, u8 value, int len)
+{
+    for (int i = 0; i < len; i++, value >>= 8)
+    {
+        to[i] = (unsigned char) value;
+    }
+}
+
 /* Main function responsible for tests.
  * Global.
  */
@@ -66,10 +192,32 @@ void test()
     
     test_amiga();
     
+    test_arena();
+    
+    test_buffer();
+    
     test_cdaccess();
     
     test_vpc();
     
+    test_qcow();
+    
+    test_vmdk();
+    
+    test_vhdx();
+    
+    test_udif();
+    
+    test_cloop();
+    
+    test_lvm();
+    
+    test_md();
+    
+    test_file();
+    
+    test_decompress();
+    
     test_json();
     
     test_string();
@@ -0,0 +1,985 @@
+/*
+ * udif.c
+ * Layered data source for Apple UDIF disk images (.dmg).
+ *
+ * Copyright (c) 2003 Christoph Pfisterer
+ * Copyright (c) 2018 Felix Baumann on modifications
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE. 
+ */
+
+#include "global.h"
+
+#ifdef USE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef USE_BZIP2
+#include <bzlib.h>
+#endif
+#ifdef USE_LZFSE
+#include <lzfse.h>
+#endif
+
+/*
+ * The koly trailer at the end points to an XML property list. Its blkx
+ * entries hold base64-encoded block tables ("mish"), one per partition,
+ * that map runs of disk sectors to chunks of the data fork. Chunks are
+ * stored raw or compressed, or not at all for runs of zeros. Compressed
+ * chunks are decompressed when first read and kept in a small LRU
+ * cache, as file systems tend to read many small pieces of one chunk.
+ */
+
+/*
+ * constants
+ */
+
+#define CHUNK_ZERO (0x00000000)
+#define CHUNK_RAW (0x00000001)
+#define CHUNK_IGNORE (0x00000002)
+#define CHUNK_ADC (0x80000004)
+#define CHUNK_ZLIB (0x80000005)
+#define CHUNK_BZIP2 (0x80000006)
+#define CHUNK_LZFSE (0x80000007)
+#define CHUNK_LZMA (0x80000008)
+#define CHUNK_COMMENT (0x7ffffffe)
+#define CHUNK_END (0xffffffff)
+
+#define CACHE_SIZE (8)
+/* larger chunks are taken as damaged */
+#define MAX_CHUNK_SECTORS (131072)
+#define MAX_XML_LENGTH (64 * 1024 * 1024)
+
+/*
+ * types
+ */
+
+typedef struct udif_chunk {
+  u8 start, count;     /* sectors of the disk */
+  u8 offset, length;   /* in the image */
+  u4 type;
+} UDIF_CHUNK;
+
+typedef struct chunk_cache {
+  u4 chunk;            /* its index plus one, 0 if the slot is free */
+  u8 last_use;
+  unsigned char *data;
+  u8 alloc;
+} CHUNK_CACHE;
+
+typedef struct udif_source {
+  SOURCE c;
+  UDIF_CHUNK *chunks;  /* sorted by start */
+  u4 chunk_count, chunk_alloc;
+  CHUNK_CACHE cache[CACHE_SIZE];
+  u8 clock;
+  unsigned char *packed;
+  u8 packed_alloc;
+  int decode_failed;
+  const char *compression;  /* of the chunks, "mixed" if more than one */
+} UDIF_SOURCE;
+
+/*
+ * helper functions
+ */
+
+static SOURCE *init_udif_source(SECTION *section, int level,
+				unsigned char *koly);
+static int parse_blkx(UDIF_SOURCE *us, char *xml, u8 data_fork);
+static u4 decode_base64(const char *from, const char *end,
+			unsigned char *to);
+static int add_mish(UDIF_SOURCE *us, unsigned char *mish, u4 len,
+		    u8 data_fork);
+static int compare_chunks(const void *a, const void *b);
+static const char *get_chunk_type_name(u4 type);
+static UDIF_CHUNK *find_chunk(UDIF_SOURCE *us, u8 sector, u8 *next_start);
+static unsigned char *get_chunk_data(UDIF_SOURCE *us, UDIF_CHUNK *chunk);
+static int decode_chunk(UDIF_SOURCE *us, UDIF_CHUNK *chunk,
+			unsigned char *to, u8 size);
+static int decode_adc(unsigned char *from, u8 len, unsigned char *to,
+		      u8 size);
+static u8 find_run(UDIF_SOURCE *us, u8 pos, u8 len,
+		   UDIF_CHUNK **chunk, u8 *data_off);
+static u8 read_udif(SOURCE *s, u8 pos, u8 len, void *buf);
+static void prefetch_udif(SOURCE *s, u8 pos, u8 len);
+static void close_udif(SOURCE *s);
+
+/*
+ * Apple UDIF disk images
+ */
+
+void detect_udif(SECTION *section, int level)
+{
+  u8 pos;
+  unsigned char *buf, koly[512];
+  SOURCE *src;
+  char s[256];
+
+  if (section->size < 1024 || section->source->sequential)
+    return;
+
+  pos = section->size - 512;
+  if (get_buffer(section, pos, 512, (void **)&buf) < 512)
+    return;
+  if (memcmp(buf, "koly", 4) != 0)
+    return;
+  memcpy(koly, buf, 512);
+
+  #ifdef JSON
+  add_content_object(level, "Apple UDIF disk image", "Q14757791");
+  #endif
+
+  if (get_be_quad(koly + 224) == 0) {
+    /* block tables only in the resource fork, as written by old
+       versions of Disk Copy */
+    print_line(level, "Apple UDIF disk image, "
+	       "content detection may or may not work...");
+    return;
+  }
+
+  print_line(level, "Apple UDIF disk image");
+  src = init_udif_source(section, level, koly);
+  if (src == NULL)
+    return;
+
+  #ifdef JSON
+  add_property_u8("disk_size", src->size);
+  add_property("compression", (char *)((UDIF_SOURCE *)src)->compression);
+  #endif
+  format_size_verbose(s, src->size);
+  print_line(level + 1, "Disk size %s", s);
+  print_line(level + 1, "%lu chunks, compression %s",
+	     ((UDIF_SOURCE *)src)->chunk_count,
+	     ((UDIF_SOURCE *)src)->compression);
+
+  analyze_source(src, level);
+  close_source(src);
+  stop_detect();
+}
+
+/*
+ * initialize the mapping source from the block tables
+ */
+
+static SOURCE *init_udif_source(SECTION *section, int level,
+				unsigned char *koly)
+{
+  UDIF_SOURCE *us;
+  u8 xml_offset, xml_length, end;
+  u4 i, counts[4];
+  char *xml;
+
+  us = (UDIF_SOURCE *)malloc(sizeof(UDIF_SOURCE));
+  if (us == NULL)
+    bailout("Out of memory");
+  memset(us, 0, sizeof(UDIF_SOURCE));
+
+  us->c.size_known = 1;
+  us->c.foundation = section->source;
+  us->c.read_bytes = read_udif;
+  us->c.prefetch = prefetch_udif;
+  us->c.close = close_udif;
+
+  /* read the property list */
+  xml_offset = get_be_quad(koly + 216);
+  xml_length = get_be_quad(koly + 224);
+  if (xml_length > MAX_XML_LENGTH) {
+    print_line(level + 1, "Error: Property list too large");
+    goto errorexit;
+  }
+  xml = (char *)malloc(xml_length + 1);
+  if (xml == NULL)
+    bailout("Out of memory");
+  if (get_buffer_real(section->source, section->pos + xml_offset,
+		      xml_length, xml, NULL) < xml_length) {
+    print_line(level + 1, "Error reading the property list");
+    free(xml);
+    goto errorexit;
+  }
+  xml[xml_length] = 0;
+
+  /* chunks are in the data fork, counted from the start of the
+     section */
+  if (!parse_blkx(us, xml, section->pos + get_be_quad(koly + 24))) {
+    print_line(level + 1, "Error: No valid block tables");
+    free(xml);
+    goto errorexit;
+  }
+  free(xml);
+
+  qsort(us->chunks, us->chunk_count, sizeof(UDIF_CHUNK), compare_chunks);
+  end = 0;
+  for (i = 0; i < us->chunk_count; i++) {
+    if (us->chunks[i].start + us->chunks[i].count > end)
+      end = us->chunks[i].start + us->chunks[i].count;
+  }
+  us->c.size = get_be_quad(koly + 492);
+  if (us->c.size == 0 || us->c.size > end)
+    us->c.size = end;
+  us->c.size *= 512;
+
+  /* say how it's stored */
+  memset(counts, 0, sizeof(counts));
+  for (i = 0; i < us->chunk_count; i++) {
+    switch (us->chunks[i].type) {
+    case CHUNK_RAW: counts[0]++; break;
+    case CHUNK_ZERO: case CHUNK_IGNORE: counts[1]++; break;
+    default:
+      if (counts[2]++ == 0)
+	counts[3] = us->chunks[i].type;
+      else if (counts[3] != us->chunks[i].type)
+	counts[3] = 0;
+    }
+  }
+  if (counts[2] == 0)
+    us->compression = "none";
+  else if (counts[3] == 0)
+    us->compression = "mixed";
+  else
+    us->compression = get_chunk_type_name(counts[3]);
+
+  return (SOURCE *)us;
+
+errorexit:
+  close_udif((SOURCE *)us);
+  free(us);
+  return NULL;
+}
+
+/*
+ * collect the chunks of all block tables in the blkx array of the
+ * property list; returns 0 if there aren't any
+ */
+
+static int parse_blkx(UDIF_SOURCE *us, char *xml, u8 data_fork)
+{
+  char *p, *array_end, *data, *data_end;
+  unsigned char *mish;
+  u4 len;
+  int found = 0;
+
+  p = strstr(xml, "<key>blkx</key>");
+  if (p == NULL)
+    return 0;
+  array_end = strstr(p, "</array>");
+  if (array_end == NULL)
+    return 0;
+  *array_end = 0;
+
+  while ((data = strstr(p, "<data>")) != NULL) {
+    data += 6;
+    data_end = strstr(data, "</data>");
+    if (data_end == NULL)
+      break;
+    mish = (unsigned char *)malloc((data_end - data) / 4 * 3 + 3);
+    if (mish == NULL)
+      bailout("Out of memory");
+    len = decode_base64(data, data_end, mish);
+    if (add_mish(us, mish, len, data_fork))
+      found = 1;
+    free(mish);
+    p = data_end + 7;
+  }
+  return found;
+}
+
+/*
+ * decode base64 from FROM up to END, skipping white space; returns the
+ * number of bytes
+ */
+
+static u4 decode_base64(const char *from, const char *end,
+			unsigned char *to)
+{
+  u4 bits, len;
+  int count, value;
+  char c;
+
+  bits = 0;
+  count = 0;
+  len = 0;
+  for (; from < end; from++) {
+    c = *from;
+    if (c >= 'A' && c <= 'Z')
+      value = c - 'A';
+    else if (c >= 'a' && c <= 'z')
+      value = c - 'a' + 26;
+    else if (c >= '0' && c <= '9')
+      value = c - '0' + 52;
+    else if (c == '+')
+      value = 62;
+    else if (c == '/')
+      value = 63;
+    else
+      continue;  /* white space and padding */
+
+    bits = (bits << 6) | value;
+    if (++count == 4) {
+      to[len++] = (unsigned char)(bits >> 16);
+      to[len++] = (unsigned char)(bits >> 8);
+      to[len++] = (unsigned char)bits;
+      bits = 0;
+      count = 0;
+    }
+  }
+  if (count == 3) {
+    to[len++] = (unsigned char)(bits >> 10);
+    to[len++] = (unsigned char)(bits >> 2);
+  } else if (count == 2) {
+    to[len++] = (unsigned char)(bits >> 4);
+  }
+  return len;
+}
+
+/*
+ * add the chunks of a block table, returns 0 if it isn't one
+ */
+
+static int add_mish(UDIF_SOURCE *us, unsigned char *mish, u4 len,
+		    u8 data_fork)
+{
+  unsigned char *entry;
+  UDIF_CHUNK *chunk;
+  u8 first_sector, data_offset;
+  u4 count, i, type;
+
+  if (len < 204 || memcmp(mish, "mish", 4) != 0)
+    return 0;
+  first_sector = get_be_quad(mish + 8);
+  data_offset = get_be_quad(mish + 24);
+  count = get_be_long(mish + 200);
+  if (count > (len - 204) / 40)
+    count = (len - 204) / 40;
+
+  for (i = 0; i < count; i++) {
+    entry = mish + 204 + i * 40;
+    type = get_be_long(entry);
+    if (type == CHUNK_END)
+      break;
+    if (type == CHUNK_COMMENT || get_be_quad(entry + 16) == 0)
+      continue;
+
+    if (us->chunk_count >= us->chunk_alloc) {
+      us->chunk_alloc = us->chunk_alloc ? us->chunk_alloc * 2 : 64;
+      us->chunks = (UDIF_CHUNK *)realloc(us->chunks, (u8)us->chunk_alloc *
+					 sizeof(UDIF_CHUNK));
+      if (us->chunks == NULL)
+	bailout("Out of memory");
+    }
+    chunk = &us->chunks[us->chunk_count++];
+    chunk->type = type;
+    chunk->start = first_sector + get_be_quad(entry + 8);
+    chunk->count = get_be_quad(entry + 16);
+    chunk->offset = data_fork + data_offset + get_be_quad(entry + 24);
+    chunk->length = get_be_quad(entry + 32);
+  }
+  return 1;
+}
+
+static int compare_chunks(const void *a, const void *b)
+{
+  const UDIF_CHUNK *ca = (const UDIF_CHUNK *)a;
+  const UDIF_CHUNK *cb = (const UDIF_CHUNK *)b;
+
+  if (ca->start < cb->start)
+    return -1;
+  return ca->start > cb->start;
+}
+
+static const char *get_chunk_type_name(u4 type)
+{
+  switch (type) {
+  case CHUNK_ADC: return "ADC";
+  case CHUNK_ZLIB: return "zlib";
+  case CHUNK_BZIP2: return "bzip2";
+  case CHUNK_LZFSE: return "LZFSE";
+  case CHUNK_LZMA: return "LZMA";
+  default: return "unknown";
+  }
+}
+
+/*
+ * find the chunk holding SECTOR; NULL if it falls into a gap, then
+ * NEXT_START is where the gap ends
+ */
+
+static UDIF_CHUNK *find_chunk(UDIF_SOURCE *us, u8 sector, u8 *next_start)
+{
+  u4 low, high, mid;
+
+  /* the last chunk starting at or before the sector */
+  low = 0;
+  high = us->chunk_count;
+  while (low < high) {
+    mid = low + (high - low) / 2;
+    if (us->chunks[mid].start <= sector)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+
+  if (low > 0 && sector < us->chunks[low - 1].start +
+      us->chunks[low - 1].count)
+    return &us->chunks[low - 1];
+  *next_start = (low < us->chunk_count) ? us->chunks[low].start :
+    us->c.size / 512;
+  return NULL;
+}
+
+/*
+ * get the decompressed data of a chunk from the cache, decompressing it
+ * in place of the one used least recently if needed; NULL if that's not
+ * possible
+ */
+
+static unsigned char *get_chunk_data(UDIF_SOURCE *us, UDIF_CHUNK *chunk)
+{
+  CHUNK_CACHE *e, *victim;
+  u4 index;
+  u8 size;
+  int i;
+
+  index = (u4)(chunk - us->chunks) + 1;
+  victim = &us->cache[0];
+  for (i = 0; i < CACHE_SIZE; i++) {
+    e = &us->cache[i];
+    if (e->chunk == index) {
+      e->last_use = ++us->clock;
+      return e->data;
+    }
+    if (e->last_use < victim->last_use)
+      victim = e;
+  }
+
+  victim->chunk = 0;
+  victim->last_use = 0;
+  if (chunk->count > MAX_CHUNK_SECTORS)
+    return NULL;
+  size = chunk->count * 512;
+  if (victim->alloc < size) {
+    free(victim->data);
+    victim->data = (unsigned char *)malloc(size);
+    if (victim->data == NULL)
+      bailout("Out of memory");
+    victim->alloc = size;
+  }
+  if (!decode_chunk(us, chunk, victim->data, size))
+    return NULL;
+  victim->chunk = index;
+  victim->last_use = ++us->clock;
+  return victim->data;
+}
+
+/*
+ * decompress a chunk into TO, SIZE bytes; returns 0 if that's not
+ * possible
+ */
+
+static int decode_chunk(UDIF_SOURCE *us, UDIF_CHUNK *chunk,
+			unsigned char *to, u8 size)
+{
+  if (chunk->length > 2 * size + 4096)
+    return 0;
+  if (us->packed_alloc < chunk->length) {
+    free(us->packed);
+    us->packed = (unsigned char *)malloc(chunk->length);
+    if (us->packed == NULL)
+      bailout("Out of memory");
+    us->packed_alloc = chunk->length;
+  }
+  if (get_buffer_real(us->c.foundation, chunk->offset, chunk->length,
+		      us->packed, NULL) < chunk->length)
+    return 0;
+
+  switch (chunk->type) {
+  case CHUNK_ADC:
+    return decode_adc(us->packed, chunk->length, to, size);
+#ifdef USE_ZLIB
+  case CHUNK_ZLIB:
+    {
+      uLongf out_len = (uLongf)size;
+
+      if (uncompress(to, &out_len, us->packed, (uLong)chunk->length)
+	  != Z_OK)
+	return 0;
+      memset(to + out_len, 0, size - out_len);
+      return 1;
+    }
+#endif
+#ifdef USE_BZIP2
+  case CHUNK_BZIP2:
+    {
+      unsigned int out_len = (unsigned int)size;
+
+      if (BZ2_bzBuffToBuffDecompress((char *)to, &out_len,
+				     (char *)us->packed,
+				     (unsigned int)chunk->length, 0, 0)
+	  != BZ_OK)
+	return 0;
+      memset(to + out_len, 0, size - out_len);
+      return 1;
+    }
+#endif
+#ifdef USE_LZFSE
+  case CHUNK_LZFSE:
+    {
+      size_t out_len;
+
+      out_len = lzfse_decode_buffer(to, size, us->packed, chunk->length,
+				    NULL);
+      if (out_len == 0)
+	return 0;
+      memset(to + out_len, 0, size - out_len);
+      return 1;
+    }
+#endif
+  }
+  return 0;
+}
+
+/*
+ * decode Apple Data Compression, a simple LZ77 variant; returns 0 if
+ * the data is damaged
+ */
+
+static int decode_adc(unsigned char *from, u8 len, unsigned char *to,
+		      u8 size)
+{
+  u8 in, out, count, distance;
+
+  for (in = 0, out = 0; in < len && out < size; ) {
+    if (from[in] & 0x80) {
+      /* literal bytes */
+      count = (from[in] & 0x7f) + 1;
+      if (in + 1 + count > len || out + count > size)
+	return 0;
+      memcpy(to + out, from + in + 1, count);
+      in += 1 + count;
+      out += count;
+      continue;
+    }
+
+    /* a copy of earlier output, with a short or a long distance */
+    if (from[in] & 0x40) {
+      if (in + 3 > len)
+	return 0;
+      count = (from[in] & 0x3f) + 4;
+      distance = get_be_short(from + in + 1) + 1;
+      in += 3;
+    } else {
+      if (in + 2 > len)
+	return 0;
+      count = ((from[in] >> 2) & 0x0f) + 3;
+      distance = (((u8)from[in] & 3) << 8 | from[in + 1]) + 1;
+      in += 2;
+    }
+    if (distance > out || out + count > size)
+      return 0;
+    /* may overlap, byte by byte */
+    for (; count > 0; count--, out++)
+      to[out] = to[out - distance];
+  }
+
+  memset(to + out, 0, size - out);
+  return 1;
+}
+
+/*
+ * find out how much from POS on, up to LEN bytes, is alike: raw data
+ * in the image at DATA_OFF, a single compressed CHUNK, or zeros with
+ * CHUNK set to NULL; returns 0 past the end
+ */
+
+static u8 find_run(UDIF_SOURCE *us, u8 pos, u8 len,
+		   UDIF_CHUNK **chunk, u8 *data_off)
+{
+  UDIF_CHUNK *c, *next;
+  u8 run, next_start, chunk_end, rel;
+
+  if (pos >= us->c.size)
+    return 0;
+  if (len > us->c.size - pos)
+    len = us->c.size - pos;
+
+  c = find_chunk(us, pos / 512, &next_start);
+  if (c == NULL) {
+    /* not covered by any chunk */
+    *chunk = NULL;
+    run = next_start * 512 - pos;
+    return (run < len) ? run : len;
+  }
+  chunk_end = (c->start + c->count) * 512;
+  run = chunk_end - pos;
+
+  if (c->type == CHUNK_ZERO || c->type == CHUNK_IGNORE) {
+    *chunk = NULL;
+  } else if (c->type == CHUNK_RAW) {
+    rel = pos - c->start * 512;
+    if (rel >= c->length) {
+      /* beyond what is stored of it */
+      *chunk = NULL;
+      return (run < len) ? run : len;
+    }
+    *chunk = c;
+    *data_off = c->offset + rel;
+    if (c->length < c->count * 512) {
+      run = c->length - rel;
+      return (run < len) ? run : len;
+    }
+    /* take the following raw chunks along while they are next to each
+       other in the image */
+    for (next = c + 1; run < len && next < us->chunks + us->chunk_count &&
+	   next->type == CHUNK_RAW && next->start * 512 == chunk_end &&
+	   next->offset == c->offset + c->length &&
+	   next->length == next->count * 512; c = next++) {
+      chunk_end = (next->start + next->count) * 512;
+      run = chunk_end - pos;
+    }
+  } else {
+    *chunk = c;
+  }
+  return (run < len) ? run : len;
+}
+
+/*
+ * mapping read
+ */
+
+static u8 read_udif(SOURCE *s, u8 pos, u8 len, void *buf)
+{
+  UDIF_SOURCE *us = (UDIF_SOURCE *)s;
+  UDIF_CHUNK *chunk;
+  u8 got, run, data_off;
+  unsigned char *data, *out;
+
+  for (got = 0; got < len; got += run) {
+    run = find_run(us, pos + got, len - got, &chunk, &data_off);
+    if (run == 0)
+      break;
+    out = (unsigned char *)buf + got;
+
+    if (chunk == NULL) {
+      /* zeros, nothing to read */
+      memset(out, 0, run);
+    } else if (chunk->type == CHUNK_RAW) {
+      if (get_buffer_real(s->foundation, data_off, run, out, NULL) < run)
+	break;
+    } else {
+      data = get_chunk_data(us, chunk);
+      if (data != NULL) {
+	memcpy(out, data + (pos + got - chunk->start * 512), run);
+      } else {
+	if (!us->decode_failed) {
+	  us->decode_failed = 1;
+	  error("udif: can't decompress %s chunks, reading them as zeros",
+		get_chunk_type_name(chunk->type));
+	}
+	memset(out, 0, run);
+      }
+    }
+  }
+  return got;
+}
+
+/*
+ * pass the hint on for runs of raw chunks
+ */
+
+static void prefetch_udif(SOURCE *s, u8 pos, u8 len)
+{
+  UDIF_SOURCE *us = (UDIF_SOURCE *)s;
+  SOURCE *fs = s->foundation;
+  UDIF_CHUNK *chunk;
+  u8 done, run, data_off;
+
+  if (fs->prefetch == NULL)
+    return;
+  for (done = 0; done < len; done += run) {
+    run = find_run(us, pos + done, len - done, &chunk, &data_off);
+    if (run == 0)
+      break;
+    if (chunk != NULL && chunk->type == CHUNK_RAW)
+      fs->prefetch(fs, data_off, run);
+  }
+}
+
+/*
+ * cleanup
+ */
+
+static void close_udif(SOURCE *s)
+{
+  UDIF_SOURCE *us = (UDIF_SOURCE *)s;
+  int i;
+
+  free(us->chunks);
+  for (i = 0; i < CACHE_SIZE; i++)
+    free(us->cache[i].data);
+  free(us->packed);
+}
+
+#ifdef JSON
+
+/* An image in memory with three block tables. The first one has two
+ * raw chunks one after the other, zeros, an ADC chunk and an ignored
+ * run; the second, from sector 32 on, a bzip2 chunk and a raw chunk
+ * stored short; the third, from sector 48 on, ten small zlib chunks,
+ * more than fit in the cache. Sectors 24 to 31 and 42 to 47 aren't in
+ * any chunk.
+ * Without the library, compressed chunks are stored raw.
+ */
+#define TEST_UDIF_SECTORS (68)
+#define TEST_UDIF_SHORT (600)
+
+static unsigned char *test_udif_image;
+static u8 test_udif_size;
+
+/* Whether the byte at POS reads as zero. */
+static int test_udif_zero(u8 pos)
+{
+    u8 sector = pos / 512;
+
+    return (sector >= 8 && sector < 12) || (sector >= 20 && sector < 32) ||
+        (pos >= 40 * 512 + TEST_UDIF_SHORT && sector < 48);
+}
+
+/* Encodes LEN bytes of DATA with ADC, copying from 256 bytes back where
+ * possible; returns the encoded length.
+ */
+static u8 encode_test_adc(unsigned char *data, u8 len, unsigned char *to)
+{
+    u8 in = 0, out = 0, n;
+
+    while (in < len)
+    {
+        for (n = 0; in >= 256 && n < 67 && in + n < len &&
+                 data[in + n] == data[in + n - 256]; n++);
+        if (n > 18)
+        {
+            to[out++] = 0x40 | (n - 4);
+            to[out++] = 0;
+            to[out++] = 255;
+        }
+        else if (n >= 3)
+        {
+            to[out++] = (n - 3) << 2;
+            to[out++] = 255;
+        }
+        else
+        {
+            to[out++] = 0x80;
+            to[out++] = data[in];
+            n = 1;
+        }
+        in += n;
+    }
+    return out;
+}
+
+/* Appends a chunk of COUNT sectors from sector START of the disk to
+ * the block table MISH, which starts at sector FIRST; the data goes to
+ * the end of the image.
+ */
+static void add_test_udif_chunk(unsigned char *mish, u4 type, u8 first,
+                                u8 start, u8 count)
+{
+    unsigned char data[8 * 512];
+    unsigned char *entry = mish + 204 + get_be_long(mish + 200) * 40;
+    u8 len = count * 512;
+
+    for (u8 i = 0; i < len; i++)
+    {
+        data[i] = test_image_pattern(start * 512 + i);
+    }
+    if (type == CHUNK_ADC)
+    {
+        len = encode_test_adc(data, len, test_udif_image + test_udif_size);
+    }
+#ifdef USE_ZLIB
+    if (type == CHUNK_ZLIB)
+    {
+        uLongf out = 2 * len + 64;
+        assert(compress(test_udif_image + test_udif_size, &out, data, len)
+               == Z_OK);
+        len = out;
+    }
+#else
+    if (type == CHUNK_ZLIB)
+    {
+        type = CHUNK_RAW;
+    }
+#endif
+#ifdef USE_BZIP2
+    if (type == CHUNK_BZIP2)
+    {
+        unsigned int out = 2 * len + 600;
+        assert(BZ2_bzBuffToBuffCompress((char *) test_udif_image
+                                        + test_udif_size, &out,
+                                        (char *) data, len, 9, 0, 0)
+               == BZ_OK);
+        len = out;
+    }
+#else
+    if (type == CHUNK_BZIP2)
+    {
+        type = CHUNK_RAW;
+    }
+#endif
+    if (type == CHUNK_RAW)
+    {
+        if (start == 40)
+        {
+            len = TEST_UDIF_SHORT;
+        }
+        memcpy(test_udif_image + test_udif_size, data, len);
+    }
+    if (type == CHUNK_ZERO || type == CHUNK_IGNORE)
+    {
+        len = 0;
+    }
+
+    put_test_be(entry, type, 4);
+    put_test_be(entry + 8, start - first, 8);
+    put_test_be(entry + 16, count, 8);
+    /* the second table counts from an offset of its own */
+    put_test_be(entry + 24, test_udif_size - (first == 32 ? 1000 : 0), 8);
+    put_test_be(entry + 32, len, 8);
+    put_test_be(mish + 200, get_be_long(mish + 200) + 1, 4);
+    test_udif_size += len;
+}
+
+/* Appends the block table MISH to the property list at XML. */
+static char *add_test_udif_mish(char *xml, unsigned char *mish)
+{
+    static const char digits[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    u4 len = 204 + get_be_long(mish + 200) * 40;
+    u4 bits;
+
+    xml += sprintf(xml, "<dict>\n<key>Data</key>\n<data>\n");
+    for (u4 i = 0; i < len; i += 3)
+    {
+        bits = (u4) mish[i] << 16;
+        bits |= (i + 1 < len) ? (u4) mish[i + 1] << 8 : 0;
+        bits |= (i + 2 < len) ? mish[i + 2] : 0;
+        *xml++ = digits[(bits >> 18) & 63];
+        *xml++ = digits[(bits >> 12) & 63];
+        *xml++ = (i + 1 < len) ? digits[(bits >> 6) & 63] : '=';
+        *xml++ = (i + 2 < len) ? digits[bits & 63] : '=';
+        if (i % 48 == 45)
+        {
+            *xml++ = '\n';
+        }
+    }
+    xml += sprintf(xml, "\n</data>\n</dict>\n");
+    return xml;
+}
+
+/* This is the main function responsible for tests in this class (udif.c). */
+void test_udif()
+{
+    unsigned char mish[3][204 + 12 * 40], koly[512];
+    char *xml, *p;
+    TEST_IMAGE foundation;
+    SECTION section;
+    SOURCE *s;
+    u8 total = TEST_UDIF_SECTORS * 512;
+
+    test_udif_image = (unsigned char *) malloc(256 * 1024);
+    test_udif_size = 0;
+    memset(mish, 0, sizeof(mish));
+    for (int i = 0; i < 3; i++)
+    {
+        memcpy(mish[i], "mish", 4);
+    }
+    put_test_be(mish[1] + 8, 32, 8);
+    put_test_be(mish[1] + 24, 1000, 8);
+    put_test_be(mish[2] + 8, 48, 8);
+
+    add_test_udif_chunk(mish[0], CHUNK_RAW, 0, 0, 4);
+    add_test_udif_chunk(mish[0], CHUNK_RAW, 0, 4, 4);
+    add_test_udif_chunk(mish[0], CHUNK_ZERO, 0, 8, 4);
+    add_test_udif_chunk(mish[0], CHUNK_ADC, 0, 12, 8);
+    add_test_udif_chunk(mish[0], CHUNK_COMMENT, 0, 20, 0);
+    add_test_udif_chunk(mish[0], CHUNK_IGNORE, 0, 20, 4);
+    add_test_udif_chunk(mish[0], CHUNK_END, 0, 24, 0);
+    add_test_udif_chunk(mish[1], CHUNK_BZIP2, 32, 32, 8);
+    add_test_udif_chunk(mish[1], CHUNK_RAW, 32, 40, 2);
+    for (u8 i = 0; i < 10; i++)
+    {
+        add_test_udif_chunk(mish[2], CHUNK_ZLIB, 48, 48 + i * 2, 2);
+    }
+
+    /* the property list, tables in a different order than the disk */
+    xml = p = (char *) test_udif_image + test_udif_size;
+    p += sprintf(p, "<plist>\n<dict>\n<key>resource-fork</key>\n<dict>\n"
+                 "<key>blkx</key>\n<array>\n");
+    p = add_test_udif_mish(p, mish[2]);
+    p = add_test_udif_mish(p, mish[0]);
+    p = add_test_udif_mish(p, mish[1]);
+    p += sprintf(p, "</array>\n</dict>\n</dict>\n</plist>\n");
+
+    memset(koly, 0, 512);
+    memcpy(koly, "koly", 4);
+    put_test_be(koly + 216, test_udif_size, 8);
+    put_test_be(koly + 224, p - xml, 8);
+    put_test_be(koly + 492, TEST_UDIF_SECTORS, 8);
+    test_udif_size += p - xml;
+
+    init_test_image(&foundation, test_udif_image, test_udif_size);
+    init_test_section(&section, &foundation);
+
+    /* The property list only. */
+    s = init_udif_source(&section, 0, koly);
+    assert(s != NULL && s->size == total && foundation.reads == 1);
+
+    /* Two raw chunks in one go, zeros without reading. */
+    assert(count_test_reads(&foundation, s, 100, 4000, test_udif_zero) == 1);
+    assert(count_test_reads(&foundation, s, 8 * 512, 2048,
+                            test_udif_zero) == 0);
+    assert(count_test_reads(&foundation, s, 20 * 512, 4096,
+                            test_udif_zero) == 0);
+
+    /* A compressed chunk is read once, then kept. */
+    assert(count_test_reads(&foundation, s, 12 * 512, 100,
+                            test_udif_zero) == 1);
+    assert(count_test_reads(&foundation, s, 12 * 512 + 100, 3000,
+                            test_udif_zero) == 0);
+
+    /* A raw chunk stored short. */
+    check_test_read(s, 40 * 512 - 100, 2000, test_udif_zero);
+
+    /* All of it, then the last chunks are still cached, the first
+       ones aren't. */
+    check_test_read_all(s, 1000, test_udif_zero);
+#ifdef USE_ZLIB
+    assert(count_test_reads(&foundation, s, total - 512, 512,
+                            test_udif_zero) == 0);
+    assert(count_test_reads(&foundation, s, 12 * 512, 512,
+                            test_udif_zero) == 1);
+#endif
+    assert(s->read_bytes(s, total - 10, 100, koly) == 10);
+
+    close_source(s);
+    free(test_udif_image);
+}
+#endif
+
+/* EOF */
@@ -0,0 +1,691 @@
+/*
+ * vhdx.c
+ * Layered data source for Hyper-V VHDX disk images.
+ *
+ * Copyright (c) 2018 Felix Baumann
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "global.h"
+
+/*
+ * The disk is cut into payload blocks (32 MiB by default) that are
+ * located through the block allocation table (BAT). The BAT is read in
+ * spans as needed. Blocks of differencing images may be present only
+ * in part, a sector bitmap says which sectors; those bitmaps are kept
+ * per block once looked at. Blocks that aren't present read as zeros
+ * without any I/O.
+ */
+
+/*
+ * constants
+ */
+
+#define VHDX_HEADER_1 (64 * 1024)
+#define VHDX_HEADER_2 (128 * 1024)
+#define VHDX_REGIONS_1 (192 * 1024)
+#define VHDX_REGIONS_2 (256 * 1024)
+#define VHDX_TABLE_SIZE (64 * 1024)
+
+/* block states in the BAT */
+#define PAYLOAD_FULLY_PRESENT (6)
+#define PAYLOAD_PARTIALLY_PRESENT (7)
+#define SB_BLOCK_PRESENT (6)
+
+/* the BAT is read in spans of this many entries, as needed */
+#define BAT_SPAN (16384)
+
+/* what is known about a block's sector bitmap, or the number of it plus
+   SLOT_BITMAP */
+#define SLOT_UNKNOWN (0)
+#define SLOT_MISSING (1)
+#define SLOT_BITMAP (2)
+
+/* region and metadata item GUIDs, as stored */
+static const unsigned char bat_guid[16] = {
+  0x66, 0x77, 0xc2, 0x2d, 0x23, 0xf6, 0x00, 0x42,
+  0x9d, 0x64, 0x11, 0x5e, 0x9b, 0xfd, 0x4a, 0x08 };
+static const unsigned char metadata_guid[16] = {
+  0x06, 0xa2, 0x7c, 0x8b, 0x90, 0x47, 0x9a, 0x4b,
+  0xb8, 0xfe, 0x57, 0x5f, 0x05, 0x0f, 0x88, 0x6e };
+static const unsigned char file_parameters_guid[16] = {
+  0x37, 0x67, 0xa1, 0xca, 0x36, 0xfa, 0x43, 0x4d,
+  0xb3, 0xb6, 0x33, 0xf0, 0xaa, 0x44, 0xe7, 0x6b };
+static const unsigned char disk_size_guid[16] = {
+  0x24, 0x42, 0xa5, 0x2f, 0x1b, 0xcd, 0x76, 0x48,
+  0xb2, 0x11, 0x5d, 0xbe, 0xd8, 0x3b, 0xf4, 0xb8 };
+static const unsigned char sector_size_guid[16] = {
+  0x1d, 0xbf, 0x41, 0x81, 0x6f, 0xa9, 0x09, 0x47,
+  0xba, 0x47, 0xf2, 0x33, 0xa8, 0xfa, 0xab, 0x5f };
+
+/*
+ * types
+ */
+
+typedef struct vhdx_source {
+  SOURCE c;
+  u8 off;
+  u4 block_size, sector_size;
+  u4 chunk_ratio;  /* payload blocks per sector bitmap block */
+  u4 block_count;
+  u8 bat_offset;
+  u4 bat_count;
+  unsigned char *raw_bat;
+  unsigned char *bat_loaded;  /* per span */
+  u4 *slots;                  /* per block */
+  /* the sector bitmaps of the blocks looked at so far, one after the
+     other */
+  u1 *bitmaps;
+  u4 bitmap_size, bitmap_count, bitmap_alloc;
+} VHDX_SOURCE;
+
+/*
+ * helper functions
+ */
+
+static u4 crc32c(const unsigned char *p, u8 len);
+static int check_table(SECTION *section, u8 pos, u4 len,
+		       const char *magic, unsigned char *table);
+static unsigned char *find_metadata(unsigned char *table, u8 meta_offset,
+				    SECTION *section,
+				    const unsigned char *guid, u4 len);
+static SOURCE *init_vhdx_source(SECTION *section, int level,
+				u8 total_size, u4 block_size,
+				u4 sector_size, u8 bat_offset, u8 bat_length);
+static u8 get_bat_entry(VHDX_SOURCE *xs, u4 index);
+static u1 *get_bitmap(VHDX_SOURCE *xs, u4 block);
+static u8 find_run(VHDX_SOURCE *xs, u8 pos, u8 len,
+		   int *present, u8 *data_off);
+static u8 read_vhdx(SOURCE *s, u8 pos, u8 len, void *buf);
+static void prefetch_vhdx(SOURCE *s, u8 pos, u8 len);
+static void close_vhdx(SOURCE *s);
+
+/*
+ * vhdx image detection
+ */
+
+void detect_vhdx(SECTION *section, int level)
+{
+  unsigned char *buf, *table, *item, *header;
+  unsigned char headers[2][4096];
+  char s[2048];
+  u8 seq, best_seq, bat_offset, bat_length, meta_offset, total_size;
+  u4 count, i, block_size, sector_size, flags;
+  int h, best;
+  SOURCE *src;
+
+  if (get_buffer(section, 0, 520, (void **)&buf) < 520)
+    return;
+  if (memcmp(buf, "vhdxfile", 8) != 0)
+    return;
+
+  print_line(level, "Microsoft VHDX disk image");
+  #ifdef JSON
+  add_content_object(level, "Microsoft VHDX disk image", "Q592312");
+  #endif
+  format_utf16_le(buf + 8, 512, s);
+  if (s[0])
+    print_line(level + 1, "Created by %s", s);
+
+  if (section->source->sequential) {
+    print_line(level + 1, "Contents not analyzed in a stream");
+    stop_detect();
+    return;
+  }
+
+  /* the current header is the valid one with the higher sequence
+     number */
+  best = -1;
+  best_seq = 0;
+  for (h = 0; h < 2; h++) {
+    if (!check_table(section, h ? VHDX_HEADER_2 : VHDX_HEADER_1, 4096,
+		     "head", headers[h]))
+      continue;
+    seq = get_le_quad(headers[h] + 8);
+    if (best < 0 || seq > best_seq) {
+      best = h;
+      best_seq = seq;
+    }
+  }
+  if (best < 0) {
+    print_line(level + 1, "Error: No valid header");
+    stop_detect();
+    return;
+  }
+  header = headers[best];
+  if (get_le_short(header + 66) != 1) {
+    print_line(level + 1, "Unknown version %u", get_le_short(header + 66));
+    stop_detect();
+    return;
+  }
+  for (i = 0; i < 16 && header[48 + i] == 0; i++);
+  if (i < 16)
+    print_line(level + 1, "Log not replayed, contents may be out of date");
+
+  /* the region table points to the BAT and the metadata */
+  table = (unsigned char *)malloc(VHDX_TABLE_SIZE);
+  if (table == NULL)
+    bailout("Out of memory");
+  if (!check_table(section, VHDX_REGIONS_1, VHDX_TABLE_SIZE, "regi", table) &&
+      !check_table(section, VHDX_REGIONS_2, VHDX_TABLE_SIZE, "regi", table)) {
+    print_line(level + 1, "Error: No valid region table");
+    goto done;
+  }
+  bat_offset = bat_length = meta_offset = 0;
+  count = get_le_long(table + 8);
+  for (i = 0; i < count && i < 2047; i++) {
+    item = table + 16 + i * 32;
+    if (memcmp(item, bat_guid, 16) == 0) {
+      bat_offset = get_le_quad(item + 16);
+      bat_length = get_le_long(item + 24);
+    } else if (memcmp(item, metadata_guid, 16) == 0) {
+      meta_offset = get_le_quad(item + 16);
+    }
+  }
+  if (bat_offset == 0 || meta_offset == 0) {
+    print_line(level + 1, "Error: BAT or metadata region missing");
+    goto done;
+  }
+
+  /* the disk's parameters from the metadata */
+  if (get_buffer(section, meta_offset, VHDX_TABLE_SIZE, (void **)&buf)
+      < VHDX_TABLE_SIZE || memcmp(buf, "metadata", 8) != 0) {
+    print_line(level + 1, "Error reading the metadata");
+    goto done;
+  }
+  memcpy(table, buf, VHDX_TABLE_SIZE);
+  if ((item = find_metadata(table, meta_offset, section,
+			    file_parameters_guid, 8)) == NULL) {
+    print_line(level + 1, "Error: File parameters missing");
+    goto done;
+  }
+  block_size = get_le_long(item);
+  flags = get_le_long(item + 4);
+  if ((item = find_metadata(table, meta_offset, section,
+			    disk_size_guid, 8)) == NULL) {
+    print_line(level + 1, "Error: Disk size missing");
+    goto done;
+  }
+  total_size = get_le_quad(item);
+  if ((item = find_metadata(table, meta_offset, section,
+			    sector_size_guid, 4)) == NULL) {
+    print_line(level + 1, "Error: Sector size missing");
+    goto done;
+  }
+  sector_size = get_le_long(item);
+
+  #ifdef JSON
+  add_property("kind", (flags & 2) ? "differencing" : "dynamic size");
+  add_property_u8("disk_size", total_size);
+  #endif
+  format_size_verbose(s, total_size);
+  print_line(level + 1, "Disk size %s", s);
+  if (flags & 2) {
+    /* not followed, what the parent holds reads as zeros */
+    print_line(level + 1, "Differencing image, parent not analyzed");
+  }
+
+  if (block_size < 1024*1024 || block_size > 256*1024*1024 ||
+      (block_size & (block_size - 1)) != 0 ||
+      (sector_size != 512 && sector_size != 4096)) {
+    print_line(level + 1, "Error: Invalid block or sector size");
+    goto done;
+  }
+
+  src = init_vhdx_source(section, level, total_size, block_size,
+			 sector_size, bat_offset, bat_length);
+  if (src != NULL) {
+    analyze_source(src, level);
+    close_source(src);
+  }
+
+done:
+  free(table);
+  stop_detect();
+}
+
+/*
+ * CRC-32C, as used for the checksums
+ */
+
+static u4 crc32c(const unsigned char *p, u8 len)
+{
+  u4 crc = 0xffffffff;
+  int k;
+
+  for (; len > 0; len--, p++) {
+    crc ^= *p;
+    for (k = 0; k < 8; k++)
+      crc = (crc >> 1) ^ ((crc & 1) ? 0x82f63b78 : 0);
+  }
+  return ~crc & 0xffffffff;
+}
+
+/*
+ * read a header or region table into TABLE, returns 0 if it doesn't
+ * carry MAGIC or the checksum doesn't match
+ */
+
+static int check_table(SECTION *section, u8 pos, u4 len,
+		       const char *magic, unsigned char *table)
+{
+  unsigned char *buf;
+  u4 sum;
+
+  if (get_buffer(section, pos, len, (void **)&buf) < len)
+    return 0;
+  if (memcmp(buf, magic, 4) != 0)
+    return 0;
+  memcpy(table, buf, len);
+  sum = get_le_long(table + 4);
+  memset(table + 4, 0, 4);
+  return crc32c(table, len) == sum;
+}
+
+/*
+ * get the value of a metadata item, at least LEN bytes of it; NULL if
+ * it isn't there
+ */
+
+static unsigned char *find_metadata(unsigned char *table, u8 meta_offset,
+				    SECTION *section,
+				    const unsigned char *guid, u4 len)
+{
+  unsigned char *entry, *buf;
+  u4 count, i;
+
+  count = get_le_short(table + 10);
+  for (i = 0; i < count && i < 2047; i++) {
+    entry = table + 32 + i * 32;
+    if (memcmp(entry, guid, 16) != 0)
+      continue;
+    if (get_le_long(entry + 20) < len)
+      return NULL;
+    if (get_buffer(section, meta_offset + get_le_long(entry + 16), len,
+		   (void **)&buf) < len)
+      return NULL;
+    return buf;
+  }
+  return NULL;
+}
+
+/*
+ * initialize the mapping source
+ */
+
+static SOURCE *init_vhdx_source(SECTION *section, int level,
+				u8 total_size, u4 block_size,
+				u4 sector_size, u8 bat_offset, u8 bat_length)
+{
+  VHDX_SOURCE *xs;
+  u4 span_count;
+  char s[256];
+
+  xs = (VHDX_SOURCE *)malloc(sizeof(VHDX_SOURCE));
+  if (xs == NULL)
+    bailout("Out of memory");
+  memset(xs, 0, sizeof(VHDX_SOURCE));
+
+  xs->c.size_known = 1;
+  xs->c.size = total_size;
+  xs->c.foundation = section->source;
+  xs->c.read_bytes = read_vhdx;
+  xs->c.prefetch = prefetch_vhdx;
+  xs->c.close = close_vhdx;
+  xs->off = section->pos;
+
+  xs->block_size = block_size;
+  xs->sector_size = sector_size;
+  xs->chunk_ratio = (u4)(((u8)1 << 23) * sector_size / block_size);
+  xs->bitmap_size = block_size / sector_size / 8;
+  if ((total_size + block_size - 1) / block_size > 0xffffffffUL / 2) {
+    print_line(level + 1, "Error: Disk too large");
+    goto errorexit;
+  }
+  xs->block_count = (u4)((total_size + block_size - 1) / block_size);
+  xs->bat_offset = bat_offset;
+  xs->bat_count = (u4)(bat_length / 8);
+
+  format_size(s, block_size);
+  print_line(level + 1, "Dynamic sizing uses %lu blocks of %s",
+	     xs->block_count, s);
+
+  /* the BAT must cover all payload blocks */
+  if (xs->block_count > 0 &&
+      (u8)xs->block_count - 1 + (xs->block_count - 1) / xs->chunk_ratio
+      >= xs->bat_count) {
+    print_line(level + 1, "Error: BAT too small for the disk size");
+    goto errorexit;
+  }
+
+  xs->raw_bat = (unsigned char *)malloc((u8)xs->bat_count * 8);
+  span_count = (xs->bat_count + BAT_SPAN - 1) / BAT_SPAN;
+  xs->bat_loaded = (unsigned char *)malloc(span_count + 1);
+  xs->slots = (u4 *)malloc((u8)xs->block_count * sizeof(u4) + 1);
+  if (xs->raw_bat == NULL || xs->bat_loaded == NULL || xs->slots == NULL)
+    bailout("Out of memory");
+  memset(xs->bat_loaded, 0, span_count);
+  memset(xs->slots, 0, (u8)xs->block_count * sizeof(u4));
+
+  return (SOURCE *)xs;
+
+errorexit:
+  close_vhdx((SOURCE *)xs);
+  free(xs);
+  return NULL;
+}
+
+/*
+ * get a BAT entry, reading its span if needed; the entries that can't
+ * be read say not present
+ */
+
+static u8 get_bat_entry(VHDX_SOURCE *xs, u4 index)
+{
+  u4 span, first, count;
+  u8 want, got;
+
+  if (index >= xs->bat_count)
+    return 0;
+  span = index / BAT_SPAN;
+  if (!xs->bat_loaded[span]) {
+    first = span * BAT_SPAN;
+    count = xs->bat_count - first;
+    if (count > BAT_SPAN)
+      count = BAT_SPAN;
+    want = (u8)count * 8;
+    got = get_buffer_real(xs->c.foundation, xs->off + xs->bat_offset
+			  + (u8)first * 8, want, xs->raw_bat + (u8)first * 8,
+			  NULL);
+    if (got < want)
+      memset(xs->raw_bat + (u8)first * 8 + got, 0, want - got);
+    xs->bat_loaded[span] = 1;
+  }
+  return get_le_quad(xs->raw_bat + (u8)index * 8);
+}
+
+/*
+ * get the sector bitmap of a partially present block, NULL if it isn't
+ * there
+ */
+
+static u1 *get_bitmap(VHDX_SOURCE *xs, u4 block)
+{
+  u4 chunk;
+  u8 entry;
+  u1 *bitmap;
+
+  if (xs->slots[block] == SLOT_UNKNOWN) {
+    /* the sector bitmap block follows the payload blocks it is for */
+    chunk = block / xs->chunk_ratio;
+    entry = get_bat_entry(xs, chunk * (xs->chunk_ratio + 1)
+			  + xs->chunk_ratio);
+
+    xs->slots[block] = SLOT_MISSING;
+    if ((entry & 7) == SB_BLOCK_PRESENT) {
+      if (xs->bitmap_count >= xs->bitmap_alloc) {
+	xs->bitmap_alloc = xs->bitmap_alloc ? xs->bitmap_alloc * 2 : 64;
+	xs->bitmaps = (u1 *)realloc(xs->bitmaps,
+				    (u8)xs->bitmap_alloc * xs->bitmap_size);
+	if (xs->bitmaps == NULL)
+	  bailout("Out of memory");
+      }
+      bitmap = xs->bitmaps + (u8)xs->bitmap_count * xs->bitmap_size;
+      if (get_buffer_real(xs->c.foundation, xs->off + (entry >> 20 << 20)
+			  + (u8)(block % xs->chunk_ratio) * xs->bitmap_size,
+			  xs->bitmap_size, bitmap, NULL) == xs->bitmap_size)
+	xs->slots[block] = SLOT_BITMAP + xs->bitmap_count++;
+    }
+  }
+
+  if (xs->slots[block] == SLOT_MISSING)
+    return NULL;
+  return xs->bitmaps + (u8)(xs->slots[block] - SLOT_BITMAP) * xs->bitmap_size;
+}
+
+/*
+ * find out how much from POS on, up to LEN bytes, is alike: either in
+ * the image at DATA_OFF, or not present; returns 0 past the end
+ */
+
+static u8 find_run(VHDX_SOURCE *xs, u8 pos, u8 len,
+		   int *present, u8 *data_off)
+{
+  u4 block, sector;
+  u8 rel, end, run_end, entry, next_off;
+  u1 *bitmap;
+  int state, next_state;
+
+  if (pos >= xs->c.size)
+    return 0;
+  if (len > xs->c.size - pos)
+    len = xs->c.size - pos;
+  block = (u4)(pos / xs->block_size);
+  rel = pos - (u8)block * xs->block_size;
+  end = rel + len;
+
+  entry = get_bat_entry(xs, block + block / xs->chunk_ratio);
+  state = entry & 7;
+  *data_off = xs->off + (entry >> 20 << 20) + rel;
+
+  if (state == PAYLOAD_PARTIALLY_PRESENT) {
+    if (end > xs->block_size)
+      end = xs->block_size;
+    bitmap = get_bitmap(xs, block);
+    if (bitmap == NULL) {
+      *present = 0;
+      return end - rel;
+    }
+
+    /* sectors in the same state as the first one */
+    sector = (u4)(rel / xs->sector_size);
+    *present = (bitmap[sector >> 3] >> (sector & 7)) & 1;
+    for (run_end = ((u8)sector + 1) * xs->sector_size; run_end < end;
+	 run_end += xs->sector_size) {
+      sector = (u4)(run_end / xs->sector_size);
+      if (((bitmap[sector >> 3] >> (sector & 7)) & 1) != *present)
+	break;
+    }
+    if (run_end > end)
+      run_end = end;
+    return run_end - rel;
+  }
+
+  /* whole blocks, take the following ones along while they are alike */
+  *present = (state == PAYLOAD_FULLY_PRESENT);
+  next_off = (entry >> 20 << 20) + xs->block_size;
+  for (run_end = xs->block_size; run_end < end;
+       run_end += xs->block_size) {
+    block++;
+    entry = get_bat_entry(xs, block + block / xs->chunk_ratio);
+    next_state = entry & 7;
+    if (next_state == PAYLOAD_PARTIALLY_PRESENT ||
+	(next_state == PAYLOAD_FULLY_PRESENT) != *present ||
+	(*present && (entry >> 20 << 20) != next_off))
+      break;
+    next_off += xs->block_size;
+  }
+  if (run_end > end)
+    run_end = end;
+  return run_end - rel;
+}
+
+/*
+ * mapping read, runs that are present take one read each
+ */
+
+static u8 read_vhdx(SOURCE *s, u8 pos, u8 len, void *buf)
+{
+  VHDX_SOURCE *xs = (VHDX_SOURCE *)s;
+  u8 got, run, data_off;
+  int present;
+
+  for (got = 0; got < len; got += run) {
+    run = find_run(xs, pos + got, len - got, &present, &data_off);
+    if (run == 0)
+      break;
+
+    if (present) {
+      if (get_buffer_real(s->foundation, data_off, run,
+			  (unsigned char *)buf + got, NULL) < run)
+	break;
+    } else {
+      /* not present, unmapped or zeroed, nothing to read */
+      memset((unsigned char *)buf + got, 0, run);
+    }
+  }
+  return got;
+}
+
+/*
+ * pass the hint on for the runs that are present
+ */
+
+static void prefetch_vhdx(SOURCE *s, u8 pos, u8 len)
+{
+  VHDX_SOURCE *xs = (VHDX_SOURCE *)s;
+  SOURCE *fs = s->foundation;
+  u8 done, run, data_off;
+  int present;
+
+  if (fs->prefetch == NULL)
+    return;
+  for (done = 0; done < len; done += run) {
+    run = find_run(xs, pos + done, len - done, &present, &data_off);
+    if (run == 0)
+      break;
+    if (present)
+      fs->prefetch(fs, data_off, run);
+  }
+}
+
+/*
+ * cleanup
+ */
+
+static void close_vhdx(SOURCE *s)
+{
+  VHDX_SOURCE *xs = (VHDX_SOURCE *)s;
+
+  free(xs->raw_bat);
+  free(xs->bat_loaded);
+  free(xs->slots);
+  free(xs->bitmaps);
+}
+
+#ifdef JSON
+
+/* An image in memory with blocks of 1 MiB: the BAT comes first, then
+ * blocks 0 and 1 one after the other, block 2 is zeroed, and block 3 is
+ * present in part: the first four of every eight sectors. The disk
+ * ends before block 3 does.
+ */
+#define TEST_VHDX_BLOCK (1024 * 1024)
+#define TEST_VHDX_SIZE (4 * TEST_VHDX_BLOCK - 1000)
+#define TEST_VHDX_RATIO (4096)
+
+static unsigned char *test_vhdx_image;
+
+/* Whether the sector at POS reads as zeros. */
+static int test_vhdx_zero(u8 pos)
+{
+    return pos / TEST_VHDX_BLOCK == 2 ||
+        (pos / TEST_VHDX_BLOCK == 3 && (pos / 512) % 8 >= 4);
+}
+
+/* Stores VALUE in the BAT entry INDEX. */
+static void put_test_bat(u4 index, u8 value)
+{
+    put_test_le(test_vhdx_image + (u8) index * 8, value, 8);
+}
+
+/* This is the main function responsible for tests in this class (vhdx.c). */
+void test_vhdx()
+{
+    TEST_IMAGE foundation;
+    SECTION section;
+    SOURCE *s;
+    u8 block_at[4] = { 1, 2, 0, 3 };
+
+    test_vhdx_image = (unsigned char *) malloc(5 * TEST_VHDX_BLOCK);
+    memset(test_vhdx_image, 0xaa, 5 * TEST_VHDX_BLOCK);
+    memset(test_vhdx_image, 0, TEST_VHDX_BLOCK);
+    for (u8 b = 0; b < 4; b++)
+    {
+        if (block_at[b] == 0)
+        {
+            put_test_bat(b, 2);
+            continue;
+        }
+        put_test_bat(b, (block_at[b] * TEST_VHDX_BLOCK)
+                     | (b == 3 ? PAYLOAD_PARTIALLY_PRESENT
+                        : PAYLOAD_FULLY_PRESENT));
+        for (u8 i = 0; i < TEST_VHDX_BLOCK; i++)
+        {
+            if (!test_vhdx_zero(b * TEST_VHDX_BLOCK + i))
+            {
+                test_vhdx_image[block_at[b] * TEST_VHDX_BLOCK + i] =
+                    test_image_pattern(b * TEST_VHDX_BLOCK + i);
+            }
+        }
+    }
+    /* the sector bitmap block, with the bitmap of block 3 */
+    put_test_bat(TEST_VHDX_RATIO, (4 * TEST_VHDX_BLOCK) | SB_BLOCK_PRESENT);
+    memset(test_vhdx_image + 4 * TEST_VHDX_BLOCK + 3 * 256, 0x0f, 256);
+
+    init_test_image(&foundation, test_vhdx_image, 5 * TEST_VHDX_BLOCK);
+    init_test_section(&section, &foundation);
+
+    /* Nothing is read up front. */
+    s = init_vhdx_source(&section, 0, TEST_VHDX_SIZE, TEST_VHDX_BLOCK, 512,
+                         0, TEST_VHDX_BLOCK);
+    assert(s != NULL && foundation.reads == 0);
+
+    /* The BAT, then across two blocks in one go; a zeroed block needs
+       no reads at all. */
+    assert(count_test_reads(&foundation, s, TEST_VHDX_BLOCK - 1000, 2000,
+                            test_vhdx_zero) == 2);
+    assert(count_test_reads(&foundation, s, 2 * TEST_VHDX_BLOCK + 1000, 4000,
+                            test_vhdx_zero) == 0);
+
+    /* The sector bitmap is read once, then each run of sectors. */
+    assert(count_test_reads(&foundation, s, 3 * TEST_VHDX_BLOCK, 4096,
+                            test_vhdx_zero) == 2);
+    assert(count_test_reads(&foundation, s, 3 * TEST_VHDX_BLOCK + 4096, 4096,
+                            test_vhdx_zero) == 1);
+
+    /* All of it, up to the end of the disk. */
+    check_test_read_all(s, 4000, test_vhdx_zero);
+    assert(s->read_bytes(s, TEST_VHDX_SIZE - 10, 100, test_vhdx_image)
+           == 10);
+
+    /* One hint for the two blocks, none for the zeroed one. */
+    foundation.hints = 0;
+    s->prefetch(s, 0, 3 * TEST_VHDX_BLOCK);
+    assert(foundation.hints == 1);
+
+    close_source(s);
+    free(test_vhdx_image);
+}
+#endif
+
+/* EOF */
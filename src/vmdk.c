@@ -0,0 +1,664 @@
+/*
+ * vmdk.c
+ * Layered data source for VMware sparse extents (VMDK).
+ *
+ * Copyright (c) 2018 Felix Baumann
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "global.h"
+
+#ifdef USE_ZLIB
+#include <zlib.h>
+#endif
+
+/*
+ * A sparse extent is cut into grains (64 KiB by default). The grain
+ * directory is small and read up front, it points to grain tables that
+ * are kept in a small LRU cache. Grains that were never written to are
+ * zeros and cost no I/O; stream-optimized extents deflate each grain.
+ */
+
+/*
+ * constants
+ */
+
+#define VMDK_FLAG_COMPRESSED (1 << 16)
+#define VMDK_GD_AT_END (0xffffffffffffffffULL)
+
+#define GT_CACHE_SIZE (16)
+
+/* the kinds of runs */
+#define RUN_DATA (0)
+#define RUN_ZERO (1)
+#define RUN_COMPRESSED (2)
+
+/*
+ * types
+ */
+
+typedef struct grain_table {
+  u8 sector;    /* in the extent, 0 if the slot is free */
+  u8 last_use;
+  unsigned char *entries;
+} GRAIN_TABLE;
+
+typedef struct vmdk_source {
+  SOURCE c;
+  u8 off;
+  u8 grain_size;  /* in bytes */
+  u4 gt_entries;  /* per grain table */
+  u4 gd_count;
+  unsigned char *gd;
+  GRAIN_TABLE gt_cache[GT_CACHE_SIZE];
+  u8 gt_clock;
+  int compressed;
+  /* the compressed grain inflated last, its number plus one */
+  u8 inflated_grain;
+  unsigned char *inflated, *deflated;
+  int inflate_failed;
+} VMDK_SOURCE;
+
+/*
+ * helper functions
+ */
+
+static int get_descriptor_value(const char *desc, const char *key,
+				char *value);
+static SOURCE *init_vmdk_source(SECTION *section, int level,
+				unsigned char *header);
+static u4 get_grain_entry(VMDK_SOURCE *ms, u8 grain);
+static unsigned char *get_grain_table(VMDK_SOURCE *ms, u8 sector);
+static u8 find_run(VMDK_SOURCE *ms, u8 pos, u8 len, int *kind, u8 *where);
+static unsigned char *inflate_grain(VMDK_SOURCE *ms, u8 grain, u8 sector);
+static u8 read_vmdk(SOURCE *s, u8 pos, u8 len, void *buf);
+static void prefetch_vmdk(SOURCE *s, u8 pos, u8 len);
+static void close_vmdk(SOURCE *s);
+
+/*
+ * sparse extent detection
+ */
+
+void detect_vmdk(SECTION *section, int level)
+{
+  unsigned char *buf, header[512];
+  u4 version, flags;
+  u8 desc_offset, desc_size;
+  char s[256], value[256], *desc;
+  SOURCE *src;
+
+  if (get_buffer(section, 0, 512, (void **)&buf) < 512)
+    return;
+  if (memcmp(buf, "KDMV", 4) != 0)
+    return;
+  memcpy(header, buf, 512);
+
+  version = get_le_long(header + 4);
+  flags = get_le_long(header + 8);
+  print_line(level, "VMware VMDK sparse extent, version %lu", version);
+  #ifdef JSON
+  add_content_object(level, "VMware VMDK sparse extent", "Q592312");
+  add_property_u4("version", version);
+  add_property_u8("disk_size", get_le_quad(header + 12) * 512);
+  #endif
+  format_size_verbose(s, get_le_quad(header + 12) * 512);
+  print_line(level + 1, "Disk size %s", s);
+
+  /* the embedded descriptor names the kind of disk and its parent */
+  desc_offset = get_le_quad(header + 28);
+  desc_size = get_le_quad(header + 36);
+  if (desc_offset > 0 && desc_size > 0) {
+    if (desc_size > 64)
+      desc_size = 64;
+    if (get_buffer(section, desc_offset * 512, desc_size * 512,
+		   (void **)&buf) == desc_size * 512) {
+      desc = (char *)malloc(desc_size * 512 + 1);
+      if (desc == NULL)
+	bailout("Out of memory");
+      memcpy(desc, buf, desc_size * 512);
+      desc[desc_size * 512] = 0;
+      if (get_descriptor_value(desc, "createType", value)) {
+	print_line(level + 1, "Type %s", value);
+	#ifdef JSON
+	add_property("kind", value);
+	#endif
+      }
+      if (get_descriptor_value(desc, "parentFileNameHint", value)) {
+	/* not followed, what the parent holds reads as zeros */
+	print_line(level + 1, "Parent image %s", value);
+	#ifdef JSON
+	add_property("parent_name", value);
+	#endif
+      }
+      free(desc);
+    }
+  }
+
+  /* stream-optimized extents have the grain directory, and the header
+     saying where, at the end */
+  if (get_le_quad(header + 56) == VMDK_GD_AT_END) {
+    if (section->size < 2048 || section->source->sequential ||
+	get_buffer(section, section->size - 1024, 512, (void **)&buf) < 512 ||
+	memcmp(buf, "KDMV", 4) != 0) {
+      print_line(level + 1, "Error: Footer not found");
+      stop_detect();
+      return;
+    }
+    memcpy(header, buf, 512);
+  }
+
+  if ((flags & VMDK_FLAG_COMPRESSED) && get_le_short(header + 77) != 1) {
+    print_line(level + 1, "Unknown compression method %u",
+	       get_le_short(header + 77));
+  } else {
+    src = init_vmdk_source(section, level, header);
+    if (src != NULL) {
+      analyze_source(src, level);
+      close_source(src);
+    }
+  }
+
+  stop_detect();
+}
+
+/*
+ * get a quoted value from the descriptor into VALUE (256 bytes);
+ * returns 0 if the key isn't there
+ */
+
+static int get_descriptor_value(const char *desc, const char *key,
+				char *value)
+{
+  const char *p, *end;
+  int key_len, len;
+
+  key_len = strlen(key);
+  for (p = desc; *p; p = (*end) ? end + 1 : end) {
+    end = strchr(p, '\n');
+    if (end == NULL)
+      end = p + strlen(p);
+    if (strncmp(p, key, key_len) != 0)
+      continue;
+    p += key_len;
+    while (p < end && (*p == ' ' || *p == '='))
+      p++;
+    if (p < end && *p == '"')
+      p++;
+    for (len = 0; p + len < end && p[len] != '"' && p[len] != '\r'; len++);
+    if (len > 255)
+      len = 255;
+    memcpy(value, p, len);
+    value[len] = 0;
+    return len > 0;
+  }
+  return 0;
+}
+
+/*
+ * initialize the mapping source
+ */
+
+static SOURCE *init_vmdk_source(SECTION *section, int level,
+				unsigned char *header)
+{
+  VMDK_SOURCE *ms;
+  u8 grain_sectors, gd_sector, gd_len, table_span;
+  char s[256];
+  int i;
+
+  ms = (VMDK_SOURCE *)malloc(sizeof(VMDK_SOURCE));
+  if (ms == NULL)
+    bailout("Out of memory");
+  memset(ms, 0, sizeof(VMDK_SOURCE));
+
+  ms->c.size_known = 1;
+  ms->c.size = get_le_quad(header + 12) * 512;
+  ms->c.foundation = section->source;
+  ms->c.read_bytes = read_vmdk;
+  ms->c.prefetch = prefetch_vmdk;
+  ms->c.close = close_vmdk;
+  ms->off = section->pos;
+  ms->compressed = (get_le_long(header + 8) & VMDK_FLAG_COMPRESSED) ? 1 : 0;
+
+  grain_sectors = get_le_quad(header + 20);
+  ms->gt_entries = get_le_long(header + 44);
+  gd_sector = get_le_quad(header + 56);
+  if (grain_sectors == 0 || grain_sectors > 32768 ||
+      (grain_sectors & (grain_sectors - 1)) != 0) {
+    print_line(level + 1, "Error: Invalid grain size (%llu sectors)",
+	       grain_sectors);
+    goto errorexit;
+  }
+  if (ms->gt_entries == 0 || ms->gt_entries > 65536) {
+    print_line(level + 1, "Error: Invalid grain table size (%lu entries)",
+	       ms->gt_entries);
+    goto errorexit;
+  }
+  ms->grain_size = grain_sectors * 512;
+  format_size(s, ms->grain_size);
+  print_line(level + 1, "Grain size %s%s", s,
+	     ms->compressed ? ", compressed" : "");
+
+  /* read the whole grain directory */
+  table_span = ms->grain_size * ms->gt_entries;
+  if ((ms->c.size + table_span - 1) / table_span > 0x1000000) {
+    print_line(level + 1, "Error: Grain directory too large");
+    goto errorexit;
+  }
+  ms->gd_count = (u4)((ms->c.size + table_span - 1) / table_span);
+  gd_len = (u8)ms->gd_count * 4;
+  ms->gd = (unsigned char *)malloc(gd_len + 1);
+  if (ms->gd == NULL)
+    bailout("Out of memory");
+  if (get_buffer_real(section->source, ms->off + gd_sector * 512, gd_len,
+		      ms->gd, NULL) < gd_len) {
+    print_line(level + 1, "Error reading the grain directory");
+    goto errorexit;
+  }
+
+  for (i = 0; i < GT_CACHE_SIZE; i++) {
+    ms->gt_cache[i].entries = (unsigned char *)malloc(ms->gt_entries * 4);
+    if (ms->gt_cache[i].entries == NULL)
+      bailout("Out of memory");
+  }
+
+  return (SOURCE *)ms;
+
+errorexit:
+  close_vmdk((SOURCE *)ms);
+  free(ms);
+  return NULL;
+}
+
+/*
+ * get the grain table entry of a grain, 0 if it isn't allocated
+ */
+
+static u4 get_grain_entry(VMDK_SOURCE *ms, u8 grain)
+{
+  u8 gd_index, gt_sector;
+  unsigned char *table;
+
+  gd_index = grain / ms->gt_entries;
+  if (gd_index >= ms->gd_count)
+    return 0;
+  gt_sector = get_le_long(ms->gd + gd_index * 4);
+  if (gt_sector == 0)
+    return 0;
+
+  table = get_grain_table(ms, gt_sector);
+  if (table == NULL)
+    return 0;
+  return get_le_long(table + (grain % ms->gt_entries) * 4);
+}
+
+/*
+ * get a grain table from the cache, reading it in place of the one
+ * used least recently if needed; NULL if it can't be read
+ */
+
+static unsigned char *get_grain_table(VMDK_SOURCE *ms, u8 sector)
+{
+  GRAIN_TABLE *t, *victim;
+  int i;
+
+  victim = &ms->gt_cache[0];
+  for (i = 0; i < GT_CACHE_SIZE; i++) {
+    t = &ms->gt_cache[i];
+    if (t->sector == sector) {
+      t->last_use = ++ms->gt_clock;
+      return t->entries;
+    }
+    if (t->last_use < victim->last_use)
+      victim = t;
+  }
+
+  victim->sector = 0;
+  victim->last_use = 0;
+  if (get_buffer_real(ms->c.foundation, ms->off + sector * 512,
+		      (u8)ms->gt_entries * 4, victim->entries, NULL)
+      < (u8)ms->gt_entries * 4)
+    return NULL;
+  victim->sector = sector;
+  victim->last_use = ++ms->gt_clock;
+  return victim->entries;
+}
+
+/*
+ * find out how much from POS on, up to LEN bytes, is alike: data in
+ * the extent at WHERE, zeros, or a single compressed grain starting in
+ * sector WHERE; returns 0 past the end
+ */
+
+static u8 find_run(VMDK_SOURCE *ms, u8 pos, u8 len, int *kind, u8 *where)
+{
+  u8 grain, rel, run, next_sector;
+  u4 entry;
+  int next_kind;
+
+  if (pos >= ms->c.size)
+    return 0;
+  if (len > ms->c.size - pos)
+    len = ms->c.size - pos;
+
+  grain = pos / ms->grain_size;
+  rel = pos % ms->grain_size;
+  run = ms->grain_size - rel;
+
+  /* 0 is never written to, 1 is zeroed */
+  entry = get_grain_entry(ms, grain);
+  if (entry > 1 && ms->compressed) {
+    *kind = RUN_COMPRESSED;
+    *where = entry;
+    return (run < len) ? run : len;
+  }
+  if (entry <= 1) {
+    *kind = RUN_ZERO;
+  } else {
+    *kind = RUN_DATA;
+    *where = ms->off + (u8)entry * 512 + rel;
+  }
+
+  /* take the following grains along while they are alike */
+  next_sector = (u8)entry + ms->grain_size / 512;
+  while (run < len) {
+    entry = get_grain_entry(ms, ++grain);
+    next_kind = (entry <= 1) ? RUN_ZERO : RUN_DATA;
+    if (next_kind != *kind ||
+	(next_kind == RUN_DATA && entry != next_sector))
+      break;
+    run += ms->grain_size;
+    next_sector += ms->grain_size / 512;
+  }
+
+  return (run < len) ? run : len;
+}
+
+/*
+ * inflate a compressed grain, keeping it for the next read; NULL if
+ * that's not possible
+ */
+
+static unsigned char *inflate_grain(VMDK_SOURCE *ms, u8 grain, u8 sector)
+{
+  unsigned char marker[12];
+  u4 in_len;
+
+  if (ms->inflated_grain == grain + 1)
+    return ms->inflated;
+  if (ms->inflated == NULL) {
+    ms->inflated = (unsigned char *)malloc(ms->grain_size);
+    ms->deflated = (unsigned char *)malloc(2 * ms->grain_size);
+    if (ms->inflated == NULL || ms->deflated == NULL)
+      bailout("Out of memory");
+  }
+  ms->inflated_grain = 0;
+
+  /* the grain marker: the grain's sector in the disk, and the length of
+     the zlib stream following it */
+  in_len = 0;
+  if (get_buffer_real(ms->c.foundation, ms->off + sector * 512, 12,
+		      marker, NULL) == 12)
+    in_len = get_le_long(marker + 8);
+  if (in_len > 2 * ms->grain_size)
+    in_len = 0;
+  if (in_len > 0)
+    in_len = get_buffer_real(ms->c.foundation, ms->off + sector * 512 + 12,
+			     in_len, ms->deflated, NULL);
+
+#ifdef USE_ZLIB
+  if (in_len > 0) {
+    z_stream zs;
+    int result;
+
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit(&zs) != Z_OK)
+      bailout("Can't initialize zlib");
+    zs.next_in = ms->deflated;
+    zs.avail_in = (uInt)in_len;
+    zs.next_out = ms->inflated;
+    zs.avail_out = (uInt)ms->grain_size;
+    result = inflate(&zs, Z_FINISH);
+    inflateEnd(&zs);
+    /* the last grain may be short, the rest of it reads as zeros */
+    if (result == Z_STREAM_END) {
+      memset(ms->inflated + ms->grain_size - zs.avail_out, 0, zs.avail_out);
+      ms->inflated_grain = grain + 1;
+      return ms->inflated;
+    }
+  }
+#endif
+
+  if (!ms->inflate_failed) {
+    ms->inflate_failed = 1;
+    error("vmdk: can't decompress a grain, reading it as zeros");
+  }
+  return NULL;
+}
+
+/*
+ * mapping read
+ */
+
+static u8 read_vmdk(SOURCE *s, u8 pos, u8 len, void *buf)
+{
+  VMDK_SOURCE *ms = (VMDK_SOURCE *)s;
+  u8 got, run, where;
+  unsigned char *data, *out;
+  int kind;
+
+  for (got = 0; got < len; got += run) {
+    run = find_run(ms, pos + got, len - got, &kind, &where);
+    if (run == 0)
+      break;
+    out = (unsigned char *)buf + got;
+
+    if (kind == RUN_DATA) {
+      if (get_buffer_real(s->foundation, where, run, out, NULL) < run)
+	break;
+    } else if (kind == RUN_COMPRESSED) {
+      data = inflate_grain(ms, (pos + got) / ms->grain_size, where);
+      if (data != NULL)
+	memcpy(out, data + (pos + got) % ms->grain_size, run);
+      else
+	memset(out, 0, run);
+    } else {
+      /* never written to or zeroed, nothing to read */
+      memset(out, 0, run);
+    }
+  }
+  return got;
+}
+
+/*
+ * pass the hint on for runs of uncompressed grains
+ */
+
+static void prefetch_vmdk(SOURCE *s, u8 pos, u8 len)
+{
+  VMDK_SOURCE *ms = (VMDK_SOURCE *)s;
+  SOURCE *fs = s->foundation;
+  u8 done, run, where;
+  int kind;
+
+  if (fs->prefetch == NULL)
+    return;
+  for (done = 0; done < len; done += run) {
+    run = find_run(ms, pos + done, len - done, &kind, &where);
+    if (run == 0)
+      break;
+    if (kind == RUN_DATA)
+      fs->prefetch(fs, where, run);
+  }
+}
+
+/*
+ * cleanup
+ */
+
+static void close_vmdk(SOURCE *s)
+{
+  VMDK_SOURCE *ms = (VMDK_SOURCE *)s;
+  int i;
+
+  free(ms->gd);
+  for (i = 0; i < GT_CACHE_SIZE; i++)
+    free(ms->gt_cache[i].entries);
+  free(ms->inflated);
+  free(ms->deflated);
+}
+
+#ifdef JSON
+
+/* An extent in memory with grains of 512 bytes and grain tables of 64
+ * entries, two tables more than fit in the cache. The grains repeat a
+ * pattern of eight: four stored one after the other, one zeroed, one
+ * never written to and two stored by themselves. Compressed, each grain
+ * is stored by itself.
+ */
+#define TEST_VMDK_TABLES (GT_CACHE_SIZE + 2)
+#define TEST_VMDK_GRAINS (TEST_VMDK_TABLES * 64)
+#define TEST_VMDK_GT (2)
+#define TEST_VMDK_DATA ((TEST_VMDK_GT + TEST_VMDK_TABLES) * 512)
+
+static unsigned char *test_vmdk_image;
+
+/* Whether the byte at POS reads as zero. */
+static int test_vmdk_zero(u8 pos)
+{
+    return pos / 512 % 8 == 4 || pos / 512 % 8 == 5;
+}
+
+/* Builds the extent, returns its size. */
+static u8 make_test_vmdk(int compressed)
+{
+    u8 at = TEST_VMDK_DATA, entry;
+    unsigned char *gt;
+
+    memset(test_vmdk_image, 0, TEST_VMDK_DATA);
+    memcpy(test_vmdk_image, "KDMV", 4);
+    put_test_le(test_vmdk_image + 4, compressed ? 3 : 1, 4);
+    put_test_le(test_vmdk_image + 8, compressed ? VMDK_FLAG_COMPRESSED : 0,
+                4);
+    put_test_le(test_vmdk_image + 12, TEST_VMDK_GRAINS, 8);
+    put_test_le(test_vmdk_image + 20, 1, 8);
+    put_test_le(test_vmdk_image + 44, 64, 4);
+    put_test_le(test_vmdk_image + 56, 1, 8);
+    put_test_le(test_vmdk_image + 77, compressed, 2);
+
+    for (u8 g = 0; g < TEST_VMDK_GRAINS; g++)
+    {
+        if (g % 64 == 0)
+        {
+            put_test_le(test_vmdk_image + 512 + g / 64 * 4,
+                        TEST_VMDK_GT + g / 64, 4);
+        }
+        gt = test_vmdk_image + (TEST_VMDK_GT + g / 64) * 512;
+
+        entry = test_vmdk_zero(g * 512) ? g % 8 == 4 : at / 512;
+        if (entry > 1 && compressed)
+        {
+#ifdef USE_ZLIB
+            unsigned char data[512];
+            uLongf len = 1024;
+
+            for (int i = 0; i < 512; i++)
+            {
+                data[i] = test_image_pattern(g * 512 + i);
+            }
+            assert(compress(test_vmdk_image + at + 12, &len, data, 512)
+                   == Z_OK);
+            put_test_le(test_vmdk_image + at, g, 8);
+            put_test_le(test_vmdk_image + at + 8, len, 4);
+            at += (12 + len + 511) / 512 * 512;
+#endif
+        }
+        else if (entry > 1)
+        {
+            /* the two at the end of the pattern go apart */
+            if (g % 8 == 7)
+            {
+                memset(test_vmdk_image + at, 0xaa, 512);
+                entry = at / 512 + 1;
+                at += 512;
+            }
+            for (int i = 0; i < 512; i++)
+            {
+                test_vmdk_image[at + i] = test_image_pattern(g * 512 + i);
+            }
+            at += 512;
+        }
+        put_test_le(gt + g % 64 * 4, entry, 4);
+    }
+    return at;
+}
+
+/* This is the main function responsible for tests in this class (vmdk.c). */
+void test_vmdk()
+{
+    TEST_IMAGE foundation;
+    SECTION section;
+    SOURCE *s;
+    u8 total = (u8) TEST_VMDK_GRAINS * 512;
+
+    test_vmdk_image = (unsigned char *) malloc(TEST_VMDK_DATA
+                                               + TEST_VMDK_GRAINS * 1024);
+    init_test_image(&foundation, test_vmdk_image, make_test_vmdk(0));
+    init_test_section(&section, &foundation);
+
+    /* The grain directory only. */
+    s = init_vmdk_source(&section, 0, test_vmdk_image);
+    assert(s != NULL && s->size == total && foundation.reads == 1);
+
+    /* The grain table, then four grains in one go; zeroed and unwritten
+       grains need no reads, grains apart take one each. */
+    assert(count_test_reads(&foundation, s, 100, 1900, test_vmdk_zero) == 2);
+    assert(count_test_reads(&foundation, s, 4 * 512, 1024,
+                            test_vmdk_zero) == 0);
+    assert(count_test_reads(&foundation, s, 6 * 512, 1024,
+                            test_vmdk_zero) == 2);
+
+    /* After all of it, the last grain tables are cached, the first ones
+       were evicted. */
+    check_test_read_all(s, 4000, test_vmdk_zero);
+    assert(count_test_reads(&foundation, s, total - 512, 100,
+                            test_vmdk_zero) == 1);
+    assert(count_test_reads(&foundation, s, 0, 100, test_vmdk_zero) == 2);
+    close_source(s);
+
+#ifdef USE_ZLIB
+    /* Compressed, a grain is read once, then kept. */
+    foundation.c.size = make_test_vmdk(1);
+    init_test_section(&section, &foundation);
+    s = init_vmdk_source(&section, 0, test_vmdk_image);
+    assert(s != NULL);
+    check_test_read(s, 0, 100, test_vmdk_zero);
+    assert(count_test_reads(&foundation, s, 100, 300, test_vmdk_zero) == 0);
+    check_test_read_all(s, 4000, test_vmdk_zero);
+    close_source(s);
+#endif
+
+    free(test_vmdk_image);
+}
+#endif
+
+/* EOF */
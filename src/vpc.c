@@ -32,19 +32,35 @@
  * types
  */
 
-typedef struct vhd_chunk {
-  int present;
-  u8 off;
-  u1 bitmap[1];
-} VHD_CHUNK;
+/* the chunk map is read in spans of this many entries, as needed */
+#define MAP_SPAN (16384)
+
+/* what is known about a chunk, or the number of its bitmap plus
+   SLOT_BITMAP */
+#define SLOT_UNKNOWN (0)
+#define SLOT_MISSING (1)
+#define SLOT_BITMAP (2)
+
+/* how many differencing images may be stacked */
+#define MAX_CHAIN (32)
 
 typedef struct vhd_source {
   SOURCE c;
   u8 off;
   u4 chunk_size;
   u4 chunk_count;
-  u4 *raw_map;
-  VHD_CHUNK **chunks;
+  u8 map_offset;
+  unsigned char *raw_map;
+  unsigned char *map_loaded;  /* per span */
+  u4 *slots;                  /* per chunk */
+  /* the written-to bitmaps of the chunks looked at so far, one after
+     the other */
+  u1 *bitmaps;
+  u4 bitmap_size, bitmap_count, bitmap_alloc;
+  /* for differencing images: the image below, with a cache and bitmaps
+     of its own, and its file */
+  SOURCE *parent, *parent_file;
+  char *path;  /* of this image's file, the parent is found next to it */
 } VHD_SOURCE;
 
 /*
@@ -52,8 +68,19 @@ typedef struct vhd_source {
  */
 
 static SOURCE *init_vhd_source(SECTION *section, int level,
-			       u8 total_size, u8 sparse_offset);
-static int read_block_vhd(SOURCE *s, u8 pos, void *buf);
+			       u8 total_size, u8 sparse_offset,
+			       int differencing, const char *path, int depth);
+static int open_parent(VHD_SOURCE *vs, u8 sparse_offset, int level,
+		       int depth);
+static int get_locator(VHD_SOURCE *vs, unsigned char *entry, char *name);
+static int try_parent(VHD_SOURCE *vs, const char *name, unsigned char *uuid,
+		      int level, int depth);
+static int load_map_span(VHD_SOURCE *vs, u4 span);
+static u1 *get_bitmap(VHD_SOURCE *vs, u4 chunk);
+static u8 find_run(VHD_SOURCE *vs, u8 pos, u8 len,
+		   int *present, u8 *data_off);
+static u8 read_vhd(SOURCE *s, u8 pos, u8 len, void *buf);
+static void prefetch_vhd(SOURCE *s, u8 pos, u8 len);
 static void close_vhd(SOURCE *s);
 
 #ifdef JSON
@@ -138,11 +165,13 @@ void detect_vhd(SECTION *section, int level)
   format_size_verbose(s, total_size);
   print_line(level + 1, "Disk size %s", s);
 
-  if (type == 3) {
-    /* dynamically sized, set up a mapping data source */
+  if (type == 3 || type == 4) {
+    /* dynamically sized, set up a mapping data source; for differencing
+       images, that includes the chain of parent images */
     sparse_offset = get_be_quad(buf + 16);
 
-    src = init_vhd_source(section, level, total_size, sparse_offset);
+    src = init_vhd_source(section, level, total_size, sparse_offset,
+			  type == 4, current_analysis->path, 0);
 
     if (src != NULL) {
       /* analyze it */
@@ -160,12 +189,12 @@ void detect_vhd(SECTION *section, int level)
  */
 
 static SOURCE *init_vhd_source(SECTION *section, int level,
-			       u8 total_size, u8 sparse_offset)
+			       u8 total_size, u8 sparse_offset,
+			       int differencing, const char *path, int depth)
 {
   VHD_SOURCE *vs;
   unsigned char *buf;
-  u8 map_offset;
-  u4 map_size;
+  u4 span_count;
   char s[256];
 
   /* allocate and init source structure */
@@ -176,18 +205,23 @@ static SOURCE *init_vhd_source(SECTION *section, int level,
 
   vs->c.size_known = 1;
   vs->c.size = total_size;
-  vs->c.blocksize = 512;
   vs->c.foundation = section->source;
-  vs->c.read_block = read_block_vhd;
+  vs->c.read_bytes = read_vhd;
+  vs->c.prefetch = prefetch_vhd;
   vs->c.close = close_vhd;
   vs->off = section->pos;
+  if (path != NULL) {
+    vs->path = strdup(path);
+    if (vs->path == NULL)
+      bailout("Out of memory");
+  }
 
   /* read sparse information block */
   if (get_buffer(section, sparse_offset, 512, (void **)&buf) < 512) {
     print_line(level + 1, "Error reading the sparse image info block");
     goto errorexit;
   }
-  map_offset = get_be_quad(buf + 16);
+  vs->map_offset = get_be_quad(buf + 16);
   vs->chunk_count = get_be_long(buf + 28);
   vs->chunk_size = get_be_long(buf + 32);
 
@@ -210,24 +244,27 @@ static SOURCE *init_vhd_source(SECTION *section, int level,
 	       vs->chunk_size);
     goto errorexit;
   }
+  vs->bitmap_size = (vs->chunk_size / 512 + 7) / 8;
 
   /* allocate further data structures */
-  map_size = vs->chunk_count * 4;
-  vs->raw_map = (u4 *)malloc(map_size);
-  if (vs->raw_map == NULL)
-    bailout("Out of memory");
-  vs->chunks = (VHD_CHUNK **)malloc(vs->chunk_count * sizeof(VHD_CHUNK *));
-  if (vs->chunks == NULL)
+  vs->raw_map = (unsigned char *)malloc((u8)vs->chunk_count * 4);
+  span_count = (vs->chunk_count + MAP_SPAN - 1) / MAP_SPAN;
+  vs->map_loaded = (unsigned char *)malloc(span_count);
+  vs->slots = (u4 *)malloc((u8)vs->chunk_count * sizeof(u4));
+  if (vs->raw_map == NULL || vs->map_loaded == NULL || vs->slots == NULL)
     bailout("Out of memory");
-  memset(vs->chunks, 0, vs->chunk_count * sizeof(VHD_CHUNK *));
+  memset(vs->map_loaded, 0, span_count);
+  memset(vs->slots, 0, (u8)vs->chunk_count * sizeof(u4));
 
-  /* read the chunk map */
-  if (get_buffer_real(section->source, vs->off + map_offset, map_size,
-		      (void *)vs->raw_map, NULL) < map_size) {
+  /* read the start of the chunk map, the rest when it is needed */
+  if (!load_map_span(vs, 0)) {
     print_line(level + 1, "Error reading the sparse image map");
     goto errorexit;
   }
 
+  if (differencing && !open_parent(vs, sparse_offset, level, depth))
+    goto errorexit;
+
   return (SOURCE *)vs;
 
 errorexit:
@@ -237,97 +274,623 @@ errorexit:
 }
 
 /*
- * mapping read
+ * find the parent image by the locator entries, or else by its name
+ * next to this image; it must carry the ID noted in the header
  */
 
-static int read_block_vhd(SOURCE *s, u8 pos, void *buf)
+static int open_parent(VHD_SOURCE *vs, u8 sparse_offset, int level,
+		       int depth)
 {
-  VHD_SOURCE *vs = (VHD_SOURCE *)s;
-  SOURCE *fs = s->foundation;
-  u4 chunk, chunk_start_sector, sector;
-  u8 chunk_disk_off, sector_pos;
-  unsigned char *filebuf;
-  int present;
+  unsigned char header[1024];
+  char name[2048];
+  int i;
 
-  chunk = (u4)(pos / vs->chunk_size);
-  if (chunk >= vs->chunk_count)
+  if (depth >= MAX_CHAIN) {
+    print_line(level + 1, "Error: More than %d differencing images stacked",
+	       MAX_CHAIN);
     return 0;
+  }
+  if (get_buffer_real(vs->c.foundation, vs->off + sparse_offset, 1024,
+		      header, NULL) < 1024) {
+    print_line(level + 1, "Error reading the sparse image info block");
+    return 0;
+  }
 
-  if (vs->chunks[chunk] == NULL) {
-    /* create data structure for the chunk */
+  format_utf16_be(header + 64, 512, name);
+  print_line(level + 1, "Parent image %s", name);
+  #ifdef JSON
+  if (depth == 0)
+    add_property("parent_name", name);
+  #endif
+
+  for (i = 0; i < 8; i++) {
+    if (get_locator(vs, header + 576 + i * 24, name) &&
+	try_parent(vs, name, header + 40, level + 1, depth))
+      return 1;
+  }
+  format_utf16_be(header + 64, 512, name);
+  if (try_parent(vs, name, header + 40, level + 1, depth))
+    return 1;
 
-    chunk_start_sector = get_be_long(vs->raw_map + chunk);
-    /* NOTE: raw_map is a u4*, so C does the arithmetics for us */
+  print_line(level + 2, "Error: Parent image not found");
+  return 0;
+}
 
-    if (chunk_start_sector == 0xffffffff) {
-      present = 0;
+/*
+ * get the file name from a locator entry into NAME (2048 bytes), with
+ * forward slashes; returns 0 if it isn't one we can use
+ */
+
+static int get_locator(VHD_SOURCE *vs, unsigned char *entry, char *name)
+{
+  unsigned char data[512];
+  u4 code, len, i;
+  u8 data_off;
+
+  code = get_be_long(entry);
+  len = get_be_long(entry + 8);
+  data_off = get_be_quad(entry + 16);
+  if (len == 0 || len > 510)
+    return 0;
+  if (get_buffer_real(vs->c.foundation, vs->off + data_off, len,
+		      data, NULL) < len)
+    return 0;
+
+  if (code == 0x57327275 || code == 0x57326b75) {
+    /* W2ru, W2ku: relative and absolute Windows paths, UTF-16 */
+    data[len] = data[len + 1] = 0;
+    format_utf16_le(data, len, name);
+  } else if (code == 0x4d616358) {
+    /* MacX: file URL, UTF-8 */
+    data[len] = 0;
+    if (strncmp((char *)data, "file://", 7) != 0)
+      return 0;
+    strcpy(name, (char *)data + 7);
+    if (strncmp(name, "localhost/", 10) == 0)
+      memmove(name, name + 9, strlen(name + 9) + 1);
+  } else {
+    return 0;
+  }
+
+  for (i = 0; name[i]; i++) {
+    if (name[i] == '\\')
+      name[i] = '/';
+  }
+  return name[0] != 0;
+}
+
+/*
+ * open NAME as the parent, relative to this image's directory; failing
+ * that, the same file name in this image's directory
+ */
+
+static int try_parent(VHD_SOURCE *vs, const char *name, unsigned char *uuid,
+		      int level, int depth)
+{
+  char path[4096], *base;
+  unsigned char footer[512];
+  SOURCE *fs;
+  SECTION section;
+  struct stat sb;
+  int attempt, fd, dir_len, type;
+  u8 total_size;
+
+  /* the directory of this image, with the slash */
+  dir_len = 0;
+  if (vs->path != NULL && (base = strrchr(vs->path, '/')) != NULL)
+    dir_len = base + 1 - vs->path;
+  if (dir_len > 1000)
+    return 0;
+
+  for (attempt = 0; attempt < 2; attempt++) {
+    if (attempt == 0 && name[0] == '/') {
+      strcpy(path, name);
     } else {
-      chunk_disk_off = vs->off + (u8)chunk_start_sector * 512;
-      if (get_buffer_real(fs, chunk_disk_off, 512,
-			  NULL, (void **)&filebuf) < 512)
-	present = 0;
-      else
-	present = 1;
+      if (dir_len > 0)
+	memcpy(path, vs->path, dir_len);
+      base = (attempt == 0) ? (char *)name : strrchr(name, '/');
+      if (base == NULL)
+	continue;  /* tried as it is already */
+      if (attempt == 1)
+	base++;
+      if (strncmp(base, "./", 2) == 0)
+	base += 2;
+      strcpy(path + dir_len, base);
     }
 
-    if (!present) {
-      vs->chunks[chunk] = (VHD_CHUNK *)malloc(sizeof(VHD_CHUNK));
-      if (vs->chunks[chunk] == NULL)
-	bailout("Out of memory");
-      vs->chunks[chunk]->present = 0;
-    } else {
-      vs->chunks[chunk] = (VHD_CHUNK *)malloc(sizeof(VHD_CHUNK) + 512);
-      if (vs->chunks[chunk] == NULL)
-	bailout("Out of memory");
-      vs->chunks[chunk]->present = 1;
-      vs->chunks[chunk]->off = chunk_disk_off + 512;
-      memcpy(vs->chunks[chunk]->bitmap, filebuf, 512);
+    /* the name comes from the image, don't let it make us wait on a
+       FIFO or read from a device */
+    fd = open(path, O_RDONLY | O_NONBLOCK);
+    if (fd < 0)
+      continue;
+    if (fstat(fd, &sb) < 0 || !S_ISREG(sb.st_mode)) {
+      close(fd);
+      continue;
+    }
+    fs = init_file_source(fd, S_ISREG(sb.st_mode) ? 0 : 1);
+
+    /* the footer, or its copy at the start for dynamic images */
+    if (!fs->size_known || fs->size < 1024 ||
+	get_buffer_real(fs, 0, 512, footer, NULL) < 512 ||
+	(memcmp(footer, "conectix", 8) != 0 &&
+	 (get_buffer_real(fs, fs->size - 512, 512, footer, NULL) < 512 ||
+	  memcmp(footer, "conectix", 8) != 0)) ||
+	memcmp(footer + 68, uuid, 16) != 0) {
+      close_source(fs);
+      continue;
+    }
+
+    type = get_be_long(footer + 0x3c);
+    total_size = get_be_quad(footer + 0x28);
+    if (type == 2) {
+      /* fixed size, that's the data as it is */
+      vs->parent = vs->parent_file = fs;
+      return 1;
+    }
+    if (type == 3 || type == 4) {
+      section.source = fs;
+      section.pos = 0;
+      section.size = fs->size;
+      section.flags = 0;
+      vs->parent = init_vhd_source(&section, level, total_size,
+				   get_be_quad(footer + 16), type == 4,
+				   path, depth + 1);
+      if (vs->parent != NULL) {
+	vs->parent_file = fs;
+	return 1;
+      }
     }
+    close_source(fs);
   }
+  return 0;
+}
+
+/*
+ * read a span of the chunk map, returns 0 if it isn't there in full;
+ * the chunks of the missing part count as missing
+ */
+
+static int load_map_span(VHD_SOURCE *vs, u4 span)
+{
+  u4 first, count;
+  u8 want, got;
+
+  first = span * MAP_SPAN;
+  count = vs->chunk_count - first;
+  if (count > MAP_SPAN)
+    count = MAP_SPAN;
+  want = (u8)count * 4;
+
+  got = get_buffer_real(vs->c.foundation, vs->off + vs->map_offset
+			+ (u8)first * 4, want, vs->raw_map + (u8)first * 4, NULL);
+  if (got < want)
+    memset(vs->raw_map + (u8)first * 4 + got, 0xff, want - got);
+  vs->map_loaded[span] = 1;
+  return got == want;
+}
+
+/*
+ * get the written-to bitmap of a chunk, NULL if the chunk is missing
+ */
+
+static u1 *get_bitmap(VHD_SOURCE *vs, u4 chunk)
+{
+  u4 chunk_start_sector;
+  u8 chunk_disk_off;
+  u1 *bitmap;
+
+  if (vs->slots[chunk] == SLOT_UNKNOWN) {
+    if (!vs->map_loaded[chunk / MAP_SPAN])
+      load_map_span(vs, chunk / MAP_SPAN);
+    chunk_start_sector = get_be_long(vs->raw_map + (u8)chunk * 4);
+
+    vs->slots[chunk] = SLOT_MISSING;
+    if (chunk_start_sector != 0xffffffff) {
+      if (vs->bitmap_count >= vs->bitmap_alloc) {
+	vs->bitmap_alloc = vs->bitmap_alloc ? vs->bitmap_alloc * 2 : 64;
+	vs->bitmaps = (u1 *)realloc(vs->bitmaps,
+				    (u8)vs->bitmap_alloc * vs->bitmap_size);
+	if (vs->bitmaps == NULL)
+	  bailout("Out of memory");
+      }
+      bitmap = vs->bitmaps + (u8)vs->bitmap_count * vs->bitmap_size;
+      chunk_disk_off = vs->off + (u8)chunk_start_sector * 512;
+      if (get_buffer_real(vs->c.foundation, chunk_disk_off, vs->bitmap_size,
+			  bitmap, NULL) == vs->bitmap_size)
+	vs->slots[chunk] = SLOT_BITMAP + vs->bitmap_count++;
+    }
+  }
+
+  if (vs->slots[chunk] == SLOT_MISSING)
+    return NULL;
+  return vs->bitmaps + (u8)(vs->slots[chunk] - SLOT_BITMAP) * vs->bitmap_size;
+}
+
+/*
+ * find out how much from POS on, up to LEN bytes, is alike: either in
+ * the image at DATA_OFF, or not written to; returns 0 past the end
+ */
+
+static u8 find_run(VHD_SOURCE *vs, u8 pos, u8 len,
+		   int *present, u8 *data_off)
+{
+  u4 chunk, sector;
+  u8 rel, end, run_end;
+  u1 *bitmap;
+  int state;
 
-  if (!vs->chunks[chunk]->present) {
+  chunk = (u4)(pos / vs->chunk_size);
+  if (chunk >= vs->chunk_count)
+    return 0;
+  rel = pos - (u8)chunk * vs->chunk_size;
+  end = rel + len;
+  if (end > vs->chunk_size)
+    end = vs->chunk_size;
+
+  bitmap = get_bitmap(vs, chunk);
+  if (bitmap == NULL) {
     /* whole chunk is missing */
-    memset(buf, 0, 512);
-    return 1;
+    *present = 0;
+    return end - rel;
   }
 
-  sector = (u4)((pos - (u8)chunk * vs->chunk_size) / 512);
-  if (vs->chunks[chunk]->bitmap[sector >> 3] & (128 >> (sector & 7))) {
-    /* sector is present and in use */
-    sector_pos = vs->chunks[chunk]->off + (u8)sector * 512;
-    if (get_buffer_real(fs, sector_pos, 512, buf, NULL) < 512)
-      return 0;
-  } else {
-    /* sector has not been written to (although it's present on disk) */
-    memset(buf, 0, 512);
+  /* sectors in the same state as the first one */
+  sector = (u4)(rel / 512);
+  state = (bitmap[sector >> 3] & (128 >> (sector & 7))) ? 1 : 0;
+  for (run_end = ((u8)sector + 1) * 512; run_end < end; run_end += 512) {
+    sector = (u4)(run_end / 512);
+    if (((bitmap[sector >> 3] & (128 >> (sector & 7))) ? 1 : 0) != state)
+      break;
   }
-  return 1;
+  if (run_end > end)
+    run_end = end;
+
+  *present = state;
+  /* the data follows the bitmap sector */
+  *data_off = vs->off + (u8)get_be_long(vs->raw_map + (u8)chunk * 4) * 512
+    + 512 + rel;
+  return run_end - rel;
 }
 
 /*
- * cleanup
+ * mapping read, runs of sectors that are present take one read each
  */
 
-static void close_vhd(SOURCE *s)
+static u8 read_vhd(SOURCE *s, u8 pos, u8 len, void *buf)
 {
   VHD_SOURCE *vs = (VHD_SOURCE *)s;
-  u4 chunk;
+  u8 got, run, data_off, below;
+  int present;
 
-  /* free raw chunk map */
-  if (vs->raw_map != NULL)
-    free(vs->raw_map);
+  for (got = 0; got < len; got += run) {
+    run = find_run(vs, pos + got, len - got, &present, &data_off);
+    if (run == 0)
+      break;
+
+    if (present) {
+      /* sectors are present and in use */
+      if (get_buffer_real(s->foundation, data_off, run,
+			  (unsigned char *)buf + got, NULL) < run)
+	break;
+    } else if (vs->parent != NULL) {
+      /* not written to in this layer, it's what the parent holds */
+      below = get_buffer_real(vs->parent, pos + got, run,
+			      (unsigned char *)buf + got, NULL);
+      if (below < run)
+	memset((unsigned char *)buf + got + below, 0, run - below);
+    } else {
+      /* sectors have not been written to (although they may be present
+	 on disk) */
+      memset((unsigned char *)buf + got, 0, run);
+    }
+  }
+  return got;
+}
+
+/*
+ * pass the hint on for the runs that are present, joined where they
+ * are next to each other in the image
+ */
+
+static void prefetch_vhd(SOURCE *s, u8 pos, u8 len)
+{
+  VHD_SOURCE *vs = (VHD_SOURCE *)s;
+  SOURCE *fs = s->foundation;
+  u8 done, run, data_off, hint_off, hint_len;
+  int present;
 
-  /* free chunk info data */
-  if (vs->chunks != NULL) {
-    for (chunk = 0; chunk < vs->chunk_count; chunk++) {
-      if (vs->chunks[chunk] != NULL)
-	free(vs->chunks[chunk]);
+  hint_off = hint_len = 0;
+  for (done = 0; done < len; done += run) {
+    run = find_run(vs, pos + done, len - done, &present, &data_off);
+    if (run == 0)
+      break;
+    if (!present) {
+      /* the parent passes it on in turn */
+      if (vs->parent != NULL && vs->parent->prefetch != NULL)
+	vs->parent->prefetch(vs->parent, pos + done, run);
+      continue;
+    }
+    if (fs->prefetch == NULL)
+      continue;
+    if (hint_len > 0 && hint_off + hint_len == data_off) {
+      hint_len += run;
+      continue;
     }
-    free(vs->chunks);
+    if (hint_len > 0)
+      fs->prefetch(fs, hint_off, hint_len);
+    hint_off = data_off;
+    hint_len = run;
   }
+  if (hint_len > 0)
+    fs->prefetch(fs, hint_off, hint_len);
+}
+
+/*
+ * cleanup
+ */
+
+static void close_vhd(SOURCE *s)
+{
+  VHD_SOURCE *vs = (VHD_SOURCE *)s;
+
+  free(vs->raw_map);
+  free(vs->map_loaded);
+  free(vs->slots);
+  free(vs->bitmaps);
+  free(vs->path);
+  if (vs->parent != NULL && vs->parent != vs->parent_file)
+    close_source(vs->parent);
+  if (vs->parent_file != NULL)
+    close_source(vs->parent_file);
 }
 
 #ifdef JSON
+
+/* A dynamic image in memory: chunks of 64 KiB, one more than a span of
+ * the chunk map. Chunk 0 has the first half written to, chunk 2 all of
+ * it and the last chunk none of it, the others are missing. Sectors not
+ * written to hold junk.
+ */
+#define TEST_VHD_CHUNK (65536)
+#define TEST_VHD_CHUNKS (MAP_SPAN + 1)
+#define TEST_VHD_MAP (1536)
+#define TEST_VHD_DATA (TEST_VHD_MAP + (TEST_VHD_CHUNKS * 4 + 511) / 512 * 512)
+
+static unsigned char *test_vhd_image;
+static u8 test_vhd_size;
+
+/* Puts down chunk CHUNK as the next one in the image, with its first
+ * WRITTEN sectors written to.
+ */
+static void add_test_vhd_chunk(u4 chunk, int written)
+{
+    u8 at = test_vhd_size;
+
+    put_test_be(test_vhd_image + TEST_VHD_MAP + chunk * 4, at / 512, 4);
+    memset(test_vhd_image + at, 0, 512);
+    for (int i = 0; i < written; i++)
+    {
+        test_vhd_image[at + (i >> 3)] |= 128 >> (i & 7);
+    }
+    at += 512;
+    for (u8 i = 0; i < TEST_VHD_CHUNK; i++)
+    {
+        test_vhd_image[at + i] = i < (u8) written * 512 ?
+            test_image_pattern((u8) chunk * TEST_VHD_CHUNK + i) : 0xaa;
+    }
+    test_vhd_size = at + TEST_VHD_CHUNK;
+}
+
+/* Writes a fixed size image of SIZE bytes carrying ID to PATH, to be
+ * found as a parent. The chunks the checks read hold the pattern.
+ */
+static void write_test_vhd_parent(const char *path, u8 size, int id)
+{
+    static unsigned char data[TEST_VHD_CHUNK];
+    unsigned char footer[512];
+    u4 chunks[] = { 0, 1, 2, TEST_VHD_CHUNKS - 1 };
+    int fd;
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0);
+    for (int i = 0; i < 4; i++)
+    {
+        for (u8 j = 0; j < TEST_VHD_CHUNK; j++)
+        {
+            data[j] = test_image_pattern((u8) chunks[i] * TEST_VHD_CHUNK + j);
+        }
+        assert(pwrite(fd, data, sizeof(data),
+                      (off_t) chunks[i] * TEST_VHD_CHUNK) == sizeof(data));
+    }
+    memset(footer, 0, sizeof(footer));
+    memcpy(footer, "conectix", 8);
+    put_test_be(footer + 0x28, size, 8);
+    put_test_be(footer + 0x3c, 2, 4);
+    memset(footer + 68, id, 16);
+    assert(pwrite(fd, footer, 512, (off_t) size) == 512);
+    close(fd);
+}
+
+/* Makes the image a differencing one on top of the image carrying ID,
+ * with NAME in the header and LOCATOR in a W2ru entry if given.
+ */
+static void set_test_vhd_parent(int id, const char *name,
+                                const char *locator)
+{
+    unsigned char *header = test_vhd_image + 512;
+
+    memset(header + 40, id, 16);
+    memset(header + 64, 0, 512 + 8 * 24);
+    for (int i = 0; name[i]; i++)
+    {
+        header[64 + 2 * i + 1] = name[i];
+    }
+    if (locator != NULL)
+    {
+        /* the path goes to the reserved end of the header */
+        put_test_be(header + 576, 0x57327275, 4);
+        put_test_be(header + 576 + 8, 2 * strlen(locator), 4);
+        put_test_be(header + 576 + 16, 512 + 768, 8);
+        memset(header + 768, 0, 256);
+        for (int i = 0; locator[i]; i++)
+        {
+            header[768 + 2 * i] = locator[i];
+        }
+    }
+}
+
+/* Whether the byte at POS wasn't written to in the image. */
+static int test_vhd_unwritten(u8 pos)
+{
+    u8 chunk = pos / TEST_VHD_CHUNK, rel = pos % TEST_VHD_CHUNK;
+
+    return !((chunk == 0 && rel < TEST_VHD_CHUNK / 2) || chunk == 2);
+}
+
+/* Finds the parents of the image as a differencing image in a temporary
+ * directory: by the locator relative to the image, by its base name,
+ * or by the name in the header, and only when the ID matches.
+ */
+static void test_vhd_parents(u8 total)
+{
+    char dir[] = "/tmp/disktype-test-XXXXXX";
+    char path[4][64];
+    unsigned char footer[512];
+    TEST_IMAGE foundation;
+    SECTION section;
+    SOURCE *s;
+    FILE *f;
+
+    assert(mkdtemp(dir) != NULL);
+    sprintf(path[0], "%s/child.vhd", dir);
+    sprintf(path[1], "%s/parent.vhd", dir);
+    sprintf(path[2], "%s/sub", dir);
+    sprintf(path[3], "%s/sub/parent.vhd", dir);
+    assert(mkdir(path[2], 0755) == 0);
+    write_test_vhd_parent(path[1], total, 1);
+    write_test_vhd_parent(path[3], total, 2);
+
+    init_test_image(&foundation, test_vhd_image, test_vhd_size);
+    init_test_section(&section, &foundation);
+
+    /* the parent name goes to the image's object */
+    add_win_virt_pc_json(0, 4, total);
+
+    /* Relative to the image. */
+    set_test_vhd_parent(2, "parent.vhd", "sub\\parent.vhd");
+    s = init_vhd_source(&section, 0, total, 512, 1, path[0], 0);
+    assert(s != NULL);
+    check_test_read(s, 2 * TEST_VHD_CHUNK - 100, 4096, NULL);
+    check_test_read(s, total - 4096, 4096, NULL);
+    close_source(s);
+
+    /* The base name of a path from another machine. */
+    set_test_vhd_parent(1, "x.vhd", "C:\\images\\parent.vhd");
+    s = init_vhd_source(&section, 0, total, 512, 1, path[0], 0);
+    assert(s != NULL);
+    check_test_read(s, TEST_VHD_CHUNK / 2 - 1000, 4096, NULL);
+    close_source(s);
+
+    /* The name in the header, when no locator leads anywhere. */
+    set_test_vhd_parent(1, "parent.vhd", "missing.vhd");
+    s = init_vhd_source(&section, 0, total, 512, 1, path[0], 0);
+    assert(s != NULL);
+    check_test_read(s, total - 4096, 4096, NULL);
+    close_source(s);
+
+    /* A file with another ID isn't the parent, wherever it is found. */
+    set_test_vhd_parent(3, "parent.vhd", "sub\\parent.vhd");
+    assert(init_vhd_source(&section, 0, total, 512, 1, path[0], 0) == NULL);
+
+    /* Neither is a FIFO, and opening it doesn't wait for a writer. */
+    sprintf(path[3], "%s/fifo.vhd", dir);
+    assert(mkfifo(path[3], 0644) == 0);
+    set_test_vhd_parent(1, "fifo.vhd", "fifo.vhd");
+    assert(init_vhd_source(&section, 0, total, 512, 1, path[0], 0) == NULL);
+    unlink(path[3]);
+
+    /* An image that is its own parent ends at the bound on the chain. */
+    set_test_vhd_parent(4, "child.vhd", NULL);
+    memset(footer, 0, sizeof(footer));
+    memcpy(footer, "conectix", 8);
+    put_test_be(footer + 16, 512, 8);
+    put_test_be(footer + 0x28, total, 8);
+    put_test_be(footer + 0x3c, 4, 4);
+    memset(footer + 68, 4, 16);
+    memcpy(test_vhd_image, footer, 512);
+    f = fopen(path[0], "wb");
+    assert(f != NULL);
+    assert(fwrite(test_vhd_image, 1, test_vhd_size, f) == test_vhd_size);
+    fclose(f);
+    assert(init_vhd_source(&section, 0, total, 512, 1, path[0], 0) == NULL);
+    assert(init_vhd_source(&section, 0, total, 512, 1, path[0],
+                           MAX_CHAIN) == NULL);
+
+    unlink(path[0]);
+    unlink(path[1]);
+    sprintf(path[3], "%s/sub/parent.vhd", dir);
+    unlink(path[3]);
+    rmdir(path[2]);
+    rmdir(dir);
+    reset_json();
+}
+
+static void test_vhd_source()
+{
+    u8 total = (u8) TEST_VHD_CHUNKS * TEST_VHD_CHUNK;
+    TEST_IMAGE foundation;
+    SECTION section;
+    SOURCE *s;
+
+    test_vhd_image = (unsigned char *) malloc(TEST_VHD_DATA
+                                              + 3 * (512 + TEST_VHD_CHUNK));
+    memset(test_vhd_image, 0xff, TEST_VHD_DATA);
+    memset(test_vhd_image + 512, 0, 1024);
+    put_test_be(test_vhd_image + 512 + 16, TEST_VHD_MAP, 8);
+    put_test_be(test_vhd_image + 512 + 28, TEST_VHD_CHUNKS, 4);
+    put_test_be(test_vhd_image + 512 + 32, TEST_VHD_CHUNK, 4);
+    test_vhd_size = TEST_VHD_DATA;
+    add_test_vhd_chunk(0, TEST_VHD_CHUNK / 512 / 2);
+    add_test_vhd_chunk(2, TEST_VHD_CHUNK / 512);
+    add_test_vhd_chunk(MAP_SPAN, 0);
+
+    init_test_image(&foundation, test_vhd_image, test_vhd_size);
+    init_test_section(&section, &foundation);
+
+    /* The header and the first span of the map. */
+    s = init_vhd_source(&section, 0, total, 512, 0, NULL, 0);
+    assert(s != NULL && foundation.reads == 2);
+
+    /* The bitmap, then a run of sectors in one go. */
+    assert(count_test_reads(&foundation, s, 0, 4096,
+                            test_vhd_unwritten) == 2);
+    assert(count_test_reads(&foundation, s, 8192, 4096,
+                            test_vhd_unwritten) == 1);
+
+    /* Where the written-to part ends, and across a missing chunk. */
+    assert(count_test_reads(&foundation, s, TEST_VHD_CHUNK / 2 - 1000, 4096,
+                            test_vhd_unwritten) == 1);
+    assert(count_test_reads(&foundation, s, 2 * TEST_VHD_CHUNK - 100, 4096,
+                            test_vhd_unwritten) == 2);
+
+    /* The last chunk needs the next span of the map. */
+    assert(count_test_reads(&foundation, s, total - 4096, 4096,
+                            test_vhd_unwritten) == 2);
+
+    /* Hints only for what is there, one per chunk. */
+    foundation.hints = 0;
+    foundation.hint_len = 0;
+    s->prefetch(s, 0, 3 * TEST_VHD_CHUNK);
+    assert(foundation.hints == 2);
+    assert(foundation.hint_len == TEST_VHD_CHUNK / 2 + TEST_VHD_CHUNK);
+
+    close_source(s);
+
+    /* As a differencing image, what wasn't written to is the parent's. */
+    test_vhd_parents(total);
+    free(test_vhd_image);
+}
+
 /* This is the main function responsible for tests in this class (vpc.c). */
 void test_vpc()
 {
@@ -352,6 +915,8 @@ void test_vpc()
     assert(equal_chars(size, "4096"));
 
     reset_json();
+
+    test_vhd_source();
 }
 #endif
 